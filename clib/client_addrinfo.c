@@ -127,24 +127,48 @@ int muacc_ai_getaddrinfo(const char *hostname, const char *service,
         return EAI_NONAME;
     }
 
-    /* Step 6: Allocate a muacc_addrinfo for the result */
+    /* Step 6: Allocate a muacc_addrinfo for the result - it lives in a
+     * single block together with its addresses and socket options, so
+     * muacc_ai_freeaddrinfo is a single free() */
     assert((*result)==NULL);
 
-    *result=malloc(sizeof(struct muacc_addrinfo));
-    if(*result==NULL)
+    if(ctx.ctx->remote_sa_len>sizeof(struct sockaddr_storage)) {
+        DLOG(CLIB_IF_NOISY_DEBUG1, "Warning: remote_sa_len seems too long. "
+            "We won't copy it!\n");
+        return EAI_NONAME;
+    }
+
+    size_t bindaddrlen = 0;
+    if(ctx.ctx->bind_sa_suggested)
     {
-        return EAI_MEMORY;
+        if(ctx.ctx->bind_sa_suggested_len>sizeof(struct sockaddr_storage)) {
+            DLOG(CLIB_IF_NOISY_DEBUG1, "Warning: bind_sa_suggested_len seems too long. "
+                "We won't copy it!\n");
+        } else {
+            bindaddrlen=ctx.ctx->bind_sa_suggested_len;
+        }
     }
-    memset(*result, 0, sizeof(struct muacc_addrinfo));
-    (*result)->ai_sockopts=_muacc_clone_socketopts(ctx.ctx->sockopts_suggested);
-    if(((*result)->ai_sockopts==NULL) &&
-        (ctx.ctx->sockopts_suggested!=NULL))
+
+    size_t len = MUACC_FLAT_AI_ALIGN(sizeof(struct muacc_addrinfo))
+        + MUACC_FLAT_AI_ALIGN(ctx.ctx->remote_sa_len)
+        + MUACC_FLAT_AI_ALIGN(bindaddrlen);
+    const struct socketopt *so;
+    for (so = ctx.ctx->sockopts_suggested; so != NULL; so = so->next)
+    {
+        len += MUACC_FLAT_AI_ALIGN(sizeof(struct socketopt));
+        if (so->optval != NULL)
+            len += MUACC_FLAT_AI_ALIGN(so->optlen);
+    }
+
+    char *data=malloc(len);
+    if(data==NULL)
     {
-        /* muacc_clone_socketopts failed to allocate memory. */
-        free(*result);
-        *result=NULL;
         return EAI_MEMORY;
     }
+    memset(data, 0, len);
+
+    *result=(struct muacc_addrinfo *) data;
+    data += MUACC_FLAT_AI_ALIGN(sizeof(struct muacc_addrinfo));
 
     (*result)->ai_flags=0;
     (*result)->ai_next=NULL;
@@ -153,69 +177,39 @@ int muacc_ai_getaddrinfo(const char *hostname, const char *service,
     (*result)->ai_socktype=ctx.ctx->type;
     (*result)->ai_protocol=ctx.ctx->protocol;
 
-    if(ctx.ctx->bind_sa_suggested)
-    {
-        // Copy bind_sa_suggested to ai_bindaddr
-        if(ctx.ctx->bind_sa_suggested_len>sizeof(struct sockaddr_storage)) {
-            DLOG(CLIB_IF_NOISY_DEBUG1, "Warning: bind_sa_suggested_len seems too long. "
-                "We won't copy it!\n");
-        } else {
+    // Copy remote_sa to ai_addr
+    (*result)->ai_addrlen=ctx.ctx->remote_sa_len;
+    (*result)->ai_addr=(struct sockaddr *) data;
+    memcpy((*result)->ai_addr, ctx.ctx->remote_sa, (*result)->ai_addrlen);
+    data += MUACC_FLAT_AI_ALIGN((*result)->ai_addrlen);
 
-            (*result)->ai_bindaddrlen=ctx.ctx->bind_sa_suggested_len;
-            (*result)->ai_bindaddr=malloc((*result)->ai_bindaddrlen);
-            if((*result)->ai_bindaddr==NULL) {
-                _muacc_free_socketopts((*result)->ai_sockopts);
-                (*result)->ai_sockopts=NULL;
-                free(*result);
-                *result=NULL;
-                return EAI_MEMORY;
-            }
-            memcpy((*result)->ai_bindaddr, ctx.ctx->bind_sa_suggested,
-                (*result)->ai_bindaddrlen);
-        }
-    }
-    else
+    if(bindaddrlen>0)
     {
-        (*result)->ai_bindaddrlen=0;
-        (*result)->ai_bindaddr=0;
+        // Copy bind_sa_suggested to ai_bindaddr
+        (*result)->ai_bindaddrlen=bindaddrlen;
+        (*result)->ai_bindaddr=(struct sockaddr *) data;
+        memcpy((*result)->ai_bindaddr, ctx.ctx->bind_sa_suggested, bindaddrlen);
+        data += MUACC_FLAT_AI_ALIGN(bindaddrlen);
     }
 
-    if(ctx.ctx->remote_sa)
+    // Copy sockopts_suggested to ai_sockopts
+    struct socketopt **cur=&((*result)->ai_sockopts);
+    for (so = ctx.ctx->sockopts_suggested; so != NULL; so = so->next)
     {
-        // Copy remote_sa to ai_addr
-        if(ctx.ctx->remote_sa_len>sizeof(struct sockaddr_storage)) {
-            DLOG(CLIB_IF_NOISY_DEBUG1, "Warning: remote_sa_len seems too long. "
-                "We won't copy it!\n");
-        } else {
+        *cur=(struct socketopt *) data;
+        memcpy(*cur, so, sizeof(struct socketopt));
+        (*cur)->next=NULL;
+        data += MUACC_FLAT_AI_ALIGN(sizeof(struct socketopt));
 
-            (*result)->ai_addrlen=ctx.ctx->remote_sa_len;
-            (*result)->ai_addr=malloc((*result)->ai_bindaddrlen);
-            if((*result)->ai_addr==NULL) {
-                if((*result)->ai_bindaddr) {
-                    free((*result)->ai_bindaddr);
-                    (*result)->ai_bindaddr=NULL;
-                }
-                _muacc_free_socketopts((*result)->ai_sockopts);
-                (*result)->ai_sockopts=NULL;
-                free(*result);
-                *result=NULL;
-                return EAI_MEMORY;
-            }
-            memcpy((*result)->ai_addr, ctx.ctx->remote_sa,
-                (*result)->ai_addrlen);
+        if (so->optval != NULL)
+        {
+            (*cur)->optval=data;
+            memcpy((*cur)->optval, so->optval, so->optlen);
+            data += MUACC_FLAT_AI_ALIGN(so->optlen);
         }
+        cur=&((*cur)->next);
     }
-    else
-    {
-        DLOG(CLIB_IF_NOISY_DEBUG1, "First it seemed like we had a remote_sa, "
-            "now we don't?");
-        /* We should never come here, since we are not going to generate a
-         * result in case we received no remote socket address. */
-        abort();
-
-        /* (*result)->ai_addrlen=0;
-         * (*result)->ai_addr=0; */
-    }
+
     (*result)->ai_canonname=0; /* Unsupported at the moment. */
 
     return 0;
@@ -223,22 +217,11 @@ int muacc_ai_getaddrinfo(const char *hostname, const char *service,
 
 void muacc_ai_freeaddrinfo(struct muacc_addrinfo *ai)
 {
-    assert(*ai!=NULL);
+    assert(ai!=NULL);
     assert(ai->ai_next==NULL); /* as our getaddrinfo only returns one address,
     we only have to free one. */
-    
-    if(ai->ai_addr) {
-        free(ai->ai_addr);
-        ai->ai_addr=NULL;
-    }
-
-    if(ai->ai_bindaddr) {
-        free(ai->ai_bindaddr);
-        ai->ai_bindaddr=NULL;
-    }
 
-    _muacc_free_socketopts(ai->ai_sockopts);
-    ai->ai_sockopts=NULL;
+    /* addresses and socket options live in the same block */
     free(ai);
 }
 
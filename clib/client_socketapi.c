@@ -122,12 +122,13 @@ int muacc_sa_getaddrinfo(muacc_context_t *ctx,
 
 	/* save hint */
 	if(ctx->ctx->remote_addrinfo_hint != NULL)
-		freeaddrinfo(ctx->ctx->remote_addrinfo_hint);
+		_muacc_free_addrinfo(ctx->ctx->remote_addrinfo_hint);
 	ctx->ctx->remote_addrinfo_hint = _muacc_clone_addrinfo(hints);
 
 	/* clear result from previous calls */
 	if (ctx->ctx->remote_addrinfo_res != NULL)
 	{
+		_muacc_free_addrinfo(ctx->ctx->remote_addrinfo_res);
 		ctx->ctx->remote_addrinfo_res = NULL;
 	}
 
@@ -140,8 +141,11 @@ int muacc_sa_getaddrinfo(muacc_context_t *ctx,
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG2, "using result from mam\n");
 
-		*res = _muacc_clone_addrinfo(ctx->ctx->remote_addrinfo_res);
-		ret = 0;
+		/* the application releases it with freeaddrinfo() */
+		if ((*res = _muacc_export_addrinfo(ctx->ctx->remote_addrinfo_res)) == NULL)
+			ret = EAI_MEMORY;
+		else
+			ret = 0;
 	}
 	else
 	{
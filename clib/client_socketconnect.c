@@ -147,6 +147,103 @@ int muacc_sc_socketconnect(int *s, const char *host, size_t hostlen, const char
 	}
 }
 
+int muacc_sc_socketconnect_batch(struct muacc_sc_batch_item *items, size_t n)
+{
+	muacc_context_t *ctxs;
+	muacc_context_t **pending;
+	int *results;
+	size_t i;
+	size_t n_pending = 0;
+	int created = 0;
+
+	if (items == NULL)
+		return -1;
+
+	DLOG(CLIB_IF_NOISY_DEBUG0, "Socketconnect batch of %zu sockets invoked\n", n);
+
+	ctxs = calloc(n, sizeof(muacc_context_t));
+	pending = calloc(n, sizeof(muacc_context_t *));
+	results = calloc(n, sizeof(int));
+	if (n > 0 && (ctxs == NULL || pending == NULL || results == NULL))
+	{
+		free(ctxs);
+		free(pending);
+		free(results);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		items[i].socket = -1;
+		items[i].result = -1;
+
+		muacc_init_context(&ctxs[i]);
+		if (ctxs[i].ctx == NULL)
+			continue;
+		ctxs[i].ctx->domain = items[i].domain;
+		ctxs[i].ctx->type = items[i].type;
+		ctxs[i].ctx->protocol = items[i].proto;
+		ctxs[i].ctx->sockopts_current = _muacc_clone_socketopts((const struct socketopt*) items[i].sockopts);
+
+		if (_muacc_host_serv_to_ctx(&ctxs[i], items[i].host, items[i].hostlen, items[i].serv, items[i].servlen) != 0)
+		{
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Host or service of batch item %zu not given - skipping it.\n", i);
+		}
+		else if (_muacc_lease_apply(&ctxs[i]) == 0)
+		{
+			DLOG(CLIB_IF_NOISY_DEBUG2, "MAM leased its decision for batch item %zu - not asking again\n", i);
+			items[i].result = _muacc_socketconnect_create(&ctxs[i], &(items[i].socket), &socketsetlist, &socketsetlist_lock, 0);
+		}
+		else
+		{
+			pending[n_pending++] = &ctxs[i];
+		}
+	}
+
+	if (n_pending > 0 && _muacc_contact_mam_batch(pending, results, n_pending) != 0)
+	{
+		DLOG(CLIB_IF_NOISY_DEBUG1, "Could not send the batch - asking MAM for each socket\n");
+		for (i = 0; i < n_pending; i++)
+			results[i] = _muacc_contact_mam(muacc_act_socketconnect_req, pending[i]);
+	}
+
+	for (i = 0; i < n_pending; i++)
+	{
+		struct muacc_sc_batch_item *item = &items[pending[i] - ctxs];
+
+		if (results[i] == -1)
+		{
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Got no response from MAM for %s:%s - Failing.\n", pending[i]->ctx->remote_hostname, pending[i]->ctx->remote_service);
+		}
+		else
+		{
+			item->result = _muacc_socketconnect_create(pending[i], &(item->socket), &socketsetlist, &socketsetlist_lock, 0);
+		}
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		if (items[i].result == 1)
+		{
+			created++;
+		}
+		else if (items[i].socket != -1)
+		{
+			/* socket was created, but binding or connecting it failed */
+			close(items[i].socket);
+			items[i].socket = -1;
+		}
+		muacc_release_context(&ctxs[i]);
+	}
+
+	free(ctxs);
+	free(pending);
+	free(results);
+
+	DLOG(CLIB_IF_NOISY_DEBUG2, "Socketconnect batch created %d of %zu sockets\n", created, n);
+	return created;
+}
+
 int _socketconnect_request(muacc_context_t *ctx, int *s, const char *host, size_t hostlen, const char *serv, size_t servlen)
 {
 	if (ctx == NULL)
@@ -159,6 +256,11 @@ int _socketconnect_request(muacc_context_t *ctx, int *s, const char *host, size_
 		DLOG(CLIB_IF_NOISY_DEBUG1, "Host or service not given - aborting.\n");
 		return -1;
 	}
+	else if (_muacc_lease_apply(ctx) == 0)
+	{
+		DLOG(CLIB_IF_NOISY_DEBUG2, "MAM leased its decision - not asking again\n");
+		return _muacc_socketconnect_create(ctx, s, &socketsetlist, &socketsetlist_lock, 0);
+	}
 	else
 	{
 		if (-1 == _muacc_contact_mam(muacc_act_socketconnect_req, ctx))
@@ -253,7 +355,7 @@ int muacc_sc_socketrelease(int socket)
 		{
 			slist->flags = slist->flags & ~MUACC_SOCKET_IN_USE;
 			set_to_release->use_count -= 1;
-			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %d\n", socket, set_to_release->use_count);
+			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %u\n", socket, set_to_release->use_count);
 
 			pthread_rwlock_unlock(&(set_to_release->lock));
 			DLOG(CLIB_IF_LOCKS, "LOCK: Marked socket as free - Releasing set %p\n", (void *) set_to_release);
@@ -302,7 +404,7 @@ int muacc_sc_socketcleanup(int socket)
 			// Marking socket as free, so cleanup function will include it
 			slist->flags = slist->flags & ~MUACC_SOCKET_IN_USE;
 			set_to_cleanup->use_count -= 1;
-			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %d\n", socket, set_to_cleanup->use_count);
+			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %u\n", socket, set_to_cleanup->use_count);
 		}
 
 		DLOG(CLIB_IF_NOISY_DEBUG2, "Cleaning up socket set of socket %d\n", socket);
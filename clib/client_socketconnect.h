@@ -36,6 +36,16 @@ int muacc_sc_socketconnect(
 	int proto			/**< [in]		Protocol for socket() call */
 );
 
+/** Function that returns freshly connected sockets for several URLs, asking MAM about all of them in a single request
+ *  Sockets from existing socket sets are never reused. If MAM cannot take batches, it is asked once per socket.
+ *
+ *  @return number of sockets created (see result of each item), -1 if fail
+ */
+int muacc_sc_socketconnect_batch(
+	struct muacc_sc_batch_item *items,	/**< [in,out]	Sockets to create */
+	size_t n							/**< [in]		Number of items */
+);
+
 /** Close a socket that was supplied by socketconnect, drop it from the socket set
  *
  *  @return 0 if successful, -1 if fail
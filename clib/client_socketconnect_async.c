@@ -49,6 +49,7 @@
 struct postponed_muacc_context {
 	int fd;
 	muacc_context_t ctx;
+	muacc_reqid_t request_id;
 	enum {
 		SOCKETCONNECT_SENT,
 		SOCKETCHOOSE_SENT
@@ -74,23 +75,24 @@ static struct postponed_muacc_context *postponed_ctx_list=NULL;
 
 /* External asynchronous (and thread-safe) API */
 int muacc_sca_socketconnect(int *s, const char *host, size_t hostlen, const char *serv, size_t servlen, struct socketopt *sockopts, int domain, int type, int proto);
+int muacc_sca_socketconnect_batch(struct muacc_sc_batch_item *items, size_t n);
 int muacc_sca_socketclose(int socket);
 int muacc_sca_socketrelease(int socket);
 int muacc_sca_socketcleanup(int socket);
 int muacc_sca_socketselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *exceptfds, struct timeval *timeout);
 
 /* All asynchronous action functions regarding the socketconnect request */
-int _socketconnect_request_a(muacc_context_t *ctx, int *s, const char *host, size_t hostlen, const char *serv, size_t servlen);
-int _muacc_contact_mam_a (muacc_mam_action_t reason, muacc_context_t *ctx);
-int _socketconnect_request_a_response(struct postponed_muacc_context *ppc);
+int _socketconnect_request_a(muacc_context_t *ctx, muacc_reqid_t *reqid, int *s, const char *host, size_t hostlen, const char *serv, size_t servlen);
+int _muacc_contact_mam_a (muacc_mam_action_t reason, muacc_context_t *ctx, muacc_reqid_t *reqid);
+int _socketconnect_request_a_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len);
 
 /* All asynchronous action functions regarding the socketchoose request */
-int _socketchoose_request_a(muacc_context_t *ctx, int *s, struct socketset *set);
-int _muacc_send_socketchoose_a (muacc_context_t *ctx, int *socket, struct socketset *set);
-int _socketchoose_request_a_response(struct postponed_muacc_context *ppc);
+int _socketchoose_request_a(muacc_context_t *ctx, muacc_reqid_t *reqid, int *s, struct socketset *set);
+int _muacc_send_socketchoose_a (muacc_context_t *ctx, muacc_reqid_t *reqid, int *socket, struct socketset *set);
+int _socketchoose_request_a_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len);
 
 /* process_response: Calls appropriate response function, replaces dummy fd */
-static int process_response(struct postponed_muacc_context *ppc);
+static int process_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len);
 
 static int rename_fd_in_socketsets(int new_fd, int old_fd);
 
@@ -175,7 +177,18 @@ int muacc_sca_socketconnect(int *s, const char *host, size_t hostlen, const char
 		 * The request we send to the server is a socketconnect request. */
 		DLOG(CLIB_IF_NOISY_DEBUG1, "No reusable socket candidate. Creating new socket.\n");
 
-		if ((ret = _socketconnect_request_a(&ppc->ctx, s, host, hostlen, serv, servlen)) == -1)
+		if (_muacc_lease_apply(&ppc->ctx) == 0)
+		{
+			/* MAM leased its decision - no need to wait for it */
+			DLOG(CLIB_IF_NOISY_DEBUG2, "MAM leased its decision - not asking again\n");
+			ret = _muacc_socketconnect_create(&ppc->ctx, s, &async_socketsetlist, NULL, 1);
+			muacc_release_context(&ppc->ctx);
+			free(ppc);
+			pthread_mutex_unlock(&async_io_global_lock);
+			return (ret < 0) ? -1 : 1;
+		}
+
+		if ((ret = _socketconnect_request_a(&ppc->ctx, &ppc->request_id, s, host, hostlen, serv, servlen)) == -1)
 		{
 			DLOG(CLIB_IF_NOISY_DEBUG1, "Error creating a new socket!\n");
 			muacc_release_context(&ppc->ctx);
@@ -206,7 +219,7 @@ int muacc_sca_socketconnect(int *s, const char *host, size_t hostlen, const char
 			ppc->ctx.ctx->remote_service = _muacc_clone_string(candidate_set->sockets->ctx->remote_service);
 		}
 
-		if ((ret = _socketchoose_request_a (&ppc->ctx, s, candidate_set)) == -1)
+		if ((ret = _socketchoose_request_a (&ppc->ctx, &ppc->request_id, s, candidate_set)) == -1)
 		{
 			DLOG(CLIB_IF_NOISY_DEBUG1, "Socketchoose error!\n");
 			muacc_release_context(&ppc->ctx);
@@ -227,6 +240,122 @@ int muacc_sca_socketconnect(int *s, const char *host, size_t hostlen, const char
 	}	
 }
 
+int muacc_sca_socketconnect_batch(struct muacc_sc_batch_item *items, size_t n)
+{
+	struct postponed_muacc_context **ppcs;
+	struct postponed_muacc_context *ppc;
+	muacc_context_t **ctxs;
+	muacc_reqid_t *ids;
+	size_t i, j;
+	size_t n_pending = 0;
+	int batch_sent;
+	int created = 0;
+
+	if (items == NULL)
+		return -1;
+
+	pthread_mutex_lock(&async_io_global_lock);
+	DLOG(CLIB_IF_NOISY_DEBUG0, "Socketconnect_a batch of %zu sockets invoked\n", n);
+
+	ppcs = calloc(n, sizeof(struct postponed_muacc_context *));
+	ctxs = calloc(n, sizeof(muacc_context_t *));
+	ids = calloc(n, sizeof(muacc_reqid_t));
+	if (n > 0 && (ppcs == NULL || ctxs == NULL || ids == NULL))
+	{
+		free(ppcs);
+		free(ctxs);
+		free(ids);
+		pthread_mutex_unlock(&async_io_global_lock);
+		return -1;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		items[i].socket = -1;
+		items[i].result = -1;
+
+		if ((ppc = malloc(sizeof(struct postponed_muacc_context))) == NULL)
+			continue;
+		memset(ppc, 0, sizeof(struct postponed_muacc_context));
+
+		muacc_init_context(&ppc->ctx);
+		if (ppc->ctx.ctx == NULL)
+		{
+			free(ppc);
+			continue;
+		}
+		ppc->ctx.ctx->domain = items[i].domain;
+		ppc->ctx.ctx->type = items[i].type;
+		ppc->ctx.ctx->protocol = items[i].proto;
+		ppc->ctx.ctx->sockopts_current = _muacc_clone_socketopts((const struct socketopt*) items[i].sockopts);
+
+		if (_muacc_host_serv_to_ctx(&ppc->ctx, items[i].host, items[i].hostlen, items[i].serv, items[i].servlen) != 0)
+		{
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Host or service of batch item %zu not given - skipping it.\n", i);
+		}
+		else if (_muacc_lease_apply(&ppc->ctx) == 0)
+		{
+			/* MAM leased its decision - no need to wait for it */
+			DLOG(CLIB_IF_NOISY_DEBUG2, "MAM leased its decision for batch item %zu - not asking again\n", i);
+			items[i].result = (_muacc_socketconnect_create(&ppc->ctx, &(items[i].socket), &async_socketsetlist, NULL, 1) < 0) ? -1 : 1;
+		}
+		else if ((ppc->fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+		{
+			/* temporary socket that we will later dup2 away */
+			DLOG(CLIB_IF_NOISY_DEBUG1, "socket call failed.\n");
+		}
+		else
+		{
+			ppcs[i] = ppc;
+			ctxs[n_pending++] = &ppc->ctx;
+			continue;
+		}
+
+		muacc_release_context(&ppc->ctx);
+		free(ppc);
+	}
+
+	/* one request for all of them - MAM answers each on its own, so the responses are processed as usual */
+	batch_sent = (n_pending > 0 && _muacc_send_socketconnect_batch(ctxs, ids, n_pending, 1) == 0);
+	if (n_pending > 0 && !batch_sent)
+		DLOG(CLIB_IF_NOISY_DEBUG1, "Could not send the batch - asking MAM for each socket\n");
+
+	for (i = 0, j = 0; i < n; i++)
+	{
+		if ((ppc = ppcs[i]) == NULL)
+			continue;
+
+		if (batch_sent)
+			ppc->request_id = ids[j];
+		j++;
+
+		if (!batch_sent && _muacc_contact_mam_a(muacc_act_socketconnect_req, &ppc->ctx, &ppc->request_id) == -1)
+		{
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Got no response from MAM (Is it running?) - Failing.\n");
+			close(ppc->fd);
+			muacc_release_context(&ppc->ctx);
+			free(ppc);
+			continue;
+		}
+
+		items[i].socket = ppc->fd;
+		items[i].result = 1;
+		postpone_context(ppc, SOCKETCONNECT_SENT);
+	}
+
+	for (i = 0; i < n; i++)
+		if (items[i].result == 1)
+			created++;
+
+	free(ppcs);
+	free(ctxs);
+	free(ids);
+
+	DLOG(CLIB_IF_NOISY_DEBUG2, "Socketconnect_a batch handed out %d of %zu sockets, contexts postponed.\n", created, n);
+	pthread_mutex_unlock(&async_io_global_lock);
+	return created;
+}
+
 int muacc_sca_socketclose(int socket)
 {
 	pthread_mutex_lock(&async_io_global_lock);
@@ -274,7 +403,7 @@ int muacc_sca_socketrelease(int socket)
 		{
 			slist->flags = slist->flags & ~MUACC_SOCKET_IN_USE;
 			set_to_release->use_count -= 1;
-			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %d\n", socket, set_to_release->use_count);
+			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %u\n", socket, set_to_release->use_count);
 
 			DLOG(CLIB_IF_NOISY_DEBUG2, "Set entry of socket %d found and marked as free\n", socket);
 		}
@@ -313,7 +442,7 @@ int muacc_sca_socketcleanup(int socket)
 			// Marking socket as free, so cleanup function will include it
 			slist->flags = slist->flags & ~MUACC_SOCKET_IN_USE;
 			set_to_cleanup->use_count -= 1;
-			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %d\n", socket, set_to_cleanup->use_count);
+			DLOG(CLIB_IF_NOISY_DEBUG2, "Socket set of %d: use count = %u\n", socket, set_to_cleanup->use_count);
 		}
 
 		DLOG(CLIB_IF_NOISY_DEBUG2, "Cleaning up socket set of socket %d\n", socket);
@@ -356,7 +485,13 @@ int muacc_sca_socketselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *
 	}
 	
 	bool mam_response_processed;
+	bool mam_response_pending;
+	bool mam_wakeup_only;
 	int retval;
+	int mam_sock, mam_shm_event, mam_notify;
+	char *resp;
+	ssize_t resp_len;
+	int ret;
 	
 	fd_set readfds_copy, writefds_copy, exceptfds_copy;
 	
@@ -375,6 +510,7 @@ int muacc_sca_socketselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *
 		memcpy(&writefds_copy, writefds, sizeof(fd_set));
 		memcpy(&exceptfds_copy, exceptfds, sizeof(fd_set));
 		
+		mam_response_pending=false;
 		for(ppc=postponed_ctx_list;ppc;ppc=ppc->next)
 		{
 			/* If we want to do either r, w or x with any postponed context,
@@ -384,21 +520,33 @@ int muacc_sca_socketselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *
 			if(FD_ISSET(ppc->fd, &readfds_copy))
 			{
 				FD_CLR(ppc->fd, &readfds_copy);
-				FD_SET(ppc->ctx.mamsock, &readfds_copy);
+				mam_response_pending=true;
 			}
 			
 			if(FD_ISSET(ppc->fd, &writefds_copy))
 			{
 				FD_CLR(ppc->fd, &writefds_copy);
-				FD_SET(ppc->ctx.mamsock, &readfds_copy);
+				mam_response_pending=true;
 			}
 			
 			if(FD_ISSET(ppc->fd, &exceptfds_copy))
 			{
 				FD_CLR(ppc->fd, &exceptfds_copy);
-				FD_SET(ppc->ctx.mamsock, &readfds_copy);
+				mam_response_pending=true;
 			}
 		}
+		
+		/* All responses arrive on the shared MAM session - responses read by
+		 * other threads are signalled through its notification pipe */
+		_muacc_mam_session_fds(&mam_sock, &mam_shm_event, &mam_notify);
+		if(!mam_response_pending)
+			mam_sock = mam_shm_event = mam_notify = -1;
+		if(mam_sock != -1)
+			FD_SET(mam_sock, &readfds_copy);
+		if(mam_shm_event != -1)
+			FD_SET(mam_shm_event, &readfds_copy);
+		if(mam_notify != -1)
+			FD_SET(mam_notify, &readfds_copy);
 			
 		struct timeval now, timeout_left;
 		if(timeout)
@@ -416,26 +564,52 @@ int muacc_sca_socketselect(int nfds, fd_set *readfds, fd_set *writefds, fd_set *
 		retval=select(FD_SETSIZE, &readfds_copy, &writefds_copy, &exceptfds_copy,timeout?&timeout_left:NULL);
 		
 		mam_response_processed=false;
+		mam_wakeup_only=false;
+		if(retval > 0 && mam_shm_event != -1 && FD_ISSET(mam_shm_event, &readfds_copy))
+		{
+			FD_CLR(mam_shm_event, &readfds_copy);
+			retval--;
+			mam_wakeup_only=true;
+		}
+		if(retval > 0 && mam_sock != -1 && FD_ISSET(mam_sock, &readfds_copy))
+		{
+			FD_CLR(mam_sock, &readfds_copy);
+			retval--;
+			mam_wakeup_only=true;
+		}
+		if(mam_wakeup_only)
+			_muacc_mam_process_events(1);
+		if(retval > 0 && mam_notify != -1 && FD_ISSET(mam_notify, &readfds_copy))
+		{
+			FD_CLR(mam_notify, &readfds_copy);
+			if(!mam_wakeup_only)
+				_muacc_mam_process_events(0);
+			retval--;
+			mam_wakeup_only=true;
+		}
+
 		struct postponed_muacc_context *next;
-		for(ppc=postponed_ctx_list;ppc;ppc=next)
+		for(ppc=postponed_ctx_list;mam_wakeup_only && ppc;ppc=next)
 		{
 			next=ppc->next; /* we need to save this reference here in case process_response removed the ppc from the list. */
 		
-			if(FD_ISSET(ppc->ctx.mamsock, &readfds_copy))
+			if((ret = _muacc_mam_poll_response(ppc->request_id, &resp, &resp_len)) != 0)
 			{
-				// If _any_ mamsock is readable, we have to call process the queued response from MAM with process_mam
+				// If _any_ response arrived, we have to process it
 				// and we cannot return the current xxxfds
-				if(0 > process_response(ppc))
+				if(0 > process_response(ppc, (ret > 0) ? resp : NULL, resp_len))
 				{
 					DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING : process_response failed\n");
 					goto error;
 				}
 				mam_response_processed=true;
 			}
-		}	
+		}
+		/* MAM woke us up without an answer for us - only return if something else happened */
+		mam_wakeup_only = mam_wakeup_only && !mam_response_processed && retval == 0;
 	
 	}
-	while(mam_response_processed);
+	while(mam_response_processed || mam_wakeup_only);
 	
 	memcpy(readfds, &readfds_copy, sizeof(fd_set));
 	memcpy(writefds, &writefds_copy, sizeof(fd_set));
@@ -458,7 +632,7 @@ error:
  *****************************************************************************/
 
 
-int _socketconnect_request_a(muacc_context_t *ctx, int *s, const char *host, size_t hostlen, const char *serv, size_t servlen)
+int _socketconnect_request_a(muacc_context_t *ctx, muacc_reqid_t *reqid, int *s, const char *host, size_t hostlen, const char *serv, size_t servlen)
 {
 	if (ctx == NULL)
 	{
@@ -472,7 +646,7 @@ int _socketconnect_request_a(muacc_context_t *ctx, int *s, const char *host, siz
 	}
 	else
 	{
-		if (-1 == _muacc_contact_mam_a(muacc_act_socketconnect_req, ctx))
+		if (-1 == _muacc_contact_mam_a(muacc_act_socketconnect_req, ctx, reqid))
 		{
 			DLOG(CLIB_IF_NOISY_DEBUG1, "Got no response from MAM (Is it running?) - Failing.\n");
 			return -1;
@@ -490,35 +664,38 @@ int _socketconnect_request_a(muacc_context_t *ctx, int *s, const char *host, siz
 	}
 }
 
-int _muacc_contact_mam_a (muacc_mam_action_t reason, muacc_context_t *ctx)
+int _muacc_contact_mam_a (muacc_mam_action_t reason, muacc_context_t *ctx, muacc_reqid_t *reqid)
 {
 	char buf[MUACC_TLV_MAXLEN];
 	ssize_t pos = 0;
 	ssize_t ret = 0;
 	
 	/* connect to MAM */
-	if(	_muacc_connect_ctx_to_mam(ctx) != 0 )
+	if(	_muacc_connect_ctx_to_mam(ctx) != 0 || _muacc_mam_new_request(reqid, 1) != 0 )
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
+		goto _muacc_contact_mam_connect_err;
 	}
 
 	DLOG(CLIB_IF_NOISY_DEBUG2, "Serializing MAM context\n");
 
 	/* pack request */
-	if( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_contact_mam_pack_err;
-	if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), ctx->ctx) ) goto  _muacc_contact_mam_pack_err;
-	if( 0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) ) goto  _muacc_contact_mam_pack_err;
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->mamversion, action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_contact_mam_pack_err;
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->mamversion, request_id, reqid, sizeof(muacc_reqid_t)) ) goto  _muacc_contact_mam_pack_err;
+	if( 0 > _muacc_pack_ctx_for_mam(ctx, buf, &pos, sizeof(buf)) ) goto  _muacc_contact_mam_pack_err;
+	if( 0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), ctx->mamversion, eof) ) goto  _muacc_contact_mam_pack_err;
 	DLOG(CLIB_IF_NOISY_DEBUG2,"Serializing MAM context done - Sending it to MAM\n");
 
 	/* send request */
-	if( 0 > (ret = send(ctx->mamsock, buf, pos, 0)) )
+	if( 0 > (ret = _muacc_send_to_mam(ctx, buf, pos)) )
 	{
-		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: error sending request: %s\n", strerror(errno));
+		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: error sending request\n");
+		_muacc_mam_cancel_request(*reqid);
 		goto _muacc_contact_mam_connect_err;
 	}
 	else
 	{
-		DLOG(CLIB_IF_NOISY_DEBUG2, "Request sent  - %ld of %ld bytes\n", (long int) ret, (long int) pos);
+		DLOG(CLIB_IF_NOISY_DEBUG2, "Request %u sent  - %ld of %ld bytes\n", *reqid, (long int) ret, (long int) pos);
 	}
 
 	return 0;
@@ -528,16 +705,16 @@ _muacc_contact_mam_connect_err:
 _muacc_contact_mam_pack_err:
 
 	DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: failed to serialize MAM context\n");
+	_muacc_mam_cancel_request(*reqid);
 	return(-1);
 }
 
 /* 0 on success but continue, 1 on success and finish, -1 on failure. */
-int _socketconnect_request_a_response(struct postponed_muacc_context *ppc)
+int _socketconnect_request_a_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len)
 {
 
 	muacc_context_t *ctx=&ppc->ctx;
 
-	char buf[MUACC_TLV_MAXLEN];
 	ssize_t pos = 0;
 
 
@@ -546,16 +723,31 @@ int _socketconnect_request_a_response(struct postponed_muacc_context *ppc)
 	muacc_tlv_t tag;
 	void *data;
 	ssize_t data_len;
+	muacc_mam_action_t resp_action = muacc_act_socketconnect_resp;
 	
+	if (resp == NULL)
+		goto _socketconnect_request_a_response_err;
+
 	DLOG(CLIB_IF_NOISY_DEBUG0, "Processing response \n");
 	pos = 0;
-	while( (ret = _muacc_read_tlv(ctx->mamsock, buf, &pos, sizeof(buf), &tag, &data, &data_len)) > 0)
+	while( (ret = _muacc_next_tlv(resp, &pos, resp_len, ctx->mamversion, &tag, &data, &data_len)) > 0)
 	{
 		if( tag == eof )
 			break;
+		else if( tag == request_id || tag == lease_ttl || tag == lease_epoch )
+			continue;
+		else if( tag == action && data_len == sizeof(muacc_mam_action_t) )
+			resp_action = *(muacc_mam_action_t *) data;
 		else if ( 0 > _muacc_unpack_ctx(tag, data, data_len, ctx->ctx) )
-			return -1;
+			goto _socketconnect_request_a_response_err;
 	}
+	if (ret <= 0)
+		goto _socketconnect_request_a_response_err;
+
+	_muacc_mam_ctx_synced(ctx, resp_action, 1);
+	if (resp_action == muacc_error_unknown_ctx)
+		return -1;
+	_muacc_lease_take(ctx, resp_action, resp, resp_len);
 	
 	int new_fd;
 	
@@ -571,6 +763,10 @@ int _socketconnect_request_a_response(struct postponed_muacc_context *ppc)
 	
 	
 	return 1; // success and finished
+
+_socketconnect_request_a_response_err:
+	_muacc_mam_ctx_synced(ctx, resp_action, 0);
+	return -1;
 }
 
 
@@ -578,84 +774,100 @@ int _socketconnect_request_a_response(struct postponed_muacc_context *ppc)
  * All asynchronous action functions regarding the socketchoose request      *
  *****************************************************************************/
 
-int _socketchoose_request_a(muacc_context_t *ctx, int *s, struct socketset *set)
+int _socketchoose_request_a(muacc_context_t *ctx, muacc_reqid_t *reqid, int *s, struct socketset *set)
 {
-	return _muacc_send_socketchoose_a (ctx, s, set);
+	return _muacc_send_socketchoose_a (ctx, reqid, s, set);
 
 }
 
-int _muacc_send_socketchoose_a (muacc_context_t *ctx, int *socket, struct socketset *set)
+int _muacc_send_socketchoose_a (muacc_context_t *ctx, muacc_reqid_t *reqid, int *socket, struct socketset *set)
 {
 
 
 	DLOG(CLIB_IF_NOISY_DEBUG0, "Sending socketchoose\n");
 
-	char buf[MUACC_TLV_MAXLEN];
+	char *buf = NULL;
+	ssize_t buf_len = MUACC_TLV_MAXLEN;
+	/* room kept for the eof of either encoding while packing the sockets */
+	ssize_t eof_len = sizeof(muacc_tlv_t) + sizeof(ssize_t);
 	ssize_t pos = 0;
 	ssize_t ret = 0;
+	int offered = 0;
 	
 	muacc_mam_action_t reason = muacc_act_socketchoose_req;
 
 	struct socketlist *list = set->sockets;
 
-	if ( _muacc_connect_ctx_to_mam(ctx) != 0 )
+	if ( (buf = malloc(buf_len)) == NULL )
+		return -1;
+
+	if ( _muacc_connect_ctx_to_mam(ctx) != 0 || _muacc_mam_new_request(reqid, 1) != 0 )
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
+		free(buf);
 		return -1;
 	}
 
 	DLOG(CLIB_IF_NOISY_DEBUG2, "Serializing MAM context\n");
-	if ( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) )
+	if ( 0 > _muacc_push_tlv_v(buf, &pos, buf_len, ctx->mamversion, action, &reason, sizeof(muacc_mam_action_t)) ||
+		 0 > _muacc_push_tlv_v(buf, &pos, buf_len, ctx->mamversion, request_id, reqid, sizeof(muacc_reqid_t)) )
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG1, "Error pushing label\n");
-		return -1;
+		goto _muacc_send_socketchoose_a_err;
 	}
 
 	/* Pack context from request */
-	if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), ctx->ctx) )
+	if( 0 > _muacc_pack_ctx_for_mam(ctx, buf, &pos, buf_len - eof_len) )
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG1, "Error serializing socket context \n");
-		return -1;
+		goto _muacc_send_socketchoose_a_err;
 	}
 
-	/* Pack sockets from socketset */
+	/* Pack all sockets from socketset - the buffer grows as needed */
 	while (list != NULL)
 	{
-		// Suggest all sockets that are currently not in use to MAM
-		if ((list->flags & MUACC_SOCKET_IN_USE) == 0)
+		// Suggest all sockets that are currently not in use and not closed by the peer to MAM
+		if ((list->flags & MUACC_SOCKET_IN_USE) == 0 && _muacc_probe_socket(list))
 		{
 			DLOG(CLIB_IF_NOISY_DEBUG2, "Pushing socket %d\n", list->file);
-			if ( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), socketset_file, &(list->file), sizeof(int)) )
-			{
-				DLOG(CLIB_IF_NOISY_DEBUG1, "Error pushing socket with file descriptor %d\n", list->file);
-				return -1;
-			}
-			if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), list->ctx) )
+			while( 0 > _muacc_pack_socket_for_mam(ctx, list, buf, &pos, buf_len - eof_len) )
 			{
-				DLOG(CLIB_IF_NOISY_DEBUG1, "Error pushing socket context of %d\n", list->file);
-				return -1;
+				if ( 0 > _muacc_grow_request(&buf, &buf_len) )
+				{
+					DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: socket set exceeds the maximum request length - offering only %d sockets\n", offered);
+					goto _muacc_send_socketchoose_a_eof;
+				}
 			}
+			offered++;
 		}
 		list = list->next;
 	}
-	if( 0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) )
+_muacc_send_socketchoose_a_eof:
+	if( 0 > _muacc_push_tlv_tag_v(buf, &pos, buf_len, ctx->mamversion, eof) )
 	{
 		DLOG(CLIB_IF_NOISY_DEBUG1, "Error pushing eof\n");
-		return -1;
+		goto _muacc_send_socketchoose_a_err;
 	}
-	DLOG(CLIB_IF_NOISY_DEBUG2, "Pushing request done\n");
+	DLOG(CLIB_IF_NOISY_DEBUG2, "Pushing request with %d sockets done\n", offered);
 
-	if ( 0 > (ret = send(ctx->mamsock, buf, pos, 0)) )
+	if ( 0 > (ret = _muacc_send_to_mam(ctx, buf, pos)) )
 	{
-		DLOG(CLIB_IF_NOISY_DEBUG1, "Error sending request: %s\n", strerror(errno));
-		return -1;
+		DLOG(CLIB_IF_NOISY_DEBUG1, "Error sending request\n");
+		goto _muacc_send_socketchoose_a_err;
 	}
 	
-	DLOG(CLIB_IF_NOISY_DEBUG2, "Sent request - %ld of %ld bytes\n", (long int) ret, (long int) pos);
+	DLOG(CLIB_IF_NOISY_DEBUG2, "Sent request %u - %ld of %ld bytes\n", *reqid, (long int) ret, (long int) pos);
+	free(buf);
 	return 0;
+
+_muacc_send_socketchoose_a_err:
+	free(buf);
+	_muacc_mam_cancel_request(*reqid);
+	_muacc_socketset_forget_mam_keys(set);
+	return -1;
 }
 
-int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
+int _socketchoose_request_a_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len)
 {
 	assert(ppc->candidate_set->socketchoose_pending);
 	ppc->candidate_set->socketchoose_pending=0;
@@ -664,7 +876,6 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 	
 	struct socketset *set = ppc->candidate_set;
 
-	char buf[MUACC_TLV_MAXLEN];
 	ssize_t pos = 0;
 	
 
@@ -680,8 +891,12 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 	
 	int reuse_fd = -1;
 	bool reuse_socket = false;
+	muacc_mam_action_t resp_action = muacc_act_socketchoose_resp_new;
+
+	if (resp == NULL)
+		goto _socketchoose_request_a_response_err;
 
-    while( (ret = _muacc_read_tlv(ctx->mamsock, buf, &pos, sizeof(buf), &tag, &data, &data_len)) > 0)
+    while( (ret = _muacc_next_tlv(resp, &pos, resp_len, ctx->mamversion, &tag, &data, &data_len)) > 0)
     {
 		if (tag == action)
 		{
@@ -699,40 +914,51 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 			else if (*(muacc_mam_action_t *) data == muacc_error_unknown_request)
 			{
 				DLOG(CLIB_IF_NOISY_DEBUG1, "Error: MAM sent error code \"Unknown Request\" -- Aborting.\n");
-				return -1;
+				goto _socketchoose_request_a_response_err;
+			}
+			else if (*(muacc_mam_action_t *) data == muacc_error_unknown_ctx)
+			{
+				DLOG(CLIB_IF_NOISY_DEBUG1, "Error: MAM does not know the contexts anymore -- Aborting.\n");
+				resp_action = muacc_error_unknown_ctx;
+				goto _socketchoose_request_a_response_err;
 			}
 			else
 			{
 				DLOG(CLIB_IF_NOISY_DEBUG1, "Error: Unknown MAM Response Action Type\n");
-				return -1;
+				goto _socketchoose_request_a_response_err;
 			}
 		}
 		else if (tag == socketset_file && data_len == sizeof(int))
 		{
 			if (reuse_socket)
 			{
+				/* remember the socket, but process the response up to eof */
 				reuse_fd=*(int *) data;
-				
-				return 0;
 			}
 			else
 			{
 				DLOG(CLIB_IF_NOISY_DEBUG1, "Socket %d suggested, but there was no muacc_act_socketchoose_resp_existing -- fail\n", *(int *)data);
-				return -1;
+				goto _socketchoose_request_a_response_err;
 			}
 		}
         else if( tag == eof )
             break;
+        else if( tag == request_id )
+            continue;
         else
 		{
 			if ( 0 > _muacc_unpack_ctx(tag, data, data_len, ctx->ctx) )
 			{
 				DLOG(CLIB_IF_NOISY_DEBUG1, "Error unpacking context\n");
-
-				return -1;
+				goto _socketchoose_request_a_response_err;
 			}
 		}
     }
+	if (ret <= 0)
+		goto _socketchoose_request_a_response_err;
+
+	_muacc_mam_ctx_synced(ctx, resp_action, 1);
+
     DLOG(CLIB_IF_NOISY_DEBUG0, "Socketchoose done, reuse_fd = %d, reuse_socket = %d\n", reuse_fd, reuse_socket);
 	
 	if(reuse_socket && reuse_fd > 0)
@@ -747,14 +973,14 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 
 		if (item == NULL)
 		{
-			DLOG(CLIB_IF_NOISY_DEBUG1, "Socket %d suggested, but not found in set -- this should not have happened.\n", *(int *)data);
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Socket %d suggested, but not found in set -- this should not have happened.\n", reuse_fd);
 			return -1;
 		}
 		
 		if ((item->flags & MUACC_SOCKET_IN_USE))
 		{
 			// Socket is already in use, so we cannot use it
-			DLOG(CLIB_IF_NOISY_DEBUG1, "Socket %d suggested, but is already in use -- this should not have happened.\n", *(int *) data);
+			DLOG(CLIB_IF_NOISY_DEBUG1, "Socket %d suggested, but is already in use -- this should not have happened.\n", reuse_fd);
 			return -1;
 		}
 		
@@ -771,7 +997,7 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 		close(reuse_fd);
 		
 
-		DLOG(CLIB_IF_NOISY_DEBUG2, "Use socket %d (previously %d) - use count of set is now %d\n", ppc->fd, reuse_fd, set->use_count);
+		DLOG(CLIB_IF_NOISY_DEBUG2, "Use socket %d (previously %d) - use count of set is now %u\n", ppc->fd, reuse_fd, set->use_count);
 
 		return 1; // success and finish
 	}
@@ -795,25 +1021,31 @@ int _socketchoose_request_a_response(struct postponed_muacc_context *ppc)
 	
 	//dup2(new_fd, ppc->fd); // This call really takes source first and destination second
 	//close(new_fd);
+
+_socketchoose_request_a_response_err:
+	_muacc_mam_ctx_synced(ctx, resp_action, 0);
+	if (resp_action == muacc_error_unknown_ctx)
+		_muacc_socketset_forget_mam_keys(set);
+	return -1;
 }
  
 /*****************************************************************************
  * process_response: Calls appropriate response function, replaces dummy fd  *
  *****************************************************************************/
 
-static int process_response(struct postponed_muacc_context *ppc)
+static int process_response(struct postponed_muacc_context *ppc, char *resp, ssize_t resp_len)
 { 
 	int ret;
 	switch(ppc->state)
 	{
 		case SOCKETCONNECT_SENT:
 			DLOG(CLIB_IF_NOISY_DEBUG0, "Calling handler to process socketconnect response.\n");
-			ret = _socketconnect_request_a_response(ppc);
+			ret = _socketconnect_request_a_response(ppc, resp, resp_len);
 			break;
 			
 		case SOCKETCHOOSE_SENT:
 			DLOG(CLIB_IF_NOISY_DEBUG0, "Calling handler to process socketchoose response.\n");
-			ret = _socketchoose_request_a_response(ppc);
+			ret = _socketchoose_request_a_response(ppc, resp, resp_len);
 			
 			break;
 			
@@ -822,6 +1054,7 @@ static int process_response(struct postponed_muacc_context *ppc)
 			DLOG(CLIB_IF_NOISY_DEBUG0, "WARNING: Postponed context in unknown state.\n");
 			break;
 	}
+	free(resp);
 	
 	if (ret == 0) // success, but keep postponed
 	{
@@ -877,6 +1110,9 @@ static int rename_fd_in_socketsets(int new_fd, int old_fd)
 	item->file=new_fd;
 	assert(item->ctx->sockfd==old_fd);
 	item->ctx->sockfd=new_fd;
+	/* the context MAM cached has the old fd */
+	if (item->mamkey != 0 && _muacc_socketset_release_hook != NULL)
+		_muacc_socketset_release_hook(item);
 	DLOG(CLIB_IF_NOISY_DEBUG0, "Renamed fd %d to %d\n", old_fd, new_fd);
 	return 0;
 }
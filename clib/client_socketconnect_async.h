@@ -35,6 +35,18 @@ int muacc_sca_socketconnect(
 	int proto                    /**< [in]		Protocol for socket() call */
 );
 
+/** Asynchronous function that returns new sockets for several URLs, asking MAM about all of them in a single request
+ *  The sockets can be used once muacc_sca_socketselect reports them writable, like those of muacc_sca_socketconnect.
+ *
+ *  This is the asynchronous version of muacc_sc_socketconnect_batch.
+ *
+ *  @return number of sockets returned (see result of each item), -1 if fail
+ */
+int muacc_sca_socketconnect_batch(
+	struct muacc_sc_batch_item *items,	/**< [in,out]	Sockets to create */
+	size_t n							/**< [in]		Number of items */
+);
+
 /** Close a socket that was supplied by socketconnect, drop it from the socket set
  *
  *  This is the asynchronous version of muacc_sc_socketclose.
@@ -16,10 +16,16 @@
 #include <errno.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include "dlog.h"
 #include "muacc_ctx.h"
 #include "muacc_tlv.h"
+#include "muacc_ring.h"
 #include "intents.h"
 
 #include "client_util.h"
@@ -39,6 +45,108 @@
 #define MUACC_CLIENT_UTIL_NOISY_DEBUG2 0
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef MSG_CMSG_CLOEXEC
+#define MSG_CMSG_CLOEXEC 0
+#endif
+
+/** how long to wait for MAM to make room in a full request ring */
+#define MUACC_MAM_SHM_SEND_TIMEOUT_US 1000000
+#define MUACC_MAM_SHM_SEND_POLL_US 100
+
+/** number of socketconnect decisions leased at a time */
+#define MUACC_LEASE_MAX 64
+
+/** State of a request sent over the MAM session */
+typedef enum
+{
+	muacc_mam_req_pending = 0,      /**< waiting for the response */
+	muacc_mam_req_answered,         /**< response received */
+	muacc_mam_req_failed            /**< connection was lost before the response arrived */
+} muacc_mam_req_state_t;
+
+/** Request waiting for its response on the MAM session */
+struct _muacc_mam_req
+{
+	muacc_reqid_t id;
+	muacc_mam_req_state_t state;
+	int async;                      /**< wake up muacc_sca_socketselect when answered */
+	char *resp;                     /**< complete response (malloced) once answered */
+	ssize_t resp_len;
+	struct _muacc_mam_req *next;
+};
+
+/** Shared memory rings the session talks to MAM through instead of the socket
+ *
+ *  Set MUACC_TRANSPORT=shm in the environment to use them - the socket then
+ *  only tells us when MAM goes away.
+ */
+struct _muacc_mam_shm
+{
+	int refs;                       /**< the session and threads using it - protected by the session lock */
+	void *base;                     /**< mapping of the rings */
+	size_t len;
+	muacc_ring_ref_t req;           /**< we produce requests */
+	muacc_ring_ref_t resp;          /**< we consume responses */
+	int efd_mam;                    /**< wakes up MAM */
+	int efd_client;                 /**< MAM wakes us up */
+};
+
+/** Decision MAM leased for socketconnect requests with the same host, service, type and intents
+ *
+ *  Valid until it expires, MAM revokes it or the connection it was granted on goes away.
+ */
+struct _muacc_lease
+{
+	char *host;
+	char *serv;
+	int domain;
+	int type;
+	int protocol;
+	struct socketopt *intents;      /**< socket options of the request */
+	struct _muacc_ctx *decision;    /**< context as MAM answered, NULL until granted */
+	uint64_t expires;               /**< end of the lease on the monotonic clock in ms */
+	struct _muacc_lease *next;
+};
+
+/** Process-wide session to MAM
+ *
+ *  All contexts share a single connection that is opened lazily.
+ *  Requests carry an id that MAM echoes in its response, so many requests
+ *  can be in flight at the same time and may be answered in any order.
+ *  Whichever waiting thread finds nobody else reading reads the next
+ *  response and hands it to the request it belongs to.
+ */
+static struct
+{
+	pthread_mutex_t lock;           /**< protects everything below */
+	pthread_mutex_t send_lock;      /**< keeps requests from interleaving on the connection */
+	pthread_cond_t answered;        /**< broadcast whenever a response was dispatched */
+	int sock;                       /**< connection to MAM, -1 if not connected */
+	muacc_readbuf_t *rbuf;          /**< responses received on the connection but not dispatched yet */
+	int reading;                    /**< a thread is currently reading a response */
+	int notify[2];                  /**< pipe signalling answered async requests */
+	int version;                    /**< protocol version negotiated on the connection */
+	unsigned int epoch;             /**< counts connections, so stale cache keys can be detected */
+	uint32_t next_key;              /**< next key to cache a context under */
+	muacc_reqid_t next_id;
+	uuid_t ctxid;                   /**< id MAM assigned to the connection */
+	struct _muacc_mam_req *reqs;    /**< outstanding requests, oldest first */
+	int want_shm;                   /**< ask MAM for shared memory on new connections */
+	struct _muacc_mam_shm *shm;     /**< shared memory of the connection, NULL if requests go over the socket */
+	struct _muacc_lease *leases;    /**< decisions leased on the connection */
+	int n_leases;
+	uint32_t lease_revoked;         /**< leases granted before this epoch of MAM are revoked */
+} mam_session = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, -1, NULL, 0, {-1, -1}, MUACC_PROTOCOL_V1, 0, 1, 1, {0}, NULL, 0, NULL, NULL, 0, 0 };
+
+static pthread_once_t mam_session_once = PTHREAD_ONCE_INIT;
+
+static void _muacc_mam_forget(uint32_t key, unsigned int epoch);
+static void _muacc_lease_free(struct _muacc_lease *lease);
+
 int muacc_init_context(struct muacc_context *ctx)
 {
 	struct _muacc_ctx *_ctx = _muacc_create_ctx();
@@ -51,213 +159,1568 @@ int muacc_init_context(struct muacc_context *ctx)
 	ctx->usage = 1;
 	ctx->locks = 0;
 	ctx->mamsock = -1;
+	ctx->mamversion = MUACC_PROTOCOL_V1;
+	ctx->mamepoch = 0;
+	ctx->mamkey = 0;
+	ctx->mamshadow = NULL;
+	ctx->lease = NULL;
+
+	ctx->ctx = _ctx;
+	return(0);
+}
+
+muacc_ctxino_t _muacc_get_ctxino(int sockfd)
+{
+    struct stat s;
+    fstat(sockfd, &s);
+    return s.st_ino;
+}
+
+int _is_socket_open(int sockfd)
+{
+    char dummy;
+	ssize_t ret;
+    ret = recv(sockfd, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Socket closed check returned: %zu errno: %d\n", ret, errno);
+	if (ret == 0)
+	{
+		return 0;
+	}
+	else if (ret == -1)
+	{
+		if (errno == EWOULDBLOCK)
+			return 1;
+		else
+			return 0;
+	}
+	else
+		return 1;
+}
+
+int _muacc_probe_socket(struct socketlist *list)
+{
+#if defined(IS_LINUX) && defined(TCP_INFO)
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+
+	if (getsockopt(list->file, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 && len >= sizeof(info.tcpi_state))
+	{
+		list->tcp_state = info.tcpi_state;
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Socket %d is in TCP state %d\n", list->file, list->tcp_state);
+
+		/* FIN received (or the connection is gone) */
+		return (info.tcpi_state != TCP_CLOSE_WAIT && info.tcpi_state != TCP_LAST_ACK && info.tcpi_state != TCP_CLOSE);
+	}
+#endif
+
+	list->tcp_state = 0;
+	return _is_socket_open(list->file);
+}
+
+int _lock_ctx (muacc_context_t *ctx)
+{
+    return( -(ctx->locks++) );
+}
+
+int _unlock_ctx (muacc_context_t *ctx)
+{
+    return( -(--(ctx->locks)) );
+}
+
+int muacc_retain_context(struct muacc_context *ctx)
+{
+	if(ctx->ctx == NULL)
+	{
+		return(-1);
+	}
+
+	return(++(ctx->usage));
+}
+
+void muacc_print_context(struct muacc_context *ctx)
+{
+	strbuf_t sb;
+
+	if (ctx == NULL)
+	{
+		dprintf(muacc_debug_fd, "ctx = NULL\n");
+	}
+	else if (ctx->ctx == NULL)
+	{
+		dprintf(muacc_debug_fd, "ctx->ctx = NULL\n");
+	}
+	else
+	{
+		strbuf_init(&sb);
+		_muacc_print_ctx(&sb, ctx->ctx);
+		dprintf(muacc_debug_fd, "/**************************************/\n%s\n/**************************************/\n", strbuf_export(&sb));
+		strbuf_release(&sb);
+	}
+}
+
+int muacc_release_context(struct muacc_context *ctx)
+{
+	if(ctx == NULL)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: tried to release NULL POINTER context\n");
+		return -1;
+	}
+	else if(ctx->ctx == NULL)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "empty context - nothing to release\n");
+		return 0;
+	}
+	else
+	{
+		if( --(ctx->usage) == 0 )
+		{
+			_muacc_mam_forget(ctx->mamkey, ctx->mamepoch);
+			if (ctx->mamshadow != NULL)
+				_muacc_free_ctx(ctx->mamshadow);
+			ctx->mamshadow = NULL;
+			_muacc_lease_free(ctx->lease);
+			ctx->lease = NULL;
+			return _muacc_free_ctx(ctx->ctx);
+		} else {
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "context has still %d references\n", ctx->usage);
+			return(ctx->usage);
+		}
+	}
+}
+
+
+int muacc_clone_context(struct muacc_context *dst, struct muacc_context *src)
+{
+	if (dst == NULL)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0,"WARNING: cloning into empty context\n");
+		return 0;
+	}
+
+	if (src == NULL)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0,"WARNING: cloning uninitialized context\n");
+		dst->ctx = NULL;
+	}
+	else
+	{
+		dst->ctx = _muacc_clone_ctx(src->ctx);
+	}
+
+	dst->usage = 1;
+	dst->locks = 0;
+	dst->mamsock = -1;
+	dst->mamversion = MUACC_PROTOCOL_V1;
+	dst->mamepoch = 0;
+	dst->mamkey = 0;
+	dst->mamshadow = NULL;
+	dst->lease = NULL;
+
+	return(0);
+}
+
+
+
+/** Open a new connection to MAM
+ *
+ * @return file descriptor on success, a negative number otherwise
+ */
+static int _muacc_mam_open(void)
+{
+	struct sockaddr_un mams;
+	int fd;
+	int err;
+
+	memset(&mams, 0, sizeof(mams));
+	mams.sun_family = AF_UNIX;
+	#ifdef HAVE_SOCKADDR_LEN
+	mams.sun_len = sizeof(struct sockaddr_un);
+	#endif
+	strncpy( mams.sun_path, MUACC_SOCKET, sizeof(mams.sun_path) - 1);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1)
+	{
+		err = errno;
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: socket creation failed: %s\n", strerror(err));
+		return(-err);
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	if(connect(fd, (struct sockaddr*) &mams, sizeof(mams)) < 0)
+	{
+		err = errno;
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: connect to mam via %s failed: %s\n",  mams.sun_path, strerror(err));
+		close(fd);
+		return(-err);
+	}
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Opened connection %d to MAM\n", fd);
+	return fd;
+}
+
+/** Agree on the protocol version to use on a new connection - call with the session locked
+ *
+ *  The hello is always sent in protocol version 1. A MAM that does not know it
+ *  answers with an error and no version, so we stay with version 1.
+ *
+ * @return negotiated version on success, -1 if the connection failed
+ */
+static int _muacc_mam_hello_locked(int fd, muacc_readbuf_t *rb)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	char *resp;
+	ssize_t pos = 0;
+	ssize_t len;
+	muacc_mam_action_t reason = muacc_act_hello_req;
+	uint32_t version = MUACC_PROTOCOL_MAX;
+	int chosen = 0;
+	int is_hello_resp = 0;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+
+	if( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv(buf, &pos, sizeof(buf), protocol_version, &version, sizeof(uint32_t)) ||
+		0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) )
+		return(-1);
+
+	if (send(fd, buf, pos, MSG_NOSIGNAL) != pos)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: error sending hello: %s\n", strerror(errno));
+		return(-1);
+	}
+
+	if ((len = _muacc_read_msg(fd, rb, MUACC_PROTOCOL_V1, &resp)) <= 0)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to read hello response from MAM\n");
+		return(-1);
+	}
+
+	pos = 0;
+	while ( _muacc_next_tlv(resp, &pos, len, MUACC_PROTOCOL_V1, &tag, &data, &data_len) > 0 && tag != eof)
+	{
+		if (tag == action && data_len == sizeof(muacc_mam_action_t))
+			is_hello_resp = (*(muacc_mam_action_t *) data == muacc_act_hello_resp);
+		else if (tag == protocol_version && data_len == sizeof(uint32_t))
+			chosen = *(uint32_t *) data;
+		else if (tag == ctxid && data_len == sizeof(uuid_t))
+			__uuid_copy(mam_session.ctxid, *(uuid_t *) data);
+	}
+
+	if (!is_hello_resp || chosen < MUACC_PROTOCOL_V1)
+		chosen = MUACC_PROTOCOL_V1;
+	else if (chosen > MUACC_PROTOCOL_MAX)
+		chosen = MUACC_PROTOCOL_MAX;
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Speaking protocol version %d with MAM\n", chosen);
+	return(chosen);
+}
+
+/** Drop a reference to the shared memory, unmapping it with the last one - call with the session locked */
+static void _muacc_mam_shm_put_locked(struct _muacc_mam_shm *shm)
+{
+	if (shm == NULL || --(shm->refs) > 0)
+		return;
+
+	munmap(shm->base, shm->len);
+	close(shm->efd_mam);
+	close(shm->efd_client);
+	free(shm);
+}
+
+/** Signal the other side through an eventfd */
+static void _muacc_mam_shm_signal(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "WARNING: could not signal eventfd %d: %s\n", efd, strerror(errno));
+}
+
+/** Ask MAM to move a new connection to shared memory - call with the session locked
+ *
+ *  MAM passes the shared memory and two eventfds along with its response.
+ *  If it declines, requests keep going over the socket.
+ *
+ * @return 0 on success (*shm is NULL if MAM declined), -1 if the connection failed
+ */
+static int _muacc_mam_shm_open_locked(int fd, struct _muacc_mam_shm **shm)
+{
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	ssize_t len;
+	muacc_mam_action_t reason = muacc_act_shm_req;
+	int accepted = 0;
+	int complete = 0;
+	int fds[3] = { -1, -1, -1 };
+	int nfds = 0;
+	int i;
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct stat st;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+
+	*shm = NULL;
+
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, eof) )
+		return(-1);
+
+	if (send(fd, buf, pos, MSG_NOSIGNAL) != pos)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: error asking for shared memory: %s\n", strerror(errno));
+		return(-1);
+	}
+
+	/* MAM sends the whole response with a single sendmsg */
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = sizeof(buf);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if ((len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) <= 0)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to read shm response from MAM\n");
+		return(-1);
+	}
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (nfds > 3)
+				nfds = 3;
+			memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+		}
+	}
+
+	pos = 0;
+	while ( _muacc_next_tlv(buf, &pos, len, MUACC_PROTOCOL_V2, &tag, &data, &data_len) > 0)
+	{
+		if (tag == eof)
+		{
+			complete = 1;
+			break;
+		}
+		else if (tag == action && data_len == sizeof(muacc_mam_action_t))
+			accepted = (*(muacc_mam_action_t *) data == muacc_act_shm_resp);
+	}
+
+	if (!complete || (msg.msg_flags & MSG_CTRUNC))
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: incomplete shm response from MAM\n");
+		goto _muacc_mam_shm_open_err;
+	}
+	if (!accepted || nfds != 3)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "MAM declined shared memory - using the socket\n");
+		for (i = 0; i < nfds; i++)
+			close(fds[i]);
+		return(0);
+	}
+
+	if ((*shm = malloc(sizeof(struct _muacc_mam_shm))) == NULL || fstat(fds[0], &st) != 0)
+		goto _muacc_mam_shm_open_err;
+
+	(*shm)->refs = 1;
+	(*shm)->len = st.st_size;
+	(*shm)->base = mmap(NULL, (*shm)->len, PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+	if ((*shm)->base == MAP_FAILED)
+		goto _muacc_mam_shm_open_err;
+	if (_muacc_ring_shm_attach((*shm)->base, (*shm)->len, &((*shm)->req), &((*shm)->resp)) != 0)
+	{
+		munmap((*shm)->base, (*shm)->len);
+		goto _muacc_mam_shm_open_err;
+	}
+
+	close(fds[0]);
+	(*shm)->efd_mam = fds[1];
+	(*shm)->efd_client = fds[2];
+	for (i = 1; i < 3; i++)
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Talking to MAM through shared memory\n");
+	return(0);
+
+_muacc_mam_shm_open_err:
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: could not set up shared memory\n");
+	for (i = 0; i < nfds; i++)
+		close(fds[i]);
+	free(*shm);
+	*shm = NULL;
+	return(-1);
+}
+
+/** Send a request on the connection or through the shared memory - call with the send lock held
+ *
+ * @return number of bytes sent, -1 otherwise (errno is set)
+ */
+static ssize_t _muacc_mam_transmit(int fd, struct _muacc_mam_shm *shm, const void *buf, size_t len)
+{
+	int waited = 0;
+	int ret;
+
+	if (shm == NULL)
+		return send(fd, buf, len, MSG_NOSIGNAL);
+
+	while ((ret = _muacc_ring_push(&(shm->req), buf, len)) == -1)
+	{
+		/* MAM never stops taking requests off the ring for long - it queues its responses */
+		if (waited >= MUACC_MAM_SHM_SEND_TIMEOUT_US)
+		{
+			errno = ETIMEDOUT;
+			return(-1);
+		}
+		usleep(MUACC_MAM_SHM_SEND_POLL_US);
+		waited += MUACC_MAM_SHM_SEND_POLL_US;
+	}
+	if (ret < 0)
+	{
+		errno = EMSGSIZE;
+		return(-1);
+	}
+
+	if (_muacc_ring_wake_consumer(&(shm->req)))
+		_muacc_mam_shm_signal(shm->efd_mam);
+
+	return(len);
+}
+
+static void _muacc_mam_notify_pipe_open(void)
+{
+	int i;
+
+	if (pipe(mam_session.notify) != 0)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: could not create notification pipe: %s\n", strerror(errno));
+		mam_session.notify[0] = mam_session.notify[1] = -1;
+		return;
+	}
+
+	for (i = 0; i < 2; i++)
+	{
+		fcntl(mam_session.notify[i], F_SETFD, FD_CLOEXEC);
+		fcntl(mam_session.notify[i], F_SETFL, O_NONBLOCK);
+	}
+}
+
+/** Wake up muacc_sca_socketselect if it waits for any request - call with the session locked
+ *
+ *  Also needed if its response did not arrive yet, as the select might not
+ *  watch the connection while another thread reads from it.
+ */
+static void _muacc_mam_notify_locked(void)
+{
+	struct _muacc_mam_req *req;
+	char c = 0;
+
+	for (req = mam_session.reqs; req != NULL && !req->async; req = req->next);
+	if (req == NULL || mam_session.notify[1] == -1)
+		return;
+
+	if (write(mam_session.notify[1], &c, 1) < 0 && errno != EAGAIN)
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "WARNING: could not write to notification pipe: %s\n", strerror(errno));
+}
+
+static struct _muacc_mam_req *_muacc_mam_find_req_locked(muacc_reqid_t id)
+{
+	struct _muacc_mam_req *req;
+
+	for (req = mam_session.reqs; req != NULL; req = req->next)
+		if (req->id == id)
+			return req;
+	return NULL;
+}
+
+/** drop all leased decisions - call with the session locked */
+static void _muacc_mam_drop_leases_locked(void)
+{
+	struct _muacc_lease *lease, *next;
+
+	for (lease = mam_session.leases; lease != NULL; lease = next)
+	{
+		next = lease->next;
+		_muacc_lease_free(lease);
+	}
+	mam_session.leases = NULL;
+	mam_session.n_leases = 0;
+}
+
+/** Drop the connection and fail all outstanding requests - call with the session locked
+ *
+ *  If another thread is blocked reading on the connection, it is only shut down
+ *  here and closed by the reader, so the descriptor cannot be reused meanwhile.
+ */
+static void _muacc_mam_session_reset_locked(void)
+{
+	struct _muacc_mam_req *req;
+
+	if (mam_session.sock != -1)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Dropping connection %d to MAM\n", mam_session.sock);
+		if (mam_session.reading)
+		{
+			/* the reader closes it and frees its buffer */
+			shutdown(mam_session.sock, SHUT_RDWR);
+		}
+		else
+		{
+			close(mam_session.sock);
+			free(mam_session.rbuf);
+		}
+		mam_session.sock = -1;
+		mam_session.rbuf = NULL;
+	}
+	memset(mam_session.ctxid, 0, sizeof(uuid_t));
+
+	/* a reader waiting for the shared memory notices the shutdown of the socket */
+	_muacc_mam_shm_put_locked(mam_session.shm);
+	mam_session.shm = NULL;
+
+	/* leases are only valid as long as MAM could revoke them - a new MAM counts epochs anew */
+	_muacc_mam_drop_leases_locked();
+	mam_session.lease_revoked = 0;
+
+	for (req = mam_session.reqs; req != NULL; req = req->next)
+	{
+		if (req->state == muacc_mam_req_pending)
+			req->state = muacc_mam_req_failed;
+	}
+
+	pthread_cond_broadcast(&mam_session.answered);
+	_muacc_mam_notify_locked();
+}
+
+/** Take the id MAM assigned to the connection from a packed context - call with the session locked */
+static void _muacc_mam_learn_ctxid_locked(const void *data, ssize_t data_len)
+{
+	struct _muacc_ctx *_ctx = _muacc_create_ctx();
+
+	if (_ctx == NULL)
+		return;
+	if (_muacc_unpack_ctx(packed_ctx, data, data_len, _ctx) == 0)
+		__uuid_copy(mam_session.ctxid, _ctx->ctxid);
+	_muacc_free_ctx(_ctx);
+}
+
+/** Hand a complete response to the request it belongs to - call with the session locked
+ *
+ *  Responses without request id (from a MAM that does not know it) answer
+ *  the oldest outstanding request, as MAM used to answer in order.
+ */
+static void _muacc_mam_dispatch_locked(char *resp, ssize_t resp_len, int version)
+{
+	ssize_t pos = 0;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+	struct _muacc_mam_req *req = NULL;
+	int has_id = 0;
+	muacc_mam_action_t resp_action = muacc_error_unknown_request;
+	uint32_t revoked = mam_session.lease_revoked;
+
+	while ( _muacc_next_tlv(resp, &pos, resp_len, version, &tag, &data, &data_len) > 0 && tag != eof)
+	{
+		if (tag == action && data_len == sizeof(muacc_mam_action_t))
+		{
+			resp_action = *(muacc_mam_action_t *) data;
+		}
+		else if (tag == lease_epoch && data_len == sizeof(uint32_t))
+		{
+			revoked = *(uint32_t *) data;
+		}
+		else if (tag == request_id && data_len == sizeof(muacc_reqid_t))
+		{
+			req = _muacc_mam_find_req_locked(*(muacc_reqid_t *) data);
+			has_id = 1;
+		}
+		else if (tag == ctxid && data_len == sizeof(uuid_t) && __uuid_is_null(mam_session.ctxid))
+		{
+			__uuid_copy(mam_session.ctxid, *(uuid_t *) data);
+		}
+		else if (tag == packed_ctx && __uuid_is_null(mam_session.ctxid))
+		{
+			_muacc_mam_learn_ctxid_locked(data, data_len);
+		}
+	}
+
+	if (resp_action == muacc_act_lease_revoke)
+	{
+		/* not a response - MAM may decide differently from now on */
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "MAM revoked all leases before epoch %u\n", revoked);
+		mam_session.lease_revoked = revoked;
+		_muacc_mam_drop_leases_locked();
+		free(resp);
+		return;
+	}
+
+	if (!has_id)
+		for (req = mam_session.reqs; req != NULL && req->state != muacc_mam_req_pending; req = req->next);
+
+	if (req == NULL || req->state != muacc_mam_req_pending)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "WARNING: dropping response that matches no outstanding request\n");
+		free(resp);
+		return;
+	}
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Received response to request %u\n", req->id);
+	req->resp = resp;
+	req->resp_len = resp_len;
+	req->state = muacc_mam_req_answered;
+
+	pthread_cond_broadcast(&mam_session.answered);
+}
+
+/** Take the next response off the shared memory - call without the session locked
+ *
+ *  Waits for MAM to signal the eventfd if there is none and block is set.
+ *  Gives up if anything happens on the socket - MAM does not send there anymore.
+ *
+ * @return length of the response, 0 if there is none and block was not set, -1 on error
+ */
+static ssize_t _muacc_mam_shm_read(int fd, struct _muacc_mam_shm *shm, char *resp, int block)
+{
+	struct pollfd pfd[2];
+	uint64_t cnt;
+	ssize_t resp_len;
+
+	for (;;)
+	{
+		if ((resp_len = _muacc_ring_pop(&(shm->resp), resp, MUACC_TLV_MAXLEN)) != 0 || !block)
+			break;
+		if (!_muacc_ring_consumer_sleep(&(shm->resp)))
+			continue;
+
+		pfd[0].fd = shm->efd_client;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = fd;
+		pfd[1].events = POLLIN;
+		pfd[0].revents = pfd[1].revents = 0;
+
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return(-1);
+		}
+		if (pfd[1].revents != 0)
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Connection to MAM closed while waiting for shared memory\n");
+			return(-1);
+		}
+		if (pfd[0].revents & POLLIN)
+			while (read(shm->efd_client, &cnt, sizeof(cnt)) > 0);
+	}
+
+	/* MAM queues responses while the ring is full - tell it we made room */
+	if (resp_len > 0 && _muacc_ring_wake_producer(&(shm->resp)))
+		_muacc_mam_shm_signal(shm->efd_mam);
+
+	return(resp_len);
+}
+
+/** Copy a response out of the read buffer and dispatch it - call with the session locked */
+static void _muacc_mam_dispatch_copy_locked(const char *msg, ssize_t msg_len, int version)
+{
+	char *resp;
+
+	if ((resp = malloc(msg_len)) == NULL)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: dropping response - out of memory\n");
+		return;
+	}
+	memcpy(resp, msg, msg_len);
+	_muacc_mam_dispatch_locked(resp, msg_len, version);
+}
+
+/** Read the next response from MAM and dispatch it - call with the session locked
+ *
+ *  The lock is released while blocking in read. Without block, only a response
+ *  that already arrived in the shared memory is read.
+ *  Responses that came in with the same read are dispatched as well - the
+ *  socket does not become readable again for them.
+ */
+static void _muacc_mam_read_locked(int block)
+{
+	int fd = mam_session.sock;
+	int version = mam_session.version;
+	struct _muacc_mam_shm *shm = mam_session.shm;
+	muacc_readbuf_t *rb = mam_session.rbuf;
+	char *resp = NULL;
+	ssize_t resp_len = -1;
+
+	if (fd == -1 || mam_session.reading)
+		return;
+
+	mam_session.reading = 1;
+	if (shm != NULL)
+		shm->refs++;
+	pthread_mutex_unlock(&mam_session.lock);
+
+	if (shm != NULL)
+	{
+		if ((resp = malloc(MUACC_TLV_MAXLEN)) != NULL)
+			resp_len = _muacc_mam_shm_read(fd, shm, resp, block);
+	}
+	else
+	{
+		resp_len = _muacc_read_msg(fd, rb, version, &resp);
+	}
+
+	pthread_mutex_lock(&mam_session.lock);
+	mam_session.reading = 0;
+	_muacc_mam_shm_put_locked(shm);
+
+	if (fd != mam_session.sock)
+	{
+		/* session was reset while we were reading */
+		close(fd);
+		if (shm != NULL)
+			free(resp);
+		else
+			free(rb);
+	}
+	else if (resp_len == 0 && shm != NULL)
+	{
+		/* nothing in the shared memory yet */
+		free(resp);
+	}
+	else if (resp_len <= 0)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to read response from MAM\n");
+		if (shm != NULL)
+			free(resp);
+		_muacc_mam_session_reset_locked();
+	}
+	else if (shm != NULL)
+	{
+		_muacc_mam_dispatch_locked(resp, resp_len, version);
+	}
+	else
+	{
+		_muacc_mam_dispatch_copy_locked(resp, resp_len, version);
+		while ((resp_len = _muacc_take_msg(rb, version, &resp)) > 0)
+			_muacc_mam_dispatch_copy_locked(resp, resp_len, version);
+		if (resp_len < 0)
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: garbage in response from MAM\n");
+			_muacc_mam_session_reset_locked();
+		}
+	}
+
+	_muacc_mam_notify_locked();
+}
+
+/** Unlink an answered or failed request and pass its response on - call with the session locked
+ *
+ * @return 0 if answered, -1 if failed
+ */
+static int _muacc_mam_take_req_locked(struct _muacc_mam_req *req, char **resp, ssize_t *resp_len)
+{
+	struct _muacc_mam_req **preq;
+	int ret = (req->state == muacc_mam_req_answered) ? 0 : -1;
+
+	for (preq = &mam_session.reqs; *preq != req; preq = &((*preq)->next));
+	*preq = req->next;
+
+	*resp = req->resp;
+	*resp_len = req->resp_len;
+	free(req);
+	return ret;
+}
+
+/** Child side of fork() - the connection is shared with the parent now,
+ *  so it must never be used for requests of the child
+ */
+static void _muacc_mam_session_atfork_child(void)
+{
+	struct _muacc_mam_req *req, *next;
+
+	pthread_mutex_init(&mam_session.lock, NULL);
+	pthread_mutex_init(&mam_session.send_lock, NULL);
+	pthread_cond_init(&mam_session.answered, NULL);
+
+	if (mam_session.sock != -1)
+		close(mam_session.sock);
+	mam_session.sock = -1;
+	free(mam_session.rbuf);
+	mam_session.rbuf = NULL;
+	mam_session.reading = 0;
+	memset(mam_session.ctxid, 0, sizeof(uuid_t));
+
+	/* the parent keeps using the rings - just get rid of our mapping */
+	if (mam_session.shm != NULL)
+	{
+		mam_session.shm->refs = 1;
+		_muacc_mam_shm_put_locked(mam_session.shm);
+		mam_session.shm = NULL;
+	}
+	_muacc_mam_drop_leases_locked();
+
+	for (req = mam_session.reqs; req != NULL; req = next)
+	{
+		next = req->next;
+		free(req->resp);
+		free(req);
+	}
+	mam_session.reqs = NULL;
+
+	if (mam_session.notify[0] != -1)
+	{
+		close(mam_session.notify[0]);
+		close(mam_session.notify[1]);
+	}
+	_muacc_mam_notify_pipe_open();
+}
+
+static void _muacc_mam_release_socket(struct socketlist *list)
+{
+	_muacc_mam_forget(list->mamkey, list->mamepoch);
+	list->mamkey = 0;
+}
+
+static void _muacc_mam_session_init(void)
+{
+	const char *transport = getenv("MUACC_TRANSPORT");
+
+	mam_session.want_shm = (transport != NULL && strcmp(transport, "shm") == 0);
+	_muacc_mam_notify_pipe_open();
+	_muacc_socketset_release_hook = &_muacc_mam_release_socket;
+	pthread_atfork(NULL, NULL, &_muacc_mam_session_atfork_child);
+}
+
+int _muacc_connect_ctx_to_mam(muacc_context_t *ctx)
+{
+	int fd;
+	int version;
+	int ret = 0;
+	muacc_readbuf_t *rb;
+
+	pthread_once(&mam_session_once, &_muacc_mam_session_init);
+
+	pthread_mutex_lock(&mam_session.lock);
+	if (mam_session.sock == -1)
+	{
+		if ((rb = calloc(1, sizeof(muacc_readbuf_t))) == NULL)
+			ret = -1;
+		else if ((fd = _muacc_mam_open()) < 0)
+			ret = fd;
+		else if ((version = _muacc_mam_hello_locked(fd, rb)) < 0 ||
+				(version >= MUACC_PROTOCOL_V2 && mam_session.want_shm && _muacc_mam_shm_open_locked(fd, &(mam_session.shm)) < 0))
+		{
+			close(fd);
+			memset(mam_session.ctxid, 0, sizeof(uuid_t));
+			ret = -1;
+		}
+		else
+		{
+			mam_session.rbuf = rb;
+			rb = NULL;
+			mam_session.sock = fd;
+			mam_session.version = version;
+			mam_session.epoch++;
+		}
+		free(rb);
+	}
+
+	if (ret == 0)
+	{
+		/* MAM identifies contexts by the connection they talk on */
+		if (ctx->ctx != NULL)
+			__uuid_copy(ctx->ctx->ctxid, mam_session.ctxid);
+		ctx->mamsock = mam_session.sock;
+		ctx->mamversion = mam_session.version;
+
+		/* a new connection starts with an empty cache */
+		if (ctx->mamepoch != mam_session.epoch)
+		{
+			if (ctx->mamshadow != NULL)
+				_muacc_free_ctx(ctx->mamshadow);
+			ctx->mamshadow = NULL;
+			ctx->mamkey = 0;
+			ctx->mamepoch = mam_session.epoch;
+		}
+	}
+	pthread_mutex_unlock(&mam_session.lock);
+
+	return ret;
+}
+
+int _muacc_mam_new_request(muacc_reqid_t *id, int async)
+{
+	struct _muacc_mam_req *req, **preq;
+
+	if ((req = malloc(sizeof(struct _muacc_mam_req))) == NULL)
+		return(-1);
+	memset(req, 0, sizeof(struct _muacc_mam_req));
+	req->async = async;
+
+	pthread_mutex_lock(&mam_session.lock);
+	req->id = mam_session.next_id++;
+	for (preq = &mam_session.reqs; *preq != NULL; preq = &((*preq)->next));
+	*preq = req;
+	pthread_mutex_unlock(&mam_session.lock);
+
+	*id = req->id;
+	return(0);
+}
+
+void _muacc_mam_cancel_request(muacc_reqid_t id)
+{
+	struct _muacc_mam_req *req;
+	char *resp;
+	ssize_t resp_len;
+
+	pthread_mutex_lock(&mam_session.lock);
+	if ((req = _muacc_mam_find_req_locked(id)) != NULL)
+	{
+		/* a response still to come will be dropped as unmatched */
+		_muacc_mam_take_req_locked(req, &resp, &resp_len);
+		free(resp);
+	}
+	pthread_mutex_unlock(&mam_session.lock);
+}
+
+ssize_t _muacc_send_to_mam(muacc_context_t *ctx, const void *buf, size_t len)
+{
+	ssize_t ret = -1;
+	int err = 0;
+	int fd;
+	struct _muacc_mam_shm *shm;
+	int version = ctx->mamversion;
+	unsigned int epoch = ctx->mamepoch;
+
+	if ( _muacc_connect_ctx_to_mam(ctx) != 0 )
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
+		return(-1);
+	}
+	if ( ctx->mamversion != version || ctx->mamepoch != epoch )
+	{
+		/* the request was encoded for the connection we lost - context ids and cache keys are gone with it */
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Connection to MAM was reset - request has to be packed again\n");
+		return(_muacc_send_to_mam_lost);
+	}
+	fd = ctx->mamsock;
+
+	/* keep the shared memory mapped while we use it, even if the session is reset meanwhile */
+	pthread_mutex_lock(&mam_session.lock);
+	shm = (fd == mam_session.sock) ? mam_session.shm : NULL;
+	if (shm != NULL)
+		shm->refs++;
+	pthread_mutex_unlock(&mam_session.lock);
+
+	pthread_mutex_lock(&mam_session.send_lock);
+	ret = _muacc_mam_transmit(fd, shm, buf, len);
+	err = errno;
+	pthread_mutex_unlock(&mam_session.send_lock);
+
+	pthread_mutex_lock(&mam_session.lock);
+	_muacc_mam_shm_put_locked(shm);
+	if (ret < 0 && fd == mam_session.sock)
+		_muacc_mam_session_reset_locked();
+	pthread_mutex_unlock(&mam_session.lock);
+
+	if (ret >= 0)
+		return ret;
+
+	if (err == EPIPE || err == ECONNRESET || err == ENOTCONN)
+	{
+		/* MAM went away (e.g. restarted) */
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Connection to MAM lost - request has to be packed again\n");
+		return(_muacc_send_to_mam_lost);
+	}
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: error sending request: %s\n", strerror(err));
+	return(-1);
+}
+
+int _muacc_mam_wait_response(muacc_reqid_t id, char **resp, ssize_t *resp_len)
+{
+	struct _muacc_mam_req *req;
+	int ret;
+
+	pthread_mutex_lock(&mam_session.lock);
+	for (;;)
+	{
+		if ((req = _muacc_mam_find_req_locked(id)) == NULL)
+		{
+			ret = -1;
+			break;
+		}
+		else if (req->state != muacc_mam_req_pending)
+		{
+			ret = _muacc_mam_take_req_locked(req, resp, resp_len);
+			break;
+		}
+		else if (!mam_session.reading)
+		{
+			/* nobody is reading - fetch the next response ourselves */
+			_muacc_mam_read_locked(1);
+		}
+		else
+		{
+			pthread_cond_wait(&mam_session.answered, &mam_session.lock);
+		}
+	}
+	pthread_mutex_unlock(&mam_session.lock);
+
+	return ret;
+}
+
+int _muacc_mam_poll_response(muacc_reqid_t id, char **resp, ssize_t *resp_len)
+{
+	struct _muacc_mam_req *req;
+	int ret = 0;
+
+	pthread_mutex_lock(&mam_session.lock);
+	if ((req = _muacc_mam_find_req_locked(id)) == NULL)
+		ret = -1;
+	else if (req->state != muacc_mam_req_pending)
+		ret = (_muacc_mam_take_req_locked(req, resp, resp_len) == 0) ? 1 : -1;
+	pthread_mutex_unlock(&mam_session.lock);
+
+	return ret;
+}
+
+void _muacc_mam_process_events(int sock_readable)
+{
+	char c[64];
+
+	if (sock_readable)
+	{
+		pthread_mutex_lock(&mam_session.lock);
+		if (mam_session.shm == NULL)
+			_muacc_mam_read_locked(1);
+		else
+		{
+			/* the eventfd was signalled - take everything that arrived meanwhile */
+			struct _muacc_mam_shm *shm = mam_session.shm;
+			uint64_t cnt;
+			struct pollfd pfd;
+
+			while (read(shm->efd_client, &cnt, sizeof(cnt)) > 0);
+			while (mam_session.shm == shm && !mam_session.reading && !_muacc_ring_empty(&(shm->resp)))
+				_muacc_mam_read_locked(0);
+
+			/* MAM does not send anything on the socket anymore - unless it goes away */
+			pfd.fd = mam_session.sock;
+			pfd.events = POLLIN;
+			pfd.revents = 0;
+			if (mam_session.shm == shm && !mam_session.reading && poll(&pfd, 1, 0) > 0)
+			{
+				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Connection to MAM closed\n");
+				_muacc_mam_session_reset_locked();
+			}
+		}
+		pthread_mutex_unlock(&mam_session.lock);
+	}
+
+	/* drain notifications - the caller polls all its requests next */
+	if (mam_session.notify[0] != -1)
+		while (read(mam_session.notify[0], c, sizeof(c)) > 0);
+}
+
+void _muacc_mam_session_fds(int *sock, int *shm_event, int *notify)
+{
+	pthread_once(&mam_session_once, &_muacc_mam_session_init);
+
+	pthread_mutex_lock(&mam_session.lock);
+	*sock = mam_session.reading ? -1 : mam_session.sock;
+	*shm_event = -1;
+	if (*sock != -1 && mam_session.shm != NULL)
+	{
+		/* wait for MAM to signal the eventfd - unless there already is something to read */
+		*shm_event = mam_session.shm->efd_client;
+		if (!_muacc_ring_consumer_sleep(&(mam_session.shm->resp)))
+			_muacc_mam_shm_signal(*shm_event);
+	}
+	*notify = mam_session.notify[0];
+	pthread_mutex_unlock(&mam_session.lock);
+}
+
+
+/** tell MAM that a cached context is not needed anymore - it does not answer */
+static void _muacc_mam_forget(uint32_t key, unsigned int epoch)
+{
+	char buf[64];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_ctx_release;
+
+	if (key == 0)
+		return;
+
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, ctx_key, &key, sizeof(uint32_t)) ||
+		0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, eof) )
+		return;
+
+	/* the key is only valid on the connection it was made for */
+	pthread_mutex_lock(&mam_session.send_lock);
+	pthread_mutex_lock(&mam_session.lock);
+	if (mam_session.sock != -1 && mam_session.epoch == epoch && mam_session.version >= MUACC_PROTOCOL_V2)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Telling MAM to forget context %u\n", key);
+		if (_muacc_mam_transmit(mam_session.sock, mam_session.shm, buf, pos) != pos)
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "WARNING: could not release context %u: %s\n", key, strerror(errno));
+	}
+	pthread_mutex_unlock(&mam_session.lock);
+	pthread_mutex_unlock(&mam_session.send_lock);
+}
+
+static uint32_t _muacc_mam_new_ctx_key(void)
+{
+	uint32_t key;
+
+	pthread_mutex_lock(&mam_session.lock);
+	if ((key = mam_session.next_key++) == 0)
+		key = mam_session.next_key++;
+	pthread_mutex_unlock(&mam_session.lock);
+
+	return key;
+}
+
+int _muacc_pack_ctx_for_mam(muacc_context_t *ctx, char *buf, ssize_t *pos, ssize_t len)
+{
+	ssize_t pos0 = *pos;
+
+	if (ctx->mamversion < MUACC_PROTOCOL_V2)
+		return (_muacc_pack_ctx_v(buf, pos, len, ctx->mamversion, ctx->ctx) < 0) ? -1 : 0;
+
+	if (ctx->mamkey != 0 && ctx->mamshadow != NULL)
+	{
+		/* MAM knows the context - send what changed since */
+		if (0 > _muacc_push_tlv_v(buf, pos, len, ctx->mamversion, ctx_base, &(ctx->mamkey), sizeof(uint32_t)) ||
+			0 > _muacc_pack_ctx_delta(buf, pos, len, ctx->mamshadow, ctx->ctx) )
+			goto _muacc_pack_ctx_for_mam_err;
+		return 0;
+	}
+
+	if (ctx->mamkey == 0)
+		ctx->mamkey = _muacc_mam_new_ctx_key();
+
+	if (0 > _muacc_push_tlv_v(buf, pos, len, ctx->mamversion, ctx_key, &(ctx->mamkey), sizeof(uint32_t)) ||
+		0 > _muacc_pack_ctx_v(buf, pos, len, ctx->mamversion, ctx->ctx) )
+		goto _muacc_pack_ctx_for_mam_err;
+	return 0;
+
+_muacc_pack_ctx_for_mam_err:
+	*pos = pos0;
+	return -1;
+}
+
+int _muacc_pack_socket_for_mam(muacc_context_t *ctx, struct socketlist *list, char *buf, ssize_t *pos, ssize_t len)
+{
+	ssize_t pos0 = *pos;
+	char summary[30];
+	ssize_t summary_len = 0;
+	uint32_t key;
+
+	if (ctx->mamversion < MUACC_PROTOCOL_V2)
+	{
+		if (0 > _muacc_push_tlv_v(buf, pos, len, ctx->mamversion, socketset_file, &(list->file), sizeof(int)) ||
+			0 > _muacc_pack_ctx_v(buf, pos, len, ctx->mamversion, list->ctx) )
+			goto _muacc_pack_socket_for_mam_err;
+		return 0;
+	}
+
+	/* contexts of sockets in a set do not change - a reference is enough once MAM cached it */
+	key = (list->mamkey != 0 && list->mamepoch == ctx->mamepoch) ? list->mamkey : 0;
+
+	_muacc_push_varint(summary, &summary_len, sizeof(summary), list->file);
+	_muacc_push_varint(summary, &summary_len, sizeof(summary), key);
+	_muacc_push_varint(summary, &summary_len, sizeof(summary), list->tcp_state);
+	if (0 > _muacc_push_tlv_v(buf, pos, len, ctx->mamversion, socketset_summary, summary, summary_len))
+		goto _muacc_pack_socket_for_mam_err;
+	if (key != 0)
+		return 0;
+
+	key = _muacc_mam_new_ctx_key();
+	if (0 > _muacc_push_tlv_v(buf, pos, len, ctx->mamversion, ctx_key, &key, sizeof(uint32_t)) ||
+		0 > _muacc_pack_ctx_v(buf, pos, len, ctx->mamversion, list->ctx) )
+		goto _muacc_pack_socket_for_mam_err;
+
+	list->mamkey = key;
+	list->mamepoch = ctx->mamepoch;
+	return 0;
+
+_muacc_pack_socket_for_mam_err:
+	*pos = pos0;
+	return -1;
+}
+
+ssize_t _muacc_mam_request_maxlen(void)
+{
+	ssize_t max = MUACC_REQUEST_MAXLEN;
+
+	pthread_mutex_lock(&mam_session.lock);
+	if (mam_session.shm != NULL && (ssize_t) _muacc_ring_max_msg(&(mam_session.shm->req)) < max)
+		max = _muacc_ring_max_msg(&(mam_session.shm->req));
+	pthread_mutex_unlock(&mam_session.lock);
+
+	return max;
+}
+
+int _muacc_grow_request(char **buf, ssize_t *buf_len)
+{
+	ssize_t max = _muacc_mam_request_maxlen();
+	ssize_t len = *buf_len * 2;
+	char *new;
+
+	if (*buf_len >= max)
+		return -1;
+	if (len > max)
+		len = max;
+
+	if ((new = realloc(*buf, len)) == NULL)
+		return -1;
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Request buffer grew to %ld bytes\n", (long) len);
+	*buf = new;
+	*buf_len = len;
+	return 0;
+}
+
+void _muacc_socketset_forget_mam_keys(struct socketset *set)
+{
+	struct socketlist *list;
+
+	for (list = set->sockets; list != NULL; list = list->next)
+		list->mamkey = 0;
+}
+
+void _muacc_mam_ctx_synced(muacc_context_t *ctx, muacc_mam_action_t resp_action, int ok)
+{
+	if (ctx->mamversion < MUACC_PROTOCOL_V2 || ctx->mamkey == 0)
+		return;
 
-	ctx->ctx = _ctx;
-	return(0);
+	if (ctx->mamshadow != NULL)
+		_muacc_free_ctx(ctx->mamshadow);
+	ctx->mamshadow = NULL;
+
+	/* MAM caches what it sent back - unless it did not know the context */
+	if (ok && resp_action != muacc_error_unknown_ctx)
+		ctx->mamshadow = _muacc_clone_ctx(ctx->ctx);
+	else
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "MAM context cache out of sync - sending the whole context next time\n");
 }
 
-muacc_ctxino_t _muacc_get_ctxino(int sockfd)
+/** current time on the monotonic clock in ms */
+static uint64_t _muacc_now_ms(void)
 {
-    struct stat s;
-    fstat(sockfd, &s);
-    return s.st_ino;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-int _is_socket_open(int sockfd)
+static int _muacc_string_differs(const char *a, const char *b)
 {
-    char dummy;
-	ssize_t ret;
-    ret = recv(sockfd, &dummy, 1, MSG_PEEK | MSG_DONTWAIT);
+	if (a == NULL || b == NULL)
+		return (a != b);
+	return (strcmp(a, b) != 0);
+}
 
-	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Socket closed check returned: %zu errno: %d\n", ret, errno);
-	if (ret == 0)
-	{
-		return 0;
-	}
-	else if (ret == -1)
+/** compare intents - what setting them returned does not matter */
+static int _muacc_intents_differ(const struct socketopt *a, const struct socketopt *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
 	{
-		if (errno == EWOULDBLOCK)
+		if (a->level != b->level || a->optname != b->optname || a->flags != b->flags || a->optlen != b->optlen ||
+			(a->optval == NULL) != (b->optval == NULL) ||
+			(a->optval != NULL && memcmp(a->optval, b->optval, a->optlen) != 0))
 			return 1;
-		else
-			return 0;
 	}
-	else
-		return 1;
+	return (a != b);
 }
 
-int _lock_ctx (muacc_context_t *ctx)
+/** check whether a lease covers requests for the given context */
+static int _muacc_lease_matches(const struct _muacc_lease *lease, const struct _muacc_ctx *_ctx)
 {
-    return( -(ctx->locks++) );
+	return (lease->domain == _ctx->domain && lease->type == _ctx->type && lease->protocol == _ctx->protocol &&
+		!_muacc_string_differs(lease->host, _ctx->remote_hostname) &&
+		!_muacc_string_differs(lease->serv, _ctx->remote_service) &&
+		!_muacc_intents_differ(lease->intents, _ctx->sockopts_current));
 }
 
-int _unlock_ctx (muacc_context_t *ctx)
+/** check whether two leases cover the same requests */
+static int _muacc_lease_same(const struct _muacc_lease *a, const struct _muacc_lease *b)
 {
-    return( -(--(ctx->locks)) );
+	return (a->domain == b->domain && a->type == b->type && a->protocol == b->protocol &&
+		!_muacc_string_differs(a->host, b->host) &&
+		!_muacc_string_differs(a->serv, b->serv) &&
+		!_muacc_intents_differ(a->intents, b->intents));
 }
 
-int muacc_retain_context(struct muacc_context *ctx)
+static void _muacc_lease_free(struct _muacc_lease *lease)
 {
-	if(ctx->ctx == NULL)
-	{
-		return(-1);
-	}
-
-	return(++(ctx->usage));
+	if (lease == NULL)
+		return;
+
+	free(lease->host);
+	free(lease->serv);
+	_muacc_free_socketopts(lease->intents);
+	if (lease->decision != NULL)
+		_muacc_free_ctx(lease->decision);
+	free(lease);
 }
 
-void muacc_print_context(struct muacc_context *ctx)
+/** dispatch everything MAM already sent, e.g. a revocation, without waiting - call with the session locked */
+static void _muacc_mam_poll_locked(void)
 {
-	strbuf_t sb;
+	struct pollfd pfd;
 
-	if (ctx == NULL)
-	{
-		dprintf(muacc_debug_fd, "ctx = NULL\n");
-	}
-	else if (ctx->ctx == NULL)
-	{
-		dprintf(muacc_debug_fd, "ctx->ctx = NULL\n");
-	}
-	else
+	while (mam_session.sock != -1 && !mam_session.reading)
 	{
-		strbuf_init(&sb);
-		_muacc_print_ctx(&sb, ctx->ctx);
-		dprintf(muacc_debug_fd, "/**************************************/\n%s\n/**************************************/\n", strbuf_export(&sb));
-		strbuf_release(&sb);
+		if (mam_session.shm != NULL)
+		{
+			if (_muacc_ring_empty(&(mam_session.shm->resp)))
+				break;
+			_muacc_mam_read_locked(0);
+			continue;
+		}
+
+		pfd.fd = mam_session.sock;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0)
+			break;
+		_muacc_mam_read_locked(1);
 	}
 }
 
-int muacc_release_context(struct muacc_context *ctx)
+int _muacc_lease_apply(muacc_context_t *ctx)
 {
-	if(ctx == NULL)
-	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: tried to release NULL POINTER context\n");
+	struct _muacc_lease **plist, *lease;
+	struct _muacc_ctx *decision = NULL;
+	uint64_t now;
+	int want_lease;
+
+	if (ctx == NULL || ctx->ctx == NULL || ctx->ctx->remote_hostname == NULL)
 		return -1;
-	}
-	else if(ctx->ctx == NULL)
-	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "empty context - nothing to release\n");
-		return 0;
-	}
-	else
+
+	pthread_once(&mam_session_once, &_muacc_mam_session_init);
+	pthread_mutex_lock(&mam_session.lock);
+
+	if (mam_session.leases != NULL)
 	{
-		if( --(ctx->usage) == 0 )
+		/* make sure we saw all revocations MAM sent so far */
+		_muacc_mam_poll_locked();
+
+		now = _muacc_now_ms();
+		for (plist = &mam_session.leases; (lease = *plist) != NULL; )
 		{
-			if (ctx->mamsock != -1) 				close(ctx->mamsock);
-			return _muacc_free_ctx(ctx->ctx);
-		} else {
-			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "context has still %d references\n", ctx->usage);
-			return(ctx->usage);
+			if (lease->expires <= now)
+			{
+				*plist = lease->next;
+				mam_session.n_leases--;
+				_muacc_lease_free(lease);
+				continue;
+			}
+			if (_muacc_lease_matches(lease, ctx->ctx))
+			{
+				decision = _muacc_clone_ctx(lease->decision);
+				break;
+			}
+			plist = &(lease->next);
 		}
 	}
-}
 
+	/* MAM speaking version 1 never grants leases */
+	want_lease = (mam_session.sock == -1 || mam_session.version >= MUACC_PROTOCOL_V2);
+	pthread_mutex_unlock(&mam_session.lock);
 
-int muacc_clone_context(struct muacc_context *dst, struct muacc_context *src)
-{
-	if (dst == NULL)
+	if (decision != NULL)
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0,"WARNING: cloning into empty context\n");
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Applying decision MAM leased for %s:%s\n", ctx->ctx->remote_hostname, ctx->ctx->remote_service);
+		decision->sockfd = ctx->ctx->sockfd;
+		_muacc_free_ctx(ctx->ctx);
+		ctx->ctx = decision;
 		return 0;
 	}
 
-	if (src == NULL)
-	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0,"WARNING: cloning uninitialized context\n");
-		dst->ctx = NULL;
-	}
-	else
-	{
-		dst->ctx = _muacc_clone_ctx(src->ctx);
-	}
+	_muacc_lease_free(ctx->lease);
+	ctx->lease = NULL;
+	if (!want_lease || (lease = malloc(sizeof(struct _muacc_lease))) == NULL)
+		return -1;
 
-	dst->usage = 1;
-	dst->locks = 0;
-	dst->mamsock = -1;
+	/* remember what we asked for - MAM may change the context in its response */
+	memset(lease, 0, sizeof(struct _muacc_lease));
+	lease->host = _muacc_clone_string(ctx->ctx->remote_hostname);
+	lease->serv = _muacc_clone_string(ctx->ctx->remote_service);
+	lease->domain = ctx->ctx->domain;
+	lease->type = ctx->ctx->type;
+	lease->protocol = ctx->ctx->protocol;
+	lease->intents = _muacc_clone_socketopts(ctx->ctx->sockopts_current);
+	ctx->lease = lease;
 
-	return(0);
+	return -1;
 }
 
+void _muacc_lease_take(muacc_context_t *ctx, muacc_mam_action_t resp_action, char *resp, ssize_t resp_len)
+{
+	struct _muacc_lease *lease = ctx->lease;
+	struct _muacc_lease **plist, **pfirst, *old;
+	ssize_t pos = 0;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+	uint32_t ttl = 0;
+	uint32_t epoch = 0;
 
+	ctx->lease = NULL;
+	if (lease == NULL || resp_action != muacc_act_socketconnect_resp)
+		goto _muacc_lease_take_drop;
 
-int _muacc_connect_ctx_to_mam(muacc_context_t *ctx)
-{
-	struct sockaddr_un mams;
-	mams.sun_family = AF_UNIX;
-	#ifdef HAVE_SOCKADDR_LEN
-	mams.sun_len = sizeof(struct sockaddr_un);
-	#endif
+	while ( _muacc_next_tlv(resp, &pos, resp_len, ctx->mamversion, &tag, &data, &data_len) > 0 && tag != eof)
+	{
+		if (tag == lease_ttl && data_len == sizeof(uint32_t))
+			ttl = *(uint32_t *) data;
+		else if (tag == lease_epoch && data_len == sizeof(uint32_t))
+			epoch = *(uint32_t *) data;
+	}
+	if (ttl == 0 || (lease->decision = _muacc_clone_ctx(ctx->ctx)) == NULL)
+		goto _muacc_lease_take_drop;
+	lease->expires = _muacc_now_ms() + ttl;
 
-	if(	ctx->mamsock != -1 )
-		return 0;
+	pthread_mutex_lock(&mam_session.lock);
 
-	strncpy( mams.sun_path, MUACC_SOCKET, sizeof(mams.sun_path));
-	ctx->mamsock = socket(AF_UNIX, SOCK_STREAM, 0);
-	if(ctx->mamsock == -1)
+	/* the lease may have been revoked before we got it */
+	if (mam_session.sock == -1 || mam_session.epoch != ctx->mamepoch || (int32_t) (epoch - mam_session.lease_revoked) < 0)
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: socket creation failed: %s\n", strerror(errno));
-		return(-errno);
+		pthread_mutex_unlock(&mam_session.lock);
+		goto _muacc_lease_take_drop;
 	}
 
-	if(connect(ctx->mamsock, (struct sockaddr*) &mams, sizeof(mams)) < 0)
+	/* replace an older lease for the same requests, or the one ending first if there are too many */
+	for (plist = &mam_session.leases; *plist != NULL && !_muacc_lease_same(*plist, lease); plist = &((*plist)->next));
+	if (*plist == NULL && mam_session.n_leases >= MUACC_LEASE_MAX)
+	{
+		pfirst = &mam_session.leases;
+		for (plist = &mam_session.leases; *plist != NULL; plist = &((*plist)->next))
+		{
+			if ((*plist)->expires < (*pfirst)->expires)
+				pfirst = plist;
+		}
+		plist = pfirst;
+	}
+	if (*plist != NULL)
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: connect to mam via %s failed: %s\n",  mams.sun_path, strerror(errno));
-		close(ctx->mamsock);
-		ctx->mamsock = -1;
-		return(-errno);
+		old = *plist;
+		*plist = old->next;
+		mam_session.n_leases--;
+		_muacc_lease_free(old);
 	}
 
-	return 0;
-}
+	lease->next = mam_session.leases;
+	mam_session.leases = lease;
+	mam_session.n_leases++;
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "MAM leased its decision for %s:%s for %u ms\n", lease->host, lease->serv, ttl);
 
+	pthread_mutex_unlock(&mam_session.lock);
+	return;
 
-int _muacc_contact_mam (muacc_mam_action_t reason, muacc_context_t *ctx)
-{
+_muacc_lease_take_drop:
+	_muacc_lease_free(lease);
+}
 
-	char buf[MUACC_TLV_MAXLEN];
+/** unpack a response into ctx and keep the context cache of MAM and the leases in sync
+ *
+ * @return 0 on success, -1 if the response was malformed or MAM did not know the context
+ */
+static int _muacc_apply_response(muacc_context_t *ctx, muacc_mam_action_t reason, char *resp, ssize_t resp_len)
+{
 	ssize_t pos = 0;
-	ssize_t ret = 0;
+	ssize_t ret;
 	muacc_tlv_t tag;
 	void *data;
 	ssize_t data_len;
+	muacc_mam_action_t resp_action = reason;
 
-	/* connect to MAM */
-	if(	_muacc_connect_ctx_to_mam(ctx) != 0 )
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Processing response \n");
+	while( (ret = _muacc_next_tlv(resp, &pos, resp_len, ctx->mamversion, &tag, &data, &data_len)) > 0)
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
-		goto _muacc_contact_mam_connect_err;
+		if( tag == eof )
+			break;
+		else if( tag == request_id || tag == lease_ttl || tag == lease_epoch )
+			continue;
+		else if( tag == action && data_len == sizeof(muacc_mam_action_t) )
+			resp_action = *(muacc_mam_action_t *) data;
+		else if ( 0 > _muacc_unpack_ctx(tag, data, data_len, ctx->ctx) )
+			goto _muacc_apply_response_err;
 	}
+	if( ret <= 0 )
+		goto _muacc_apply_response_err;
 
-	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Serializing MAM context\n");
+	_muacc_mam_ctx_synced(ctx, resp_action, 1);
+	_muacc_lease_take(ctx, resp_action, resp, resp_len);
+	return(resp_action == muacc_error_unknown_ctx ? -1 : 0);
 
-	/* pack request */
-	if( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_contact_mam_pack_err;
-	if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), ctx->ctx) ) goto  _muacc_contact_mam_pack_err;
-	if( 0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) ) goto  _muacc_contact_mam_pack_err;
-	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2,"Serializing MAM context done - Sending it to MAM\n");
+_muacc_apply_response_err:
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to process response\n");
+	_muacc_mam_ctx_synced(ctx, resp_action, 0);
+	return(-1);
+}
 
+int _muacc_contact_mam (muacc_mam_action_t reason, muacc_context_t *ctx)
+{
 
-	/* send request */
-	if( 0 > (ret = send(ctx->mamsock, buf, pos, 0)) )
-	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: error sending request: %s\n", strerror(errno));
-		goto _muacc_contact_mam_connect_err;
-	}
-	else
-	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Request sent  - %ld of %ld bytes\n", (long int) ret, (long int) pos);
-	}
+	char buf[MUACC_TLV_MAXLEN];
+	ssize_t pos = 0;
+	ssize_t ret = 0;
+	muacc_reqid_t reqid;
+	char *resp = NULL;
+	ssize_t resp_len = 0;
+	int attempt;
 
-	/* read & unpack response */
-	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Processing response \n");
-	pos = 0;
-	while( (ret = _muacc_read_tlv(ctx->mamsock, buf, &pos, sizeof(buf), &tag, &data, &data_len)) > 0)
+	/* a request packed for a connection that was lost is packed again once for the new one */
+	for (attempt = 0; ; attempt++)
 	{
-		if( tag == eof )
+		/* connect to MAM - before packing, as the connection determines the context id */
+		if(	_muacc_connect_ctx_to_mam(ctx) != 0 || _muacc_mam_new_request(&reqid, 0) != 0 )
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
+			goto _muacc_contact_mam_connect_err;
+		}
+
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Serializing MAM context\n");
+
+		/* pack request */
+		pos = 0;
+		if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->mamversion, action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_contact_mam_pack_err;
+		if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->mamversion, request_id, &reqid, sizeof(muacc_reqid_t)) ) goto  _muacc_contact_mam_pack_err;
+		if( 0 > _muacc_pack_ctx_for_mam(ctx, buf, &pos, sizeof(buf)) ) goto  _muacc_contact_mam_pack_err;
+		if( 0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), ctx->mamversion, eof) ) goto  _muacc_contact_mam_pack_err;
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2,"Serializing MAM context done - Sending it to MAM\n");
+
+		/* send request */
+		if( 0 <= (ret = _muacc_send_to_mam(ctx, buf, pos)) )
 			break;
-		else if ( 0 > _muacc_unpack_ctx(tag, data, data_len, ctx->ctx) )
-			goto  _muacc_contact_mam_parse_err;
+
+		_muacc_mam_cancel_request(reqid);
+		if (ret != _muacc_send_to_mam_lost || attempt > 0)
+			goto _muacc_contact_mam_connect_err;
 	}
-	return(0);
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Request %u sent  - %ld of %ld bytes\n", reqid, (long int) ret, (long int) pos);
+
+	/* wait for & unpack response */
+	if( 0 > _muacc_mam_wait_response(reqid, &resp, &resp_len) )
+		goto _muacc_contact_mam_parse_err;
+
+	ret = _muacc_apply_response(ctx, reason, resp, resp_len);
+	free(resp);
+	return(ret);
 
 _muacc_contact_mam_connect_err:
 	return(-1);
@@ -265,13 +1728,132 @@ _muacc_contact_mam_connect_err:
 _muacc_contact_mam_pack_err:
 
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to serialize MAM context\n");
+	_muacc_mam_cancel_request(reqid);
 	return(-1);
 
 _muacc_contact_mam_parse_err:
 
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to process response\n");
+	_muacc_mam_ctx_synced(ctx, reason, 0);
+	return(-1);
+
+}
+
+/** pack a socketconnect batch - each item is a request id followed by the whole context,
+ *  MAM has not cached fresh contexts anyway
+ *
+ * @return length of the request, -1 if it does not fit into buf
+ */
+static ssize_t _muacc_pack_socketconnect_batch(muacc_context_t **ctxs, const muacc_reqid_t *ids, size_t n, int version, char *buf, ssize_t len)
+{
+	muacc_mam_action_t reason = muacc_act_socketconnect_batch_req;
+	ssize_t pos = 0;
+	size_t i;
+
+	if( 0 > _muacc_push_tlv_v(buf, &pos, len, version, action, &reason, sizeof(muacc_mam_action_t)) ) return(-1);
+	for (i = 0; i < n; i++)
+	{
+		if( 0 > _muacc_push_tlv_v(buf, &pos, len, version, batch_item, &(ids[i]), sizeof(muacc_reqid_t)) ) return(-1);
+		if( 0 > _muacc_pack_ctx_v(buf, &pos, len, version, ctxs[i]->ctx) ) return(-1);
+	}
+	if( 0 > _muacc_push_tlv_tag_v(buf, &pos, len, version, eof) ) return(-1);
+
+	return(pos);
+}
+
+int _muacc_send_socketconnect_batch(muacc_context_t **ctxs, muacc_reqid_t *ids, size_t n, int async)
+{
+	char *buf = NULL;
+	ssize_t buf_len = MUACC_TLV_MAXLEN;
+	ssize_t pos;
+	ssize_t ret;
+	size_t i;
+	size_t registered = 0;
+	int version;
+
+	if (n == 0)
+		return(-1);
+
+	/* connect to MAM - before packing, as the connection determines the context ids */
+	for (i = 0; i < n; i++)
+	{
+		if (_muacc_connect_ctx_to_mam(ctxs[i]) != 0)
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
+			return(-1);
+		}
+	}
+	version = ctxs[0]->mamversion;
+	if (version < MUACC_PROTOCOL_V2 || ctxs[n-1]->mamepoch != ctxs[0]->mamepoch)
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "MAM does not take batches on this connection\n");
+		return(-1);
+	}
+
+	for (registered = 0; registered < n; registered++)
+		if (_muacc_mam_new_request(&(ids[registered]), async) != 0)
+			goto _muacc_send_socketconnect_batch_err;
+
+	if ((buf = malloc(buf_len)) == NULL)
+		goto _muacc_send_socketconnect_batch_err;
+
+	/* pack request - grow the buffer until the whole batch fits */
+	while (0 > (pos = _muacc_pack_socketconnect_batch(ctxs, ids, n, version, buf, buf_len)))
+	{
+		if (_muacc_grow_request(&buf, &buf_len) != 0)
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: batch of %zu requests does not fit into a single request\n", n);
+			goto _muacc_send_socketconnect_batch_err;
+		}
+	}
+
+	/* send request */
+	if( 0 > (ret = _muacc_send_to_mam(ctxs[0], buf, pos)) )
+		goto _muacc_send_socketconnect_batch_err;
+
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Batch of %zu requests sent - %ld of %ld bytes\n", n, (long int) ret, (long int) pos);
+	free(buf);
+	return(0);
+
+_muacc_send_socketconnect_batch_err:
+	for (i = 0; i < registered; i++)
+		_muacc_mam_cancel_request(ids[i]);
+	free(buf);
 	return(-1);
+}
+
+int _muacc_contact_mam_batch(muacc_context_t **ctxs, int *results, size_t n)
+{
+	muacc_reqid_t *ids;
+	char *resp;
+	ssize_t resp_len;
+	size_t i;
+
+	if ((ids = malloc(n * sizeof(muacc_reqid_t))) == NULL)
+		return(-1);
+
+	if (_muacc_send_socketconnect_batch(ctxs, ids, n, 0) != 0)
+	{
+		free(ids);
+		return(-1);
+	}
 
+	/* each item is answered on its own */
+	for (i = 0; i < n; i++)
+	{
+		resp = NULL;
+		if (0 > _muacc_mam_wait_response(ids[i], &resp, &resp_len))
+		{
+			DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: no response to request %u of the batch\n", ids[i]);
+			results[i] = -1;
+			continue;
+		}
+		results[i] = _muacc_apply_response(ctxs[i], muacc_act_socketconnect_req, resp, resp_len);
+		free(resp);
+	}
+
+	free(ids);
+	return(0);
 }
 
 int muacc_set_intent(socketopt_t **opts, int optname, const void *optval, socklen_t optlen, int flags)
@@ -290,74 +1872,84 @@ int muacc_free_socket_option_list(struct socketopt *opts)
 	return -1;
 }
 
-int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketset *set)
+/** send a socketchoose request packed for the current connection and process the response -
+ *  the set is read-locked on entry and unlocked on return
+ *
+ * @return like _muacc_send_socketchoose, _muacc_send_to_mam_lost if it has to be packed again
+ */
+static int _muacc_send_socketchoose_once (muacc_context_t *ctx, int *socket, struct socketset *set)
 {
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Sending socketchoose\n");
 	int returnvalue = -1;
 
-	char buf[MUACC_TLV_MAXLEN];
+	char *buf = NULL;
+	ssize_t buf_len = MUACC_TLV_MAXLEN;
+	/* room kept for the eof of either encoding while packing the sockets */
+	ssize_t eof_len = sizeof(muacc_tlv_t) + sizeof(ssize_t);
 	ssize_t pos = 0;
-	ssize_t prevpos = 0;
 	ssize_t ret = 0;
+	int offered = 0;
 	muacc_tlv_t tag;
     void *data;
     ssize_t data_len;
 
 	muacc_mam_action_t reason = muacc_act_socketchoose_req;
+	muacc_reqid_t reqid;
+	char *resp = NULL;
+	ssize_t resp_len = 0;
 
 	struct socketlist *list = set->sockets;
     struct socketlist *prev = NULL;
 	struct socketlist *list_next = NULL;
 
-	if ( _muacc_connect_ctx_to_mam(ctx) != 0 )
+	if ( (buf = malloc(buf_len)) == NULL )
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: out of memory\n");
+        goto unlock_set;
+	}
+
+	if ( _muacc_connect_ctx_to_mam(ctx) != 0 || _muacc_mam_new_request(&reqid, 0) != 0 )
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: failed to contact MAM\n");
         goto unlock_set;
 	}
 
 	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Serializing MAM context\n");
-	if ( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), action, &reason, sizeof(muacc_mam_action_t)) )
+	if ( 0 > _muacc_push_tlv_v(buf, &pos, buf_len, ctx->mamversion, action, &reason, sizeof(muacc_mam_action_t)) ||
+		 0 > _muacc_push_tlv_v(buf, &pos, buf_len, ctx->mamversion, request_id, &reqid, sizeof(muacc_reqid_t)) )
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing label\n");
+		_muacc_mam_cancel_request(reqid);
 		goto unlock_set;
 	}
 
 	/* Pack context from request */
-	if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), ctx->ctx) )
+	if( 0 > _muacc_pack_ctx_for_mam(ctx, buf, &pos, buf_len - eof_len) )
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error serializing socket context \n");
+		_muacc_mam_cancel_request(reqid);
 		goto unlock_set;
 	}
 
-	/* Pack sockets from socketset */
+	/* Pack all sockets from socketset - the buffer grows as needed */
 	while (list != NULL)
 	{
         /* Only consider sockets that are not remotly closed (FIN,ACK received) */
-        if (_is_socket_open(list->file))
+        if (_muacc_probe_socket(list))
         {
             /* Suggest all sockets that are currently not in use to MAM */
             if ((list->flags & MUACC_SOCKET_IN_USE) == 0)
             {
-                // Store current position in buffer, in case adding this socket fails
-                prevpos = pos;
-
                 DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Pushing socket %d to buf %p pos %li\n", list->file, buf, pos);
-                if ( 0 > _muacc_push_tlv(buf, &pos, sizeof(buf), socketset_file, &(list->file), sizeof(int)) )
-                {
-                    DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket with file descriptor %d\n", list->file);
-                    // Abort adding this socket to the request, just add eof and send it
-                    DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Resetting pos to %li and trying to push eof\n", prevpos);
-                    pos = prevpos;
-                    goto push_eof;
-                }
-                if( 0 > _muacc_pack_ctx(buf, &pos, sizeof(buf), list->ctx) )
+                while( 0 > _muacc_pack_socket_for_mam(ctx, list, buf, &pos, buf_len - eof_len) )
                 {
-                    DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing socket context of %d\n", list->file);
-                    // Abort adding this socket to the request, just add eof and send it
-                    DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Resetting pos to %li and trying to push eof\n", prevpos);
-                    pos = prevpos;
-                    goto push_eof;
+                    if ( 0 > _muacc_grow_request(&buf, &buf_len) )
+                    {
+                        DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "WARNING: socket set exceeds the maximum request length - offering only %d sockets\n", offered);
+                        goto push_eof;
+                    }
                 }
+                offered++;
             }
 			prev = list;
 			list = list->next;
@@ -378,33 +1970,50 @@ int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketse
         
 	}
 push_eof:
-	if( 0 > _muacc_push_tlv_tag(buf, &pos, sizeof(buf), eof) )
+	if( 0 > _muacc_push_tlv_tag_v(buf, &pos, buf_len, ctx->mamversion, eof) )
 	{
 		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error pushing eof\n");
+		_muacc_mam_cancel_request(reqid);
 		goto unlock_set;
 	}
     
-	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Pushing request done\n");
+	DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Pushing request with %d sockets done\n", offered);
 	DLOG(CLIB_IF_LOCKS, "LOCK: Pushed socket set - Unlocking %p\n", (void *)set);
 	pthread_rwlock_unlock(&(set->lock));
 
-	if ( 0 > (ret = send(ctx->mamsock, buf, pos, 0)) )
+	ret = _muacc_send_to_mam(ctx, buf, pos);
+	free(buf);
+	buf = NULL;
+	if ( 0 > ret )
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error sending request: %s\n", strerror(errno));
-		return -1;
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error sending request\n");
+		_muacc_mam_cancel_request(reqid);
+		pthread_rwlock_wrlock(&(set->lock));
+		_muacc_socketset_forget_mam_keys(set);
+		pthread_rwlock_unlock(&(set->lock));
+		return (ret == _muacc_send_to_mam_lost) ? _muacc_send_to_mam_lost : -1;
 	}
 	else
 	{
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Sent request - %ld of %ld bytes\n", (long int) ret, (long int) pos);
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Sent request %u - %ld of %ld bytes\n", reqid, (long int) ret, (long int) pos);
 	}
 
-	/* read & unpack response */
+	/* wait for & unpack response */
     DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Getting response:\n");
-    pos = 0;
 	int ret2 = -1;
 	int set_in_use = 0;
+	int response_ok = 0;
+	muacc_mam_action_t resp_action = muacc_act_socketchoose_resp_new;
+
+	if ( 0 > _muacc_mam_wait_response(reqid, &resp, &resp_len) )
+	{
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error receiving response\n");
+		_muacc_mam_ctx_synced(ctx, reason, 0);
+		return -1;
+	}
 
-    while( (ret = _muacc_read_tlv(ctx->mamsock, buf, &pos, sizeof(buf), &tag, &data, &data_len)) > 0)
+    pos = 0;
+    while( (ret = _muacc_next_tlv(resp, &pos, resp_len, ctx->mamversion, &tag, &data, &data_len)) > 0)
     {
 		if (tag == action)
 		{
@@ -426,17 +2035,27 @@ push_eof:
 			else if (*(muacc_mam_action_t *) data == muacc_error_resolve)
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error: Name resolution failed.\n");
-				return -1;
+				returnvalue = -1;
+				goto response_done;
 			}
 			else if (*(muacc_mam_action_t *) data == muacc_error_unknown_request)
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error: MAM sent error code \"Unknown Request\" -- Aborting.\n");
-				return -1;
+				returnvalue = -1;
+				goto response_done;
+			}
+			else if (*(muacc_mam_action_t *) data == muacc_error_unknown_ctx)
+			{
+				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error: MAM does not know the contexts anymore -- Aborting.\n");
+				resp_action = muacc_error_unknown_ctx;
+				returnvalue = -1;
+				goto response_done;
 			}
 			else
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error: Unknown MAM Response Action Type %d\n", *(muacc_mam_action_t *) data);
-				return -1;
+				returnvalue = -1;
+				goto response_done;
 			}
 		}
 		else if (tag == socketset_file && data_len == sizeof(int))
@@ -462,11 +2081,11 @@ push_eof:
 					// Socket is not in use yet - set flag as IN USE
 					list->flags |= MUACC_SOCKET_IN_USE;
 					set->use_count += 1;
-					DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Use socket %d - use count of set is now %d\n", *socket, set->use_count);
+					DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Use socket %d - use count of set is now %u\n", *socket, set->use_count);
 					memcpy(socket, (int *)data, data_len);
 					DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Use socket %d from set - mark it as \"in use\" and returning\n", *socket);
                     
-                    if (!_is_socket_open(list->file))
+                    if (!_muacc_probe_socket(list))
                     {
                         if(1 == _muacc_free_socket(set, list, prev))
 						{
@@ -477,9 +2096,7 @@ push_eof:
                         continue;
                     }
 
-					DLOG(CLIB_IF_LOCKS, "LOCK: Found socket to use - Unlocking socketset lock\n");
-					pthread_rwlock_unlock(&(set->lock));
-					return 0;
+					returnvalue = 0;
 				}
 				else
 				{
@@ -498,35 +2115,61 @@ push_eof:
 		}
         else if( tag == eof )
             break;
+        else if( tag == request_id )
+            continue;
         else
 		{
 			ret2 = _muacc_unpack_ctx(tag, data, data_len, ctx->ctx);
 			if ( 0 > ret2 )
 			{
 				DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG1, "Error unpacking context\n");
-
-				if (set_in_use)
-				{
-					DLOG(CLIB_IF_LOCKS, "LOCK: End of socketchoose - Unlocking set %p\n", (void *)set);
-					pthread_rwlock_unlock(&(set->lock));
-				}
-
-				return -1;
+				returnvalue = -1;
+				goto response_done;
 			}
 		}
     }
     DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG0, "Socketchoose done, returnvalue = %d, socket = %d\n", returnvalue, *socket);
+	response_ok = (ret > 0);
+
+response_done:
+	free(resp);
+	_muacc_mam_ctx_synced(ctx, resp_action, response_ok);
+	if (resp_action == muacc_error_unknown_ctx)
+	{
+		/* MAM lost track of the sockets as well - send them again next time */
+		if (!set_in_use)
+			pthread_rwlock_wrlock(&(set->lock));
+		_muacc_socketset_forget_mam_keys(set);
+		if (!set_in_use)
+			pthread_rwlock_unlock(&(set->lock));
+	}
 
 	if (set_in_use)
 	{
     
 unlock_set:
+		free(buf);
 		DLOG(CLIB_IF_LOCKS, "LOCK: End of socketchoose - Unlocking set %p\n", (void *)set);
 		pthread_rwlock_unlock(&(set->lock));
 	}
 	return returnvalue;
 }
 
+int _muacc_send_socketchoose (muacc_context_t *ctx, int *socket, struct socketset *set)
+{
+	int ret = _muacc_send_socketchoose_once(ctx, socket, set);
+
+	if (ret == _muacc_send_to_mam_lost)
+	{
+		/* the caller still holds the destroylock, so the set is still there - offer its sockets on the new connection */
+		DLOG(CLIB_IF_LOCKS, "LOCK: Sending socketchoose again - Locking set %p\n", (void *)set);
+		pthread_rwlock_rdlock(&(set->lock));
+		ret = _muacc_send_socketchoose_once(ctx, socket, set);
+	}
+
+	return (ret == _muacc_send_to_mam_lost) ? -1 : ret;
+}
+
 int _muacc_host_serv_to_ctx(muacc_context_t *ctx, const char *host, size_t hostlen, const char *serv, size_t servlen)
 {
 	if (host == NULL || serv == NULL)
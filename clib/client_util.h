@@ -24,10 +24,30 @@ typedef struct muacc_context
 {
     int     usage;              /**< reference counter */
     uint8_t locks;              /**< lock to avoid multiple concurrent requests */
-    int     mamsock;            /**< socket to talk to MAM */
+    int     mamsock;            /**< connection to MAM the last request was sent on, -1 if none */
+    int     mamversion;         /**< protocol version spoken on mamsock */
+    unsigned int mamepoch;      /**< connection to MAM mamsock belongs to */
+    uint32_t mamkey;            /**< key MAM caches the context under, 0 if none */
+    struct _muacc_ctx *mamshadow; /**< copy of the context as MAM cached it, NULL if unknown */
+    struct _muacc_lease *lease; /**< socketconnect request MAM may lease its decision for, NULL if none */
     struct _muacc_ctx *ctx;     /**< internal struct with relevant socket context data */
 } muacc_context_t;
 
+/** One socket requested through muacc_sc_socketconnect_batch or muacc_sca_socketconnect_batch */
+struct muacc_sc_batch_item
+{
+	int socket;						/**< [out]	new socket, -1 if none */
+	int result;						/**< [out]	1 if the socket was created, -1 if fail */
+	const char *host;				/**< [in]	Host name to connect to */
+	size_t hostlen;
+	const char *serv;				/**< [in]	Service or port (in ASCII) to connect to */
+	size_t servlen;
+	struct socketopt *sockopts;		/**< [in]	List of socket options to be set, may be NULL */
+	int domain;						/**< [in]	Address family for socket() call (e.g. AF_INET, AF_INET6) */
+	int type;						/**< [in]	Type for socket() call (e.g. SOCK_STREAM or SOCK_DGRAM) */
+	int proto;						/**< [in]	Protocol for socket() call */
+};
+
 /** initialize background structures for muacc_context
  *
  * @return 0 on success, -1 otherwise
@@ -63,6 +83,15 @@ int _unlock_ctx (muacc_context_t *ctx);
  */
 int _is_socket_open(int sockfd);
 
+/** Check if a socket of a set is still usable and remember its TCP state in list->tcp_state
+ *
+ * Uses TCP_INFO where available, so sockets the peer closed are recognized
+ * even if data is still waiting to be read. Falls back to _is_socket_open().
+ *
+ * @return 1 if the socket is open, 0 if it was closed from the remote side
+ */
+int _muacc_probe_socket(struct socketlist *list);
+
 /** make a deep copy of a muacc_context
  *
  * @return 0 on success, -1 otherwise
@@ -95,6 +124,32 @@ int _muacc_contact_mam (
 	muacc_context_t *ctx		/**< [in]	context to be updated */
 );
 
+/** send the socketconnect requests of several contexts to MAM at once - each is answered on its own
+ *
+ *  Registers a request id per context, to wait for the responses with _muacc_mam_wait_response
+ *  or _muacc_mam_poll_response. Needs protocol version 2, the caller has to fall back to
+ *  single requests otherwise.
+ *
+ * @return 0 on success, -1 if the batch could not be sent
+ */
+int _muacc_send_socketconnect_batch(
+	muacc_context_t **ctxs,		/**< [in]	contexts to ask for */
+	muacc_reqid_t *ids,			/**< [out]	request ids, one per context */
+	size_t n,					/**< [in]	number of contexts */
+	int async					/**< [in]	wake up muacc_sca_socketselect when answered */
+);
+
+/** speak the TLV protocol as a client to make MAM update several contexts for socketconnect in one request
+ *
+ * @return 0 if the batch was answered - results[i] tells as _muacc_contact_mam would whether ctxs[i] was updated,
+ *         -1 if it could not be sent at all
+ */
+int _muacc_contact_mam_batch(
+	muacc_context_t **ctxs,		/**< [in]	contexts to be updated */
+	int *results,				/**< [out]	result per context */
+	size_t n					/**< [in]	number of contexts */
+);
+
 /** Process a socketconnect response, create a new socket, bind and connect it. Append it to set list my_socksetlist and use my_socksetlist_lock for that, if not NULL.
  *
  *  @return 1 if successful, -1 if fail
@@ -102,12 +157,119 @@ int _muacc_contact_mam (
 int _muacc_socketconnect_create(muacc_context_t *ctx, int *s, struct socketset **my_socketsetlist, pthread_rwlock_t *my_socketsetlist_lock, int create_nonblock_socket);
 
 
-/** make the TLV client ready by establishing a connection to MAM
+/** make the TLV client ready by connecting the process-wide session to MAM
+ *  (if not connected yet) and giving the context the id MAM knows it by
  *
  * @return 0 on success, a negative number otherwise
  */
 int _muacc_connect_ctx_to_mam(muacc_context_t *ctx) ;
 
+/** register a new request on the session
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int _muacc_mam_new_request(
+	muacc_reqid_t *id,			/**< [out]	id to put into the request */
+	int async					/**< [in]	wake up muacc_sca_socketselect when answered */
+);
+
+/** forget about a request, e.g. because it could not be sent */
+void _muacc_mam_cancel_request(muacc_reqid_t id);
+
+#define _muacc_send_to_mam_lost	-2
+/** send a request packed for the connection of ctx to MAM using the session
+ *
+ *  If that connection is gone, the session is connected again, but the request
+ *  has to be packed again for the new connection before it can be sent.
+ *
+ * @return number of bytes sent, _muacc_send_to_mam_lost if the connection the request
+ *         was packed for is gone, -1 otherwise
+ */
+ssize_t _muacc_send_to_mam(muacc_context_t *ctx, const void *buf, size_t len);
+
+/** block until the response to a request arrived
+ *
+ *  The response is malloced and has to be freed by the caller.
+ *
+ * @return 0 on success, -1 if the connection to MAM was lost
+ */
+int _muacc_mam_wait_response(muacc_reqid_t id, char **resp, ssize_t *resp_len);
+
+/** check whether the response to a request arrived without blocking
+ *
+ *  The response is malloced and has to be freed by the caller.
+ *
+ * @return 1 if it arrived, 0 if it is still outstanding, -1 if the connection to MAM was lost
+ */
+int _muacc_mam_poll_response(muacc_reqid_t id, char **resp, ssize_t *resp_len);
+
+/** handle events select() reported on the session descriptors
+ *
+ *  Reads one response (or all that arrived in the shared memory) if the connection
+ *  is readable and consumes notifications - afterwards all async requests should be polled.
+ */
+void _muacc_mam_process_events(
+	int sock_readable			/**< [in]	select() reported the connection readable */
+);
+
+/** get the descriptors to wait on for responses to async requests
+ *
+ *  sock is -1 if the session is not connected or another thread is reading it -
+ *  responses it reads are signalled through notify. If the session uses shared
+ *  memory, shm_event signals responses and sock only MAM going away, otherwise
+ *  shm_event is -1. Either being readable counts as the connection being readable.
+ */
+void _muacc_mam_session_fds(int *sock, int *shm_event, int *notify);
+
+/** pack the context of a request - only the changes if MAM has cached it
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int _muacc_pack_ctx_for_mam(muacc_context_t *ctx, char *buf, ssize_t *pos, ssize_t len);
+
+/** pack a socket offered to socketchoose - only a summary of file descriptor, context key and TCP state if MAM has cached its context
+ *
+ * @return 0 on success, -1 otherwise
+ */
+int _muacc_pack_socket_for_mam(muacc_context_t *ctx, struct socketlist *list, char *buf, ssize_t *pos, ssize_t len);
+
+/** largest request MAM can take on the current connection
+ *
+ * @return MUACC_REQUEST_MAXLEN, or less if requests go through shared memory
+ */
+ssize_t _muacc_mam_request_maxlen(void);
+
+/** grow a request buffer allocated with malloc by doubling it, up to _muacc_mam_request_maxlen()
+ *
+ * @return 0 on success, -1 if the request cannot grow any further
+ */
+int _muacc_grow_request(char **buf, ssize_t *buf_len);
+
+/** make MAM cache the contexts of a socket set again, e.g. because the request did not make it */
+void _muacc_socketset_forget_mam_keys(struct socketset *set);
+
+/** remember the context as MAM has it now that its response was processed
+ *
+ *  Call with ok = 0 if the response could not be applied completely.
+ */
+void _muacc_mam_ctx_synced(muacc_context_t *ctx, muacc_mam_action_t resp_action, int ok);
+
+/** apply a decision MAM leased earlier for a socketconnect request like this one
+ *
+ *  Replaces the context by the one MAM answered with, so the socket can be
+ *  created right away. If there is no valid lease, remembers the request, so
+ *  _muacc_lease_take can keep a lease MAM grants in its response.
+ *
+ * @return 0 if a leased decision was applied, -1 if MAM has to be asked
+ */
+int _muacc_lease_apply(muacc_context_t *ctx);
+
+/** keep the lease MAM granted in a socketconnect response, if any
+ *
+ *  Call after the response was unpacked into the context.
+ */
+void _muacc_lease_take(muacc_context_t *ctx, muacc_mam_action_t resp_action, char *resp, ssize_t resp_len);
+
 /** Add a Socket Intent to a socket options list
  *
  *  @return 0 on success, a negative number otherwise
@@ -32,6 +32,14 @@ typedef enum
 	muacc_act_socketchoose_resp_new,		/**< socketchoose response, create new socket */
 	muacc_error_unknown_request,			/**< Error: Unknown request */
 	muacc_error_resolve,					/**< Error: Name resolution failed */
+	muacc_act_hello_req,					/**< negotiate the protocol version of a new connection */
+	muacc_act_hello_resp,					/**< hello response, carries the version chosen by MAM */
+	muacc_act_ctx_release,					/**< MAM may forget a cached context - not answered */
+	muacc_error_unknown_ctx,				/**< Error: Request refers to a context MAM has not cached */
+	muacc_act_shm_req,						/**< switch the connection to shared memory rings */
+	muacc_act_shm_resp,						/**< shm response, passes the shared memory and eventfds along */
+	muacc_act_lease_revoke,					/**< MAM revokes all leases granted before - sent unsolicited */
+	muacc_act_socketconnect_batch_req,		/**< several socketconnect requests at once - each answered on its own */
 } muacc_mam_action_t;
 
 /** Linked list of socket options to be set */
@@ -55,6 +63,10 @@ typedef struct socketopt {
 	Used as an identifier that is unique per MPTCP session */
 typedef uint64_t muacc_ctxino_t;
 
+/** Identifier of a request, unique per MAM connection
+	Used to match responses to requests if several are in flight */
+typedef uint32_t muacc_reqid_t;
+
 /** Internal muacc context struct
 	All data will be serialized and sent to MAM */
 struct _muacc_ctx {
@@ -77,6 +89,7 @@ struct _muacc_ctx {
 	socklen_t 			 remote_sa_len;    		/**< length of remote_sa_res */
 	struct socketopt	*sockopts_current;		/**< socket options currently set */
 	struct socketopt	*sockopts_suggested;	/**< socket options suggested by MAM */
+	struct muacc_arena	*arena;					/**< arena the context and its fields were allocated from, NULL for the heap */
 };
 
 typedef enum
@@ -85,6 +98,10 @@ typedef enum
 	action,					/**< action triggering request */
 	socketset_file,			/**< file descriptor of an existing socket from a socketset */
 	calls_performed,		/**< flags of which socket calls have already been performed */
+	request_id,				/**< identifier of the request, echoed in the response */
+	protocol_version,		/**< protocol version offered (hello request) or chosen (hello response) */
+	packed_ctx,				/**< complete context in compact encoding (protocol version 2 only) */
+	packed_ctx_delta,		/**< changes to a context in compact encoding (protocol version 2 only) */
 	ctxid = 0x08,			/**< identifier for the context if sharing mamsock */
     ctxino,                 /**< inode of the socket (used as identifier for MPTCP sessions) */
 	sockfd,
@@ -99,7 +116,13 @@ typedef enum
 	remote_addrinfo_res,	/**< candidate remote addresses (sorted by mam preference) */
 	remote_sa,     			/**< remote address choosen */
 	sockopts_current,		/**< list of currently set sockopts */
-	sockopts_suggested		/**< list of sockopts suggested by MAM */
+	sockopts_suggested,		/**< list of sockopts suggested by MAM */
+	ctx_key = 0x30,			/**< MAM caches the following context under this key */
+	ctx_base,				/**< context starts as the one MAM cached under this key */
+	lease_ttl,				/**< the decision may be reused for this many milliseconds */
+	lease_epoch,			/**< invalidation epoch of MAM the lease belongs to */
+	socketset_summary,		/**< socket of a socketset as varints of file descriptor, cached context key (0 if the context follows) and TCP state (protocol version 2 only) */
+	batch_item				/**< request id of the next socketconnect request of a batch, its context follows */
 } muacc_tlv_t;
 
 /** Flags for storing which socketcalls have been performed */
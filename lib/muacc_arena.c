@@ -0,0 +1,220 @@
+/** \file muacc_arena.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "muacc_arena.h"
+
+#include "dlog.h"
+
+#ifndef MUACC_ARENA_NOISY_DEBUG
+#define MUACC_ARENA_NOISY_DEBUG 0
+#endif
+
+#define MUACC_ARENA_ALIGN 16		/**< alignment of all allocations */
+#define MUACC_ARENA_KEEP 4			/**< chunks an arena keeps when it is recycled */
+
+/** Memory an arena hands out allocations from */
+struct muacc_arena_chunk {
+	struct muacc_arena_chunk	*next;
+	size_t						size;		/**< size of data */
+	size_t						used;		/**< bytes of data handed out */
+	char						data[] __attribute__((aligned(MUACC_ARENA_ALIGN)));
+};
+
+struct muacc_arena {
+	struct muacc_arena_chunk	*chunks;	/**< chunks in use, the one allocations come from first */
+	struct muacc_arena_chunk	*spare;		/**< chunks kept from an earlier use */
+	struct muacc_arena			*next;		/**< next arena on the free list */
+};
+
+static __thread muacc_arena_t *current = NULL;
+static __thread muacc_arena_t *free_list = NULL;
+static __thread int free_count = 0;
+
+static struct muacc_arena_chunk *_muacc_arena_chunk_new(size_t size)
+{
+	struct muacc_arena_chunk *chunk;
+
+	if ((chunk = malloc(sizeof(struct muacc_arena_chunk) + size)) == NULL)
+		return NULL;
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return chunk;
+}
+
+muacc_arena_t *_muacc_arena_get(void)
+{
+	muacc_arena_t *arena;
+
+	if (free_list != NULL)
+	{
+		arena = free_list;
+		free_list = arena->next;
+		free_count--;
+		arena->next = NULL;
+		return arena;
+	}
+
+	if ((arena = malloc(sizeof(struct muacc_arena))) == NULL)
+		return NULL;
+	memset(arena, 0, sizeof(struct muacc_arena));
+
+	DLOG(MUACC_ARENA_NOISY_DEBUG, "created new arena %p\n", (void *) arena);
+	return arena;
+}
+
+void _muacc_arena_put(muacc_arena_t *arena)
+{
+	struct muacc_arena_chunk *chunk;
+	int kept = 0;
+
+	if (arena == NULL)
+		return;
+
+	if (current == arena)
+		current = NULL;
+
+	/* keep a few chunks of the usual size, release the others */
+	for (chunk = arena->spare; chunk != NULL; chunk = chunk->next)
+		kept++;
+	while ((chunk = arena->chunks) != NULL)
+	{
+		arena->chunks = chunk->next;
+		if (chunk->size == MUACC_ARENA_CHUNK && kept < MUACC_ARENA_KEEP && free_count < MUACC_ARENA_FREE_MAX)
+		{
+			chunk->used = 0;
+			chunk->next = arena->spare;
+			arena->spare = chunk;
+			kept++;
+		}
+		else
+		{
+			free(chunk);
+		}
+	}
+
+	if (free_count >= MUACC_ARENA_FREE_MAX)
+	{
+		while ((chunk = arena->spare) != NULL)
+		{
+			arena->spare = chunk->next;
+			free(chunk);
+		}
+		free(arena);
+		return;
+	}
+
+	arena->next = free_list;
+	free_list = arena;
+	free_count++;
+}
+
+void *_muacc_arena_alloc(muacc_arena_t *arena, size_t len)
+{
+	struct muacc_arena_chunk *chunk = arena->chunks;
+	void *p;
+
+	len = (len + MUACC_ARENA_ALIGN - 1) & ~((size_t) MUACC_ARENA_ALIGN - 1);
+	if (len == 0)
+		len = MUACC_ARENA_ALIGN;
+
+	if (chunk == NULL || chunk->size - chunk->used < len)
+	{
+		if (len > MUACC_ARENA_CHUNK / 2)
+		{
+			/* large allocations get a chunk of their own, behind the current one */
+			if ((chunk = _muacc_arena_chunk_new(len)) == NULL)
+				return NULL;
+			chunk->used = len;
+			if (arena->chunks == NULL)
+			{
+				arena->chunks = chunk;
+			}
+			else
+			{
+				chunk->next = arena->chunks->next;
+				arena->chunks->next = chunk;
+			}
+			return chunk->data;
+		}
+
+		if (arena->spare != NULL)
+		{
+			chunk = arena->spare;
+			arena->spare = chunk->next;
+		}
+		else if ((chunk = _muacc_arena_chunk_new(MUACC_ARENA_CHUNK)) == NULL)
+		{
+			return NULL;
+		}
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+	}
+
+	p = chunk->data + chunk->used;
+	chunk->used += len;
+	return p;
+}
+
+int _muacc_arena_owns(const muacc_arena_t *arena, const void *p)
+{
+	const struct muacc_arena_chunk *chunk;
+
+	if (arena == NULL || p == NULL)
+		return 0;
+
+	for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next)
+	{
+		if ((uintptr_t) p >= (uintptr_t) chunk->data && (uintptr_t) p < (uintptr_t) chunk->data + chunk->size)
+			return 1;
+	}
+
+	return 0;
+}
+
+void _muacc_arena_free(muacc_arena_t *arena, void *p)
+{
+	if (p != NULL && !_muacc_arena_owns(arena, p))
+		free(p);
+}
+
+void _muacc_arena_freeaddrinfo(muacc_arena_t *arena, struct addrinfo *ai)
+{
+	/* the muacc library keeps addrinfo lists in a single allocation */
+	_muacc_arena_free(arena, ai);
+}
+
+muacc_arena_t *_muacc_arena_use(muacc_arena_t *arena)
+{
+	muacc_arena_t *prev = current;
+
+	current = arena;
+	return prev;
+}
+
+muacc_arena_t *_muacc_arena_current(void)
+{
+	return current;
+}
+
+void *_muacc_alloc(size_t len)
+{
+	if (current != NULL)
+		return _muacc_arena_alloc(current, len);
+
+	return malloc(len);
+}
+
+void _muacc_dealloc(void *p)
+{
+	_muacc_arena_free(current, p);
+}
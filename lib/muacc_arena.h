@@ -0,0 +1,77 @@
+/** \file  muacc_arena.h
+ *  \brief Bump allocator for memory that lives exactly as long as a request
+ *
+ *  Everything MAM allocates while parsing and answering a request can come
+ *  from an arena attached to the request and is released at once together
+ *  with it. Released arenas keep their memory and are recycled through a
+ *  per-thread free list, so the allocator is rarely touched in steady state.
+ *
+ *  The context helpers (_muacc_clone_*, _muacc_unpack_ctx, ...) allocate from
+ *  the arena of the current thread set by _muacc_arena_use(), and from the
+ *  heap otherwise. Memory from an arena is never passed to free() - the
+ *  functions releasing context fields check which arena they belong to.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#ifndef __MUACC_ARENA_H__
+#define __MUACC_ARENA_H__
+
+#include <stddef.h>
+
+struct addrinfo;
+
+#ifndef MUACC_ARENA_CHUNK
+#define MUACC_ARENA_CHUNK 4096		/**< size of the chunks an arena grows by */
+#endif
+
+#ifndef MUACC_ARENA_FREE_MAX
+#define MUACC_ARENA_FREE_MAX 64		/**< arenas kept for reuse per thread */
+#endif
+
+typedef struct muacc_arena muacc_arena_t;
+
+/** get an empty arena, recycled from the free list if possible
+ *
+ * @return the arena, NULL if out of memory
+ */
+muacc_arena_t *_muacc_arena_get(void);
+
+/** release all memory allocated from an arena and put it on the free list */
+void _muacc_arena_put(muacc_arena_t *arena);
+
+/** allocate from an arena - the memory is suitably aligned for any type
+ *
+ * @return the memory, NULL if out of memory
+ */
+void *_muacc_arena_alloc(muacc_arena_t *arena, size_t len);
+
+/** check whether memory was allocated from an arena
+ *
+ * @return 1 if it was, 0 otherwise (also if arena is NULL)
+ */
+int _muacc_arena_owns(const muacc_arena_t *arena, const void *p);
+
+/** free memory unless it was allocated from arena */
+void _muacc_arena_free(muacc_arena_t *arena, void *p);
+
+/** free a flat addrinfo list (see _muacc_alloc_flat_addrinfo) unless it was allocated from arena */
+void _muacc_arena_freeaddrinfo(muacc_arena_t *arena, struct addrinfo *ai);
+
+/** make arena the one the context helpers allocate from in this thread
+ *
+ * @return the arena used before, to be restored afterwards
+ */
+muacc_arena_t *_muacc_arena_use(muacc_arena_t *arena);
+
+/** arena the context helpers allocate from in this thread, NULL if they use the heap */
+muacc_arena_t *_muacc_arena_current(void);
+
+/** allocate from the current arena or the heap */
+void *_muacc_alloc(size_t len);
+
+/** free memory unless it was allocated from the current arena */
+void _muacc_dealloc(void *p);
+
+#endif /* __MUACC_ARENA_H__ */
@@ -17,6 +17,7 @@
 #include "muacc_ctx.h"
 #include "muacc_tlv.h"
 #include "muacc_util.h"
+#include "muacc_arena.h"
 
 #ifndef MUACC_CTX_NOISY_DEBUG0
 #define MUACC_CTX_NOISY_DEBUG0 1
@@ -36,12 +37,13 @@ struct _muacc_ctx *_muacc_create_ctx()
 	struct _muacc_ctx *_ctx;
 
 	/* initialize context backing struct */
-	if( ( _ctx = malloc( sizeof(struct _muacc_ctx) )) == NULL )
+	if( ( _ctx = _muacc_alloc( sizeof(struct _muacc_ctx) )) == NULL )
 	{
 		perror("_muacc_ctx malloc failed");
 		return(NULL);
 	}
 	memset(_ctx, 0x00, sizeof(struct _muacc_ctx));
+	_ctx->arena = _muacc_arena_current();
 	
 	DLOG(MUACC_CTX_NOISY_DEBUG1,"created new _ctx=%p successfully  \n", (void *) _ctx);
 
@@ -87,27 +89,22 @@ void _muacc_print_ctx(strbuf_t *sb, const struct _muacc_ctx *_ctx)
 
 int _muacc_free_ctx (struct _muacc_ctx *_ctx)
 {
+	/* fields from the arena of the context are released together with it */
+	muacc_arena_t *prev = _muacc_arena_use(_ctx->arena);
+
 	DLOG(MUACC_CTX_NOISY_DEBUG2, "trying to free data fields\n");
 
-	if (_ctx->remote_addrinfo_hint != NULL) freeaddrinfo(_ctx->remote_addrinfo_hint);
-	if (_ctx->remote_addrinfo_res != NULL)  freeaddrinfo(_ctx->remote_addrinfo_res);
-	if (_ctx->bind_sa_req != NULL)          free(_ctx->bind_sa_req);
-	if (_ctx->bind_sa_suggested != NULL)          free(_ctx->bind_sa_suggested);
-	if (_ctx->remote_sa != NULL)        free(_ctx->remote_sa);
-	if (_ctx->remote_hostname != NULL)      free(_ctx->remote_hostname);
-	while (_ctx->sockopts_current != NULL)
-	{
-		socketopt_t *current = _ctx->sockopts_current;
-		_ctx->sockopts_current = current->next;
-		free(current);
-	}
-	while (_ctx->sockopts_suggested != NULL)
-	{
-		socketopt_t *current = _ctx->sockopts_suggested;
-		_ctx->sockopts_suggested = current->next;
-		free(current);
-	}
-	free(_ctx);
+	_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_hint);
+	_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_res);
+	_muacc_dealloc(_ctx->bind_sa_req);
+	_muacc_dealloc(_ctx->bind_sa_suggested);
+	_muacc_dealloc(_ctx->remote_sa);
+	_muacc_dealloc(_ctx->remote_hostname);
+	_muacc_dealloc(_ctx->remote_service);
+	_muacc_free_socketopts(_ctx->sockopts_current);
+	_muacc_free_socketopts(_ctx->sockopts_suggested);
+	_muacc_dealloc(_ctx);
+	_muacc_arena_use(prev);
 	DLOG(MUACC_CTX_NOISY_DEBUG1, "context successfully freed\n");
 
 	return(0);
@@ -181,8 +178,459 @@ _muacc_pack_ctx_err:
 
 }
 
+/** Members present in a packed_ctx element - the order of the bits is the order of the members */
+#define MUACC_PACKED_CTX_CTXID                (1 << 0)
+#define MUACC_PACKED_CTX_CTXINO               (1 << 1)
+#define MUACC_PACKED_CTX_SOCKFD               (1 << 2)
+#define MUACC_PACKED_CTX_CALLS_PERFORMED      (1 << 3)
+#define MUACC_PACKED_CTX_DOMAIN               (1 << 4)
+#define MUACC_PACKED_CTX_TYPE                 (1 << 5)
+#define MUACC_PACKED_CTX_PROTOCOL             (1 << 6)
+#define MUACC_PACKED_CTX_BIND_SA_REQ          (1 << 7)
+#define MUACC_PACKED_CTX_BIND_SA_RES          (1 << 8)
+#define MUACC_PACKED_CTX_REMOTE_SA            (1 << 9)
+#define MUACC_PACKED_CTX_REMOTE_HOSTNAME      (1 << 10)
+#define MUACC_PACKED_CTX_REMOTE_SERVICE       (1 << 11)
+#define MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT (1 << 12)
+#define MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES  (1 << 13)
+#define MUACC_PACKED_CTX_SOCKOPTS_CURRENT     (1 << 14)
+#define MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED   (1 << 15)
+
+/** Scalar members - they are zero if left out */
+#define MUACC_PACKED_CTX_SCALARS (MUACC_PACKED_CTX_CTXINO | MUACC_PACKED_CTX_SOCKFD | MUACC_PACKED_CTX_CALLS_PERFORMED | \
+	MUACC_PACKED_CTX_DOMAIN | MUACC_PACKED_CTX_TYPE | MUACC_PACKED_CTX_PROTOCOL)
+
+/** Room left for the length of a packed_ctx element before its body is known */
+#define MUACC_PACKED_CTX_LEN_RESERVE 5
+
+/** bitmap of the members of a context that are not zero or NULL */
+static uint64_t _muacc_ctx_present(const struct _muacc_ctx *ctx)
+{
+	uint64_t present = 0;
+
+	if (!__uuid_is_null(ctx->ctxid))     present |= MUACC_PACKED_CTX_CTXID;
+	if (ctx->ctxino != 0)                present |= MUACC_PACKED_CTX_CTXINO;
+	if (ctx->sockfd != 0)                present |= MUACC_PACKED_CTX_SOCKFD;
+	if (ctx->calls_performed != 0)       present |= MUACC_PACKED_CTX_CALLS_PERFORMED;
+	if (ctx->domain != 0)                present |= MUACC_PACKED_CTX_DOMAIN;
+	if (ctx->type != 0)                  present |= MUACC_PACKED_CTX_TYPE;
+	if (ctx->protocol != 0)              present |= MUACC_PACKED_CTX_PROTOCOL;
+	if (ctx->bind_sa_req != NULL)        present |= MUACC_PACKED_CTX_BIND_SA_REQ;
+	if (ctx->bind_sa_suggested != NULL)  present |= MUACC_PACKED_CTX_BIND_SA_RES;
+	if (ctx->remote_sa != NULL)          present |= MUACC_PACKED_CTX_REMOTE_SA;
+	if (ctx->remote_hostname != NULL)    present |= MUACC_PACKED_CTX_REMOTE_HOSTNAME;
+	if (ctx->remote_service != NULL)     present |= MUACC_PACKED_CTX_REMOTE_SERVICE;
+	if (ctx->remote_addrinfo_hint != NULL) present |= MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT;
+	if (ctx->remote_addrinfo_res != NULL)  present |= MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES;
+	if (ctx->sockopts_current != NULL)   present |= MUACC_PACKED_CTX_SOCKOPTS_CURRENT;
+	if (ctx->sockopts_suggested != NULL) present |= MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED;
+
+	return present;
+}
 
-int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struct _muacc_ctx *_ctx)
+static int _muacc_sockaddr_differs(const struct sockaddr *a, socklen_t a_len, const struct sockaddr *b, socklen_t b_len)
+{
+	if (a == NULL || b == NULL)
+		return (a != b);
+	return (a_len != b_len || memcmp(a, b, a_len) != 0);
+}
+
+static int _muacc_string_differs(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a != b);
+	return (strcmp(a, b) != 0);
+}
+
+static int _muacc_addrinfo_differs(const struct addrinfo *a, const struct addrinfo *b)
+{
+	for (; a != NULL && b != NULL; a = a->ai_next, b = b->ai_next)
+	{
+		if (a->ai_flags != b->ai_flags || a->ai_family != b->ai_family ||
+			a->ai_socktype != b->ai_socktype || a->ai_protocol != b->ai_protocol ||
+			_muacc_sockaddr_differs(a->ai_addr, a->ai_addrlen, b->ai_addr, b->ai_addrlen) ||
+			_muacc_string_differs(a->ai_canonname, b->ai_canonname))
+			return 1;
+	}
+	return (a != b);
+}
+
+static int _muacc_socketopt_differs(const struct socketopt *a, const struct socketopt *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
+	{
+		if (a->level != b->level || a->optname != b->optname || a->flags != b->flags ||
+			a->returnvalue != b->returnvalue || a->optlen != b->optlen ||
+			(a->optval == NULL) != (b->optval == NULL) ||
+			(a->optval != NULL && memcmp(a->optval, b->optval, a->optlen) != 0))
+			return 1;
+	}
+	return (a != b);
+}
+
+/** bitmap of the members that differ between two contexts */
+static uint64_t _muacc_ctx_changed(const struct _muacc_ctx *old, const struct _muacc_ctx *ctx)
+{
+	uint64_t changed = 0;
+
+	if (__uuid_compare(old->ctxid, ctx->ctxid) != 0)    changed |= MUACC_PACKED_CTX_CTXID;
+	if (old->ctxino != ctx->ctxino)                     changed |= MUACC_PACKED_CTX_CTXINO;
+	if (old->sockfd != ctx->sockfd)                     changed |= MUACC_PACKED_CTX_SOCKFD;
+	if (old->calls_performed != ctx->calls_performed)   changed |= MUACC_PACKED_CTX_CALLS_PERFORMED;
+	if (old->domain != ctx->domain)                     changed |= MUACC_PACKED_CTX_DOMAIN;
+	if (old->type != ctx->type)                         changed |= MUACC_PACKED_CTX_TYPE;
+	if (old->protocol != ctx->protocol)                 changed |= MUACC_PACKED_CTX_PROTOCOL;
+	if (_muacc_sockaddr_differs(old->bind_sa_req, old->bind_sa_req_len, ctx->bind_sa_req, ctx->bind_sa_req_len))
+		changed |= MUACC_PACKED_CTX_BIND_SA_REQ;
+	if (_muacc_sockaddr_differs(old->bind_sa_suggested, old->bind_sa_suggested_len, ctx->bind_sa_suggested, ctx->bind_sa_suggested_len))
+		changed |= MUACC_PACKED_CTX_BIND_SA_RES;
+	if (_muacc_sockaddr_differs(old->remote_sa, old->remote_sa_len, ctx->remote_sa, ctx->remote_sa_len))
+		changed |= MUACC_PACKED_CTX_REMOTE_SA;
+	if (_muacc_string_differs(old->remote_hostname, ctx->remote_hostname))
+		changed |= MUACC_PACKED_CTX_REMOTE_HOSTNAME;
+	if (_muacc_string_differs(old->remote_service, ctx->remote_service))
+		changed |= MUACC_PACKED_CTX_REMOTE_SERVICE;
+	if (_muacc_addrinfo_differs(old->remote_addrinfo_hint, ctx->remote_addrinfo_hint))
+		changed |= MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT;
+	if (_muacc_addrinfo_differs(old->remote_addrinfo_res, ctx->remote_addrinfo_res))
+		changed |= MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES;
+	if (_muacc_socketopt_differs(old->sockopts_current, ctx->sockopts_current))
+		changed |= MUACC_PACKED_CTX_SOCKOPTS_CURRENT;
+	if (_muacc_socketopt_differs(old->sockopts_suggested, ctx->sockopts_suggested))
+		changed |= MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED;
+
+	return changed;
+}
+
+/** pack the members given by fields in the order of their bits */
+static int _muacc_pack_ctx_fields(char *buf, ssize_t *pos, ssize_t len, const struct _muacc_ctx *ctx, uint64_t fields)
+{
+	if (fields & MUACC_PACKED_CTX_CTXID)
+	{
+		if (*pos + (ssize_t) sizeof(uuid_t) > len) return(-1);
+		memcpy(buf + *pos, ctx->ctxid, sizeof(uuid_t));
+		*pos += sizeof(uuid_t);
+	}
+	if ((fields & MUACC_PACKED_CTX_CTXINO) &&
+		0 > _muacc_push_varint(buf, pos, len, ctx->ctxino)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_SOCKFD) &&
+		0 > _muacc_push_varint(buf, pos, len, MUACC_ZIGZAG_ENCODE(ctx->sockfd))) return(-1);
+	if ((fields & MUACC_PACKED_CTX_CALLS_PERFORMED) &&
+		0 > _muacc_push_varint(buf, pos, len, MUACC_ZIGZAG_ENCODE(ctx->calls_performed))) return(-1);
+	if ((fields & MUACC_PACKED_CTX_DOMAIN) &&
+		0 > _muacc_push_varint(buf, pos, len, MUACC_ZIGZAG_ENCODE(ctx->domain))) return(-1);
+	if ((fields & MUACC_PACKED_CTX_TYPE) &&
+		0 > _muacc_push_varint(buf, pos, len, MUACC_ZIGZAG_ENCODE(ctx->type))) return(-1);
+	if ((fields & MUACC_PACKED_CTX_PROTOCOL) &&
+		0 > _muacc_push_varint(buf, pos, len, MUACC_ZIGZAG_ENCODE(ctx->protocol))) return(-1);
+	if ((fields & MUACC_PACKED_CTX_BIND_SA_REQ) &&
+		0 > _muacc_push_packed_sockaddr(buf, pos, len, ctx->bind_sa_req, ctx->bind_sa_req_len)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_BIND_SA_RES) &&
+		0 > _muacc_push_packed_sockaddr(buf, pos, len, ctx->bind_sa_suggested, ctx->bind_sa_suggested_len)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_REMOTE_SA) &&
+		0 > _muacc_push_packed_sockaddr(buf, pos, len, ctx->remote_sa, ctx->remote_sa_len)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_REMOTE_HOSTNAME) &&
+		0 > _muacc_push_packed_string(buf, pos, len, ctx->remote_hostname)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_REMOTE_SERVICE) &&
+		0 > _muacc_push_packed_string(buf, pos, len, ctx->remote_service)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT) &&
+		0 > _muacc_push_packed_addrinfo(buf, pos, len, ctx->remote_addrinfo_hint)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES) &&
+		0 > _muacc_push_packed_addrinfo(buf, pos, len, ctx->remote_addrinfo_res)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_SOCKOPTS_CURRENT) &&
+		0 > _muacc_push_packed_socketopt(buf, pos, len, ctx->sockopts_current)) return(-1);
+	if ((fields & MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED) &&
+		0 > _muacc_push_packed_socketopt(buf, pos, len, ctx->sockopts_suggested)) return(-1);
+
+	return(0);
+}
+
+/** pack a compact context element (protocol version 2)
+ *
+ *  The body of a packed_ctx is a bitmap of the members present, followed by these members.
+ *  The body of a packed_ctx_delta starts with a bitmap of the members changed, so members
+ *  changed but not present have been cleared.
+ */
+static ssize_t _muacc_pack_ctx_compact(char *buf, ssize_t *pos, ssize_t len, muacc_tlv_t tag,
+	const struct _muacc_ctx *old, const struct _muacc_ctx *ctx)
+{
+	ssize_t pos0 = *pos;
+	ssize_t body0, body_len, len_len;
+	uint64_t present = _muacc_ctx_present(ctx);
+	uint64_t changed = 0;
+
+	if (tag == packed_ctx_delta)
+	{
+		changed = _muacc_ctx_changed(old, ctx);
+		present &= changed;
+	}
+
+	/* tag, room for the length, body */
+	if (*pos + 1 + MUACC_PACKED_CTX_LEN_RESERVE >= len)
+		goto _muacc_pack_ctx_compact_err;
+	buf[(*pos)++] = (char) tag;
+	*pos += MUACC_PACKED_CTX_LEN_RESERVE;
+	body0 = *pos;
+
+	if (tag == packed_ctx_delta && 0 > _muacc_push_varint(buf, pos, len, changed)) goto _muacc_pack_ctx_compact_err;
+	if (0 > _muacc_push_varint(buf, pos, len, present)) goto _muacc_pack_ctx_compact_err;
+	if (0 > _muacc_pack_ctx_fields(buf, pos, len, ctx, present)) goto _muacc_pack_ctx_compact_err;
+
+	/* now that the length is known, close the gap behind it */
+	body_len = *pos - body0;
+	*pos = pos0 + 1;
+	len_len = _muacc_push_varint(buf, pos, len, body_len);
+	if (len_len < 0 || len_len > MUACC_PACKED_CTX_LEN_RESERVE) goto _muacc_pack_ctx_compact_err;
+	memmove(buf + *pos, buf + body0, body_len);
+	*pos += body_len;
+
+	DLOG(MUACC_CTX_NOISY_DEBUG1,"packed _ctx=%p into %ld bytes\n", (void *) ctx, (long) (*pos - pos0));
+	return ( *pos - pos0 );
+
+_muacc_pack_ctx_compact_err:
+
+	*pos = pos0;
+	return(-1);
+}
+
+ssize_t _muacc_pack_ctx_v(char *buf, ssize_t *pos, ssize_t len, int version, const struct _muacc_ctx *ctx)
+{
+	if (version < MUACC_PROTOCOL_V2)
+		return _muacc_pack_ctx(buf, pos, len, ctx);
+	else
+		return _muacc_pack_ctx_compact(buf, pos, len, packed_ctx, NULL, ctx);
+}
+
+ssize_t _muacc_pack_ctx_delta(char *buf, ssize_t *pos, ssize_t len, const struct _muacc_ctx *old, const struct _muacc_ctx *ctx)
+{
+	if (_muacc_ctx_changed(old, ctx) == 0)
+		return(0);
+	return _muacc_pack_ctx_compact(buf, pos, len, packed_ctx_delta, old, ctx);
+}
+
+/** unpack the members given by fields into the context, replacing their current values */
+static int _muacc_unpack_ctx_fields(const char *data, ssize_t *pos, ssize_t data_len, struct _muacc_ctx *_ctx, uint64_t fields)
+{
+	uint64_t v;
+	struct sockaddr *sa;
+	socklen_t sa_len;
+	struct addrinfo *ai;
+	struct socketopt *so;
+	char *str;
+
+	if (fields & MUACC_PACKED_CTX_CTXID)
+	{
+		if (*pos + (ssize_t) sizeof(uuid_t) > data_len)
+			return(-1);
+		/* same checks as for a ctxid TLV */
+		if (0 > _muacc_unpack_ctx(ctxid, data + *pos, sizeof(uuid_t), _ctx))
+			return(-1);
+		*pos += sizeof(uuid_t);
+	}
+
+	if (fields & MUACC_PACKED_CTX_CTXINO)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->ctxino = v;
+	}
+	if (fields & MUACC_PACKED_CTX_SOCKFD)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->sockfd = MUACC_ZIGZAG_DECODE(v);
+	}
+	if (fields & MUACC_PACKED_CTX_CALLS_PERFORMED)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->calls_performed = MUACC_ZIGZAG_DECODE(v);
+	}
+	if (fields & MUACC_PACKED_CTX_DOMAIN)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->domain = MUACC_ZIGZAG_DECODE(v);
+	}
+	if (fields & MUACC_PACKED_CTX_TYPE)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->type = MUACC_ZIGZAG_DECODE(v);
+	}
+	if (fields & MUACC_PACKED_CTX_PROTOCOL)
+	{
+		if (0 > _muacc_get_varint(data, pos, data_len, &v)) return(-1);
+		_ctx->protocol = MUACC_ZIGZAG_DECODE(v);
+	}
+
+	if (fields & MUACC_PACKED_CTX_BIND_SA_REQ)
+	{
+		if (0 > _muacc_get_packed_sockaddr(data, pos, data_len, &sa, &sa_len)) return(-1);
+		_muacc_dealloc(_ctx->bind_sa_req);
+		_ctx->bind_sa_req = sa;
+		_ctx->bind_sa_req_len = sa_len;
+	}
+	if (fields & MUACC_PACKED_CTX_BIND_SA_RES)
+	{
+		if (0 > _muacc_get_packed_sockaddr(data, pos, data_len, &sa, &sa_len)) return(-1);
+		_muacc_dealloc(_ctx->bind_sa_suggested);
+		_ctx->bind_sa_suggested = sa;
+		_ctx->bind_sa_suggested_len = sa_len;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_SA)
+	{
+		if (0 > _muacc_get_packed_sockaddr(data, pos, data_len, &sa, &sa_len)) return(-1);
+		_muacc_dealloc(_ctx->remote_sa);
+		_ctx->remote_sa = sa;
+		_ctx->remote_sa_len = sa_len;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_HOSTNAME)
+	{
+		if (0 > _muacc_get_packed_string(data, pos, data_len, &str)) return(-1);
+		_muacc_dealloc(_ctx->remote_hostname);
+		_ctx->remote_hostname = str;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_SERVICE)
+	{
+		if (0 > _muacc_get_packed_string(data, pos, data_len, &str)) return(-1);
+		_muacc_dealloc(_ctx->remote_service);
+		_ctx->remote_service = str;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT)
+	{
+		if (0 > _muacc_get_packed_addrinfo(data, pos, data_len, &ai)) return(-1);
+		_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_hint);
+		_ctx->remote_addrinfo_hint = ai;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES)
+	{
+		if (0 > _muacc_get_packed_addrinfo(data, pos, data_len, &ai)) return(-1);
+		_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_res);
+		_ctx->remote_addrinfo_res = ai;
+	}
+	if (fields & MUACC_PACKED_CTX_SOCKOPTS_CURRENT)
+	{
+		if (0 > _muacc_get_packed_socketopt(data, pos, data_len, &so)) return(-1);
+		_muacc_free_socketopts(_ctx->sockopts_current);
+		_ctx->sockopts_current = so;
+	}
+	if (fields & MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED)
+	{
+		if (0 > _muacc_get_packed_socketopt(data, pos, data_len, &so)) return(-1);
+		_muacc_free_socketopts(_ctx->sockopts_suggested);
+		_ctx->sockopts_suggested = so;
+	}
+
+	return(0);
+}
+
+/** reset the members given by fields to zero or NULL */
+static void _muacc_clear_ctx_fields(struct _muacc_ctx *_ctx, uint64_t fields)
+{
+	if (fields & MUACC_PACKED_CTX_CTXID)           memset(_ctx->ctxid, 0, sizeof(uuid_t));
+	if (fields & MUACC_PACKED_CTX_CTXINO)          _ctx->ctxino = 0;
+	if (fields & MUACC_PACKED_CTX_SOCKFD)          _ctx->sockfd = 0;
+	if (fields & MUACC_PACKED_CTX_CALLS_PERFORMED) _ctx->calls_performed = 0;
+	if (fields & MUACC_PACKED_CTX_DOMAIN)          _ctx->domain = 0;
+	if (fields & MUACC_PACKED_CTX_TYPE)            _ctx->type = 0;
+	if (fields & MUACC_PACKED_CTX_PROTOCOL)        _ctx->protocol = 0;
+	if (fields & MUACC_PACKED_CTX_BIND_SA_REQ)
+	{
+		_muacc_dealloc(_ctx->bind_sa_req);
+		_ctx->bind_sa_req = NULL;
+		_ctx->bind_sa_req_len = 0;
+	}
+	if (fields & MUACC_PACKED_CTX_BIND_SA_RES)
+	{
+		_muacc_dealloc(_ctx->bind_sa_suggested);
+		_ctx->bind_sa_suggested = NULL;
+		_ctx->bind_sa_suggested_len = 0;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_SA)
+	{
+		_muacc_dealloc(_ctx->remote_sa);
+		_ctx->remote_sa = NULL;
+		_ctx->remote_sa_len = 0;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_HOSTNAME)
+	{
+		_muacc_dealloc(_ctx->remote_hostname);
+		_ctx->remote_hostname = NULL;
+	}
+	if (fields & MUACC_PACKED_CTX_REMOTE_SERVICE)
+	{
+		_muacc_dealloc(_ctx->remote_service);
+		_ctx->remote_service = NULL;
+	}
+	if ((fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_HINT) && _ctx->remote_addrinfo_hint != NULL)
+	{
+		_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_hint);
+		_ctx->remote_addrinfo_hint = NULL;
+	}
+	if ((fields & MUACC_PACKED_CTX_REMOTE_ADDRINFO_RES) && _ctx->remote_addrinfo_res != NULL)
+	{
+		_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_res);
+		_ctx->remote_addrinfo_res = NULL;
+	}
+	if (fields & MUACC_PACKED_CTX_SOCKOPTS_CURRENT)
+	{
+		_muacc_free_socketopts(_ctx->sockopts_current);
+		_ctx->sockopts_current = NULL;
+	}
+	if (fields & MUACC_PACKED_CTX_SOCKOPTS_SUGGESTED)
+	{
+		_muacc_free_socketopts(_ctx->sockopts_suggested);
+		_ctx->sockopts_suggested = NULL;
+	}
+}
+
+/** parse a packed_ctx element (protocol version 2) into the context
+ *
+ *  Scalars left out are zero, pointers left out keep their current value.
+ */
+static int _muacc_unpack_ctx_compact(const char *data, ssize_t data_len, struct _muacc_ctx *_ctx)
+{
+	ssize_t pos = 0;
+	uint64_t present;
+	uuid_t id;
+
+	if (0 > _muacc_get_varint(data, &pos, data_len, &present))
+		return(-1);
+
+	if (!(present & MUACC_PACKED_CTX_CTXID))
+	{
+		/* same checks as for an empty ctxid TLV */
+		memset(id, 0, sizeof(uuid_t));
+		if (0 > _muacc_unpack_ctx(ctxid, id, sizeof(uuid_t), _ctx))
+			return(-1);
+	}
+
+	_muacc_clear_ctx_fields(_ctx, MUACC_PACKED_CTX_SCALARS & ~present);
+	if (0 > _muacc_unpack_ctx_fields(data, &pos, data_len, _ctx, present))
+		return(-1);
+
+	if (pos != data_len)
+		DLOG(MUACC_CTX_NOISY_DEBUG1, "ignoring %ld trailing bytes of packed context\n", (long) (data_len - pos));
+
+	return(0);
+}
+
+/** apply a packed_ctx_delta element (protocol version 2) to the context */
+static int _muacc_unpack_ctx_delta(const char *data, ssize_t data_len, struct _muacc_ctx *_ctx)
+{
+	ssize_t pos = 0;
+	uint64_t changed, present;
+
+	if (0 > _muacc_get_varint(data, &pos, data_len, &changed) ||
+		0 > _muacc_get_varint(data, &pos, data_len, &present) ||
+		(present & ~changed) != 0)
+		return(-1);
+
+	_muacc_clear_ctx_fields(_ctx, changed & ~present);
+	if (0 > _muacc_unpack_ctx_fields(data, &pos, data_len, _ctx, present))
+		return(-1);
+
+	DLOG(MUACC_CTX_NOISY_DEBUG2, "applied delta changing %lx\n", (unsigned long) changed);
+	return(0);
+}
+
+static int _muacc_unpack_ctx_tlv(muacc_tlv_t tag, const void *data, ssize_t data_len, struct _muacc_ctx *_ctx)
 {
 	struct addrinfo *ai;
 	struct sockaddr *sa;
@@ -242,7 +690,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking bind_sa_req\n");
 			if ((int) _muacc_extract_socketaddr_tlv(data, data_len, &sa) > 0)
 			{
-				free(_ctx->bind_sa_req);
+				_muacc_dealloc(_ctx->bind_sa_req);
 				_ctx->bind_sa_req = sa;
 				_ctx->bind_sa_req_len = data_len;
 			}
@@ -253,7 +701,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking bind_sa_res\n");
 			if((int) _muacc_extract_socketaddr_tlv(data, data_len, &sa) > 0)
 			{
-				free(_ctx->bind_sa_suggested);
+				_muacc_dealloc(_ctx->bind_sa_suggested);
 				_ctx->bind_sa_suggested = sa;
 				_ctx->bind_sa_suggested_len = data_len;
 			}
@@ -264,7 +712,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking remote_sa\n");
 			if((int) _muacc_extract_socketaddr_tlv(data, data_len, &sa) > 0)
 			{
-				free(_ctx->remote_sa);
+				_muacc_dealloc(_ctx->remote_sa);
 				_ctx->remote_sa = sa;
 				_ctx->remote_sa_len = data_len;
 			}
@@ -273,7 +721,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			break;
 		case remote_hostname:
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking remote_hostname\n");
-			if((str = malloc(data_len)) != NULL)
+			if((str = _muacc_alloc(data_len)) != NULL)
 			{
 				strncpy(str, data, data_len);
 				str[data_len-1] = 0x00;
@@ -284,7 +732,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			break;
 		case remote_service:
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking remote_service\n");
-			if((str = malloc(data_len)) != NULL)
+			if((str = _muacc_alloc(data_len)) != NULL)
 			{
 				strncpy(str, data, data_len);
 				str[data_len-1] = 0x00;
@@ -297,7 +745,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking remote_addrinfo_hint\n");
 			if((int) _muacc_extract_addrinfo_tlv( data, data_len, &ai) > 0)
 			{
-				freeaddrinfo(_ctx->remote_addrinfo_hint);
+				_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_hint);
 				_ctx->remote_addrinfo_hint = ai;
 			}
 			else
@@ -308,7 +756,7 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking remote_addrinfo_res\n");
 			if((int) _muacc_extract_addrinfo_tlv( data, data_len, &ai) > 0)
 			{
-				freeaddrinfo(_ctx->remote_addrinfo_res);
+				_muacc_arena_freeaddrinfo(_ctx->arena, _ctx->remote_addrinfo_res);
 				_ctx->remote_addrinfo_res = ai;
 			}
 			else
@@ -337,6 +785,24 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 				return(-1);
 			break;
 
+		case packed_ctx:
+			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking packed_ctx\n");
+			if (0 > _muacc_unpack_ctx_compact(data, data_len, _ctx))
+			{
+				DLOG(MUACC_CTX_NOISY_DEBUG0, "failed to unpack packed_ctx\n");
+				return(-1);
+			}
+			break;
+
+		case packed_ctx_delta:
+			DLOG(MUACC_CTX_NOISY_DEBUG2, "unpacking packed_ctx_delta\n");
+			if (0 > _muacc_unpack_ctx_delta(data, data_len, _ctx))
+			{
+				DLOG(MUACC_CTX_NOISY_DEBUG0, "failed to unpack packed_ctx_delta\n");
+				return(-1);
+			}
+			break;
+
 		default:
 			DLOG(MUACC_CTX_NOISY_DEBUG0, "_muacc_unpack_ctx: ignoring unknown tag %x\n", tag);
 				return(-1);
@@ -344,3 +810,13 @@ int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struc
 
 	return(0);
 }
+
+int _muacc_unpack_ctx(muacc_tlv_t tag, const void *data, ssize_t data_len, struct _muacc_ctx *_ctx)
+{
+	/* unpacked fields live as long as the context */
+	muacc_arena_t *prev = _muacc_arena_use(_ctx->arena);
+	int ret = _muacc_unpack_ctx_tlv(tag, data, data_len, _ctx);
+
+	_muacc_arena_use(prev);
+	return(ret);
+}
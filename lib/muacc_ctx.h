@@ -52,6 +52,31 @@ ssize_t _muacc_pack_ctx(
 	const struct _muacc_ctx *ctx	/**< [in]		context to pack */
 );
 
+/** Serialize the _ctx packing struct in the encoding of the given protocol version
+ *
+ * version 1 uses _muacc_pack_ctx, version 2 packs the whole context
+ * into a single packed_ctx element
+ */
+ssize_t _muacc_pack_ctx_v(
+	char *buf,						/**< [in]		buffer to write TLVs to */
+	ssize_t *pos,					/**< [in,out]	position within buf */
+	ssize_t len,					/**< [in]		length of buf	*/
+	int version,					/**< [in]		protocol version to use */
+	const struct _muacc_ctx *ctx	/**< [in]		context to pack */
+);
+
+/** Serialize the members of ctx that differ from old into a packed_ctx_delta element
+ *
+ * only for protocol version 2 - nothing is written if the contexts do not differ
+ */
+ssize_t _muacc_pack_ctx_delta(
+	char *buf,						/**< [in]		buffer to write TLVs to */
+	ssize_t *pos,					/**< [in,out]	position within buf */
+	ssize_t len,					/**< [in]		length of buf	*/
+	const struct _muacc_ctx *old,	/**< [in]		context as the receiver knows it */
+	const struct _muacc_ctx *ctx	/**< [in]		context to pack */
+);
+
 /** parse a single TLV and push its content to the respective member of _muacc_ctx
  *
  * this has to be kept in sync with the members of _muacc_ctx
@@ -0,0 +1,748 @@
+/** \file muacc_log.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "muacc_log.h"
+
+#include "dlog.h"
+
+#ifndef MUACC_LOG_NOISY_DEBUG0
+#define MUACC_LOG_NOISY_DEBUG0 0
+#endif
+
+#ifndef MUACC_LOG_NOISY_DEBUG1
+#define MUACC_LOG_NOISY_DEBUG1 1
+#endif
+
+/** average length of the strings a block of a binary log has room for */
+#define MUACC_LOG_STRING_AVG 32
+
+/** Value of a column of a row of the block that is not encoded yet */
+struct muacc_log_cell {
+	int						valid;				/**< 0 for NA */
+	union {
+		int64_t				i;
+		double				d;
+		struct { uint32_t off; uint32_t len; } s;	/**< in the strings of the log */
+		struct { int64_t sec; int64_t usec; } tv;
+	} v;
+};
+
+struct muacc_log {
+	char					*filename;
+	int						format;				/**< MUACC_LOG_CSV or MUACC_LOG_BINARY */
+	int						fd;
+	size_t					rotate_size;		/**< 0 to never rotate */
+	size_t					written;			/**< size of the current file */
+	int64_t					last_write;			/**< monotonic time of the last write of the buffer in ms */
+	int						*types;				/**< types of the columns */
+	unsigned int			n_columns;
+	unsigned int			n_strings;			/**< columns of type MUACC_LOG_STRING */
+	unsigned int			column;				/**< column the next value of the current row is for */
+	char					*header;			/**< header of a binary log file */
+	size_t					header_len;
+	char					*buf;				/**< text or encoded blocks to write */
+	size_t					len;
+	size_t					size;
+	struct muacc_log_cell	*cells;				/**< rows of the current block of a binary log, one after another */
+	unsigned int			rows;				/**< complete rows in cells */
+	char					*strings;			/**< strings of the current block */
+	size_t					strings_len;
+	size_t					strings_size;
+};
+
+static int64_t muacc_log_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** bytes a value takes in a block of a binary log */
+static size_t muacc_log_value_size(int type, const struct muacc_log_cell *cell)
+{
+	switch (type)
+	{
+		case MUACC_LOG_INT:
+		case MUACC_LOG_DOUBLE:
+			return 8;
+		case MUACC_LOG_TIMEVAL:
+			return 16;
+		case MUACC_LOG_STRING:
+			return 1 + ((cell != NULL) ? cell->v.s.len : MUACC_LOG_STRING_MAX);
+	}
+	return 0;
+}
+
+/** write data to the file, all of it */
+static int muacc_log_write(muacc_log_t *log, const void *data, size_t len)
+{
+	const char *p = data;
+	ssize_t n;
+
+	while (len > 0)
+	{
+		if ((n = write(log->fd, p, len)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			DLOG(MUACC_LOG_NOISY_DEBUG1, "writing to log %s failed: %s\n", log->filename, strerror(errno));
+			return -1;
+		}
+		p += n;
+		len -= n;
+		log->written += n;
+	}
+	return 0;
+}
+
+/** write the buffer as it is and empty it */
+static int muacc_log_write_buffer(muacc_log_t *log)
+{
+	int ret = 0;
+
+	if (log->len > 0)
+		ret = muacc_log_write(log, log->buf, log->len);
+	log->len = 0;
+	log->last_write = muacc_log_now_ms();
+	return ret;
+}
+
+static int muacc_log_rotate(muacc_log_t *log);
+
+/** open the file of the log and append to it - binary log files are started with the header,
+ *  and rotated away if they start with another one
+ */
+static int muacc_log_open_file(muacc_log_t *log, int flags)
+{
+	char *header;
+	off_t end;
+	int same;
+
+	if ((log->fd = open(log->filename, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644)) < 0)
+	{
+		DLOG(MUACC_LOG_NOISY_DEBUG1, "opening log %s failed: %s\n", log->filename, strerror(errno));
+		return -1;
+	}
+	if ((end = lseek(log->fd, 0, SEEK_END)) < 0)
+		return -1;
+	log->written = end;
+
+	if (log->format != MUACC_LOG_BINARY)
+		return 0;
+
+	if (log->written == 0)
+		return muacc_log_write(log, log->header, log->header_len);
+
+	if ((header = malloc(log->header_len)) == NULL)
+		return -1;
+	same = (pread(log->fd, header, log->header_len, 0) == (ssize_t) log->header_len && memcmp(header, log->header, log->header_len) == 0);
+	free(header);
+	if (same)
+		return 0;
+
+	DLOG(MUACC_LOG_NOISY_DEBUG0, "log %s has other columns - starting a new one\n", log->filename);
+	return muacc_log_rotate(log);
+}
+
+/** rename the file to filename.1, the ones before to filename.2 and so on, and start a new one */
+static int muacc_log_rotate(muacc_log_t *log)
+{
+	size_t n = strlen(log->filename) + 16;
+	char from[n], to[n];
+	int i;
+
+	for (i = MUACC_LOG_KEEP; i > 1; i--)
+	{
+		snprintf(from, n, "%s.%d", log->filename, i - 1);
+		snprintf(to, n, "%s.%d", log->filename, i);
+		rename(from, to);
+	}
+	if (MUACC_LOG_KEEP > 0)
+	{
+		snprintf(to, n, "%s.1", log->filename);
+		rename(log->filename, to);
+	}
+
+	DLOG(MUACC_LOG_NOISY_DEBUG0, "rotated log %s after %zu bytes\n", log->filename, log->written);
+	close(log->fd);
+	return muacc_log_open_file(log, O_TRUNC);
+}
+
+/** add formatted text to the buffer, writing the buffer first if it does not fit */
+static int muacc_log_vappend(muacc_log_t *log, const char *format, va_list args)
+{
+	va_list copy;
+	char *text;
+	int n, ret;
+
+	va_copy(copy, args);
+	n = vsnprintf(log->buf + log->len, log->size - log->len, format, copy);
+	va_end(copy);
+	if (n < 0)
+		return -1;
+	if ((size_t) n < log->size - log->len)
+	{
+		log->len += n;
+		return 0;
+	}
+
+	if (muacc_log_write_buffer(log) < 0)
+		return -1;
+	if ((size_t) n < log->size)
+	{
+		log->len = vsnprintf(log->buf, log->size, format, args);
+		return 0;
+	}
+
+	// larger than the whole buffer
+	if ((n = vasprintf(&text, format, args)) < 0)
+		return -1;
+	ret = muacc_log_write(log, text, n);
+	free(text);
+	return ret;
+}
+
+static int muacc_log_append(muacc_log_t *log, const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	va_start(args, format);
+	ret = muacc_log_vappend(log, format, args);
+	va_end(args);
+	return ret;
+}
+
+/** encode the rows of the current block into the buffer */
+static int muacc_log_encode_block(muacc_log_t *log)
+{
+	const struct muacc_log_cell *cell;
+	size_t bitmap = (log->rows + 7) / 8;
+	size_t need = 3 * sizeof(uint32_t);
+	uint32_t head[3];
+	unsigned char *bits;
+	unsigned int r, c;
+	char *p;
+
+	if (log->rows == 0)
+		return 0;
+
+	for (c = 0; c < log->n_columns; c++)
+	{
+		need += bitmap;
+		for (r = 0; r < log->rows; r++)
+			if ((cell = &(log->cells[r * log->n_columns + c]))->valid)
+				need += muacc_log_value_size(log->types[c], cell);
+	}
+
+	// the buffer always has room for a whole block once it is written
+	if (need > log->size - log->len && muacc_log_write_buffer(log) < 0)
+	{
+		log->rows = 0;
+		log->strings_len = 0;
+		return -1;
+	}
+
+	p = log->buf + log->len;
+	head[0] = MUACC_LOG_BLOCK_MAGIC;
+	head[1] = log->rows;
+	head[2] = need - sizeof(head);
+	memcpy(p, head, sizeof(head));
+	p += sizeof(head);
+
+	// each column: bitmap of the rows with a value, then these values
+	for (c = 0; c < log->n_columns; c++)
+	{
+		bits = (unsigned char *) p;
+		memset(bits, 0, bitmap);
+		p += bitmap;
+
+		for (r = 0; r < log->rows; r++)
+		{
+			cell = &(log->cells[r * log->n_columns + c]);
+			if (!cell->valid)
+				continue;
+			bits[r / 8] |= 1 << (r % 8);
+
+			switch (log->types[c])
+			{
+				case MUACC_LOG_INT:
+					memcpy(p, &(cell->v.i), 8);
+					break;
+				case MUACC_LOG_DOUBLE:
+					memcpy(p, &(cell->v.d), 8);
+					break;
+				case MUACC_LOG_TIMEVAL:
+					memcpy(p, &(cell->v.tv.sec), 8);
+					memcpy(p + 8, &(cell->v.tv.usec), 8);
+					break;
+				case MUACC_LOG_STRING:
+					*p = (unsigned char) cell->v.s.len;
+					memcpy(p + 1, log->strings + cell->v.s.off, cell->v.s.len);
+					break;
+			}
+			p += muacc_log_value_size(log->types[c], cell);
+		}
+	}
+
+	log->len += need;
+	log->rows = 0;
+	log->strings_len = 0;
+	return 0;
+}
+
+/** write the buffer if it is due and rotate the file if it is too large - at the end of a row */
+static int muacc_log_row_done(muacc_log_t *log)
+{
+	int ret = 0;
+
+	if (log->rotate_size > 0 && log->written + log->len >= log->rotate_size)
+	{
+		if ((ret = _muacc_log_flush(log)) == 0)
+			ret = muacc_log_rotate(log);
+	}
+	else if (muacc_log_now_ms() - log->last_write >= MUACC_LOG_FLUSH_MS)
+	{
+		ret = _muacc_log_flush(log);
+	}
+	return ret;
+}
+
+muacc_log_t *_muacc_log_open(const char *filename, int format, const struct muacc_log_column *columns, unsigned int n_columns, size_t rotate_size)
+{
+	muacc_log_t *log;
+	size_t block, name_len;
+	unsigned int c;
+	uint32_t magic = MUACC_LOG_MAGIC;
+	uint16_t version = MUACC_LOG_VERSION, n = n_columns;
+	char *p;
+
+	if (filename == NULL || (format == MUACC_LOG_BINARY && (columns == NULL || n_columns == 0 || n_columns > UINT16_MAX)))
+		return NULL;
+
+	if ((log = malloc(sizeof(struct muacc_log))) == NULL)
+		return NULL;
+	memset(log, 0, sizeof(struct muacc_log));
+	log->fd = -1;
+	log->format = format;
+	log->rotate_size = rotate_size;
+	log->n_columns = (columns != NULL) ? n_columns : 0;
+	log->size = MUACC_LOG_BUFFER_SIZE;
+
+	if ((log->filename = strdup(filename)) == NULL)
+		goto error;
+
+	if (log->n_columns > 0)
+	{
+		if ((log->types = malloc(n_columns * sizeof(int))) == NULL)
+			goto error;
+		log->header_len = sizeof(magic) + sizeof(version) + sizeof(n);
+		for (c = 0; c < n_columns; c++)
+		{
+			log->types[c] = columns[c].type;
+			if (columns[c].type == MUACC_LOG_STRING)
+				log->n_strings++;
+			log->header_len += 2 + strnlen(columns[c].name, MUACC_LOG_STRING_MAX);
+		}
+	}
+
+	if (format == MUACC_LOG_BINARY)
+	{
+		// header: magic, version, number of columns, then type, length of the name and name of each one
+		if ((log->header = malloc(log->header_len)) == NULL)
+			goto error;
+		p = log->header;
+		memcpy(p, &magic, sizeof(magic));
+		memcpy(p + sizeof(magic), &version, sizeof(version));
+		memcpy(p + sizeof(magic) + sizeof(version), &n, sizeof(n));
+		p += sizeof(magic) + sizeof(version) + sizeof(n);
+		for (c = 0; c < n_columns; c++)
+		{
+			name_len = strnlen(columns[c].name, MUACC_LOG_STRING_MAX);
+			*p++ = (char) columns[c].type;
+			*p++ = (char) name_len;
+			memcpy(p, columns[c].name, name_len);
+			p += name_len;
+		}
+
+		log->strings_size = log->n_strings * MUACC_LOG_BLOCK_ROWS * MUACC_LOG_STRING_AVG;
+		if ((log->cells = malloc(MUACC_LOG_BLOCK_ROWS * n_columns * sizeof(struct muacc_log_cell))) == NULL
+			|| (log->n_strings > 0 && (log->strings = malloc(log->strings_size)) == NULL))
+			goto error;
+
+		// largest block there can be: every value there and all strings used
+		block = 3 * sizeof(uint32_t) + log->strings_size;
+		for (c = 0; c < n_columns; c++)
+			block += (MUACC_LOG_BLOCK_ROWS + 7) / 8 + MUACC_LOG_BLOCK_ROWS * ((log->types[c] == MUACC_LOG_STRING) ? 1 : muacc_log_value_size(log->types[c], NULL));
+		if (block > log->size)
+			log->size = block;
+	}
+
+	if ((log->buf = malloc(log->size)) == NULL)
+		goto error;
+
+	if (muacc_log_open_file(log, 0) < 0)
+		goto error;
+	log->last_write = muacc_log_now_ms();
+
+	DLOG(MUACC_LOG_NOISY_DEBUG0, "logging to %s with a buffer of %zu bytes\n", filename, log->size);
+	return log;
+
+error:
+	log->len = 0;
+	_muacc_log_close(log);
+	return NULL;
+}
+
+void _muacc_log_close(muacc_log_t *log)
+{
+	if (log == NULL)
+		return;
+
+	if (log->fd >= 0)
+	{
+		_muacc_log_flush(log);
+		close(log->fd);
+	}
+
+	free(log->filename);
+	free(log->types);
+	free(log->header);
+	free(log->buf);
+	free(log->cells);
+	free(log->strings);
+	free(log);
+}
+
+int _muacc_log_flush(muacc_log_t *log)
+{
+	int ret = 0;
+
+	if (log == NULL)
+		return 0;
+
+	if (log->format == MUACC_LOG_BINARY && muacc_log_encode_block(log) < 0)
+		ret = -1;
+	if (muacc_log_write_buffer(log) < 0)
+		ret = -1;
+	return ret;
+}
+
+int _muacc_log_printf(muacc_log_t *log, const char *format, ...)
+{
+	va_list args;
+	int ret;
+
+	if (log == NULL)
+		return 0;
+	if (log->n_columns > 0)
+		return -1;
+
+	va_start(args, format);
+	ret = muacc_log_vappend(log, format, args);
+	va_end(args);
+
+	if (ret == 0 && log->len > 0 && log->buf[log->len - 1] == '\n')
+		ret = muacc_log_row_done(log);
+	return ret;
+}
+
+/** the cell for the next value of the current row, starting a new block if the current one may have no room for the row */
+static struct muacc_log_cell *muacc_log_cell(muacc_log_t *log)
+{
+	if (log->column == 0 && log->strings_size - log->strings_len < log->n_strings * MUACC_LOG_STRING_MAX)
+		muacc_log_encode_block(log);
+
+	return &(log->cells[log->rows * log->n_columns + log->column]);
+}
+
+/** check whether the next column of the current row is of type - logs NA instead if it is not
+ *
+ * @return 1 if the value can be added, 0 otherwise
+ */
+static int muacc_log_begin_value(muacc_log_t *log, int type)
+{
+	if (log == NULL || log->column >= log->n_columns)
+		return 0;
+
+	if (log->types[log->column] != type)
+	{
+		DLOG(MUACC_LOG_NOISY_DEBUG1, "column %u of log %s has another type - logging NA\n", log->column, log->filename);
+		_muacc_log_na(log);
+		return 0;
+	}
+
+	if (log->format == MUACC_LOG_CSV && log->column > 0)
+		muacc_log_append(log, ",");
+	return 1;
+}
+
+void _muacc_log_int(muacc_log_t *log, int64_t value)
+{
+	struct muacc_log_cell *cell;
+
+	if (!muacc_log_begin_value(log, MUACC_LOG_INT))
+		return;
+
+	if (log->format == MUACC_LOG_CSV)
+	{
+		muacc_log_append(log, "%" PRId64, value);
+	}
+	else
+	{
+		cell = muacc_log_cell(log);
+		cell->valid = 1;
+		cell->v.i = value;
+	}
+	log->column++;
+}
+
+void _muacc_log_double(muacc_log_t *log, double value)
+{
+	struct muacc_log_cell *cell;
+
+	if (!muacc_log_begin_value(log, MUACC_LOG_DOUBLE))
+		return;
+
+	if (log->format == MUACC_LOG_CSV)
+	{
+		muacc_log_append(log, "%f", value);
+	}
+	else
+	{
+		cell = muacc_log_cell(log);
+		cell->valid = 1;
+		cell->v.d = value;
+	}
+	log->column++;
+}
+
+void _muacc_log_string(muacc_log_t *log, const char *value)
+{
+	struct muacc_log_cell *cell;
+
+	if (value == NULL)
+	{
+		_muacc_log_na(log);
+		return;
+	}
+	if (!muacc_log_begin_value(log, MUACC_LOG_STRING))
+		return;
+
+	if (log->format == MUACC_LOG_CSV)
+	{
+		muacc_log_append(log, "%.*s", MUACC_LOG_STRING_MAX, value);
+	}
+	else
+	{
+		cell = muacc_log_cell(log);
+		cell->valid = 1;
+		cell->v.s.off = log->strings_len;
+		cell->v.s.len = strnlen(value, MUACC_LOG_STRING_MAX);
+		memcpy(log->strings + log->strings_len, value, cell->v.s.len);
+		log->strings_len += cell->v.s.len;
+	}
+	log->column++;
+}
+
+void _muacc_log_timeval(muacc_log_t *log, const struct timeval *value)
+{
+	struct muacc_log_cell *cell;
+
+	if (value == NULL)
+	{
+		_muacc_log_na(log);
+		return;
+	}
+	if (!muacc_log_begin_value(log, MUACC_LOG_TIMEVAL))
+		return;
+
+	if (log->format == MUACC_LOG_CSV)
+	{
+		muacc_log_append(log, "%ld.%ld", (long) value->tv_sec, (long) value->tv_usec);
+	}
+	else
+	{
+		cell = muacc_log_cell(log);
+		cell->valid = 1;
+		cell->v.tv.sec = value->tv_sec;
+		cell->v.tv.usec = value->tv_usec;
+	}
+	log->column++;
+}
+
+void _muacc_log_na(muacc_log_t *log)
+{
+	if (log == NULL || log->column >= log->n_columns)
+		return;
+
+	if (log->format == MUACC_LOG_CSV)
+		muacc_log_append(log, (log->column > 0) ? ",NA" : "NA");
+	else
+		muacc_log_cell(log)->valid = 0;
+	log->column++;
+}
+
+int _muacc_log_row_end(muacc_log_t *log)
+{
+	if (log == NULL || log->n_columns == 0)
+		return 0;
+
+	while (log->column < log->n_columns)
+		_muacc_log_na(log);
+	log->column = 0;
+
+	if (log->format == MUACC_LOG_CSV)
+	{
+		muacc_log_append(log, "\n");
+	}
+	else if (++log->rows == MUACC_LOG_BLOCK_ROWS)
+	{
+		if (muacc_log_encode_block(log) < 0)
+			return -1;
+	}
+
+	return muacc_log_row_done(log);
+}
+
+long _muacc_log_convert(FILE *in, FILE *out, int names)
+{
+	uint32_t magic, head[3];
+	uint16_t version, n;
+	unsigned char type, name_len;
+	char name[MUACC_LOG_STRING_MAX + 1];
+	int *types = NULL;
+	const unsigned char **bits = NULL;
+	const char **values = NULL;
+	char *block = NULL, *p, *end;
+	size_t bitmap, size, k;
+	long total = 0;
+	unsigned int r, c;
+	int64_t i, sec, usec;
+	double d;
+
+	if (fread(&magic, sizeof(magic), 1, in) != 1 || magic != MUACC_LOG_MAGIC
+		|| fread(&version, sizeof(version), 1, in) != 1 || version != MUACC_LOG_VERSION
+		|| fread(&n, sizeof(n), 1, in) != 1 || n == 0)
+		return -1;
+
+	if ((types = malloc(n * sizeof(int))) == NULL || (bits = malloc(n * sizeof(char *))) == NULL || (values = malloc(n * sizeof(char *))) == NULL)
+		goto error;
+
+	for (c = 0; c < n; c++)
+	{
+		if (fread(&type, 1, 1, in) != 1 || fread(&name_len, 1, 1, in) != 1 || fread(name, 1, name_len, in) != name_len)
+			goto error;
+		name[name_len] = 0;
+		types[c] = type;
+		if (names)
+			fprintf(out, "%s%s", (c > 0) ? "," : "", name);
+	}
+	if (names)
+		fprintf(out, "\n");
+
+	while ((k = fread(head, sizeof(uint32_t), 3, in)) == 3)
+	{
+		if (head[0] != MUACC_LOG_BLOCK_MAGIC || head[1] == 0)
+			goto error;
+		if ((p = realloc(block, head[2])) == NULL)
+			goto error;
+		block = p;
+		if (fread(block, 1, head[2], in) != head[2])
+			goto error;
+		p = block;
+		end = block + head[2];
+
+		// find the bitmap and the values of each column
+		bitmap = (head[1] + 7) / 8;
+		for (c = 0; c < n; c++)
+		{
+			if (end - p < (long) bitmap)
+				goto error;
+			bits[c] = (const unsigned char *) p;
+			p += bitmap;
+			values[c] = p;
+			for (r = 0; r < head[1]; r++)
+			{
+				if (!(bits[c][r / 8] & (1 << (r % 8))))
+					continue;
+				if (types[c] == MUACC_LOG_STRING)
+					size = (p < end) ? 1 + (unsigned char) *p : 1;
+				else if ((size = muacc_log_value_size(types[c], NULL)) == 0)
+					goto error;
+				if (end - p < (long) size)
+					goto error;
+				p += size;
+			}
+		}
+
+		for (r = 0; r < head[1]; r++)
+		{
+			for (c = 0; c < n; c++)
+			{
+				if (c > 0)
+					fputc(',', out);
+				if (!(bits[c][r / 8] & (1 << (r % 8))))
+				{
+					fprintf(out, "NA");
+					continue;
+				}
+				switch (types[c])
+				{
+					case MUACC_LOG_INT:
+						memcpy(&i, values[c], 8);
+						fprintf(out, "%" PRId64, i);
+						values[c] += 8;
+						break;
+					case MUACC_LOG_DOUBLE:
+						memcpy(&d, values[c], 8);
+						fprintf(out, "%f", d);
+						values[c] += 8;
+						break;
+					case MUACC_LOG_TIMEVAL:
+						memcpy(&sec, values[c], 8);
+						memcpy(&usec, values[c] + 8, 8);
+						fprintf(out, "%ld.%ld", (long) sec, (long) usec);
+						values[c] += 16;
+						break;
+					case MUACC_LOG_STRING:
+						fprintf(out, "%.*s", (int) (unsigned char) values[c][0], values[c] + 1);
+						values[c] += 1 + (unsigned char) values[c][0];
+						break;
+				}
+			}
+			fputc('\n', out);
+		}
+		total += head[1];
+	}
+
+	if (k != 0 || !feof(in))
+		goto error;
+
+	free(block);
+	free(values);
+	free(bits);
+	free(types);
+	return total;
+
+error:
+	free(block);
+	free(values);
+	free(bits);
+	free(types);
+	return -1;
+}
@@ -0,0 +1,124 @@
+/** \file  muacc_log.h
+ *  \brief Buffered logs of measurements and decisions
+ *
+ *  A log keeps its file open and collects what is logged in a buffer allocated
+ *  when it is opened. The buffer is written with one system call when it is full,
+ *  when the last write is MUACC_LOG_FLUSH_MS ago at the end of a row, and when the
+ *  log is flushed or closed - so up to that much is lost if the process dies.
+ *
+ *  Logs with columns get their rows value by value (_muacc_log_int, ...,
+ *  _muacc_log_row_end) and are written either as CSV or in a binary format:
+ *  after a header with the names and types of the columns, blocks of up to
+ *  MUACC_LOG_BLOCK_ROWS rows stored column by column, each column as a bitmap
+ *  of the rows that have a value followed by these values. _muacc_log_convert
+ *  turns it back into the CSV the log would have had (see mam-logcsv).
+ *
+ *  Logs without columns are CSV only and get their text through _muacc_log_printf.
+ *
+ *  Once a file has grown beyond the rotation size, it is renamed to filename.1
+ *  (and older ones to filename.2 ... filename.MUACC_LOG_KEEP) at the end of the
+ *  next row that is written, and a new one is started.
+ *
+ *  A log must only be used by one thread at a time.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#ifndef __MUACC_LOG_H__
+#define __MUACC_LOG_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/time.h>
+
+#define MUACC_LOG_CSV		0		/**< lines of comma separated values, NA for the missing ones */
+#define MUACC_LOG_BINARY	1		/**< blocks of rows stored column by column */
+
+#define MUACC_LOG_INT		1		/**< int64_t, in CSV as %" PRId64 " */
+#define MUACC_LOG_DOUBLE	2		/**< double, in CSV as %f */
+#define MUACC_LOG_STRING	3		/**< string of up to MUACC_LOG_STRING_MAX bytes, in CSV as it is */
+#define MUACC_LOG_TIMEVAL	4		/**< struct timeval, in CSV as %ld.%ld of seconds and microseconds */
+
+#define MUACC_LOG_MAGIC 0x6d6c6f67		/**< starts a binary log file */
+#define MUACC_LOG_BLOCK_MAGIC 0x6d626c6b	/**< starts a block of rows in a binary log file */
+#define MUACC_LOG_VERSION 1				/**< version of the binary format */
+#define MUACC_LOG_STRING_MAX 255		/**< longer strings are cut */
+
+#ifndef MUACC_LOG_BUFFER_SIZE
+#define MUACC_LOG_BUFFER_SIZE (64*1024)	/**< bytes collected before they are written */
+#endif
+
+#ifndef MUACC_LOG_BLOCK_ROWS
+#define MUACC_LOG_BLOCK_ROWS 256		/**< rows of a block of a binary log */
+#endif
+
+#ifndef MUACC_LOG_FLUSH_MS
+#define MUACC_LOG_FLUSH_MS 1000			/**< longest time rows wait in the buffer */
+#endif
+
+#ifndef MUACC_LOG_ROTATE_SIZE
+#define MUACC_LOG_ROTATE_SIZE (64*1024*1024)	/**< default size a log file is rotated at */
+#endif
+
+#ifndef MUACC_LOG_KEEP
+#define MUACC_LOG_KEEP 4				/**< rotated files kept */
+#endif
+
+/** Name and type (MUACC_LOG_INT, ...) of a column of a log */
+struct muacc_log_column {
+	const char *name;
+	int type;
+};
+
+typedef struct muacc_log muacc_log_t;
+
+/** open a log, appending to the file if it is there
+ *
+ *  A binary log file that was written with other columns is rotated away first.
+ *
+ * @param format       MUACC_LOG_CSV or MUACC_LOG_BINARY
+ * @param columns      columns of the rows, NULL for text through _muacc_log_printf (CSV only)
+ * @param rotate_size  size in bytes the file is rotated at, 0 to never rotate it
+ * @return the log, NULL if the file cannot be opened or out of memory
+ */
+muacc_log_t *_muacc_log_open(const char *filename, int format, const struct muacc_log_column *columns, unsigned int n_columns, size_t rotate_size);
+
+/** write what is buffered and close the log, log may be NULL */
+void _muacc_log_close(muacc_log_t *log);
+
+/** write what is buffered, a partial block of a binary log becomes a block of its own
+ *
+ * @return 0 on success, -1 if writing failed (the buffered data is dropped then)
+ */
+int _muacc_log_flush(muacc_log_t *log);
+
+/** add text to a log without columns, log may be NULL
+ *
+ * @return 0 on success, -1 if the log has columns or the text could not be added
+ */
+int _muacc_log_printf(muacc_log_t *log, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+/** add the value of the next column of the current row - a value of the wrong type is logged as NA, log may be NULL */
+void _muacc_log_int(muacc_log_t *log, int64_t value);
+void _muacc_log_double(muacc_log_t *log, double value);
+void _muacc_log_string(muacc_log_t *log, const char *value);
+void _muacc_log_timeval(muacc_log_t *log, const struct timeval *value);
+
+/** add NA as the value of the next column of the current row, log may be NULL */
+void _muacc_log_na(muacc_log_t *log);
+
+/** finish the current row, columns without a value are NA, log may be NULL
+ *
+ * @return 0 on success, -1 if writing failed
+ */
+int _muacc_log_row_end(muacc_log_t *log);
+
+/** turn a binary log back into CSV, optionally preceded by a line with the names of the columns
+ *
+ * @return number of rows converted, -1 if in is no binary log or ends within a block
+ */
+long _muacc_log_convert(FILE *in, FILE *out, int names);
+
+#endif /* __MUACC_LOG_H__ */
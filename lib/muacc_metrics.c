@@ -0,0 +1,93 @@
+/** \file muacc_metrics.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "muacc_metrics.h"
+
+#include "dlog.h"
+
+#ifndef MUACC_METRICS_NOISY_DEBUG0
+#define MUACC_METRICS_NOISY_DEBUG0 0
+#endif
+
+/** give up taking a snapshot after this many concurrent updates */
+#define MUACC_METRICS_SNAPSHOT_TRIES 100
+
+const struct muacc_metrics_shm *muacc_metrics_map(void)
+{
+	struct muacc_metrics_shm *shm;
+	int fd;
+
+	if ((fd = shm_open(MUACC_METRICS_SHM, O_RDONLY, 0)) < 0)
+	{
+		DLOG(MUACC_METRICS_NOISY_DEBUG0, "MAM does not publish measurements: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	shm = mmap(NULL, sizeof(struct muacc_metrics_shm), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+		return NULL;
+
+	if (shm->magic != MUACC_METRICS_MAGIC || shm->version != MUACC_METRICS_VERSION)
+	{
+		DLOG(MUACC_METRICS_NOISY_DEBUG0, "Measurements published in unknown layout %u\n", shm->version);
+		munmap(shm, sizeof(struct muacc_metrics_shm));
+		return NULL;
+	}
+
+	return shm;
+}
+
+void muacc_metrics_unmap(const struct muacc_metrics_shm *shm)
+{
+	if (shm != NULL)
+		munmap((void *) shm, sizeof(struct muacc_metrics_shm));
+}
+
+int muacc_metrics_snapshot(const struct muacc_metrics_shm *shm, struct muacc_metrics_shm *snap)
+{
+	uint32_t seq;
+	int i;
+
+	for (i = 0; i < MUACC_METRICS_SNAPSHOT_TRIES; i++)
+	{
+		if ((seq = __atomic_load_n(&(shm->seq), __ATOMIC_ACQUIRE)) & 1)
+			continue;
+
+		memcpy(snap, shm, sizeof(struct muacc_metrics_shm));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&(shm->seq), __ATOMIC_RELAXED) == seq)
+		{
+			/* the counts come from the other side - never trust them beyond the arrays */
+			if (snap->n_prefixes > MUACC_METRICS_MAX_PREFIXES)
+				snap->n_prefixes = MUACC_METRICS_MAX_PREFIXES;
+			if (snap->n_ifaces > MUACC_METRICS_MAX_IFACES)
+				snap->n_ifaces = MUACC_METRICS_MAX_IFACES;
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+void _muacc_metrics_write_begin(struct muacc_metrics_shm *shm)
+{
+	__atomic_store_n(&(shm->seq), shm->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void _muacc_metrics_write_end(struct muacc_metrics_shm *shm)
+{
+	__atomic_store_n(&(shm->seq), shm->seq + 1, __ATOMIC_RELEASE);
+}
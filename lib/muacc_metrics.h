@@ -0,0 +1,109 @@
+/** \file  muacc_metrics.h
+ *  \brief Read-only snapshot of the measurements of MAM in shared memory
+ *
+ *  MAM publishes the measurements of all prefixes and interfaces into a
+ *  shared memory segment of fixed-layout records after each measurement round.
+ *  Clients and monitoring tools can map it and take consistent snapshots
+ *  without talking to MAM at all.
+ *
+ *  The segment is protected by a sequence lock: the sequence number is odd
+ *  while MAM updates the records, so readers retry if it was odd or changed
+ *  while they copied them.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#ifndef __MUACC_METRICS_H__
+#define __MUACC_METRICS_H__
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef MUACC_METRICS_SHM
+#define MUACC_METRICS_SHM "/muacc_metrics"	/**< name of the POSIX shared memory segment */
+#endif
+
+#define MUACC_METRICS_MAGIC 0x6d6d6574		/**< marks an initialized segment */
+#define MUACC_METRICS_VERSION 2				/**< layout version, bumped on every incompatible change */
+
+#define MUACC_METRICS_MAX_PREFIXES 64		/**< prefixes beyond this are not published */
+#define MUACC_METRICS_MAX_IFACES 32			/**< interfaces beyond this are not published */
+#define MUACC_METRICS_IFNAMSIZ 16
+
+/** Flags telling which measurements of a record are valid */
+#define MUACC_METRICS_SRTT_MEAN			0x0001
+#define MUACC_METRICS_SRTT_MEDIAN		0x0002
+#define MUACC_METRICS_SRTT_MINIMUM		0x0004
+#define MUACC_METRICS_ERRORS			0x0008
+#define MUACC_METRICS_DOWNLOAD			0x0010
+#define MUACC_METRICS_UPLOAD			0x0020
+#define MUACC_METRICS_TIMESTAMP			0x0040
+#define MUACC_METRICS_SRTT_PERCENTILES	0x0080	/**< srtt_p10 and srtt_p90 */
+
+/** Measurements of a source prefix */
+struct muacc_metrics_prefix {
+	char					if_name[MUACC_METRICS_IFNAMSIZ];	/**< interface the prefix belongs to */
+	int32_t					family;				/**< address family */
+	uint32_t				flags;				/**< MUACC_METRICS_* of the valid fields */
+	struct sockaddr_storage	addr;				/**< first address of the prefix */
+	double					srtt_mean;			/**< mean smoothed RTT of its connections in ms */
+	double					srtt_median;		/**< median smoothed RTT in ms */
+	double					srtt_minimum;		/**< minimum smoothed RTT in ms */
+	double					srtt_p10;			/**< 10th percentile of the smoothed RTTs in ms */
+	double					srtt_p90;			/**< 90th percentile of the smoothed RTTs in ms */
+	uint64_t				rx_errors;
+	uint64_t				tx_errors;
+};
+
+/** Measurements of an interface */
+struct muacc_metrics_iface {
+	char					if_name[MUACC_METRICS_IFNAMSIZ];
+	uint32_t				flags;				/**< MUACC_METRICS_* of the valid fields */
+	double					download_rate;		/**< in bytes per second */
+	double					download_max_rate;
+	double					download_srate;		/**< smoothed download rate */
+	double					download_max_srate;
+	double					upload_rate;
+	double					upload_max_rate;
+	double					upload_srate;
+	double					upload_max_srate;
+	int64_t					timestamp_sec;		/**< time of the rate measurement */
+	int64_t					timestamp_usec;
+};
+
+/** Layout of the shared memory segment */
+struct muacc_metrics_shm {
+	uint32_t				magic;
+	uint32_t				version;			/**< MUACC_METRICS_VERSION of the layout */
+	uint32_t				seq;				/**< sequence lock, odd while an update is in progress */
+	uint32_t				n_prefixes;
+	uint32_t				n_ifaces;
+	int64_t					updated_sec;		/**< time of the last update */
+	int64_t					updated_usec;
+	struct muacc_metrics_prefix	prefixes[MUACC_METRICS_MAX_PREFIXES];
+	struct muacc_metrics_iface	ifaces[MUACC_METRICS_MAX_IFACES];
+};
+
+/** map the segment MAM publishes its measurements in, read-only
+ *
+ * @return the segment, NULL if MAM does not publish it or its layout differs
+ */
+const struct muacc_metrics_shm *muacc_metrics_map(void);
+
+/** unmap a segment returned by muacc_metrics_map */
+void muacc_metrics_unmap(const struct muacc_metrics_shm *shm);
+
+/** copy a consistent snapshot of all measurements
+ *
+ * @return 0 on success, -1 if MAM kept updating them while trying
+ */
+int muacc_metrics_snapshot(const struct muacc_metrics_shm *shm, struct muacc_metrics_shm *snap);
+
+/** start updating the segment - writer side */
+void _muacc_metrics_write_begin(struct muacc_metrics_shm *shm);
+
+/** finish updating the segment - writer side */
+void _muacc_metrics_write_end(struct muacc_metrics_shm *shm);
+
+#endif /* __MUACC_METRICS_H__ */
@@ -0,0 +1,219 @@
+/** \file muacc_ring.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "muacc_ring.h"
+
+#include "dlog.h"
+
+#ifndef MUACC_RING_NOISY_DEBUG0
+#define MUACC_RING_NOISY_DEBUG0 1
+#endif
+
+#ifndef MUACC_RING_NOISY_DEBUG1
+#define MUACC_RING_NOISY_DEBUG1 0
+#endif
+
+/** every message is preceded by its length */
+#define MUACC_RING_HDRLEN sizeof(uint32_t)
+
+/** length of one ring including its header */
+static size_t _muacc_ring_len(uint32_t size)
+{
+	return sizeof(struct muacc_ring) + size;
+}
+
+size_t _muacc_ring_shm_len(uint32_t size)
+{
+	if (size < 2 * MUACC_RING_HDRLEN || (size & (size - 1)) != 0)
+		return 0;
+
+	return 2 * _muacc_ring_len(size);
+}
+
+int _muacc_ring_shm_init(void *base, size_t len, uint32_t size, muacc_ring_ref_t *req, muacc_ring_ref_t *resp)
+{
+	struct muacc_ring *r[2];
+	int i;
+
+	if (_muacc_ring_shm_len(size) == 0 || len < _muacc_ring_shm_len(size))
+		return -1;
+
+	r[0] = (struct muacc_ring *) base;
+	r[1] = (struct muacc_ring *) ((char *) base + _muacc_ring_len(size));
+
+	for (i = 0; i < 2; i++)
+	{
+		memset(r[i], 0, sizeof(struct muacc_ring));
+		r[i]->size = size;
+		r[i]->magic = MUACC_RING_MAGIC;
+	}
+
+	/* the side consuming requests sleeps until the first one arrives */
+	r[0]->consumer_waiting = 1;
+
+	req->shm = r[0];
+	req->size = size;
+	resp->shm = r[1];
+	resp->size = size;
+	return 0;
+}
+
+int _muacc_ring_shm_attach(void *base, size_t len, muacc_ring_ref_t *req, muacc_ring_ref_t *resp)
+{
+	struct muacc_ring *r = (struct muacc_ring *) base;
+	struct muacc_ring *r2;
+	uint32_t size;
+
+	if (len < sizeof(struct muacc_ring) || r->magic != MUACC_RING_MAGIC)
+		return -1;
+
+	size = r->size;
+	if (_muacc_ring_shm_len(size) == 0 || len < _muacc_ring_shm_len(size))
+	{
+		DLOG(MUACC_RING_NOISY_DEBUG0, "WARNING: shared memory of %ld bytes does not hold rings of %u bytes\n", (long int) len, size);
+		return -1;
+	}
+
+	r2 = (struct muacc_ring *) ((char *) base + _muacc_ring_len(size));
+	if (r2->magic != MUACC_RING_MAGIC || r2->size != size)
+		return -1;
+
+	req->shm = r;
+	req->size = size;
+	resp->shm = r2;
+	resp->size = size;
+	return 0;
+}
+
+/** copy into the data area, wrapping around at its end */
+static void _muacc_ring_write(muacc_ring_ref_t *r, uint64_t at, const void *src, size_t len)
+{
+	size_t off = at & (r->size - 1);
+	size_t first = (len < r->size - off) ? len : r->size - off;
+
+	memcpy(r->shm->data + off, src, first);
+	memcpy(r->shm->data, (const char *) src + first, len - first);
+}
+
+/** copy out of the data area, wrapping around at its end */
+static void _muacc_ring_read(muacc_ring_ref_t *r, uint64_t at, void *dst, size_t len)
+{
+	size_t off = at & (r->size - 1);
+	size_t first = (len < r->size - off) ? len : r->size - off;
+
+	memcpy(dst, r->shm->data + off, first);
+	memcpy((char *) dst + first, r->shm->data, len - first);
+}
+
+/** bytes in use - the other side may have scribbled anything into the indices */
+static uint64_t _muacc_ring_used(muacc_ring_ref_t *r, int memorder)
+{
+	uint64_t head = __atomic_load_n(&(r->shm->head), memorder);
+	uint64_t tail = __atomic_load_n(&(r->shm->tail), memorder);
+
+	return head - tail;
+}
+
+size_t _muacc_ring_max_msg(const muacc_ring_ref_t *r)
+{
+	return r->size - MUACC_RING_HDRLEN;
+}
+
+int _muacc_ring_push(muacc_ring_ref_t *r, const void *msg, size_t len)
+{
+	uint64_t head = r->shm->head;
+	uint64_t used = _muacc_ring_used(r, __ATOMIC_ACQUIRE);
+	uint32_t hdr = len;
+
+	if (len > _muacc_ring_max_msg(r))
+		return -2;
+
+	if (used > r->size || r->size - used < len + MUACC_RING_HDRLEN)
+		return -1;
+
+	_muacc_ring_write(r, head, &hdr, MUACC_RING_HDRLEN);
+	_muacc_ring_write(r, head + MUACC_RING_HDRLEN, msg, len);
+
+	__atomic_store_n(&(r->shm->head), head + MUACC_RING_HDRLEN + len, __ATOMIC_RELEASE);
+	return 0;
+}
+
+ssize_t _muacc_ring_pop(muacc_ring_ref_t *r, void *buf, size_t buf_len)
+{
+	uint64_t tail = r->shm->tail;
+	uint64_t used = __atomic_load_n(&(r->shm->head), __ATOMIC_ACQUIRE) - tail;
+	uint32_t hdr;
+
+	if (used == 0)
+		return 0;
+
+	if (used > r->size || used < MUACC_RING_HDRLEN)
+	{
+		DLOG(MUACC_RING_NOISY_DEBUG0, "WARNING: ring is corrupt - %llu bytes used\n", (unsigned long long) used);
+		return -1;
+	}
+
+	_muacc_ring_read(r, tail, &hdr, MUACC_RING_HDRLEN);
+	if (hdr > used - MUACC_RING_HDRLEN || hdr > buf_len)
+	{
+		DLOG(MUACC_RING_NOISY_DEBUG0, "WARNING: message of %u bytes does not fit\n", hdr);
+		return -1;
+	}
+
+	_muacc_ring_read(r, tail + MUACC_RING_HDRLEN, buf, hdr);
+
+	__atomic_store_n(&(r->shm->tail), tail + MUACC_RING_HDRLEN + hdr, __ATOMIC_RELEASE);
+	DLOG(MUACC_RING_NOISY_DEBUG1, "popped message of %u bytes\n", hdr);
+	return hdr;
+}
+
+int _muacc_ring_empty(muacc_ring_ref_t *r)
+{
+	return _muacc_ring_used(r, __ATOMIC_ACQUIRE) == 0;
+}
+
+int _muacc_ring_consumer_sleep(muacc_ring_ref_t *r)
+{
+	__atomic_store_n(&(r->shm->consumer_waiting), 1, __ATOMIC_SEQ_CST);
+
+	if (_muacc_ring_used(r, __ATOMIC_SEQ_CST) != 0)
+	{
+		__atomic_store_n(&(r->shm->consumer_waiting), 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+int _muacc_ring_producer_sleep(muacc_ring_ref_t *r, size_t len)
+{
+	uint64_t used;
+
+	__atomic_store_n(&(r->shm->producer_waiting), 1, __ATOMIC_SEQ_CST);
+
+	used = _muacc_ring_used(r, __ATOMIC_SEQ_CST);
+	if (used <= r->size && r->size - used >= len + MUACC_RING_HDRLEN)
+	{
+		__atomic_store_n(&(r->shm->producer_waiting), 0, __ATOMIC_SEQ_CST);
+		return 0;
+	}
+	return 1;
+}
+
+int _muacc_ring_wake_consumer(muacc_ring_ref_t *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_exchange_n(&(r->shm->consumer_waiting), 0, __ATOMIC_SEQ_CST) != 0;
+}
+
+int _muacc_ring_wake_producer(muacc_ring_ref_t *r)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_exchange_n(&(r->shm->producer_waiting), 0, __ATOMIC_SEQ_CST) != 0;
+}
@@ -0,0 +1,116 @@
+/** \file  muacc_ring.h
+ *  \brief Single-producer single-consumer message rings in shared memory
+ *
+ *  Used as an alternative transport between the client library and MAM.
+ *  A shared memory region holds two rings - one for requests and one for
+ *  responses. Each ring carries whole messages (the same TLV messages that are
+ *  sent over the MAM socket), so both sides can hand them to their usual parsers.
+ *
+ *  The rings themselves never block. A side that runs out of work announces it
+ *  is going to sleep, so the other side knows it has to wake it up (e.g. using
+ *  an eventfd) - as long as it is busy, no system calls are needed at all.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#ifndef __MUACC_RING_H__
+#define __MUACC_RING_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define MUACC_RING_MAGIC 0x6d726e67		/**< marks an initialized ring */
+#define MUACC_RING_SIZE (64*1024)		/**< default size of the data area of a ring, a power of two */
+
+/** Ring as it is laid out in the shared memory
+ *
+ *  Messages are stored as 32 bit length followed by the message, wrapping around
+ *  at the end of the data area. head and tail count bytes ever written / read.
+ */
+struct muacc_ring
+{
+	uint32_t magic;
+	uint32_t size;						/**< size of data, a power of two */
+	uint32_t consumer_waiting;			/**< consumer is going to sleep - wake it up after pushing */
+	uint32_t producer_waiting;			/**< producer found the ring full - wake it up after popping */
+	uint64_t head __attribute__((aligned(64)));	/**< written by the producer only */
+	uint64_t tail __attribute__((aligned(64)));	/**< written by the consumer only */
+	char data[] __attribute__((aligned(64)));
+};
+
+/** Local handle of a ring
+ *
+ *  The size is kept outside of the shared memory, so the other side
+ *  cannot make us read or write beyond the region by changing it.
+ */
+typedef struct muacc_ring_ref
+{
+	struct muacc_ring *shm;
+	uint32_t size;
+} muacc_ring_ref_t;
+
+/** length of a shared memory region holding a request and a response ring
+ *
+ * @return length in bytes, 0 if size is no power of two
+ */
+size_t _muacc_ring_shm_len(uint32_t size);
+
+/** initialize both rings in a shared memory region and get handles for them
+ *
+ * @return 0 on success, -1 if len does not fit
+ */
+int _muacc_ring_shm_init(void *base, size_t len, uint32_t size, muacc_ring_ref_t *req, muacc_ring_ref_t *resp);
+
+/** find and check both rings in a shared memory region initialized by the other side
+ *
+ * @return 0 on success, -1 if the region does not hold valid rings
+ */
+int _muacc_ring_shm_attach(void *base, size_t len, muacc_ring_ref_t *req, muacc_ring_ref_t *resp);
+
+/** largest message that can ever fit the ring */
+size_t _muacc_ring_max_msg(const muacc_ring_ref_t *r);
+
+/** add a message to the ring - producer side
+ *
+ * @return 0 on success, -1 if there is no space right now, -2 if the message can never fit
+ */
+int _muacc_ring_push(muacc_ring_ref_t *r, const void *msg, size_t len);
+
+/** take the next message off the ring - consumer side
+ *
+ * @return length of the message, 0 if the ring is empty, -1 if the ring is corrupt or buf too small
+ */
+ssize_t _muacc_ring_pop(muacc_ring_ref_t *r, void *buf, size_t buf_len);
+
+/** check whether there is a message to pop - consumer side
+ *
+ * @return 1 if the ring is empty, 0 otherwise
+ */
+int _muacc_ring_empty(muacc_ring_ref_t *r);
+
+/** tell the producer we are going to sleep because the ring is empty - consumer side
+ *
+ * @return 1 if the ring is still empty, 0 if a message arrived meanwhile (do not sleep then)
+ */
+int _muacc_ring_consumer_sleep(muacc_ring_ref_t *r);
+
+/** tell the consumer we wait for space because the ring is full - producer side
+ *
+ * @return 1 if there is still no space for len bytes, 0 if there is now (do not sleep then)
+ */
+int _muacc_ring_producer_sleep(muacc_ring_ref_t *r, size_t len);
+
+/** check whether the consumer has to be woken up after a push - producer side
+ *
+ * @return 1 if it went to sleep, 0 otherwise
+ */
+int _muacc_ring_wake_consumer(muacc_ring_ref_t *r);
+
+/** check whether the producer has to be woken up after a pop - consumer side
+ *
+ * @return 1 if it waits for space, 0 otherwise
+ */
+int _muacc_ring_wake_producer(muacc_ring_ref_t *r);
+
+#endif /* __MUACC_RING_H__ */
@@ -15,6 +15,7 @@
 
 #include "muacc_tlv.h"
 #include "muacc_util.h"
+#include "muacc_arena.h"
 
 #include "dlog.h"
 
@@ -79,6 +80,55 @@ ssize_t _muacc_push_tlv( char *buf, ssize_t *buf_pos, ssize_t buf_len,
 }
 
 
+ssize_t _muacc_push_tlv_tag_v( char *buf, ssize_t *buf_pos, ssize_t buf_len,
+	int version, muacc_tlv_t tag)
+{
+	return _muacc_push_tlv_v(buf, buf_pos, buf_len, version, tag, NULL, 0);
+}
+
+ssize_t _muacc_push_tlv_v( char *buf, ssize_t *buf_pos, ssize_t buf_len,
+	int version, muacc_tlv_t tag,
+	const void *data, ssize_t data_len)
+{
+	ssize_t tlv_len;
+
+	if (version < MUACC_PROTOCOL_V2)
+		return _muacc_push_tlv(buf, buf_pos, buf_len, tag, data, data_len);
+
+	tlv_len = 1 + _muacc_push_varint(NULL, NULL, 0, data_len) + data_len;
+
+	/* check size */
+	if (buf == NULL)
+	{
+		return(tlv_len);
+	}
+	else if ( *buf_pos + tlv_len >= buf_len)
+	{
+		DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: buffer too small: buf_len=%li, pos=%li needed=%li\n", (long) buf_len, (long) *buf_pos, (long) tlv_len);
+		return(-1);
+	}
+
+	buf[(*buf_pos)++] = (char) tag;
+	_muacc_push_varint(buf, buf_pos, buf_len, data_len);
+
+	if(data == NULL && data_len != 0)
+	{
+		DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: trying to push NULL to a non zero length TLV\n");
+		memset(buf + *buf_pos, 0, data_len);
+		*buf_pos += data_len;
+	}
+	else if(data_len != 0)
+	{
+		memcpy( (void *) (buf + *buf_pos), data,  data_len);
+		*buf_pos += data_len;
+	}
+
+	DLOG(MUACC_TLV_NOISY_DEBUG2, "put compact tlv: buf_pos=%ld tag=%x data_len=%ld tlv_len=%ld \n", (long int) *buf_pos, tag, (long int) data_len, (long int) tlv_len);
+
+	return(tlv_len);
+}
+
+
 ssize_t _muacc_push_addrinfo_tlv( char *buf, ssize_t *buf_pos, ssize_t buf_len,
 	muacc_tlv_t tag, const struct addrinfo *ai0)
 {
@@ -100,9 +150,10 @@ ssize_t _muacc_push_addrinfo_tlv( char *buf, ssize_t *buf_pos, ssize_t buf_len,
 		ssize_t i = 0;
 
 		i += sizeof(struct addrinfo);
-		i += ai->ai_addrlen;
+		if(ai->ai_addr != NULL)
+			i += ai->ai_addrlen;
 		if(ai->ai_canonname != NULL)
-			i += strlen(ai->ai_canonname);
+			i += sizeof(ssize_t) + strlen(ai->ai_canonname) + 1;
 
 		DLOG(MUACC_TLV_NOISY_DEBUG2, "calculated  length of  addrinfo at %p is %ld\n", (void *) ai, (long) i);
 		data_len += i;
@@ -226,108 +277,128 @@ ssize_t _muacc_push_socketopt_tlv( char *buf, ssize_t *buf_pos, ssize_t buf_len,
 
 ssize_t _muacc_extract_addrinfo_tlv( const char *data, ssize_t data_len, struct addrinfo **ai0)
 {
-	struct addrinfo **ai1 = ai0;
-
-	ssize_t data_pos = 0;
+	ssize_t data_pos;
+	struct addrinfo tmp;
 	struct addrinfo *ai;
 
-	ssize_t allocated = 0;
+	size_t n = 0;
+	size_t flat_len = 0;
+	char *flat = NULL;
+	int pass;
 
 	DLOG(MUACC_TLV_NOISY_DEBUG1, "invoked data_len=%ld\n", (long) data_len);
 
-	do
-	{
-
-        /* sentinels for error handling */
-        ai = NULL;
-        *ai1 = NULL;
-
-		/* check length */
-		if (data_len-data_pos < sizeof(struct addrinfo))
-		{
-			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
-			goto muacc_extract_addrinfo_tlv_failed;
-		}
-
-		/* get memory and copy struct */
-		if( (ai = malloc(sizeof(struct addrinfo))) == NULL )
-			goto muacc_extract_addrinfo_tlv_failed;
-		allocated += sizeof(struct addrinfo);
-		memcpy( ai, (void *) (data + data_pos),sizeof(struct addrinfo));
-		data_pos += sizeof(struct addrinfo);
+	*ai0 = NULL;
 
-		DLOG(MUACC_TLV_NOISY_DEBUG2, "copied addrinfo to %p\n", (void *) ai);
+	/* walk the list twice - check and size it first, then copy it into a single allocation */
+	for (pass = 0; pass < 2; pass++)
+	{
+		data_pos = 0;
+		ai = *ai0;
 
-		/* addrinfo */
-		if ( ai->ai_addr != NULL)
+		do
 		{
-			ai->ai_addr = NULL;
-
-			/* check length again */
-			if (data_len-data_pos < ai->ai_addrlen)
+			/* check length */
+			if (data_len-data_pos < sizeof(struct addrinfo))
 			{
-				DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short while extracting ai_addr - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
-				ai->ai_canonname = NULL;
+				DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
 				goto muacc_extract_addrinfo_tlv_failed;
 			}
-			/* get memory and copy struct */
-			if( (ai->ai_addr = malloc(ai->ai_addrlen)) == NULL )
-				goto muacc_extract_addrinfo_tlv_failed;
-			allocated += ai->ai_addrlen;
-			memcpy( ai->ai_addr,  (void *) (data + data_pos), ai->ai_addrlen);
-			data_pos += ai->ai_addrlen;
-
-			DLOG(MUACC_TLV_NOISY_DEBUG2, "copied addrinfo ai_addr to %p\n", (void *) ai->ai_addr);
 
-		}
-
-		/* ai_canonname */
-		if ( ai->ai_canonname != NULL)
-		{
-			ai->ai_canonname = NULL;
+			/* copy struct - its pointers only tell which parts follow */
+			memcpy( &tmp, (void *) (data + data_pos), sizeof(struct addrinfo));
+			data_pos += sizeof(struct addrinfo);
 
-			/* check length again */
-			if (data_len-data_pos < sizeof(ssize_t))
+			if (pass == 0)
 			{
-				DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short while extracting ai_canonname_len - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
-				goto muacc_extract_addrinfo_tlv_failed;
+				n++;
+			}
+			else
+			{
+				ai->ai_flags = tmp.ai_flags;
+				ai->ai_family = tmp.ai_family;
+				ai->ai_socktype = tmp.ai_socktype;
+				ai->ai_protocol = tmp.ai_protocol;
+				ai->ai_addrlen = tmp.ai_addrlen;
 			}
-			/* get string length + trailing\0 */
-			ssize_t canonname_len = *((ssize_t *) (data + data_pos));
-			data_pos += sizeof(ssize_t);
 
-			/* check length again */
-			if (data_len-data_pos < canonname_len)
+			/* addrinfo */
+			if ( tmp.ai_addr != NULL)
 			{
-				DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING data_len too short while extracting ai_canonname - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
-				goto muacc_extract_addrinfo_tlv_failed;
+				/* check length again */
+				if (data_len-data_pos < tmp.ai_addrlen)
+				{
+					DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short while extracting ai_addr - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
+					goto muacc_extract_addrinfo_tlv_failed;
+				}
+
+				if (pass == 0)
+				{
+					flat_len += MUACC_FLAT_AI_ALIGN(tmp.ai_addrlen);
+				}
+				else
+				{
+					ai->ai_addr = (struct sockaddr *) flat;
+					memcpy( flat, (void *) (data + data_pos), tmp.ai_addrlen);
+					flat += MUACC_FLAT_AI_ALIGN(tmp.ai_addrlen);
+					DLOG(MUACC_TLV_NOISY_DEBUG2, "copied addrinfo ai_addr to %p\n", (void *) ai->ai_addr);
+				}
+				data_pos += tmp.ai_addrlen;
 			}
-			if( (ai->ai_canonname = malloc(canonname_len)) == NULL )
-				goto muacc_extract_addrinfo_tlv_failed;
-			allocated += canonname_len;
-			memcpy( ai->ai_canonname, (void *) (data + data_pos), canonname_len);
-			*((ai->ai_canonname)+canonname_len-1) = 0x00;
-			data_pos += canonname_len;
 
-			DLOG(MUACC_TLV_NOISY_DEBUG2, "copied addrinfo ai_canonname to %p (%s)\n", (void *) ai->ai_canonname, ai->ai_canonname);
+			/* ai_canonname */
+			if ( tmp.ai_canonname != NULL)
+			{
+				/* check length again */
+				if (data_len-data_pos < sizeof(ssize_t))
+				{
+					DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: data_len too short while extracting ai_canonname_len - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
+					goto muacc_extract_addrinfo_tlv_failed;
+				}
+				/* get string length + trailing\0 */
+				ssize_t canonname_len;
+				memcpy(&canonname_len, data + data_pos, sizeof(ssize_t));
+				data_pos += sizeof(ssize_t);
+
+				/* check length again */
+				if (canonname_len < 1 || data_len-data_pos < canonname_len)
+				{
+					DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING data_len too short while extracting ai_canonname - data_pos=%ld data_len=%ld sizeof(struct addrinfo)=%ld\n", (long int) data_pos, (long int) data_len, (long int) sizeof(struct addrinfo));
+					goto muacc_extract_addrinfo_tlv_failed;
+				}
+
+				if (pass == 0)
+				{
+					flat_len += MUACC_FLAT_AI_ALIGN(canonname_len);
+				}
+				else
+				{
+					ai->ai_canonname = flat;
+					memcpy( flat, (void *) (data + data_pos), canonname_len);
+					flat[canonname_len-1] = 0x00;
+					flat += MUACC_FLAT_AI_ALIGN(canonname_len);
+					DLOG(MUACC_TLV_NOISY_DEBUG2, "copied addrinfo ai_canonname to %p (%s)\n", (void *) ai->ai_canonname, ai->ai_canonname);
+				}
+				data_pos += canonname_len;
+			}
 
-		}
+			if (pass == 1)
+				ai = ai->ai_next;
 
-		/* fix pointers */
-		*ai1 = ai;
-		ai1 = &(ai->ai_next);
+		} while (tmp.ai_next != NULL);
 
-	} while (ai->ai_next != NULL);
+		if (pass == 0 && (*ai0 = _muacc_alloc_flat_addrinfo(n, flat_len, &flat)) == NULL)
+			goto muacc_extract_addrinfo_tlv_failed;
+	}
 
-	DLOG(MUACC_TLV_NOISY_DEBUG1, "done - %ld bytes allocated\n", (long) allocated);
+	DLOG(MUACC_TLV_NOISY_DEBUG1, "done - %ld addrinfos in %ld bytes\n", (long) n, (long) (n * sizeof(struct addrinfo) + flat_len));
 
-    return allocated;
+	return n * sizeof(struct addrinfo) + flat_len;
 
-    muacc_extract_addrinfo_tlv_failed:
-    if (*ai0 != NULL) freeaddrinfo(*ai0); /* cleanup chain already parsed */
-    if (*ai0 != ai && ai != NULL) freeaddrinfo(ai); /* cleanup entry that failed to parse (missing in chain) */
-    *ai0 = NULL;
-    return -1;
+	muacc_extract_addrinfo_tlv_failed:
+	_muacc_free_addrinfo(*ai0);
+	*ai0 = NULL;
+	return -1;
 
 }
 
@@ -343,7 +414,7 @@ ssize_t _muacc_extract_socketaddr_tlv( const char *data, ssize_t data_len, struc
 	}
 
 	/* get memory and copy struct */
-	if( (*sa0 = malloc(data_len)) == NULL )
+	if( (*sa0 = _muacc_alloc(data_len)) == NULL )
 		goto muacc_extract_socketaddr_tlv_malloc_failed;
 	memcpy( *sa0, (void *) data ,data_len);
 
@@ -380,7 +451,7 @@ ssize_t _muacc_extract_socketopt_tlv( const char *data, ssize_t data_len, struct
 		}
 
 		/* get memory and copy struct */
-		if( (so = malloc(sizeof(struct socketopt))) == NULL )
+		if( (so = _muacc_alloc(sizeof(struct socketopt))) == NULL )
 			goto _muacc_extract_socketopt_tlv_malloc_failed;
 		allocated += sizeof(struct socketopt);
 		memcpy( so, (void *) (data + data_pos),sizeof(struct socketopt));
@@ -398,7 +469,7 @@ ssize_t _muacc_extract_socketopt_tlv( const char *data, ssize_t data_len, struct
 				goto _muacc_extract_socketopt_tlv_parse_failed;
 			}
 
-			if( (so->optval = malloc(so->optlen)) == NULL )
+			if( (so->optval = _muacc_alloc(so->optlen)) == NULL )
 				goto _muacc_extract_socketopt_tlv_parse_failed;
 
 			memcpy(so->optval, (void *) (data + data_pos), so->optlen );
@@ -514,3 +585,594 @@ muacc_read_tlv_err:
 	return(-1);
 
 }
+
+/** find the end of the first message in a buffer
+ *
+ * @return length of the message, 0 if it is incomplete, -1 if the buffer holds garbage
+ */
+static ssize_t _muacc_scan_msg(const char *buf, ssize_t buf_len, int version)
+{
+	ssize_t pos = 0;
+	ssize_t vpos;
+	muacc_tlv_t tag;
+	ssize_t len;
+	uint64_t vlen;
+
+	while (pos < buf_len)
+	{
+		if (version < MUACC_PROTOCOL_V2)
+		{
+			if (buf_len - pos < (ssize_t) (sizeof(muacc_tlv_t) + sizeof(ssize_t)))
+				return(0);
+			memcpy(&tag, buf + pos, sizeof(muacc_tlv_t));
+			memcpy(&len, buf + pos + sizeof(muacc_tlv_t), sizeof(ssize_t));
+			pos += sizeof(muacc_tlv_t) + sizeof(ssize_t);
+		}
+		else
+		{
+			tag = (unsigned char) buf[pos++];
+			vpos = pos;
+			if (_muacc_get_varint(buf, &pos, buf_len, &vlen) < 0)
+				return((buf_len - vpos >= 10) ? -1 : 0);
+			len = vlen;
+		}
+
+		if (len < 0 || len > MUACC_TLV_MAXLEN)
+			return(-1);
+		if (buf_len - pos < len)
+			return(0);
+		pos += len;
+
+		if (tag == eof)
+			return(pos);
+	}
+
+	return(0);
+}
+
+ssize_t _muacc_take_msg(muacc_readbuf_t *rb, int version, char **msg)
+{
+	ssize_t len;
+
+	if ((len = _muacc_scan_msg(rb->buf + rb->start, rb->end - rb->start, version)) <= 0)
+		return(len);
+
+	*msg = rb->buf + rb->start;
+	rb->start += len;
+	return(len);
+}
+
+ssize_t _muacc_read_msg(int fd, muacc_readbuf_t *rb, int version, char **msg)
+{
+	ssize_t len;
+
+	for (;;)
+	{
+		if ((len = _muacc_take_msg(rb, version, msg)) > 0)
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG1, "read message of %ld bytes\n", (long int) len);
+			return(len);
+		}
+		else if (len < 0)
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: reading message failed: malformed TLV\n");
+			return(-1);
+		}
+
+		/* move the beginning of the message to the front to make room for the rest */
+		if (rb->start > 0)
+		{
+			memmove(rb->buf, rb->buf + rb->start, rb->end - rb->start);
+			rb->end -= rb->start;
+			rb->start = 0;
+		}
+		if (rb->end == sizeof(rb->buf))
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: reading message failed: buffer too small\n");
+			return(-1);
+		}
+
+		len = recv(fd, rb->buf + rb->end, sizeof(rb->buf) - rb->end, 0);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0)
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "ERROR: read failed: %s \n", (len == 0) ? "connection closed" : strerror(errno));
+			return(-1);
+		}
+		rb->end += len;
+	}
+}
+
+ssize_t _muacc_next_tlv(const char *buf, ssize_t *buf_pos, ssize_t buf_len,
+	int version, muacc_tlv_t *tag,
+	void **data, ssize_t *data_len)
+{
+	ssize_t hdr_len = sizeof(muacc_tlv_t) + sizeof(ssize_t);
+	ssize_t pos = *buf_pos;
+	uint64_t len;
+
+	if (version < MUACC_PROTOCOL_V2)
+	{
+		if ( *buf_pos + hdr_len > buf_len )
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: message ends within TLV header\n");
+			goto muacc_next_tlv_err;
+		}
+
+		*tag = *((muacc_tlv_t *) (buf + *buf_pos));
+		*data_len = *((ssize_t *) (buf + *buf_pos + sizeof(muacc_tlv_t)));
+	}
+	else
+	{
+		if ( pos + 1 > buf_len )
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: message ends within TLV header\n");
+			goto muacc_next_tlv_err;
+		}
+
+		*tag = (unsigned char) buf[pos++];
+		if ( 0 > _muacc_get_varint(buf, &pos, buf_len, &len) || (ssize_t) len < 0 )
+		{
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: message ends within TLV header\n");
+			goto muacc_next_tlv_err;
+		}
+		*data_len = len;
+		hdr_len = pos - *buf_pos;
+	}
+
+	if ( *data_len < 0 || *buf_pos + hdr_len + *data_len > buf_len )
+	{
+		DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: message ends within TLV data\n");
+		goto muacc_next_tlv_err;
+	}
+
+	*data = (*data_len > 0) ? (void *) (buf + *buf_pos + hdr_len) : NULL;
+	*buf_pos += hdr_len + *data_len;
+
+	return(hdr_len + *data_len);
+
+muacc_next_tlv_err:
+
+	*data = NULL;
+	*data_len = -1;
+	return(-1);
+}
+
+ssize_t _muacc_push_varint(char *buf, ssize_t *buf_pos, ssize_t buf_len, uint64_t val)
+{
+	ssize_t n = 1;
+	uint64_t v;
+
+	for (v = val; v >= 0x80; v >>= 7)
+		n++;
+
+	if (buf == NULL)
+		return(n);
+	else if (*buf_pos + n > buf_len)
+		return(-1);
+
+	for (v = val; v >= 0x80; v >>= 7)
+		buf[(*buf_pos)++] = (char) ((v & 0x7f) | 0x80);
+	buf[(*buf_pos)++] = (char) v;
+
+	return(n);
+}
+
+ssize_t _muacc_get_varint(const char *buf, ssize_t *buf_pos, ssize_t buf_len, uint64_t *val)
+{
+	ssize_t pos = *buf_pos;
+	unsigned int shift = 0;
+	unsigned char c;
+
+	*val = 0;
+	do
+	{
+		if (pos >= buf_len || shift > 63)
+			return(-1);
+		c = (unsigned char) buf[pos++];
+		*val |= ((uint64_t) (c & 0x7f)) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	shift = pos - *buf_pos;
+	*buf_pos = pos;
+	return(shift);
+}
+
+/** Address formats of a packed socket address */
+#define MUACC_PACKED_SA_RAW   0	/**< varint length and the struct as it is */
+#define MUACC_PACKED_SA_INET  4	/**< port and IPv4 address */
+#define MUACC_PACKED_SA_INET6 6	/**< port, IPv6 address, flowinfo and scope id */
+
+ssize_t _muacc_push_packed_sockaddr(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct sockaddr *sa, socklen_t sa_len)
+{
+	ssize_t pos0 = *buf_pos;
+
+	if (sa->sa_family == AF_INET && sa_len == sizeof(struct sockaddr_in))
+	{
+		const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+
+		if (*buf_pos + 1 + 2 + 4 > buf_len)
+			return(-1);
+		buf[(*buf_pos)++] = MUACC_PACKED_SA_INET;
+		memcpy(buf + *buf_pos, &sin->sin_port, 2);
+		memcpy(buf + *buf_pos + 2, &sin->sin_addr, 4);
+		*buf_pos += 2 + 4;
+	}
+	else if (sa->sa_family == AF_INET6 && sa_len == sizeof(struct sockaddr_in6))
+	{
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+
+		if (*buf_pos + 1 + 2 + 16 > buf_len)
+			return(-1);
+		buf[(*buf_pos)++] = MUACC_PACKED_SA_INET6;
+		memcpy(buf + *buf_pos, &sin6->sin6_port, 2);
+		memcpy(buf + *buf_pos + 2, &sin6->sin6_addr, 16);
+		*buf_pos += 2 + 16;
+		if (0 > _muacc_push_varint(buf, buf_pos, buf_len, sin6->sin6_flowinfo) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, sin6->sin6_scope_id) )
+			goto muacc_push_packed_sockaddr_err;
+	}
+	else
+	{
+		if (*buf_pos + 1 > buf_len)
+			return(-1);
+		buf[(*buf_pos)++] = MUACC_PACKED_SA_RAW;
+		if (0 > _muacc_push_varint(buf, buf_pos, buf_len, sa_len) ||
+			*buf_pos + sa_len > buf_len)
+			goto muacc_push_packed_sockaddr_err;
+		memcpy(buf + *buf_pos, sa, sa_len);
+		*buf_pos += sa_len;
+	}
+
+	return(*buf_pos - pos0);
+
+muacc_push_packed_sockaddr_err:
+	*buf_pos = pos0;
+	return(-1);
+}
+
+/** decode a socket address in compact form into ss */
+static ssize_t _muacc_decode_packed_sockaddr(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct sockaddr_storage *ss, socklen_t *sa_len)
+{
+	ssize_t pos = *buf_pos;
+	uint64_t v1, v2;
+
+	if (pos + 1 > buf_len)
+		return(-1);
+
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	switch (buf[pos++])
+	{
+		case MUACC_PACKED_SA_INET:
+		{
+			struct sockaddr_in *sin = (struct sockaddr_in *) ss;
+
+			if (pos + 2 + 4 > buf_len)
+				return(-1);
+			sin->sin_family = AF_INET;
+			#ifdef HAVE_SOCKADDR_LEN
+			sin->sin_len = sizeof(struct sockaddr_in);
+			#endif
+			memcpy(&sin->sin_port, buf + pos, 2);
+			memcpy(&sin->sin_addr, buf + pos + 2, 4);
+			pos += 2 + 4;
+			*sa_len = sizeof(struct sockaddr_in);
+			break;
+		}
+		case MUACC_PACKED_SA_INET6:
+		{
+			struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+
+			if (pos + 2 + 16 > buf_len)
+				return(-1);
+			pos += 2 + 16;
+			if (0 > _muacc_get_varint(buf, &pos, buf_len, &v1) || 0 > _muacc_get_varint(buf, &pos, buf_len, &v2))
+				return(-1);
+			sin6->sin6_family = AF_INET6;
+			#ifdef HAVE_SOCKADDR_LEN
+			sin6->sin6_len = sizeof(struct sockaddr_in6);
+			#endif
+			memcpy(&sin6->sin6_port, buf + *buf_pos + 1, 2);
+			memcpy(&sin6->sin6_addr, buf + *buf_pos + 1 + 2, 16);
+			sin6->sin6_flowinfo = v1;
+			sin6->sin6_scope_id = v2;
+			*sa_len = sizeof(struct sockaddr_in6);
+			break;
+		}
+		case MUACC_PACKED_SA_RAW:
+			if (0 > _muacc_get_varint(buf, &pos, buf_len, &v1) || v1 < sizeof(struct sockaddr) ||
+				v1 > sizeof(struct sockaddr_storage) || pos + (ssize_t) v1 > buf_len)
+				return(-1);
+			memcpy(ss, buf + pos, v1);
+			pos += v1;
+			*sa_len = v1;
+			break;
+		default:
+			DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: unknown packed address format %d\n", buf[pos - 1]);
+			return(-1);
+	}
+
+	v1 = pos - *buf_pos;
+	*buf_pos = pos;
+	return(v1);
+}
+
+ssize_t _muacc_get_packed_sockaddr(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct sockaddr **sa, socklen_t *sa_len)
+{
+	struct sockaddr_storage ss;
+	ssize_t pos = *buf_pos;
+	ssize_t ret;
+
+	*sa = NULL;
+	if (0 > (ret = _muacc_decode_packed_sockaddr(buf, &pos, buf_len, &ss, sa_len)) ||
+		(*sa = _muacc_clone_sockaddr((struct sockaddr *) &ss, *sa_len)) == NULL)
+		return(-1);
+
+	*buf_pos = pos;
+	return(ret);
+}
+
+ssize_t _muacc_push_packed_string(char *buf, ssize_t *buf_pos, ssize_t buf_len, const char *str)
+{
+	ssize_t pos0 = *buf_pos;
+	size_t sl = strlen(str);
+
+	if (0 > _muacc_push_varint(buf, buf_pos, buf_len, sl) || *buf_pos + (ssize_t) sl > buf_len)
+	{
+		*buf_pos = pos0;
+		return(-1);
+	}
+	memcpy(buf + *buf_pos, str, sl);
+	*buf_pos += sl;
+
+	return(*buf_pos - pos0);
+}
+
+ssize_t _muacc_get_packed_string(const char *buf, ssize_t *buf_pos, ssize_t buf_len, char **str)
+{
+	ssize_t pos = *buf_pos;
+	uint64_t sl;
+
+	*str = NULL;
+	if (0 > _muacc_get_varint(buf, &pos, buf_len, &sl) || sl > (uint64_t) (buf_len - pos) ||
+		(*str = _muacc_alloc(sl + 1)) == NULL)
+		return(-1);
+	memcpy(*str, buf + pos, sl);
+	(*str)[sl] = 0x00;
+	pos += sl;
+
+	sl = pos - *buf_pos;
+	*buf_pos = pos;
+	return(sl);
+}
+
+/** Optional parts of an entry of a packed addrinfo list */
+#define MUACC_PACKED_AI_ADDR      0x01
+#define MUACC_PACKED_AI_CANONNAME 0x02
+
+ssize_t _muacc_push_packed_addrinfo(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct addrinfo *ai0)
+{
+	const struct addrinfo *ai;
+	ssize_t pos0 = *buf_pos;
+	uint64_t n = 0;
+
+	for (ai = ai0; ai != NULL; ai = ai->ai_next)
+		n++;
+	if (0 > _muacc_push_varint(buf, buf_pos, buf_len, n))
+		goto muacc_push_packed_addrinfo_err;
+
+	for (ai = ai0; ai != NULL; ai = ai->ai_next)
+	{
+		if (0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(ai->ai_flags)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(ai->ai_family)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(ai->ai_socktype)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(ai->ai_protocol)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len,
+				((ai->ai_addr != NULL) ? MUACC_PACKED_AI_ADDR : 0) | ((ai->ai_canonname != NULL) ? MUACC_PACKED_AI_CANONNAME : 0)) )
+			goto muacc_push_packed_addrinfo_err;
+
+		if (ai->ai_addr != NULL && 0 > _muacc_push_packed_sockaddr(buf, buf_pos, buf_len, ai->ai_addr, ai->ai_addrlen))
+			goto muacc_push_packed_addrinfo_err;
+
+		if (ai->ai_canonname != NULL && 0 > _muacc_push_packed_string(buf, buf_pos, buf_len, ai->ai_canonname))
+			goto muacc_push_packed_addrinfo_err;
+	}
+
+	DLOG(MUACC_TLV_NOISY_DEBUG2, "packed %ld addrinfos into %ld bytes\n", (long) n, (long) (*buf_pos - pos0));
+	return(*buf_pos - pos0);
+
+muacc_push_packed_addrinfo_err:
+	*buf_pos = pos0;
+	return(-1);
+}
+
+ssize_t _muacc_get_packed_addrinfo(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct addrinfo **ai0)
+{
+	struct addrinfo *ai = NULL;
+	struct sockaddr_storage ss;
+	socklen_t sa_len;
+	ssize_t pos;
+	size_t flat_len = 0;
+	char *flat = NULL;
+	uint64_t n, i, flags, family, socktype, protocol, parts, sl;
+	int pass;
+
+	*ai0 = NULL;
+
+	/* decode the list twice - check and size it first, then copy it into a single allocation */
+	for (pass = 0; pass < 2; pass++)
+	{
+		pos = *buf_pos;
+		if (0 > _muacc_get_varint(buf, &pos, buf_len, &n))
+			goto muacc_get_packed_addrinfo_err;
+
+		if (pass == 1)
+		{
+			if (n == 0)
+				break;
+			if ((*ai0 = ai = _muacc_alloc_flat_addrinfo(n, flat_len, &flat)) == NULL)
+				goto muacc_get_packed_addrinfo_err;
+		}
+
+		for (i = 0; i < n; i++)
+		{
+			if (0 > _muacc_get_varint(buf, &pos, buf_len, &flags) ||
+				0 > _muacc_get_varint(buf, &pos, buf_len, &family) ||
+				0 > _muacc_get_varint(buf, &pos, buf_len, &socktype) ||
+				0 > _muacc_get_varint(buf, &pos, buf_len, &protocol) ||
+				0 > _muacc_get_varint(buf, &pos, buf_len, &parts) )
+				goto muacc_get_packed_addrinfo_err;
+
+			if (pass == 1)
+			{
+				ai->ai_flags = MUACC_ZIGZAG_DECODE(flags);
+				ai->ai_family = MUACC_ZIGZAG_DECODE(family);
+				ai->ai_socktype = MUACC_ZIGZAG_DECODE(socktype);
+				ai->ai_protocol = MUACC_ZIGZAG_DECODE(protocol);
+			}
+
+			if (parts & MUACC_PACKED_AI_ADDR)
+			{
+				if (0 > _muacc_decode_packed_sockaddr(buf, &pos, buf_len, &ss, &sa_len))
+					goto muacc_get_packed_addrinfo_err;
+
+				if (pass == 0)
+				{
+					flat_len += MUACC_FLAT_AI_ALIGN(sa_len);
+				}
+				else
+				{
+					ai->ai_addr = (struct sockaddr *) flat;
+					ai->ai_addrlen = sa_len;
+					memcpy(flat, &ss, sa_len);
+					flat += MUACC_FLAT_AI_ALIGN(sa_len);
+				}
+			}
+
+			if (parts & MUACC_PACKED_AI_CANONNAME)
+			{
+				if (0 > _muacc_get_varint(buf, &pos, buf_len, &sl) || sl > (uint64_t) (buf_len - pos))
+					goto muacc_get_packed_addrinfo_err;
+
+				if (pass == 0)
+				{
+					flat_len += MUACC_FLAT_AI_ALIGN(sl + 1);
+				}
+				else
+				{
+					ai->ai_canonname = flat;
+					memcpy(flat, buf + pos, sl);
+					flat[sl] = 0x00;
+					flat += MUACC_FLAT_AI_ALIGN(sl + 1);
+				}
+				pos += sl;
+			}
+
+			if (pass == 1)
+				ai = ai->ai_next;
+		}
+	}
+
+	n = pos - *buf_pos;
+	*buf_pos = pos;
+	return(n);
+
+muacc_get_packed_addrinfo_err:
+	DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: failed to decode packed addrinfo\n");
+	_muacc_free_addrinfo(*ai0);
+	*ai0 = NULL;
+	return(-1);
+}
+
+ssize_t _muacc_push_packed_socketopt(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct socketopt *so0)
+{
+	const struct socketopt *so;
+	ssize_t pos0 = *buf_pos;
+	uint64_t n = 0;
+	int has_val;
+
+	for (so = so0; so != NULL; so = so->next)
+		n++;
+	if (0 > _muacc_push_varint(buf, buf_pos, buf_len, n))
+		goto muacc_push_packed_socketopt_err;
+
+	for (so = so0; so != NULL; so = so->next)
+	{
+		has_val = (so->optlen != 0 && so->optval != NULL);
+
+		if (0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(so->level)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(so->optname)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(so->returnvalue)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, MUACC_ZIGZAG_ENCODE(so->flags)) ||
+			0 > _muacc_push_varint(buf, buf_pos, buf_len, (((uint64_t) so->optlen) << 1) | has_val) )
+			goto muacc_push_packed_socketopt_err;
+
+		if (has_val)
+		{
+			if (*buf_pos + (ssize_t) so->optlen > buf_len)
+				goto muacc_push_packed_socketopt_err;
+			memcpy(buf + *buf_pos, so->optval, so->optlen);
+			*buf_pos += so->optlen;
+		}
+	}
+
+	return(*buf_pos - pos0);
+
+muacc_push_packed_socketopt_err:
+	*buf_pos = pos0;
+	return(-1);
+}
+
+ssize_t _muacc_get_packed_socketopt(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct socketopt **so0)
+{
+	struct socketopt **so1 = so0;
+	struct socketopt *so;
+	ssize_t pos = *buf_pos;
+	uint64_t n, level, optname, returnvalue, flags, optlen;
+
+	*so0 = NULL;
+	if (0 > _muacc_get_varint(buf, &pos, buf_len, &n))
+		return(-1);
+
+	for (; n > 0; n--)
+	{
+		if (0 > _muacc_get_varint(buf, &pos, buf_len, &level) ||
+			0 > _muacc_get_varint(buf, &pos, buf_len, &optname) ||
+			0 > _muacc_get_varint(buf, &pos, buf_len, &returnvalue) ||
+			0 > _muacc_get_varint(buf, &pos, buf_len, &flags) ||
+			0 > _muacc_get_varint(buf, &pos, buf_len, &optlen) )
+			goto muacc_get_packed_socketopt_err;
+
+		if ((so = _muacc_alloc(sizeof(struct socketopt))) == NULL)
+			goto muacc_get_packed_socketopt_err;
+		memset(so, 0, sizeof(struct socketopt));
+		*so1 = so;
+		so1 = &(so->next);
+
+		so->level = MUACC_ZIGZAG_DECODE(level);
+		so->optname = MUACC_ZIGZAG_DECODE(optname);
+		so->returnvalue = MUACC_ZIGZAG_DECODE(returnvalue);
+		so->flags = MUACC_ZIGZAG_DECODE(flags);
+		so->optlen = optlen >> 1;
+
+		if (optlen & 1)
+		{
+			if (pos + (ssize_t) so->optlen > buf_len || (so->optval = _muacc_alloc(so->optlen)) == NULL)
+				goto muacc_get_packed_socketopt_err;
+			memcpy(so->optval, buf + pos, so->optlen);
+			pos += so->optlen;
+		}
+	}
+
+	n = pos - *buf_pos;
+	*buf_pos = pos;
+	return(n);
+
+muacc_get_packed_socketopt_err:
+	DLOG(MUACC_TLV_NOISY_DEBUG0, "WARNING: failed to decode packed socketopt\n");
+	_muacc_free_socketopts(*so0);
+	*so0 = NULL;
+	return(-1);
+}
@@ -12,10 +12,36 @@
 #include <sys/socket.h>
 
 #include <netdb.h>
+#include <stdint.h>
 #include "muacc.h"
 
 #define MUACC_TLV_MAXLEN 4096
 
+/** upper bound for the length of a request, to drop clients sending garbage */
+#define MUACC_REQUEST_MAXLEN (1024 * 1024)
+
+/** Buffer for reading messages from a stream socket
+ *
+ *  Holds whatever a single recv() returned - often several TLVs or even
+ *  several messages - so they can be parsed in user space. Bytes beyond the
+ *  message taken last stay in the buffer for the next one.
+ */
+typedef struct muacc_readbuf
+{
+	ssize_t start;						/**< first byte not taken yet */
+	ssize_t end;						/**< end of the bytes received */
+	char buf[MUACC_TLV_MAXLEN];
+} muacc_readbuf_t;
+
+/** Protocol versions - negotiated per connection using muacc_act_hello_req */
+#define MUACC_PROTOCOL_V1 1		/**< native tag and ssize_t length per TLV, one TLV per context field */
+#define MUACC_PROTOCOL_V2 2		/**< one byte tag, varint length, whole context in one packed_ctx TLV */
+#define MUACC_PROTOCOL_MAX MUACC_PROTOCOL_V2
+
+/** map signed integers to unsigned ones so small magnitudes give short varints */
+#define MUACC_ZIGZAG_ENCODE(n) ((((uint64_t) (n)) << 1) ^ (uint64_t) (-(int64_t) ((uint64_t) (n) >> 63)))
+#define MUACC_ZIGZAG_DECODE(n) ((int64_t) (((n) >> 1) ^ (~((n) & 1) + 1)))
+
 /** push data in an TLV buffer
  *
  * @return length of the added tlv, -1 if there was an error.
@@ -29,6 +55,32 @@ ssize_t _muacc_push_tlv (
 	ssize_t data_len    /**< [in]	 lengh of data to be pushed into the buffer */
 );
 
+/** push data in an TLV buffer using the encoding of the given protocol version
+ *
+ * @return length of the added tlv, -1 if there was an error.
+ */
+ssize_t _muacc_push_tlv_v (
+	char *buf,         /**< [in]	 pointer to buffer to put data */
+	ssize_t *buf_pos,   /**< [in,out] pointer to current offset to which the buffer is already used (in/out) */
+	ssize_t buf_len,    /**< [in]	 length of the buffer */
+	int version,       /**< [in]	 protocol version to encode for */
+	muacc_tlv_t tag,   /**< [in]	 tag of the data */
+	const void *data,  /**< [in]	 data to be pushed into the buffer */
+	ssize_t data_len    /**< [in]	 lengh of data to be pushed into the buffer */
+);
+
+/** push flag in an TLV buffer using the encoding of the given protocol version
+ *
+ * @return length of the added tlv, -1 if there was an error.
+ */
+ssize_t _muacc_push_tlv_tag_v(
+	char *buf,         /**< [in]     	pointer to buffer to put data */
+	ssize_t *buf_pos,   /**< [in,out]    pointer to current offset to which the buffer is already used */
+	ssize_t buf_len,    /**< [in]    	length of the buffer */
+	int version,       /**< [in]	 	protocol version to encode for */
+	muacc_tlv_t tag    /**< [in]    	tag to push */
+);
+
 /** push flag in an TLV buffer
  *
  * @return length of the added tlv, -1 if there was an error.
@@ -115,4 +167,115 @@ ssize_t _muacc_read_tlv(
 	ssize_t *data_len  	/**< [out]    length of data extracted */
 );
 
+/** take the next complete message (all TLVs up to and including eof) out of a read buffer
+ *
+ * @return length of the message at *msg (within rb, valid until rb is used again),
+ *         0 if the buffer holds no complete message, -1 if it holds garbage
+ */
+ssize_t _muacc_take_msg(
+	muacc_readbuf_t *rb,	/**< [in,out] buffer to take the message from */
+	int version,       	/**< [in]     protocol version the message is encoded in */
+	char **msg         	/**< [out]    the message */
+);
+
+/** read a complete message (all TLVs up to and including eof) from a stream socket
+ *
+ *  Messages already in the read buffer are returned without any system call,
+ *  otherwise as much as the socket has to offer is received at once.
+ *
+ * @return length of the message at *msg (within rb, valid until rb is used again), -1 if there was an error.
+ */
+ssize_t _muacc_read_msg(
+	int fd,           	/**< [in]     file descriptor to read from */
+	muacc_readbuf_t *rb,	/**< [in,out] read buffer of the socket */
+	int version,       	/**< [in]     protocol version the message is encoded in */
+	char **msg         	/**< [out]    the message */
+);
+
+/** get the next TLV from a buffer holding a message
+ *
+ * @return length of the tlv, -1 if the buffer does not hold a complete tlv.
+ */
+ssize_t _muacc_next_tlv(
+ 	const char *buf,  	/**< [in]     buffer holding the message */
+	ssize_t *buf_pos,  	/**< [in,out] offset of the next tlv */
+	ssize_t buf_len,   	/**< [in]     length of the message */
+	int version,       	/**< [in]     protocol version the message is encoded in */
+ 	muacc_tlv_t *tag, 	/**< [out]    tag extracted  */
+ 	void **data,      	/**< [out]    data extracted (pointer within buf) */
+	ssize_t *data_len  	/**< [out]    length of data extracted */
+);
+
+/** push an unsigned integer as LEB128 varint (7 bits per byte, least significant first)
+ *
+ * @return number of bytes used (also if buf is NULL), -1 if the buffer is too small
+ */
+ssize_t _muacc_push_varint(
+	char *buf,          /**< [in]     buffer to put the varint - NULL to only calculate the length */
+	ssize_t *buf_pos,    /**< [in,out] position of next free space in the buffer */
+	ssize_t buf_len,     /**< [in]     length of the buffer */
+	uint64_t val        /**< [in]     value to encode */
+);
+
+/** get a LEB128 varint from a buffer
+ *
+ * @return number of bytes consumed, -1 if the buffer ends within the varint or it is too long
+ */
+ssize_t _muacc_get_varint(
+	const char *buf,    /**< [in]     buffer to extract from */
+	ssize_t *buf_pos,    /**< [in,out] position of the varint */
+	ssize_t buf_len,     /**< [in]     length of the buffer */
+	uint64_t *val       /**< [out]    decoded value */
+);
+
+/** push a socket address in compact form
+ *
+ * IPv4 and IPv6 addresses are reduced to port and address, others are copied as they are
+ *
+ * @return number of bytes used, -1 if the buffer is too small
+ */
+ssize_t _muacc_push_packed_sockaddr(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct sockaddr *sa, socklen_t sa_len);
+
+/** decode a socket address in compact form
+ *
+ * @return number of bytes consumed, -1 on error
+ */
+ssize_t _muacc_get_packed_sockaddr(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct sockaddr **sa, socklen_t *sa_len);
+
+/** push a string in compact form (varint length, no trailing \0)
+ *
+ * @return number of bytes used, -1 if the buffer is too small
+ */
+ssize_t _muacc_push_packed_string(char *buf, ssize_t *buf_pos, ssize_t buf_len, const char *str);
+
+/** decode a string in compact form
+ *
+ * @return number of bytes consumed, -1 on error
+ */
+ssize_t _muacc_get_packed_string(const char *buf, ssize_t *buf_pos, ssize_t buf_len, char **str);
+
+/** push an addrinfo list in compact form
+ *
+ * @return number of bytes used, -1 if the buffer is too small
+ */
+ssize_t _muacc_push_packed_addrinfo(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct addrinfo *ai0);
+
+/** decode an addrinfo list in compact form by deep copying
+ *
+ * @return number of bytes consumed, -1 on error
+ */
+ssize_t _muacc_get_packed_addrinfo(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct addrinfo **ai0);
+
+/** push a socketopt list in compact form
+ *
+ * @return number of bytes used, -1 if the buffer is too small
+ */
+ssize_t _muacc_push_packed_socketopt(char *buf, ssize_t *buf_pos, ssize_t buf_len, const struct socketopt *so0);
+
+/** decode a socketopt list in compact form by deep copying
+ *
+ * @return number of bytes consumed, -1 on error
+ */
+ssize_t _muacc_get_packed_socketopt(const char *buf, ssize_t *buf_pos, ssize_t buf_len, struct socketopt **so0);
+
 #endif
@@ -6,6 +6,7 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -15,6 +16,7 @@
 
 #include "muacc.h"
 #include "muacc_util.h"
+#include "muacc_arena.h"
 #include "socketset.h"
 #include "intents.h"
 
@@ -30,22 +32,16 @@ void _muacc_logtofile (const char *filename, const char *format, ...)
 		return;
 	}
 	va_list args;
-	va_start (args, format);
 	FILE *fp = fopen(filename, "a");
 	if (fp == NULL)
 	{
 		DLOG(MUACC_UTIL_NOISY_DEBUG, "Could not open log file %s\n", filename);
 		return;
 	}
-	else
-	{
-		char *str;
-		vasprintf(&str, format, args);
-		fprintf(fp, "%s", str);
-	}
+	va_start (args, format);
+	vfprintf(fp, format, args);
 	va_end(args);
-	if (fp != NULL)
-		fclose(fp);
+	fclose(fp);
 }
 
 struct sockaddr *_muacc_clone_sockaddr(const struct sockaddr *src, size_t src_len)
@@ -55,7 +51,7 @@ struct sockaddr *_muacc_clone_sockaddr(const struct sockaddr *src, size_t src_le
 	if(src == NULL)
 		return(NULL);
 
-	if((ret = malloc(src_len)) == NULL)
+	if((ret = _muacc_alloc(src_len)) == NULL)
 		return NULL;
 
 	memcpy(ret, src, src_len);
@@ -71,7 +67,7 @@ char *_muacc_clone_string(const char *src)
 	if ( src != NULL)
 	{
 		size_t sl = strlen(src)+1;
-		if( ( ret = malloc(sl) ) == NULL )
+		if( ( ret = _muacc_alloc(sl) ) == NULL )
 			return(NULL);
 		memcpy( ret, src, sl);
 		ret[sl-1] = 0x00;
@@ -81,47 +77,118 @@ char *_muacc_clone_string(const char *src)
 }
 
 
+struct addrinfo *_muacc_alloc_flat_addrinfo(size_t n, size_t data_len, char **data)
+{
+	struct addrinfo *ai0;
+	size_t i;
+
+	if (n == 0 || n > (SIZE_MAX - data_len) / sizeof(struct addrinfo))
+		return NULL;
+
+	if ((ai0 = _muacc_alloc(n * sizeof(struct addrinfo) + data_len)) == NULL)
+		return NULL;
+	memset(ai0, 0, n * sizeof(struct addrinfo));
+
+	for (i = 1; i < n; i++)
+		ai0[i-1].ai_next = &ai0[i];
+
+	*data = (char *) (ai0 + n);
+	return ai0;
+}
+
 struct addrinfo *_muacc_clone_addrinfo(const struct addrinfo *src)
 {
 	struct addrinfo *res = NULL;
-	struct addrinfo **cur = &res;
-
-    const struct addrinfo *ai;
+	struct addrinfo *cur, *next;
+	const struct addrinfo *ai;
+	size_t n = 0;
+	size_t data_len = 0;
+	char *data;
 
 	if(src == NULL)
 		return(NULL);
 
+	/* size the list first, so it can be copied into a single allocation */
 	for (ai = src; ai; ai = ai->ai_next)
 	{
-		/* allocate memory and copy */
-		if( (*cur = malloc(sizeof(struct addrinfo))) == NULL )
-			goto _muacc_clone_addrinfo_malloc_err;
-		memcpy( *cur, ai, sizeof(struct addrinfo));
+		n++;
+		if (ai->ai_addr != NULL)
+			data_len += MUACC_FLAT_AI_ALIGN(ai->ai_addrlen);
+		if (ai->ai_canonname != NULL)
+			data_len += MUACC_FLAT_AI_ALIGN(strlen(ai->ai_canonname) + 1);
+	}
 
-		if ( ai->ai_addr != NULL)
+	if ((res = _muacc_alloc_flat_addrinfo(n, data_len, &data)) == NULL)
+	{
+		fprintf(stderr, "%6d: _muacc_clone_addrinfo failed to allocate memory\n", (int) getpid());
+		return NULL;
+	}
+
+	for (ai = src, cur = res; ai; ai = ai->ai_next, cur = next)
+	{
+		next = cur->ai_next;
+		memcpy(cur, ai, sizeof(struct addrinfo));
+		cur->ai_next = next;
+
+		if (ai->ai_addr != NULL)
 		{
-			(*cur)->ai_addr = _muacc_clone_sockaddr(ai->ai_addr, ai->ai_addrlen);
-			if((*cur)->ai_addr == NULL)
-				goto _muacc_clone_addrinfo_malloc_err;
+			cur->ai_addr = (struct sockaddr *) data;
+			memcpy(data, ai->ai_addr, ai->ai_addrlen);
+			data += MUACC_FLAT_AI_ALIGN(ai->ai_addrlen);
 		}
 
-		if ( ai->ai_canonname != NULL)
+		if (ai->ai_canonname != NULL)
 		{
-			if( ( (*cur)->ai_canonname = _muacc_clone_string(ai->ai_canonname)) == NULL )
-				goto _muacc_clone_addrinfo_malloc_err;
+			size_t sl = strlen(ai->ai_canonname) + 1;
+
+			cur->ai_canonname = data;
+			memcpy(data, ai->ai_canonname, sl);
+			data += MUACC_FLAT_AI_ALIGN(sl);
 		}
+	}
 
-		cur = &((*cur)->ai_next);
+	return res;
+}
 
+struct addrinfo *_muacc_export_addrinfo(const struct addrinfo *src)
+{
+	struct addrinfo *res = NULL;
+	struct addrinfo **cur = &res;
+	const struct addrinfo *ai;
+
+	for (ai = src; ai; ai = ai->ai_next)
+	{
+		/* the C library keeps the address in the allocation of its node */
+		if( (*cur = malloc(sizeof(struct addrinfo) + ((ai->ai_addr != NULL) ? ai->ai_addrlen : 0))) == NULL )
+			goto _muacc_export_addrinfo_malloc_err;
+		memcpy(*cur, ai, sizeof(struct addrinfo));
+		(*cur)->ai_next = NULL;
+		(*cur)->ai_canonname = NULL;
+
+		if (ai->ai_addr != NULL)
+		{
+			(*cur)->ai_addr = (struct sockaddr *) (*cur + 1);
+			memcpy((*cur)->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		}
+
+		if (ai->ai_canonname != NULL && ((*cur)->ai_canonname = strdup(ai->ai_canonname)) == NULL)
+			goto _muacc_export_addrinfo_malloc_err;
+
+		cur = &((*cur)->ai_next);
 	}
 
 	return res;
 
-	_muacc_clone_addrinfo_malloc_err:
-	fprintf(stderr, "%6d: _muacc_clone_addrinfo failed to allocate memory\n", (int) getpid());
-    if (res != NULL) freeaddrinfo(res);
+	_muacc_export_addrinfo_malloc_err:
+	fprintf(stderr, "%6d: _muacc_export_addrinfo failed to allocate memory\n", (int) getpid());
+	if (res != NULL)
+		freeaddrinfo(res);
 	return NULL;
+}
 
+void _muacc_free_addrinfo(struct addrinfo *ai)
+{
+	_muacc_dealloc(ai);
 }
 
 
@@ -132,7 +199,7 @@ struct socketopt *_muacc_clone_socketopts(const struct socketopt *src)
 	if (src == NULL)
 		return NULL;
 
-	if ((ret = malloc(sizeof(struct socketopt))) == NULL)
+	if ((ret = _muacc_alloc(sizeof(struct socketopt))) == NULL)
 	{
 		fprintf(stderr, "%6d: _muacc_clone_socketopts failed to allocate memory.\n", (int) getpid());
 		return NULL;
@@ -144,7 +211,7 @@ struct socketopt *_muacc_clone_socketopts(const struct socketopt *src)
 		memcpy(ret, src, sizeof(struct socketopt));
 		if (src->optlen > 0 && src->optval != NULL)
 		{
-			if ((ret->optval = malloc(src->optlen)) == NULL)
+			if ((ret->optval = _muacc_alloc(src->optlen)) == NULL)
 			{
 				fprintf(stderr, "%6d: _muacc_clone_socketopts failed to allocate memory.\n", (int) getpid());
 				return NULL;
@@ -155,7 +222,7 @@ struct socketopt *_muacc_clone_socketopts(const struct socketopt *src)
 		while (srccurrent->next != NULL)
 		{
 			struct socketopt *new = NULL;
-			if ((new = malloc(sizeof(struct socketopt))) == NULL)
+			if ((new = _muacc_alloc(sizeof(struct socketopt))) == NULL)
 			{
 				fprintf(stderr, "%6d: _muacc_clone_socketopts failed to allocate memory.\n", (int) getpid());
 				return NULL;
@@ -167,7 +234,7 @@ struct socketopt *_muacc_clone_socketopts(const struct socketopt *src)
 
 			if(srccurrent->next->optlen > 0 && srccurrent->next->optval != NULL)
 			{
-				if ((new->optval = malloc(new->optlen)) == NULL)
+				if ((new->optval = _muacc_alloc(new->optlen)) == NULL)
 				{
 					fprintf(stderr, "%6d: _muacc_clone_socketopts failed to allocate memory.\n", (int) getpid());
 					return NULL;
@@ -193,13 +260,14 @@ struct _muacc_ctx *_muacc_clone_ctx(struct _muacc_ctx *origin)
 
 	struct _muacc_ctx *_ctx;
 
-	if( (_ctx = malloc( sizeof(struct _muacc_ctx) )) == NULL )
+	if( (_ctx = _muacc_alloc( sizeof(struct _muacc_ctx) )) == NULL )
 	{
 		perror("muacc_clone_context malloc failed");
 		return NULL;
 	}
 
 	memcpy(_ctx, origin, sizeof(struct _muacc_ctx));
+	_ctx->arena = _muacc_arena_current();
 
 	_ctx->bind_sa_req   = _muacc_clone_sockaddr(origin->bind_sa_req, origin->bind_sa_req_len);
 	_ctx->bind_sa_suggested   = _muacc_clone_sockaddr(origin->bind_sa_suggested, origin->bind_sa_suggested_len);
@@ -209,6 +277,7 @@ struct _muacc_ctx *_muacc_clone_ctx(struct _muacc_ctx *origin)
 	_ctx->remote_addrinfo_res  = _muacc_clone_addrinfo(origin->remote_addrinfo_res);
 
 	_ctx->remote_hostname = _muacc_clone_string(origin->remote_hostname);
+	_ctx->remote_service = _muacc_clone_string(origin->remote_service);
 
 	_ctx->sockopts_current = _muacc_clone_socketopts(origin->sockopts_current);
 	_ctx->sockopts_suggested = _muacc_clone_socketopts(origin->sockopts_suggested);
@@ -218,6 +287,24 @@ struct _muacc_ctx *_muacc_clone_ctx(struct _muacc_ctx *origin)
 	return _ctx;
 }
 
+struct sockaddr *_muacc_ctx_clone_sockaddr(const struct _muacc_ctx *ctx, const struct sockaddr *src, size_t src_len)
+{
+	muacc_arena_t *prev = _muacc_arena_use(ctx->arena);
+	struct sockaddr *ret = _muacc_clone_sockaddr(src, src_len);
+
+	_muacc_arena_use(prev);
+	return ret;
+}
+
+struct addrinfo *_muacc_ctx_clone_addrinfo(const struct _muacc_ctx *ctx, const struct addrinfo *src)
+{
+	muacc_arena_t *prev = _muacc_arena_use(ctx->arena);
+	struct addrinfo *ret = _muacc_clone_addrinfo(src);
+
+	_muacc_arena_use(prev);
+	return ret;
+}
+
 void _muacc_free_socketopts(struct socketopt *so)
 {
 	struct socketopt *next = so;
@@ -228,9 +315,9 @@ void _muacc_free_socketopts(struct socketopt *so)
 		next = last->next;
 
 		if(last->optlen > 0 && last->optval != NULL)
-			free(last->optval);
+			_muacc_dealloc(last->optval);
 
-		free(last);
+		_muacc_dealloc(last);
 	}
 
 }
@@ -383,7 +470,7 @@ void __uuid_unparse_lower(const uuid_t u, char* dst)
 	u[0],u[1],u[2],u[3],u[4],u[5],u[6],u[7],u[8],u[9],u[10],u[11],u[12],u[13],u[14],u[15]);
 }
 
-int __uuid_is_null(uuid_t uuid)
+int __uuid_is_null(const uuid_t uuid)
 {
 	int i;
 	for (i = 0; i < 16; ++i)
@@ -393,7 +480,7 @@ int __uuid_is_null(uuid_t uuid)
 }
 
 
-int __uuid_compare(uuid_t a, uuid_t b)
+int __uuid_compare(const uuid_t a, const uuid_t b)
 {
 	int i;
 	for (i = 0; i < 16; ++i)
@@ -403,7 +490,7 @@ int __uuid_compare(uuid_t a, uuid_t b)
 }
 
 
-void __uuid_copy(uuid_t dst, uuid_t src)
+void __uuid_copy(uuid_t dst, const uuid_t src)
 {
 	int i;
 	for (i = 0; i < 16; ++i)
@@ -436,7 +523,7 @@ int _muacc_add_sockopt_to_list(socketopt_t **opts, int level, int optname, const
 	{
 		/* Option did not exist: create new option in list */
         struct socketopt *newopt;
-        newopt = malloc(sizeof(struct socketopt));
+        newopt = _muacc_alloc(sizeof(struct socketopt));
         if (newopt == NULL)
         {
             perror("__function__ malloc failed");
@@ -447,11 +534,11 @@ int _muacc_add_sockopt_to_list(socketopt_t **opts, int level, int optname, const
 		newopt->optlen = optlen;
 		if(optlen > 0 && optval != NULL)
 		{
-			newopt->optval = malloc(optlen);
+			newopt->optval = _muacc_alloc(optlen);
 			if (newopt->optval == NULL)
 			{
 				perror("__function__ malloc failed");
-				free(newopt);
+				_muacc_dealloc(newopt);
 				return retval;
 			}
 			memcpy(newopt->optval, optval, optlen);
@@ -18,7 +18,7 @@
 #include "muacc.h"
 
 /** helper that logs to a file
- *
+ *  Opens and closes the file every time - use a muacc_log (see muacc_log.h) for frequent logging
  */
 void _muacc_logtofile (const char *filename, const char *format, ...);
 
@@ -32,11 +32,37 @@ char *_muacc_clone_string(const char *src);
  */
 struct sockaddr *_muacc_clone_sockaddr(const struct sockaddr *src, size_t src_len);
 
-/** helper to deep copy addrinfo structs
+/** round up the space a member of a flat addrinfo list takes, so the next one stays aligned */
+#define MUACC_FLAT_AI_ALIGN(len) (((len) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+/** helper to allocate a flat addrinfo list
+ *
+ *  All n nodes are zeroed and chained, data_len bytes for their addresses and
+ *  canonical names follow them in the same allocation, starting at *data.
+ *  The whole list is released by a single _muacc_free_addrinfo().
+ *
+ *  @return the first node, NULL if out of memory or n is 0
+ */
+struct addrinfo *_muacc_alloc_flat_addrinfo(size_t n, size_t data_len, char **data);
+
+/** helper to deep copy addrinfo structs into a flat addrinfo list
  *
  */
 struct addrinfo *_muacc_clone_addrinfo(const struct addrinfo *src);
 
+/** helper to deep copy addrinfo structs into the layout of the C library,
+ *  i.e., one allocation per node including its address
+ *
+ *  This is what is handed out to applications - they release it with the system's freeaddrinfo()
+ */
+struct addrinfo *_muacc_export_addrinfo(const struct addrinfo *src);
+
+/** helper to free an addrinfo list allocated by the muacc library
+ *  (except for memory from the current arena - see muacc_arena.h)
+ *
+ */
+void _muacc_free_addrinfo(struct addrinfo *ai);
+
 /** helper to deep copy socketopt linked lists
  *
  */
@@ -47,7 +73,19 @@ struct socketopt *_muacc_clone_socketopts(const struct socketopt *src);
  */
 struct _muacc_ctx *_muacc_clone_ctx(struct _muacc_ctx *origin);
 
+/** helper to deep copy a sockaddr into the memory of a _muacc_ctx
+ *  (its arena, if it has one - see muacc_arena.h)
+ *
+ */
+struct sockaddr *_muacc_ctx_clone_sockaddr(const struct _muacc_ctx *ctx, const struct sockaddr *src, size_t src_len);
+
+/** helper to deep copy addrinfo structs into the memory of a _muacc_ctx
+ *
+ */
+struct addrinfo *_muacc_ctx_clone_addrinfo(const struct _muacc_ctx *ctx, const struct addrinfo *src);
+
 /** helper to deep free socketopt linked lists
+ *  (except for memory from the current arena - see muacc_arena.h)
  *
  */
 void _muacc_free_socketopts(struct socketopt *so);
@@ -86,9 +124,9 @@ void _muacc_print_socket_option(strbuf_t *sb, const struct socketopt *current);
 /** helper to avoid having to link the uuid lib into the client
  *
  */
-void __uuid_copy(uuid_t dst, uuid_t src);
-int  __uuid_compare(uuid_t a, uuid_t b);
-int  __uuid_is_null(uuid_t uuid);
+void __uuid_copy(uuid_t dst, const uuid_t src);
+int  __uuid_compare(const uuid_t a, const uuid_t b);
+int  __uuid_is_null(const uuid_t uuid);
 void __uuid_unparse_lower(const uuid_t uuid, char* dst);
 
 /** helper to set a socket option in a socketopt list
@@ -27,6 +27,8 @@
 
 // TODO: Change names of the noisy debug switches
 
+void (*_muacc_socketset_release_hook)(struct socketlist *list) = NULL;
+
 #ifndef MUACC_CLIENT_UTIL_NOISY_DEBUG0
 #define MUACC_CLIENT_UTIL_NOISY_DEBUG0 1
 #endif
@@ -91,6 +93,8 @@ struct socketset* _muacc_add_socket_to_set(struct socketset **list_of_sets, int
 		newset->sockets->file = socket;
 		newset->sockets->flags = 0;
 		newset->sockets->flags |= MUACC_SOCKET_IN_USE;
+		newset->sockets->mamkey = 0;
+		newset->sockets->mamepoch = 0;
 		newset->use_count = 1;
 		newset->sockets->ctx = _muacc_clone_ctx(ctx);
 
@@ -138,8 +142,10 @@ struct socketset* _muacc_add_socket_to_set(struct socketset **list_of_sets, int
 		slist->next->file = socket;
 		slist->next->flags = 0;
 		slist->next->flags |= MUACC_SOCKET_IN_USE;
+		slist->next->mamkey = 0;
+		slist->next->mamepoch = 0;
 		set->use_count += 1;
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Added %d - Use count of socket set is now %d\n", socket, set->use_count);
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "Added %d - Use count of socket set is now %u\n", socket, set->use_count);
 		slist->next->ctx = _muacc_clone_ctx(ctx);
 
 		DLOG(CLIB_IF_LOCKS, "LOCK: Finished trying to add - Releasing set %p\n", (void *) set);
@@ -309,7 +315,7 @@ int _muacc_remove_socket_from_list (struct socketset **list_of_sets, int socket)
 	{
 		// Decrease set use count
 		set_to_delete->use_count -= 1;
-		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "DEL %d: Decreased use count to %d\n", socket, set_to_delete->use_count);
+		DLOG(MUACC_CLIENT_UTIL_NOISY_DEBUG2, "DEL %d: Decreased use count to %u\n", socket, set_to_delete->use_count);
 		int ret;
 		if ((ret = _muacc_free_socket(set_to_delete, list_to_delete, prevlist)) == 0 && set_to_delete->use_count == 0)
 		{
@@ -396,6 +402,10 @@ int _muacc_free_socket(struct socketset *set_to_delete, struct socketlist *list_
 	int returnvalue = -1;
 	int socketfd = list_to_delete->file;
 
+	// Tell MAM it does not need to cache the context anymore
+	if (list_to_delete->mamkey != 0 && _muacc_socketset_release_hook != NULL)
+		_muacc_socketset_release_hook(list_to_delete);
+
 	// Free context if no other file descriptor needs it
 	if (_muacc_socketset_find_dup(list_to_delete) == NULL)
 	{
@@ -464,7 +474,7 @@ void muacc_print_socketset(struct socketset *set)
 	printf("host = %s\n", (set->host == NULL ? "(null)" : set->host));
 	printf("serv = %s\n", (set->serv == NULL ? "(null)" : set->serv));
 	printf("type = %d\n", set->type);
-	printf("use_count = %d\n", set->use_count);
+	printf("use_count = %u\n", set->use_count);
 	struct socketlist *list = set->sockets;
 	while (list != NULL)
 	{
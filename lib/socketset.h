@@ -16,7 +16,7 @@ typedef struct socketset
 {
 	pthread_rwlock_t lock;		/**< Read/Write lock for this set */
 	pthread_rwlock_t destroylock;/**< Lock for deleting this set */
-	uint8_t	use_count;			/**< Number of sockets in this set that are in use */
+	unsigned int use_count;		/**< Number of sockets in this set that are in use */
 	char   *host;				/**< Host name for this socket set */
 	size_t  hostlen;			/**< Length of host name in bytes (without \0) */
 	char   *serv;				/**< Destination port or service for this socket set */
@@ -35,6 +35,9 @@ typedef struct socketlist
 	int		file;				/**< File descriptor of this socket */
 	int		flags;              /**< Flags indicating the status of this socket, e.g. MUACC_SOCKET_IN_USE */
 	struct	_muacc_ctx *ctx;	/**< Context of this socket */
+	uint32_t	mamkey;			/**< Key MAM caches the context under, 0 if none */
+	unsigned int	mamepoch;	/**< Connection to MAM the key is valid on */
+	int		tcp_state;			/**< TCP state (TCP_ESTABLISHED, ...) when offered to MAM last, 0 if unknown */
 	struct socketlist 	*next;
 } socketlist_t;
 
@@ -93,6 +96,11 @@ int _muacc_remove_socket_from_list (struct socketset **list_of_sets, int socket)
  */
 int _muacc_cleanup_sockets(struct socketset **set);
 
+/** Called before a socket whose context MAM caches (mamkey != 0) leaves its set,
+ *  so the client library can tell MAM - NULL if nobody cares
+ */
+extern void (*_muacc_socketset_release_hook)(struct socketlist *list);
+
 /** Free a socket from a socket set, and close its file descriptor.
  *
  *  @return 0 on success (set still has sockets), 1 on success (set is empty now), -1 otherwise
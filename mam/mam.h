@@ -15,7 +15,9 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <event2/event.h>
 #include <event2/buffer.h>
@@ -29,6 +31,8 @@
 
 #include "muacc.h"
 #include "socketset.h"
+#include "muacc_arena.h"
+#include "muacc_metrics.h"
 #include "config.h"
 
 #include "mptcp_netlink_parser.h"
@@ -42,8 +46,23 @@ typedef struct request_context {
 	unsigned int		policy_calls_performed; /**< Policy functions that we have already called */
 	struct _muacc_ctx	*ctx;		/**< internal struct with relevant socket context data */
 	struct socketlist	*sockets;	/**< list of existing sockets for socketchoose */
+	struct socketlist	*sockets_tail;	/**< last socket of the list while the request is parsed */
 	struct mam_context	*mctx;		/**< pointer to current mam context */
 	void 			*policy_context;/**< pointer to store policy data */
+	struct _client_list	*client;	/**< client that sent the request, NULL if it went away */
+	muacc_reqid_t		request_id;	/**< id of the request to echo in the response */
+	int			has_request_id;	/**< client sent an id, so it expects one in the response */
+	int			version;	/**< protocol version the request was encoded in */
+	int			version_offered;/**< highest protocol version offered in a hello request */
+	size_t			in_scanned;	/**< bytes of the request already known to be complete */
+	uint32_t		ctx_key;	/**< key the client caches ctx under, 0 if none */
+	struct _muacc_ctx	*ctx_sent;	/**< ctx as the client knows it, to send only changes back */
+	int			ctx_unknown;	/**< request refers to a context that is not cached */
+	uint32_t		lease_ttl;	/**< ms the client may reuse a socketconnect decision without asking, 0 for none */
+	struct muacc_arena	*arena;		/**< memory of the request, released together with it (see muacc_arena.h) */
+	struct request_context	*batch;		/**< socketconnect requests of a batch, the one being parsed first */
+	struct request_context	*batch_next;	/**< next request of the same batch */
+	struct mam_policy_gen	*policy_gen;	/**< policy the request was passed to, kept loaded until the request is released */
 } request_context_t;
 
 #define MAM_POLICY_RESOLVE_CALLED 0x001
@@ -69,6 +88,54 @@ typedef struct sockaddr_list {
 #define PFX_SCOPE_LL		0x0200
 
 
+/** Measurements of a source prefix, updated by pmeasure after each round */
+struct prefix_metrics {
+	uint32_t				valid;				/**< MUACC_METRICS_* of the fields measured so far */
+	double					srtt_mean;			/**< mean smoothed RTT of its connections in ms */
+	double					srtt_median;		/**< median smoothed RTT in ms */
+	double					srtt_minimum;		/**< minimum smoothed RTT in ms, the lowest of all rounds */
+	double					srtt_p10;			/**< 10th percentile of the smoothed RTTs in ms */
+	double					srtt_p90;			/**< 90th percentile of the smoothed RTTs in ms */
+	uint64_t				rx_errors;			/**< receive errors of its interface */
+	uint64_t				tx_errors;			/**< transmit errors of its interface */
+};
+
+/** Data rates in one direction of an interface, in bytes per second */
+struct link_rates {
+	uint64_t				counter;			/**< bytes counted up to the last round */
+	double					rate;				/**< rate since the last round */
+	double					srate;				/**< smoothed rate */
+	double					max_rate;			/**< maximum rate of the current sample period */
+	double					max_srate;			/**< smoothed maximum rate of the sample periods so far */
+};
+
+/** Measurements of an interface, updated by pmeasure after each round */
+struct iface_metrics {
+	uint32_t				valid;				/**< MUACC_METRICS_* of the fields measured so far */
+	int						sample;				/**< rounds of the current sample period */
+	struct link_rates		download;
+	struct link_rates		upload;
+	uint64_t				rx_packets;			/**< packets counted up to the last round, valid with the rates */
+	uint64_t				tx_packets;
+	struct timeval			timestamp;			/**< time of the rate measurement */
+};
+
+/** Measurements of a prefix kept in a history of the last rounds (see mam_history.h) */
+enum prefix_history {
+	PFX_HISTORY_SRTT_MINIMUM = 0,				/**< minimum SRTT of the connections of a round in ms, not smoothed */
+	PFX_HISTORY_SRTT_MEDIAN,					/**< median SRTT of the connections of a round in ms, not smoothed */
+	PFX_HISTORY_MAX
+};
+
+/** Measurements of an interface kept in a history of the last rounds (see mam_history.h) */
+enum iface_history {
+	IFACE_HISTORY_DOWNLOAD = 0,					/**< download rate of a round in bytes per second, not smoothed */
+	IFACE_HISTORY_UPLOAD,						/**< upload rate of a round in bytes per second, not smoothed */
+	IFACE_HISTORY_MAX
+};
+
+struct mam_history;
+
 /** List of source prefixes */
 typedef struct src_prefix_list {
 	unsigned int			pfx_flags;			/**< Flags of that prefix */
@@ -82,29 +149,88 @@ typedef struct src_prefix_list {
 	struct evdns_base 		*evdns_base; 		/**< DNS base to do look ups for that prefix */
 	GHashTable 				*policy_set_dict; 	/**< dictionary for policy configuration */
 	void					*policy_info;		/**< Policy-internal data structure for additional information */
-	GHashTable				*measure_dict;		/**< Dictionary for measurement data of this prefix */
+	struct prefix_metrics	metrics;			/**< Measurements of this prefix */
+	struct mam_history		*history[PFX_HISTORY_MAX];	/**< Measurements of the last rounds, NULL until the first one */
+	GHashTable				*measure_dict;		/**< Dictionary for other measurement data of this prefix */
 } src_prefix_list_t;
 
 /** list of interfacses */
 typedef struct iface_list {
 	char 					*if_name;			/**< Name of the interface */
 	GHashTable 				*policy_set_dict; 	/**< dictionary for policy configuration */
-	GHashTable				*measure_dict;		/**< Dictionary for measurement data of this interface */
+	struct iface_metrics	metrics;			/**< Measurements of this interface */
+	struct mam_history		*history[IFACE_HISTORY_MAX];	/**< Measurements of the last rounds, NULL until the first one */
+	GHashTable				*measure_dict;		/**< Dictionary for other measurement data of this interface */
 } iface_list_t;
 
+struct mam_context;
+struct mptcp_flow_info;
+
+/** Version of struct mam_policy, bumped on every incompatible change */
+#define MAM_POLICY_ABI_VERSION 2
+
+/** Entry points of a policy module
+ *
+ *  Resolved once when the module is loaded: taken from the table the module
+ *  exports as const struct mam_policy mam_policy if it was built for this
+ *  MAM_POLICY_ABI_VERSION, looked up one by one by their names otherwise.
+ *  Entry points the policy does not have are NULL.
+ */
+typedef struct mam_policy {
+	unsigned int			abi_version;		/**< MAM_POLICY_ABI_VERSION the module was built for */
+	unsigned int			capabilities;		/**< MAM_POLICY_* the module declares */
+	int (*init)(struct mam_context *mctx);
+	int (*cleanup)(struct mam_context *mctx);
+	int (*on_resolve_request)(request_context_t *rctx, struct event_base *base);
+	int (*on_connect_request)(request_context_t *rctx, struct event_base *base);
+	int (*on_socketconnect_request)(request_context_t *rctx, struct event_base *base);
+	int (*on_socketconnect_batch)(request_context_t **batch, int n, struct event_base *base);	/**< all requests of a socketconnect batch at once */
+	int (*on_socketchoose_request)(request_context_t *rctx, struct event_base *base);
+	int (*on_config_request)(struct mam_context *mctx, char *config);
+	int (*on_new_subflow_request)(struct mam_context *mctx, struct mptcp_flow_info *flow);
+	void (*on_feedback)(struct mam_context *mctx);	/**< measurements were updated - on the main thread, call mam_request_lease_revoke if they changed a decision */
+	void (*on_prefix_change)(struct mam_context *mctx, struct src_prefix_list *pfx, int event);	/**< a prefix came, changed or went away (MAM_PREFIX_*) - on the main thread */
+} mam_policy_t;
+
+/** Events passed to on_prefix_change */
+#define MAM_PREFIX_ADDED	1	/**< the prefix is new in mctx->prefixes, set up its policy_info */
+#define MAM_PREFIX_CHANGED	2	/**< addresses of the prefix were added or removed */
+#define MAM_PREFIX_REMOVED	3	/**< the prefix is no longer in mctx->prefixes and is freed afterwards, release its policy_info - it may have no addresses left */
+
+/** A loaded policy module
+ *
+ *  Reloading the configuration loads a new generation for all requests from then
+ *  on. Requests already passed to the policy hold a reference to their generation,
+ *  so its module is only closed once the last of them is released.
+ */
+typedef struct mam_policy_gen {
+	lt_dlhandle				handle;				/**< handle of the module */
+	mam_policy_t			ops;				/**< its entry points */
+	unsigned int			id;					/**< number of the load */
+	int						refs;				/**< held by the MAM context while current and by requests, updated atomically */
+} mam_policy_gen_t;
+
 /** Context of the MAM */
 typedef struct mam_context {
 	int						usage;				/**< Reference counter */
 	GSList					*prefixes;			/**< Possible source prefixes on this system */
 	GSList					*ifaces;		/**< Interfaces of this system */
-	lt_dlhandle				policy;				/**< Handle of policy module */
+	struct mam_lpm			*prefix_lpm;		/**< prefixes by address, rebuilt whenever they come or go (see mam_lpm.h) */
+	struct mam_policy_gen	*policy_gen;		/**< Policy module new requests are passed to, NULL if none is loaded */
 	struct event_base 		*ev_base;			/**< Libevent Event Base */
 	struct evdns_base 		*evdns_default_base;/**< DNS base to do look ups if all other fails */
 	GHashTable 				*policy_set_dict; 	/**< dictionary for policy configuration */
 	GSList					*clients; 	 		/**< list of all applications that are connected to the MAM */
 	GHashTable				*state; 			/** global mam state */
+	uint32_t				lease_ttl;			/**< default lease_ttl of socketconnect responses, set lease_ttl in the policy block */
+	uint32_t				lease_epoch;		/**< bumped whenever leased decisions may have become wrong */
+	struct muacc_metrics_shm	*metrics;		/**< measurements as published after each round, NULL if there are none (see mam_measurements) */
 } mam_context_t;
 
+/** Capabilities a policy module declares in mam_policy_t.capabilities,
+ *  or by exporting const unsigned int mam_policy_capabilities */
+#define MAM_POLICY_THREAD_SAFE 0x0001	/**< callbacks may run concurrently on the worker threads (see mam_worker.h) */
+
 /** List of clients connected to the MAM */
 typedef struct _client_list {
 	int						client_sk;
@@ -112,6 +238,14 @@ typedef struct _client_list {
 	GSList					*sockets;
 	uint64_t				inode;
 	GHashTable				*flow_table;
+	struct bufferevent		*bev;				/**< connection to the client */
+	request_context_t		*rctx;				/**< request currently being read */
+	GHashTable				*outstanding;		/**< requests still waiting for their response */
+	int						version;			/**< protocol version negotiated with the client */
+	GHashTable				*ctx_cache;			/**< last contexts seen, by key chosen by the client */
+	struct mam_shm			*shm;				/**< shared memory the client talks through, NULL if it uses the socket */
+	struct mam_context		*mctx;				/**< context requests of the client are processed in - a view of its worker */
+	struct mam_worker		*worker;			/**< worker thread serving the client, NULL for the main thread */
 	void (*callback_function)(GSList*);
 } client_list_t;
 
@@ -144,12 +278,71 @@ void mam_print_context(mam_context_t *ctx);
 /** Print contents of a request context: associated _muacc_ctx and mam_context */
 void mam_print_request_context(request_context_t *ctx);
 
-/** Release request context */
+/** Create the context a request of client is read into - it lives in an arena of its own */
+request_context_t *mam_new_request_context(mam_context_t *mctx, struct _client_list *client);
+
+/** Release request context, together with the requests of its batch that were not handed out */
 void mam_release_request_context(request_context_t *ctx);
 
-/** update the source prefix list within the mam_context using getifaddrs()*/
+/** Prefixes and interfaces changed by an update of the lists of a mam_context
+ *
+ *  Collected while addresses are added and removed, and applied at once
+ *  by mam_prefix_changes_apply. Removed prefixes and interfaces are kept
+ *  until then, so the policy can still look at them.
+ */
+typedef struct mam_prefix_changes {
+	GSList					*before;			/**< mctx->prefixes before the update (no deep copy) */
+	GSList					*added;				/**< prefixes new in mctx->prefixes */
+	GSList					*changed;			/**< prefixes that got or lost addresses */
+	GSList					*removed;			/**< prefixes taken out of mctx->prefixes */
+	GSList					*ifaces_removed;	/**< interfaces taken out of mctx->ifaces */
+} mam_prefix_changes_t;
+
+/** update the source prefix list within the mam_context using getifaddrs()
+ *  prefixes and interfaces still there are kept as they are */
 int update_src_prefix_list (mam_context_t *ctx);
 
+/** start collecting changes of the prefixes of ctx */
+void mam_prefix_changes_init(mam_context_t *ctx, mam_prefix_changes_t *chg);
+
+/** tell the policy about the changes collected, free what was removed and
+ *  revoke the leases - main thread only, with the workers paused
+ *
+ *  Policies without on_prefix_change are cleaned up on the prefixes from before
+ *  and initialized again on the current ones.
+ */
+void mam_prefix_changes_apply(mam_context_t *ctx, mam_prefix_changes_t *chg);
+
+/** check whether there are changes to apply */
+int mam_prefix_changes_pending(const mam_prefix_changes_t *chg);
+
+/** add an address to the prefix of an interface it belongs to, creating the prefix if there is none
+ *
+ * @return 1 if the address is new, 0 if it was there already, -1 on error
+ */
+int mam_prefix_add_addr(mam_context_t *ctx, mam_prefix_changes_t *chg,
+	const char *if_name, unsigned int if_flags, int family,
+	const struct sockaddr *addr, const struct sockaddr *mask);
+
+/** remove an address from the prefixes of an interface, removing the prefix with its last address
+ *
+ * @return 1 if the address was removed, 0 if it was not there
+ */
+int mam_prefix_del_addr(mam_context_t *ctx, mam_prefix_changes_t *chg,
+	const char *if_name, int family, const struct sockaddr *addr);
+
+/** remove all prefixes of an interface, and the interface itself if gone is set
+ *
+ * @return number of prefixes removed
+ */
+int mam_iface_del(mam_context_t *ctx, mam_prefix_changes_t *chg, const char *if_name, int gone);
+
+/** bring the prefixes and interfaces up to date using getifaddrs()
+ *
+ * @return 0 on success, -1 if the addresses of the system could not be read
+ */
+int mam_prefix_rescan(mam_context_t *ctx, mam_prefix_changes_t *chg);
+
 /** get the src_prefix_list for a specific interface or prefix
   */
 struct src_prefix_list *lookup_source_prefix (
@@ -191,6 +384,10 @@ void filter_prefix_list (
 /** config read function */
 void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx);
 
+/** apply the prefix blocks of the config to prefixes not configured yet, e.g. ones that just came up -
+ *  the policy and its settings are left alone */
+void mam_configure_new_prefixes(int config_fd, struct mam_context *ctx);
+
 /* helper functions */
 #include "mam_util.h"
 
@@ -27,6 +27,7 @@
 	struct evdns_base *l_evdns_base = NULL;	/**< use a special resolvconf for that prefix */
 	unsigned int pfx_flags_set = 0;		/**< flags to set */
 	unsigned int pfx_flags_values = 0;	/**< values of the flags to set */
+	int new_prefixes_only = 0;			/**< only configure prefixes not configured yet */
 	
 	char addr_str[INET6_ADDRSTRLEN];	/** string for debug / error printing */
 	
@@ -35,6 +36,7 @@
 		
 	char *idup(int i);
 	char *ddup(double i);
+	GSList *find_config_prefix(struct src_prefix_model *m);
 %}
 
 %token SEMICOLON OBRACE CBRACE EQUAL SLASH
@@ -128,7 +130,7 @@ prefix_block:
 		struct sockaddr_in *sa = &($2);
 		inet_ntop(AF_INET, &(sa->sin_addr), addr_str, sizeof(addr_str));
 		struct src_prefix_model m = {PFX_ANY, NULL, AF_INET, (struct sockaddr *) sa, sizeof(struct sockaddr_in)};
-		GSList *listelement = g_slist_find_custom(yymctx->prefixes, (gconstpointer) &m, &compare_src_prefix);
+		GSList *listelement = find_config_prefix(&m);
 		if (listelement != NULL){
 			struct src_prefix_list *spl = listelement->data;
 			// set the dns base and set dictionary
@@ -159,7 +161,7 @@ prefix_block:
 		struct sockaddr_in6 *sa = &($2);
 		inet_ntop(AF_INET6, &(sa->sin6_addr), addr_str, sizeof(addr_str));
 		struct src_prefix_model m = {PFX_ANY, NULL, AF_INET6, (struct sockaddr *) sa, sizeof(struct sockaddr_in6)};
-		GSList *listelement = g_slist_find_custom(yymctx->prefixes, (gconstpointer) &m, &compare_src_prefix);
+		GSList *listelement = find_config_prefix(&m);
 		if (listelement != NULL){
 			struct src_prefix_list *spl = listelement->data;
 			// set the dns base and set dictionary
@@ -279,6 +281,18 @@ int yywrap()
         return 1;
 }
 
+/** find the prefix a prefix block applies to */
+GSList *find_config_prefix(struct src_prefix_model *m)
+{
+	GSList *listelement = g_slist_find_custom(yymctx->prefixes, (gconstpointer) m, &compare_src_prefix);
+
+	/* skip the ones configured before */
+	while (new_prefixes_only && listelement != NULL && (((struct src_prefix_list *) listelement->data)->pfx_flags & PFX_CONF))
+		listelement = g_slist_find_custom(listelement->next, (gconstpointer) m, &compare_src_prefix);
+
+	return listelement;
+}
+
 void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx)
 {
 
@@ -306,6 +320,25 @@ void mam_read_config(int config_fd, char **p_file_out, struct mam_context *ctx)
 
 }
 
+void mam_configure_new_prefixes(int config_fd, struct mam_context *ctx)
+{
+	char *p_file_saved = p_file;
+	char *p_file_ignored = NULL;
+	GHashTable *set_dict = ctx->policy_set_dict;
+
+	/* the policy settings go to a dictionary thrown away afterwards */
+	ctx->policy_set_dict = NULL;
+	new_prefixes_only = 1;
+	mam_read_config(config_fd, &p_file_ignored, ctx);
+	new_prefixes_only = 0;
+
+	g_hash_table_destroy(ctx->policy_set_dict);
+	ctx->policy_set_dict = set_dict;
+	if (p_file_ignored != p_file_saved)
+		free(p_file_ignored);
+	p_file = p_file_saved;
+}
+
 char *idup (int i)
 {
     char *p;
@@ -129,10 +129,47 @@ void mam_print_request_context(request_context_t *ctx)
 
 }
 
+request_context_t *mam_new_request_context(mam_context_t *mctx, struct _client_list *client)
+{
+	request_context_t *rctx;
+	muacc_arena_t *arena = _muacc_arena_get();
+	muacc_arena_t *prev = _muacc_arena_use(arena);
+
+	/* the request lives in its own arena - falls back to the heap if there is none */
+	rctx = _muacc_alloc(sizeof(struct request_context));
+	memset(rctx, 0, sizeof(struct request_context));
+	rctx->arena = arena;
+	rctx->ctx = _muacc_create_ctx();
+	_muacc_arena_use(prev);
+	rctx->mctx = mctx;
+	rctx->client = client;
+	rctx->lease_ttl = mctx->lease_ttl;
+	if (client != NULL)
+		uuid_copy(rctx->ctx->ctxid, client->id);
+
+	return rctx;
+}
+
 void mam_release_request_context(request_context_t *ctx)
 {
+	muacc_arena_t *arena = ctx->arena;
+
+	/* requests of a batch have arenas of their own */
+	while (ctx->batch != NULL)
+	{
+		request_context_t *item = ctx->batch;
+		ctx->batch = item->batch_next;
+		mam_release_request_context(item);
+	}
+
+	/* request is not outstanding anymore */
+	if (ctx->client != NULL && ctx->client->outstanding != NULL)
+		g_hash_table_remove(ctx->client->outstanding, ctx);
+
 	/* clean up old _muacc_ctx */
 	_muacc_free_ctx(ctx->ctx);
+	if (ctx->ctx_sent != NULL)
+		_muacc_free_ctx(ctx->ctx_sent);
 
 	/* clean up socket list */
 	while (ctx->sockets != NULL)
@@ -141,9 +178,14 @@ void mam_release_request_context(request_context_t *ctx)
 		ctx->sockets = socklist->next;
 
 		_muacc_free_ctx(socklist->ctx);
-		free(socklist);
+		_muacc_arena_free(arena, socklist);
 	}
 
-	free(ctx);
+	/* the policy may be closed once it has no requests left */
+	_mam_policy_unref(ctx->policy_gen);
+
+	/* everything else of the request goes at once */
+	_muacc_arena_free(arena, ctx);
+	_muacc_arena_put(arena);
 }
 
@@ -0,0 +1,340 @@
+/** \file mam_history.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "mam_history.h"
+
+#include "dlog.h"
+
+#ifndef MAM_HISTORY_NOISY_DEBUG
+#define MAM_HISTORY_NOISY_DEBUG 0
+#endif
+
+/** Running sum kept as the unevaluated sum of two doubles, so the difference of two of them
+ *  is exact for windows of small values behind large ones, e.g. an idle link after a busy one
+ */
+struct mam_history_dd {
+	double					hi;
+	double					lo;					/**< rounding errors of the additions to hi */
+};
+
+/** Running sums of samples, t relative to the base of the history */
+struct mam_history_sums {
+	struct mam_history_dd	v;
+	struct mam_history_dd	vv;
+	struct mam_history_dd	t;
+	struct mam_history_dd	tt;
+	struct mam_history_dd	tv;
+};
+
+struct mam_history_sample {
+	double					t;					/**< seconds since the base of the history */
+	double					v;
+	struct mam_history_sums	sums;				/**< of the samples from the base up to this one */
+};
+
+struct mam_history {
+	double					base;				/**< monotonic time t and the sums count from */
+	struct mam_history_sums	before;				/**< sums of the samples from the base up to the one before the oldest */
+	unsigned int			size;				/**< samples there is room for */
+	unsigned int			n;					/**< samples kept */
+	unsigned int			next;				/**< slot the next sample goes to */
+	struct mam_history_sample samples[];
+};
+
+double mam_history_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+mam_history_t *mam_history_new(unsigned int size)
+{
+	mam_history_t *h;
+
+	if (size == 0 || (h = malloc(sizeof(struct mam_history) + size * sizeof(struct mam_history_sample))) == NULL)
+		return NULL;
+
+	memset(h, 0, sizeof(struct mam_history));
+	h->size = size;
+	return h;
+}
+
+void mam_history_free(mam_history_t *h)
+{
+	free(h);
+}
+
+/** the i-th sample kept, counting from the oldest one */
+static inline const struct mam_history_sample *mam_history_sample(const mam_history_t *h, unsigned int i)
+{
+	return &(h->samples[(h->next + h->size - h->n + i) % h->size]);
+}
+
+/** sum = before + x, keeping the rounding error (two-sum) */
+static inline void mam_history_dd_add(struct mam_history_dd *sum, const struct mam_history_dd *before, double x)
+{
+	double hi = before->hi + x;
+	double b = hi - before->hi;
+
+	sum->lo = before->lo + ((before->hi - (hi - b)) + (x - b));
+	sum->hi = hi;
+}
+
+/** a - b */
+static inline double mam_history_dd_sub(const struct mam_history_dd *a, const struct mam_history_dd *b)
+{
+	return (a->hi - b->hi) + (a->lo - b->lo);
+}
+
+/** sums up to s: the ones before it plus its own */
+static void mam_history_sum(struct mam_history_sample *s, const struct mam_history_sums *before)
+{
+	mam_history_dd_add(&(s->sums.v), &(before->v), s->v);
+	mam_history_dd_add(&(s->sums.vv), &(before->vv), s->v * s->v);
+	mam_history_dd_add(&(s->sums.t), &(before->t), s->t);
+	mam_history_dd_add(&(s->sums.tt), &(before->tt), s->t * s->t);
+	mam_history_dd_add(&(s->sums.tv), &(before->tv), s->t * s->v);
+}
+
+/** make the oldest sample the base and sum up all samples again - once per wrap around, so amortized constant time */
+static void mam_history_rebase(mam_history_t *h)
+{
+	struct mam_history_sample *s;
+	const struct mam_history_sums *before;
+	double shift = mam_history_sample(h, 0)->t;
+	unsigned int i;
+
+	h->base += shift;
+	memset(&(h->before), 0, sizeof(struct mam_history_sums));
+
+	before = &(h->before);
+	for (i = 0; i < h->n; i++)
+	{
+		s = (struct mam_history_sample *) mam_history_sample(h, i);
+		s->t -= shift;
+		mam_history_sum(s, before);
+		before = &(s->sums);
+	}
+
+	DLOG(MAM_HISTORY_NOISY_DEBUG, "Rebased history of %u samples by %f s\n", h->n, shift);
+}
+
+void mam_history_add(mam_history_t *h, double t, double value)
+{
+	struct mam_history_sample *s;
+	struct mam_history_sums before;
+
+	if (h == NULL)
+		return;
+
+	if (h->n == 0)
+	{
+		h->base = t;
+		memset(&(h->before), 0, sizeof(struct mam_history_sums));
+	}
+
+	before = (h->n == 0) ? h->before : mam_history_sample(h, h->n - 1)->sums;
+
+	// the oldest sample is overwritten - windows starting after it need its sums
+	if (h->n == h->size)
+		h->before = h->samples[h->next].sums;
+	else
+		h->n++;
+
+	s = &(h->samples[h->next]);
+	s->t = t - h->base;
+	s->v = value;
+	mam_history_sum(s, &before);
+
+	if (++h->next == h->size)
+	{
+		h->next = 0;
+		if (h->n == h->size)
+			mam_history_rebase(h);
+	}
+}
+
+/** index of the oldest sample of the last window seconds, h->n if there is none */
+static unsigned int mam_history_find(const mam_history_t *h, double window)
+{
+	double from = mam_history_now() - window - h->base;
+	unsigned int lo = 0, hi = h->n, mid;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (mam_history_sample(h, mid)->t > from)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+unsigned int mam_history_stats(const mam_history_t *h, double window, struct mam_history_stats *stats)
+{
+	const struct mam_history_sums *first, *last;
+	double n, v, vv, t, tt, tv, var, denom;
+	unsigned int i;
+
+	memset(stats, 0, sizeof(struct mam_history_stats));
+	if (h == NULL || (i = mam_history_find(h, window)) >= h->n)
+		return 0;
+
+	// sums of the window: the ones up to its last sample minus the ones before its first
+	first = (i == 0) ? &(h->before) : &(mam_history_sample(h, i - 1)->sums);
+	last = &(mam_history_sample(h, h->n - 1)->sums);
+	n = h->n - i;
+	v = mam_history_dd_sub(&(last->v), &(first->v));
+	vv = mam_history_dd_sub(&(last->vv), &(first->vv));
+	t = mam_history_dd_sub(&(last->t), &(first->t));
+	tt = mam_history_dd_sub(&(last->tt), &(first->tt));
+	tv = mam_history_dd_sub(&(last->tv), &(first->tv));
+
+	stats->n = h->n - i;
+	stats->span = mam_history_sample(h, h->n - 1)->t - mam_history_sample(h, i)->t;
+	stats->mean = v / n;
+	var = vv / n - stats->mean * stats->mean;
+	stats->stddev = (var > 0) ? sqrt(var) : 0;
+
+	// least squares slope, 0 if all samples have the same time
+	denom = n * tt - t * t;
+	if (stats->span > 0 && denom > 0)
+		stats->trend = (n * tv - t * v) / denom;
+
+	return stats->n;
+}
+
+unsigned int mam_history_range(const mam_history_t *h, double window, double *min, double *max)
+{
+	double lowest, highest, v;
+	unsigned int i, j;
+
+	if (h == NULL || (i = mam_history_find(h, window)) >= h->n)
+		return 0;
+
+	lowest = highest = mam_history_sample(h, i)->v;
+	for (j = i + 1; j < h->n; j++)
+	{
+		v = mam_history_sample(h, j)->v;
+		if (v < lowest)
+			lowest = v;
+		if (v > highest)
+			highest = v;
+	}
+
+	if (min != NULL)
+		*min = lowest;
+	if (max != NULL)
+		*max = highest;
+	return h->n - i;
+}
+
+unsigned int mam_history_quantile(const mam_history_t *h, double window, double p, double *result)
+{
+	double *values;
+	unsigned int i, j;
+
+	if (h == NULL || (i = mam_history_find(h, window)) >= h->n)
+		return 0;
+
+	if ((values = malloc((h->n - i) * sizeof(double))) == NULL)
+		return 0;
+	for (j = i; j < h->n; j++)
+		values[j - i] = mam_history_sample(h, j)->v;
+
+	*result = mam_quantile(values, h->n - i, p);
+
+	free(values);
+	return h->n - i;
+}
+
+/** A random position between left and right, for pivots no input order can make bad all the time */
+static long random_position(long left, long right)
+{
+	static uint32_t state = 2463534242U;
+
+	// xorshift32
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return left + (long) (state % (uint32_t) (right - left + 1));
+}
+
+/** Move the k-th smallest of n values to values[k], the ones before it are not larger, the ones after it not smaller
+ *  Quickselect with a three-way partition, so runs of equal values do not make it quadratic
+ */
+static double select_kth(double *values, unsigned int n, unsigned int k)
+{
+	long left = 0, right = (long) n - 1;
+	long lt, gt, i;
+	double pivot, a, b, c, tmp;
+
+	while (left < right)
+	{
+		// median of three values at random positions as pivot
+		a = values[random_position(left, right)];
+		b = values[random_position(left, right)];
+		c = values[random_position(left, right)];
+		pivot = (a < b) ? ((b < c) ? b : ((a < c) ? c : a)) : ((a < c) ? a : ((b < c) ? c : b));
+
+		// [left, lt) is smaller than the pivot, [lt, gt] equal, (gt, right] larger
+		lt = left;
+		gt = right;
+		i = left;
+		while (i <= gt)
+		{
+			if (values[i] < pivot)
+			{
+				tmp = values[i]; values[i++] = values[lt]; values[lt++] = tmp;
+			}
+			else if (values[i] > pivot)
+			{
+				tmp = values[i]; values[i] = values[gt]; values[gt--] = tmp;
+			}
+			else
+			{
+				i++;
+			}
+		}
+
+		if ((long) k < lt)
+			right = lt - 1;
+		else if ((long) k > gt)
+			left = gt + 1;
+		else
+			return pivot;
+	}
+	return values[k];
+}
+
+double mam_quantile(double *values, unsigned int n, double p)
+{
+	double pos = p * (n - 1);
+	unsigned int k = (unsigned int) pos;
+	double lower = select_kth(values, n, k);
+	double upper;
+
+	if (k + 1 >= n || pos == k)
+		return lower;
+
+	// the next rank is the smallest of the values after the k-th
+	upper = values[k + 1];
+	for (unsigned int i = k + 2; i < n; i++)
+		if (values[i] < upper)
+			upper = values[i];
+
+	return lower + (pos - k) * (upper - lower);
+}
@@ -0,0 +1,76 @@
+/** \file  mam_history.h
+ *  \brief Windowed history of the measurements of prefixes and interfaces
+ *
+ *  A history is a ring of the last samples of one measurement, each with the
+ *  monotonic time it was taken at (see mam_history_now). pmeasure adds one sample
+ *  per round, policies ask for aggregates over the last seconds, e.g. the lowest
+ *  RTT of the last 10 s or the 95th percentile of the download rate of the last
+ *  minute - longer windows end at the oldest sample still kept.
+ *
+ *  Every sample carries the running sums of the samples up to it, so count, mean,
+ *  standard deviation and trend of a window come from two of them, found by a
+ *  binary search on the times. Minimum, maximum and quantiles look at each sample
+ *  of the window. The running sums start over at the oldest sample whenever the
+ *  ring wrapped around once, so they do not lose precision over time.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_HISTORY_H__
+#define __MAM_HISTORY_H__
+
+#ifndef MAM_HISTORY_SIZE
+#define MAM_HISTORY_SIZE 1024	/**< samples pmeasure keeps per measurement, about 100 s at one round per 100 ms */
+#endif
+
+typedef struct mam_history mam_history_t;
+
+/** Aggregates of the samples of a window */
+struct mam_history_stats {
+	unsigned int	n;			/**< samples in the window */
+	double			span;		/**< seconds from the first to the last of them */
+	double			mean;
+	double			stddev;		/**< standard deviation of the samples */
+	double			trend;		/**< slope of the least squares line through them, change per second */
+};
+
+/** current time of the monotonic clock the samples are taken with, in seconds */
+double mam_history_now(void);
+
+/** create an empty history for up to size samples
+ *
+ * @return the history, NULL if out of memory or size is 0
+ */
+mam_history_t *mam_history_new(unsigned int size);
+
+/** free a history created by mam_history_new */
+void mam_history_free(mam_history_t *h);
+
+/** add a sample taken at time t (see mam_history_now) - t must not be before the one of the sample added last */
+void mam_history_add(mam_history_t *h, double t, double value);
+
+/** count, mean, standard deviation and trend of the samples of the last window seconds
+ *  In constant time plus a binary search, however long the window is
+ *
+ * @return number of samples in the window, 0 if there are none (stats are zeroed then)
+ */
+unsigned int mam_history_stats(const mam_history_t *h, double window, struct mam_history_stats *stats);
+
+/** lowest and highest of the samples of the last window seconds, min or max may be NULL
+ *
+ * @return number of samples in the window, 0 if there are none (min and max are left alone then)
+ */
+unsigned int mam_history_range(const mam_history_t *h, double window, double *min, double *max);
+
+/** p-th quantile (0 <= p <= 1) of the samples of the last window seconds, see mam_quantile
+ *
+ * @return number of samples in the window, 0 if there are none or out of memory (result is left alone then)
+ */
+unsigned int mam_history_quantile(const mam_history_t *h, double window, double p, double *result);
+
+/** p-th quantile (0 <= p <= 1) of n > 0 values, interpolated between the two closest ranks
+ *  Linear time by quickselect, the values are reordered in place
+ */
+double mam_quantile(double *values, unsigned int n, double p);
+
+#endif /* __MAM_HISTORY_H__ */
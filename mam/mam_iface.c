@@ -34,6 +34,9 @@
 
 #include "mam.h"
 #include "mam_util.h"
+#include "mam_worker.h"
+#include "mam_lpm.h"
+#include "mam_history.h"
 
 #ifndef MAM_IF_NOISY_DEBUG0
 #define MAM_IF_NOISY_DEBUG0 0
@@ -218,37 +221,97 @@ struct iface_list *_add_iface_to_list (
 	}
 }
 
+/** Size of the socket addresses of a family we keep prefixes for, 0 for others */
+static socklen_t _family_size (int family)
+{
+	return (family == AF_INET)  ? sizeof(struct sockaddr_in)  :
+	       (family == AF_INET6) ? sizeof(struct sockaddr_in6) :
+	       0;
+}
+
+/** Check whether two socket addresses carry the same IP address */
+static int _same_addr (const struct sockaddr *a, const struct sockaddr *b)
+{
+	if (a == NULL || b == NULL || a->sa_family != b->sa_family)
+		return 0;
+
+	if (a->sa_family == AF_INET)
+		return memcmp(&(((struct sockaddr_in *) a)->sin_addr), &(((struct sockaddr_in *) b)->sin_addr), sizeof(struct in_addr)) == 0;
+	if (a->sa_family == AF_INET6)
+		return memcmp(&(((struct sockaddr_in6 *) a)->sin6_addr), &(((struct sockaddr_in6 *) b)->sin6_addr), sizeof(struct in6_addr)) == 0;
+
+	return 0;
+}
+
+/** Remember a prefix in one of the lists of a change set, unless it is there already */
+static void _note_prefix (GSList **l, struct src_prefix_list *pfx)
+{
+	if (g_slist_find(*l, pfx) == NULL)
+		*l = g_slist_append(*l, pfx);
+}
+
+/** Take a prefix out of the prefix list
+ *  Prefixes the policy never saw are freed right away, the others once the changes are applied
+ */
+static void _unlink_prefix (
+	mam_context_t *ctx,
+	mam_prefix_changes_t *chg,
+	struct src_prefix_list *pfx)
+{
+	ctx->prefixes = g_slist_remove(ctx->prefixes, pfx);
+	chg->changed = g_slist_remove(chg->changed, pfx);
+
+	if (g_slist_find(chg->added, pfx) != NULL)
+	{
+		chg->added = g_slist_remove(chg->added, pfx);
+		_free_src_prefix_list(pfx);
+		return;
+	}
+
+	chg->removed = g_slist_append(chg->removed, pfx);
+}
+
 /** Incorporate an address into the source prefix list:
  *  If a matching prefix exists, add it to this prefix' addr_list
  *  If no matching prefix exists yet, create one
  */
-static void _scan_update_prefix (
-	GSList **spfxl,
-	struct iface_list *iflistentry,
-	char *if_name, unsigned int if_flags,
+int mam_prefix_add_addr (
+	mam_context_t *ctx,
+	mam_prefix_changes_t *chg,
+	const char *if_name, unsigned int if_flags,
 	int family,
-	struct sockaddr *addr,
-	struct sockaddr *mask)
+	const struct sockaddr *addr,
+	const struct sockaddr *mask)
 {
 	GSList *cur = NULL;
-	size_t family_size = (family == AF_INET)  ? sizeof(struct sockaddr_in)  :
-	 					 (family == AF_INET6) ? sizeof(struct sockaddr_in6) :
-						 -1;
-	struct sockaddr_list *cus;
-	
-	
+	socklen_t family_size = _family_size(family);
+	struct sockaddr_list **cus;
+	struct src_prefix_list *pfx;
+
+	if (family_size == 0 || if_name == NULL || addr == NULL || mask == NULL)
+		return -1;
+
 	/* scan through prefixes */
 	struct src_prefix_model model = {PFX_ANY, if_name, family, addr, family_size};
-	cur = g_slist_find_custom(*spfxl, (gconstpointer) &model, &compare_src_prefix);
+	cur = g_slist_find_custom(ctx->prefixes, (gconstpointer) &model, &compare_src_prefix);
 
 	if (cur != NULL)
 	{
 		/* Prefix already exists within the list: append this address to its address list */
+		pfx = cur->data;
+		pfx->if_flags = if_flags;
+
+		for(cus = &(pfx->if_addrs); *cus != NULL; cus = &((*cus)->next))
+		{
+			if (_same_addr((*cus)->addr, addr))
+				return 0;
+		}
+		if (_append_sockaddr_list(cus, (struct sockaddr *) addr, family_size) != 0)
+			return -1;
 
-		for(cus = ((struct src_prefix_list *)cur->data)->if_addrs; cus->next != NULL; cus = cus->next);
-		; 
-		_append_sockaddr_list( &(cus->next), addr, family_size);
-		return;			
+		if (g_slist_find(chg->added, pfx) == NULL)
+			_note_prefix(&(chg->changed), pfx);
+		return 1;
 	}
 	
 	/* we have a new prefix: append it to the prefix list */
@@ -257,110 +320,293 @@ static void _scan_update_prefix (
 	struct src_prefix_list *new = NULL;
 	new = malloc(sizeof(struct src_prefix_list));
 	if(new == NULL)
-		{ DLOG(1, "malloc failed"); return; } 
+		{ DLOG(1, "malloc failed"); return -1; } 
 	memset(new, 0, sizeof(struct src_prefix_list));
 	
 	/* copy data */
 	new->if_name = _muacc_clone_string(if_name);
 	new->family = family;
 	new->if_flags = if_flags;
-	_append_sockaddr_list( &(new->if_addrs), addr, family_size);
+	_append_sockaddr_list( &(new->if_addrs), (struct sockaddr *) addr, family_size);
 	new->if_netmask = _muacc_clone_sockaddr(mask, family_size);
 	new->if_netmask_len = family_size;
 
 	/* add pointer to the interface list item of the interface that this prefix belongs to */
-	new->iface = iflistentry;
+	new->iface = _add_iface_to_list(&(ctx->ifaces), (char *) if_name);
 
 	new->measure_dict = g_hash_table_new(g_str_hash, g_str_equal);
 	
 	/* append to list */
-	*spfxl = g_slist_append(*spfxl, (gpointer) new);
+	ctx->prefixes = g_slist_append(ctx->prefixes, (gpointer) new);
+	chg->added = g_slist_append(chg->added, new);
 
-	return;
+	DLOG(MAM_IF_NOISY_DEBUG1, "%s: new prefix\n", if_name);
+	return 1;
 }
 
-/** Scan for interfaces/addresses available on the host
- *  Create a new src_prefix_list and add all active interfaces, prefixes and addresses to it
- */
-int update_src_prefix_list (mam_context_t *ctx )
+int mam_prefix_del_addr (
+	mam_context_t *ctx,
+	mam_prefix_changes_t *chg,
+	const char *if_name,
+	int family,
+	const struct sockaddr *addr)
 {
-	GSList **spfxl = &ctx->prefixes;
-	GSList **ifacel = &ctx->ifaces;
+	struct src_prefix_list *pfx;
+	struct sockaddr_list **cus;
+	struct sockaddr_list *gone;
+	GSList *cur;
+
+	for (cur = ctx->prefixes; cur != NULL; cur = cur->next)
+	{
+		pfx = cur->data;
+		if (pfx->family != family || (if_name != NULL && strcmp(pfx->if_name, if_name) != 0))
+			continue;
 
-    struct ifaddrs *ifaddr, *ifa;
-    int family;
+		for (cus = &(pfx->if_addrs); *cus != NULL; cus = &((*cus)->next))
+		{
+			if (!_same_addr((*cus)->addr, addr))
+				continue;
 
-    DLOG(MAM_IF_NOISY_DEBUG0, "creating a list of the currently active interfaces\n");
+			gone = *cus;
+			*cus = gone->next;
+			free(gone->addr);
+			free(gone);
 
-    if (getifaddrs(&ifaddr) == -1) {
-        perror("getifaddrs");
-        return(-1);
-    }
-	
-	if(*spfxl != NULL) 
+			if (pfx->if_addrs == NULL)
+			{
+				DLOG(MAM_IF_NOISY_DEBUG1, "%s: prefix lost its last address\n", pfx->if_name);
+				_unlink_prefix(ctx, chg, pfx);
+			}
+			else if (g_slist_find(chg->added, pfx) == NULL)
+			{
+				_note_prefix(&(chg->changed), pfx);
+			}
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int mam_iface_del (
+	mam_context_t *ctx,
+	mam_prefix_changes_t *chg,
+	const char *if_name,
+	int gone)
+{
+	struct src_prefix_list *pfx;
+	GSList *cur, *next;
+	int n = 0;
+
+	for (cur = ctx->prefixes; cur != NULL; cur = next)
 	{
-		g_slist_free_full(*spfxl, &_free_src_prefix_list);
+		next = cur->next;
+		pfx = cur->data;
+		if (strcmp(pfx->if_name, if_name) == 0)
+		{
+			_unlink_prefix(ctx, chg, pfx);
+			n++;
+		}
 	}
 
-	if(*ifacel != NULL)
+	if (gone && (cur = g_slist_find_custom(ctx->ifaces, (gconstpointer) if_name, &compare_if_name)) != NULL)
 	{
-		g_slist_free_full(*ifacel, &_free_iface_list);
+		DLOG(MAM_IF_NOISY_DEBUG1, "%s: interface went away\n", if_name);
+		chg->ifaces_removed = g_slist_append(chg->ifaces_removed, cur->data);
+		ctx->ifaces = g_slist_delete_link(ctx->ifaces, cur);
 	}
 
-    /* Walk through linked list, maintaining head pointer so we
-       can free list later */
-    for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) 
-    {
-		if((ifa->ifa_flags & IFF_UP)==0) 
-		{
-            DLOG(MAM_IF_NOISY_DEBUG2, "%s: interface down - skipping\n", ifa->ifa_name);
-        	continue;
-		} 
-		else if(ifa->ifa_addr == NULL) 
+	return n;
+}
+
+/** Check whether an entry of getifaddrs() is an address we keep a prefix for */
+static int _usable_ifaddr (struct ifaddrs *ifa)
+{
+	if((ifa->ifa_flags & IFF_UP)==0) 
+	{
+		DLOG(MAM_IF_NOISY_DEBUG2, "%s: interface down - skipping\n", ifa->ifa_name);
+		return 0;
+	} 
+	else if(ifa->ifa_addr == NULL || ifa->ifa_netmask == NULL) 
+	{
+		DLOG(MAM_IF_NOISY_DEBUG2, "%s: address family: (NULL) - skipping\n", ifa->ifa_name);
+		return 0;
+	}
+
+	return _family_size(ifa->ifa_addr->sa_family) != 0;
+}
+
+/** An address of a prefix that is no longer on the system, removed once all prefixes were checked */
+struct _stale_addr {
+	char *if_name;
+	int family;
+	struct sockaddr *addr;
+};
+
+int mam_prefix_rescan (mam_context_t *ctx, mam_prefix_changes_t *chg)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	struct src_prefix_list *pfx;
+	struct iface_list *iface;
+	struct sockaddr_list *cus;
+	struct _stale_addr *gone;
+	GSList *stale = NULL;
+	GSList *cur;
+	int family;
+
+	DLOG(MAM_IF_NOISY_DEBUG0, "updating the list of the currently active interfaces\n");
+
+	if (getifaddrs(&ifaddr) == -1) {
+		perror("getifaddrs");
+		return(-1);
+	}
+
+	/* addresses no longer there - collected first, as removing them unlinks and may free their prefix */
+	for (cur = ctx->prefixes; cur != NULL; cur = cur->next)
+	{
+		pfx = cur->data;
+		for (cus = pfx->if_addrs; cus != NULL; cus = cus->next)
 		{
-            DLOG(MAM_IF_NOISY_DEBUG2, "%s: address family: (NULL) - skipping\n", ifa->ifa_name);
-            continue;
-		}
-		
-		family = ifa->ifa_addr->sa_family;
-		
-		if (family == AF_INET || family == AF_INET6)
-        {
-            DLOG(MAM_IF_NOISY_DEBUG2, "%s: adding address (", ifa->ifa_name);
-			#if MAM_IF_NOISY_DEBUG2 != 0
-        	/* Display interface name and family (including symbolic
-               form of the latter for the common families) */
-		    char addr[NI_MAXHOST];
-		    char mask[NI_MAXHOST];
-			int s;
-            s = getnameinfo(ifa->ifa_addr,
-                (family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-                addr, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
-	        s = getnameinfo(ifa->ifa_netmask,
-	            (family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6),
-	            mask, NI_MAXHOST, NULL, 0, NI_NUMERICHOST);
-			if (s == 0)
+			for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+			{
+				if (_usable_ifaddr(ifa) && strcmp(ifa->ifa_name, pfx->if_name) == 0 && _same_addr(ifa->ifa_addr, cus->addr))
+					break;
+			}
+			if (ifa == NULL && (gone = malloc(sizeof(struct _stale_addr))) != NULL)
 			{
-				fprintf(stderr, "family: %d%s, address: %s mask: %s)\n",
-					 family,
-					 (family == AF_INET) ?   " (AF_INET)" :
-					 (family == AF_INET6) ?  " (AF_INET6)" : "",
-					 addr, mask);
+				gone->if_name = _muacc_clone_string(pfx->if_name);
+				gone->family = pfx->family;
+				gone->addr = _muacc_clone_sockaddr(cus->addr, cus->addr_len);
+				stale = g_slist_append(stale, gone);
 			}
-			#endif
-
-			/* add to interface list if it does not exist yet */
-			struct iface_list *iflistentry = _add_iface_to_list( ifacel, ifa->ifa_name);
-				 
-			/* add to source prefix list */
-			_scan_update_prefix( spfxl, iflistentry,
-				ifa->ifa_name, ifa->ifa_flags,
-				family, ifa->ifa_addr, ifa->ifa_netmask );
 		}
-    }
+	}
+	while (stale != NULL)
+	{
+		gone = stale->data;
+		mam_prefix_del_addr(ctx, chg, gone->if_name, gone->family, gone->addr);
+		free(gone->if_name);
+		free(gone->addr);
+		free(gone);
+		stale = g_slist_delete_link(stale, stale);
+	}
 
-    freeifaddrs(ifaddr);
-    return(0);
+	/* addresses that are new */
+	for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next) 
+	{
+		if (!_usable_ifaddr(ifa))
+			continue;
+
+		family = ifa->ifa_addr->sa_family;
+		DLOG(MAM_IF_NOISY_DEBUG2, "%s: found address of family %d\n", ifa->ifa_name, family);
+		mam_prefix_add_addr(ctx, chg, ifa->ifa_name, ifa->ifa_flags, family, ifa->ifa_addr, ifa->ifa_netmask);
+	}
+
+	/* interfaces that do not exist anymore */
+	for (cur = ctx->ifaces; cur != NULL; cur = cur->next)
+	{
+		iface = cur->data;
+		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+		{
+			if (strcmp(ifa->ifa_name, iface->if_name) == 0)
+				break;
+		}
+		if (ifa == NULL)
+			stale = g_slist_append(stale, _muacc_clone_string(iface->if_name));
+	}
+	while (stale != NULL)
+	{
+		mam_iface_del(ctx, chg, stale->data, 1);
+		free(stale->data);
+		stale = g_slist_delete_link(stale, stale);
+	}
+
+	freeifaddrs(ifaddr);
+	return(0);
+}
+
+/** Scan for interfaces/addresses available on the host
+ *  Add the active interfaces, prefixes and addresses not known yet and remove the ones gone
+ */
+int update_src_prefix_list (mam_context_t *ctx )
+{
+	mam_prefix_changes_t chg;
+	int ret;
+
+	mam_prefix_changes_init(ctx, &chg);
+	ret = mam_prefix_rescan(ctx, &chg);
+	mam_prefix_changes_apply(ctx, &chg);
+
+	return(ret);
+}
+
+void mam_prefix_changes_init (mam_context_t *ctx, mam_prefix_changes_t *chg)
+{
+	memset(chg, 0, sizeof(mam_prefix_changes_t));
+	chg->before = g_slist_copy(ctx->prefixes);
+}
+
+int mam_prefix_changes_pending (const mam_prefix_changes_t *chg)
+{
+	return chg->added != NULL || chg->changed != NULL || chg->removed != NULL || chg->ifaces_removed != NULL;
+}
+
+/** Tell the policy about the prefixes of one list of a change set */
+static void _notify_prefixes (mam_context_t *ctx, const mam_policy_t *ops, GSList *l, int event)
+{
+	for (; l != NULL; l = l->next)
+		ops->on_prefix_change(ctx, (struct src_prefix_list *) l->data, event);
+}
+
+void mam_prefix_changes_apply (mam_context_t *ctx, mam_prefix_changes_t *chg)
+{
+	const mam_policy_t *ops = mam_policy_ops(ctx);
+	GSList *now;
+
+	if (mam_prefix_changes_pending(chg))
+	{
+		DLOG(MAM_IF_NOISY_DEBUG0, "prefixes changed: %u added, %u changed, %u removed\n",
+			g_slist_length(chg->added), g_slist_length(chg->changed), g_slist_length(chg->removed));
+
+		if (ctx->policy_gen != NULL && ops->on_prefix_change != NULL)
+		{
+			_notify_prefixes(ctx, ops, chg->removed, MAM_PREFIX_REMOVED);
+			_notify_prefixes(ctx, ops, chg->changed, MAM_PREFIX_CHANGED);
+			_notify_prefixes(ctx, ops, chg->added, MAM_PREFIX_ADDED);
+		}
+		else if (ctx->policy_gen != NULL)
+		{
+			/* policy cannot follow the changes - set it up again from scratch */
+			DLOG(MAM_IF_NOISY_DEBUG1, "policy has no on_prefix_change - initializing it again\n");
+			now = ctx->prefixes;
+			ctx->prefixes = chg->before;
+			if (ops->cleanup != NULL)
+				ops->cleanup(ctx);
+			ctx->prefixes = now;
+			if (ops->init != NULL)
+				ops->init(ctx);
+		}
+
+		if (chg->added != NULL || chg->removed != NULL)
+		{
+			/* the workers see the new index once they are resumed */
+			mam_lpm_free(ctx->prefix_lpm);
+			ctx->prefix_lpm = mam_lpm_build(ctx->prefixes);
+
+			/* the workers copy the DNS bases of the prefixes there are */
+			mam_workers_reconfigured();
+		}
+
+		/* leased addresses may be gone */
+		mam_revoke_leases(ctx);
+	}
+
+	g_slist_free_full(chg->removed, &_free_src_prefix_list);
+	g_slist_free_full(chg->ifaces_removed, &_free_iface_list);
+	g_slist_free(chg->before);
+	g_slist_free(chg->added);
+	g_slist_free(chg->changed);
+	memset(chg, 0, sizeof(mam_prefix_changes_t));
 }
 
 /** Tear down a interface list structure */
@@ -377,6 +623,9 @@ void _free_iface_list (gpointer data)
 	if(element->measure_dict != NULL)
 		g_hash_table_destroy(element->measure_dict);
 
+	for (int i = 0; i < IFACE_HISTORY_MAX; i++)
+		mam_history_free(element->history[i]);
+
 	free(element);
 
 	return;
@@ -416,6 +665,9 @@ void _free_src_prefix_list (gpointer data)
 	if(element->measure_dict != NULL)
 		g_hash_table_destroy(element->measure_dict);
 
+	for (int i = 0; i < PFX_HISTORY_MAX; i++)
+		mam_history_free(element->history[i]);
+
 	free(element);
 
 	return;
@@ -0,0 +1,67 @@
+/** \file mam_logcsv.c
+ *  \brief Turn binary measurement logs of MAM back into CSV
+ *
+ *  Usage: mam-logcsv [-n] [file ...]
+ *
+ *  Prints the rows of each binary log (see muacc_log.h), or of the standard input
+ *  if no file is given, as the CSV lines MAM writes when it logs CSV. With -n,
+ *  a line with the names of the columns comes first.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "muacc_log.h"
+
+/** convert one log, return 0 on success */
+static int convert(FILE *in, const char *name, int names)
+{
+	if (_muacc_log_convert(in, stdout, names) < 0)
+	{
+		fprintf(stderr, "%s: not a binary log or truncated\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in;
+	int names = 0;
+	int ret = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n")) != -1)
+	{
+		if (opt != 'n')
+		{
+			fprintf(stderr, "usage: %s [-n] [file ...]\n", argv[0]);
+			return 2;
+		}
+		names = 1;
+	}
+
+	if (optind == argc)
+		return (convert(stdin, "stdin", names) < 0) ? 1 : 0;
+
+	for (; optind < argc; optind++)
+	{
+		if ((in = fopen(argv[optind], "r")) == NULL)
+		{
+			fprintf(stderr, "%s: %s\n", argv[optind], strerror(errno));
+			ret = 1;
+			continue;
+		}
+		if (convert(in, argv[optind], names) < 0)
+			ret = 1;
+		fclose(in);
+	}
+
+	return ret;
+}
@@ -0,0 +1,214 @@
+/** \file mam_lpm.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "mam_lpm.h"
+
+#include "dlog.h"
+
+#ifndef MAM_LPM_NOISY_DEBUG
+#define MAM_LPM_NOISY_DEBUG 0
+#endif
+
+#define MAM_LPM_WORDS 4		/**< 32 bit words of the longest key (IPv6) */
+
+/** Node of the trie - the first plen bits of key are the same for all addresses below it */
+struct mam_lpm_node {
+	uint32_t				key[MAM_LPM_WORDS];	/**< bits of the node in host byte order, zero beyond plen */
+	unsigned int			plen;				/**< number of bits of key that count */
+	struct src_prefix_list	*pfx;				/**< prefix with exactly these bits, NULL for branching nodes */
+	struct mam_lpm_node		*child[2];			/**< subtries by the bit after plen */
+};
+
+struct mam_lpm {
+	struct mam_lpm_node		*root4;				/**< trie of the IPv4 prefixes */
+	struct mam_lpm_node		*root6;				/**< trie of the IPv6 prefixes */
+	struct mam_lpm_node		*nodes;				/**< all nodes in one allocation */
+	unsigned int			n_nodes;			/**< nodes in use */
+	unsigned int			max_nodes;			/**< nodes allocated */
+};
+
+/** bit i of a key, counting from the most significant one */
+static inline int mam_lpm_bit(const uint32_t *key, unsigned int i)
+{
+	return (key[i >> 5] >> (31 - (i & 31))) & 1;
+}
+
+/** number of leading bits two keys have in common, at most max */
+static unsigned int mam_lpm_common(const uint32_t *a, const uint32_t *b, unsigned int max)
+{
+	unsigned int w, n;
+	uint32_t x;
+
+	for (w = 0; w * 32 < max; w++)
+	{
+		if ((x = a[w] ^ b[w]) != 0)
+		{
+			n = w * 32 + __builtin_clz(x);
+			return (n < max) ? n : max;
+		}
+	}
+	return max;
+}
+
+/** key and length of an address, 0 if it has no family we index */
+static unsigned int mam_lpm_key(const struct sockaddr *addr, uint32_t *key)
+{
+	const unsigned char *bytes;
+	unsigned int w, n;
+
+	if (addr->sa_family == AF_INET)
+	{
+		bytes = (const unsigned char *) &(((const struct sockaddr_in *) addr)->sin_addr);
+		n = 1;
+	}
+	else if (addr->sa_family == AF_INET6)
+	{
+		bytes = (const unsigned char *) &(((const struct sockaddr_in6 *) addr)->sin6_addr);
+		n = 4;
+	}
+	else
+	{
+		return 0;
+	}
+
+	memset(key, 0, MAM_LPM_WORDS * sizeof(uint32_t));
+	for (w = 0; w < n; w++)
+		key[w] = ((uint32_t) bytes[4*w] << 24) | ((uint32_t) bytes[4*w+1] << 16) | ((uint32_t) bytes[4*w+2] << 8) | bytes[4*w+3];
+
+	return n * 32;
+}
+
+/** take a node from the pool, with the first plen bits of key */
+static struct mam_lpm_node *mam_lpm_node_new(mam_lpm_t *lpm, const uint32_t *key, unsigned int plen, struct src_prefix_list *pfx)
+{
+	struct mam_lpm_node *node = &(lpm->nodes[lpm->n_nodes++]);
+	unsigned int w;
+
+	memset(node, 0, sizeof(struct mam_lpm_node));
+	for (w = 0; w * 32 < plen; w++)
+		node->key[w] = (plen - w * 32 >= 32) ? key[w] : key[w] & ~(0xffffffffU >> (plen - w * 32));
+	node->plen = plen;
+	node->pfx = pfx;
+
+	return node;
+}
+
+/** add a prefix to a trie - needs at most two free nodes */
+static void mam_lpm_insert(mam_lpm_t *lpm, struct mam_lpm_node **link, const uint32_t *key, unsigned int plen, struct src_prefix_list *pfx)
+{
+	struct mam_lpm_node *node, *branch;
+	unsigned int common;
+
+	while ((node = *link) != NULL)
+	{
+		common = mam_lpm_common(node->key, key, (node->plen < plen) ? node->plen : plen);
+
+		if (common < node->plen)
+		{
+			/* the new prefix leaves the path of the node: put a node for the common bits in between */
+			if (common == plen)
+			{
+				branch = mam_lpm_node_new(lpm, key, plen, pfx);
+			}
+			else
+			{
+				branch = mam_lpm_node_new(lpm, key, common, NULL);
+				branch->child[mam_lpm_bit(key, common)] = mam_lpm_node_new(lpm, key, plen, pfx);
+			}
+			branch->child[mam_lpm_bit(node->key, common)] = node;
+			*link = branch;
+			return;
+		}
+
+		if (node->plen == plen)
+		{
+			/* the first prefix with these bits wins */
+			if (node->pfx == NULL)
+				node->pfx = pfx;
+			return;
+		}
+
+		link = &(node->child[mam_lpm_bit(key, node->plen)]);
+	}
+
+	*link = mam_lpm_node_new(lpm, key, plen, pfx);
+}
+
+mam_lpm_t *mam_lpm_build(GSList *prefixes)
+{
+	mam_lpm_t *lpm;
+	struct src_prefix_list *pfx;
+	uint32_t key[MAM_LPM_WORDS], mask[MAM_LPM_WORDS];
+	unsigned int bits, plen;
+	GSList *l;
+
+	if ((lpm = malloc(sizeof(struct mam_lpm))) == NULL)
+		return NULL;
+	memset(lpm, 0, sizeof(struct mam_lpm));
+
+	lpm->max_nodes = 2 * g_slist_length(prefixes);
+	if (lpm->max_nodes > 0 && (lpm->nodes = malloc(lpm->max_nodes * sizeof(struct mam_lpm_node))) == NULL)
+	{
+		free(lpm);
+		return NULL;
+	}
+
+	for (l = prefixes; l != NULL; l = l->next)
+	{
+		pfx = l->data;
+		if (pfx == NULL || pfx->if_addrs == NULL || pfx->if_netmask == NULL)
+			continue;
+		if ((bits = mam_lpm_key(pfx->if_addrs->addr, key)) == 0 || mam_lpm_key(pfx->if_netmask, mask) != bits)
+			continue;
+
+		/* the prefix length is the number of leading ones of the netmask */
+		for (plen = 0; plen < bits && mam_lpm_bit(mask, plen); plen++)
+			;
+
+		mam_lpm_insert(lpm, (bits == 32) ? &(lpm->root4) : &(lpm->root6), key, plen, pfx);
+	}
+
+	DLOG(MAM_LPM_NOISY_DEBUG, "Indexed %u prefixes in %u nodes\n", g_slist_length(prefixes), lpm->n_nodes);
+	return lpm;
+}
+
+void mam_lpm_free(mam_lpm_t *lpm)
+{
+	if (lpm == NULL)
+		return;
+
+	free(lpm->nodes);
+	free(lpm);
+}
+
+struct src_prefix_list *mam_lpm_lookup(const mam_lpm_t *lpm, const struct sockaddr *addr)
+{
+	const struct mam_lpm_node *node;
+	struct src_prefix_list *best = NULL;
+	uint32_t key[MAM_LPM_WORDS];
+	unsigned int bits;
+
+	if (lpm == NULL || addr == NULL || (bits = mam_lpm_key(addr, key)) == 0)
+		return NULL;
+
+	node = (bits == 32) ? lpm->root4 : lpm->root6;
+	while (node != NULL && mam_lpm_common(node->key, key, node->plen) == node->plen)
+	{
+		if (node->pfx != NULL)
+			best = node->pfx;
+		if (node->plen == bits)
+			break;
+		node = node->child[mam_lpm_bit(key, node->plen)];
+	}
+
+	return best;
+}
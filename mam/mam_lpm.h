@@ -0,0 +1,40 @@
+/** \file  mam_lpm.h
+ *  \brief Longest prefix match index from addresses to source prefixes
+ *
+ *  A path-compressed binary trie per address family, built from the prefix
+ *  list of a MAM context whenever prefixes come or go (see mam_prefix_changes_apply)
+ *  and kept in mctx->prefix_lpm. A lookup compares the address with one node
+ *  per branching point on its path, one 32 bit word at a time, instead of with
+ *  every prefix of the list.
+ *
+ *  If several prefixes of the list have the same network (e.g. link local
+ *  ones on different interfaces), the first one in the list is indexed.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_LPM_H__
+#define __MAM_LPM_H__
+
+#include <sys/socket.h>
+
+#include "mam.h"
+
+typedef struct mam_lpm mam_lpm_t;
+
+/** build the index of a list of src_prefix_list
+ *
+ * @return the index, NULL if out of memory
+ */
+mam_lpm_t *mam_lpm_build(GSList *prefixes);
+
+/** free an index built by mam_lpm_build */
+void mam_lpm_free(mam_lpm_t *lpm);
+
+/** find the most specific prefix an address belongs to
+ *
+ * @return the prefix, NULL if there is none or lpm is NULL
+ */
+struct src_prefix_list *mam_lpm_lookup(const mam_lpm_t *lpm, const struct sockaddr *addr);
+
+#endif /* __MAM_LPM_H__ */
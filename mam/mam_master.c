@@ -5,22 +5,28 @@
  */
 
 #include <signal.h>
+#include <pthread.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 
 #include "muacc.h"
 #include "muacc_ctx.h"
 #include "muacc_tlv.h"
+#include "muacc_util.h"
 
 #include "mam_pmeasure.h"
 
 #include "mam_configp.h"
 #include "mam.h"
+#include "mam_shm.h"
+#include "mam_worker.h"
+#include "mam_rtnl.h"
 
 #include "mam_netlink.h"
 
 
-#define MIN_BUF (sizeof(muacc_tlv_t)+sizeof(size_t))
+/* smallest TLV of protocol version 2 - tag and length byte */
+#define MIN_BUF 2
 #define MAX_BUF 0
 
 #ifndef MAM_MASTER_NOISY_DEBUG0
@@ -40,37 +46,169 @@ const char fifo_path[] = "/tmp/mam_config_fifo";
 char configfile_path[255]; 
 int config_fd = -1;
 
+/** protects global_mctx->clients - workers remove their clients themselves */
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void clean_client_state(GSList *client);
-int compare_id_in_struct(gconstpointer list_data,  gconstpointer user_data);
+
+static void mamsock_errorcb(struct bufferevent *bev, short error, void *arg);
+static void mamshm_readcb(evutil_socket_t fd, short what, void *arg);
+
+/** switch a client to shared memory rings
+ *
+ */
+static void switch_to_shm(struct request_context *ctx)
+{
+	client_list_t *client = ctx->client;
+	struct mam_shm *shm;
+
+	if (client->shm != NULL || (shm = _mam_shm_offer(ctx)) == NULL)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "Client %d cannot use shared memory - staying with the socket\n", client->client_sk);
+		_muacc_send_ctx_event(ctx, muacc_error_unknown_request);
+		return;
+	}
+
+	mam_release_request_context(ctx);
+	client->shm = shm;
+
+	/* the client already got the rings - if we cannot watch them, it has to reconnect,
+	 * the socket callbacks drop it once the shutdown is noticed */
+	if ((shm->ev = event_new(client->mctx->ev_base, shm->efd_mam, EV_READ|EV_PERSIST, &mamshm_readcb, client)) == NULL ||
+		event_add(shm->ev, NULL) != 0)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "Could not watch shared memory of client %d\n", client->client_sk);
+		shutdown(client->client_sk, SHUT_RDWR);
+		return;
+	}
+
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "Client %d talks through shared memory from now on\n", client->client_sk);
+}
+
+static void process_mam_request(struct request_context *ctx);
+static int cleanup_policy_module(mam_context_t *ctx);
+
+/** answer the socketconnect requests of a batch - in a single call if the policy can,
+ *  one by one otherwise. The batch request itself gets no response.
+ */
+static void process_socketconnect_batch(struct request_context *ctx)
+{
+	request_context_t **batch = NULL;
+	request_context_t *item;
+	const mam_policy_t *ops = NULL;
+	muacc_arena_t *prev;
+	int n = 0;
+	int i, ret;
+
+	for (item = ctx->batch; item != NULL; item = item->batch_next)
+		n++;
+	DLOG(MAM_MASTER_NOISY_DEBUG0, "Received batch of %d socketconnect requests\n", n);
+
+	if (n > 0)
+	{
+		prev = _muacc_arena_use(ctx->arena);
+		batch = _muacc_alloc(n * sizeof(request_context_t *));
+		_muacc_arena_use(prev);
+	}
+	if (batch == NULL)
+	{
+		while ((item = ctx->batch) != NULL)
+		{
+			ctx->batch = item->batch_next;
+			item->batch_next = NULL;
+			process_mam_request(item);
+		}
+		goto process_socketconnect_batch_done;
+	}
+
+	/* the batch was parsed last item first - hand the items out in the order the client sent them */
+	i = n;
+	while ((item = ctx->batch) != NULL)
+	{
+		ctx->batch = item->batch_next;
+		item->batch_next = NULL;
+		if (item->ctx_unknown)
+		{
+			/* answered right away with an error */
+			process_mam_request(item);
+			n--;
+		}
+		else
+		{
+			batch[--i] = item;
+		}
+	}
+	batch += i;
+
+	/* all requests of the batch go to the same policy */
+	for (i = 0; i < n; i++)
+		ops = _mam_request_policy(batch[i]);
+
+	if (n > 0 && ops->on_socketconnect_batch != NULL)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG2, "calling on_socketconnect_batch callback\n");
+		for (i = 0; i < n; i++)
+			batch[i]->policy_calls_performed |= MAM_POLICY_SOCKETCONNECT_CALLED;
+		ret = ops->on_socketconnect_batch(batch, n, ctx->mctx->ev_base);
+		if (ret == 0)
+			goto process_socketconnect_batch_done;
+
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "on_socketconnect_batch callback returned %d - answering the requests one by one\n", ret);
+		for (i = 0; i < n; i++)
+			batch[i]->policy_calls_performed &= ~MAM_POLICY_SOCKETCONNECT_CALLED;
+	}
+
+	for (i = 0; i < n; i++)
+		process_mam_request(batch[i]);
+
+process_socketconnect_batch_done:
+	mam_release_request_context(ctx);
+}
 
 static void process_mam_request(struct request_context *ctx)
 {
-	int (*callback_function)(request_context_t *ctx, struct event_base *base) = NULL;
+	const mam_policy_t *ops = _mam_request_policy(ctx);
+	muacc_arena_t *prev;
 	int ret;
 
-	if (ctx->action == muacc_act_getaddrinfo_resolve_req)
+	if (ctx->action == muacc_act_ctx_release)
+	{
+		/* Client does not need a cached context anymore - nobody waits for an answer */
+		DLOG(MAM_MASTER_NOISY_DEBUG2, "Forgetting context %u\n", ctx->ctx_key);
+		if (ctx->client != NULL && ctx->ctx_key != 0)
+			g_hash_table_remove(ctx->client->ctx_cache, GUINT_TO_POINTER(ctx->ctx_key));
+		mam_release_request_context(ctx);
+	}
+	else if (ctx->ctx_unknown)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "Request refers to a context that is not cached\n");
+		_muacc_send_ctx_event(ctx, muacc_error_unknown_ctx);
+	}
+	else if (ctx->action == muacc_act_getaddrinfo_resolve_req)
 	{
 		/* Respond to a getaddrinfo resolve request */
 		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new getaddrinfo resolve request\n");
 
-		_mam_callback_or_fail(ctx, "on_resolve_request", MAM_POLICY_RESOLVE_CALLED, muacc_act_getaddrinfo_resolve_resp);
+		_mam_callback_or_fail(ctx, ops->on_resolve_request, "on_resolve_request", MAM_POLICY_RESOLVE_CALLED, muacc_act_getaddrinfo_resolve_resp);
 	}
 	else if (ctx->action == muacc_act_connect_req)
 	{
 		/* Respond to a connect request */
 		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new connect request\n");
-		_mam_callback_or_fail(ctx, "on_connect_request", MAM_POLICY_CONNECT_CALLED, muacc_act_connect_resp);
+		_mam_callback_or_fail(ctx, ops->on_connect_request, "on_connect_request", MAM_POLICY_CONNECT_CALLED, muacc_act_connect_resp);
 	}
 	else if (ctx->action == muacc_act_socketconnect_req)
 	{
 		/* Respond to a socketconnect request */
 		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new socketconnect request\n");
-		if (_mam_fetch_policy_function(ctx->mctx->policy, "on_socketconnect_request", (void **) &callback_function) == 0)
+		if (ops->on_socketconnect_request != NULL)
 		{
 			/* Call policy module function */
 			DLOG(MAM_MASTER_NOISY_DEBUG2, "calling on_socketconnect_request callback\n");
 			ctx->policy_calls_performed |= MAM_POLICY_SOCKETCONNECT_CALLED;
-			ret = callback_function(ctx, ctx->mctx->ev_base);
+			prev = _muacc_arena_use(ctx->arena);
+			ret = ops->on_socketconnect_request(ctx, ctx->mctx->ev_base);
+			_muacc_arena_use(prev);
 			if (ret != 0)
 			{
 				DLOG(MAM_MASTER_NOISY_DEBUG1, "on_socketconnect_request callback returned %d\n", ret);
@@ -80,13 +218,14 @@ static void process_mam_request(struct request_context *ctx)
 		else
 		{
 			DLOG(MAM_MASTER_NOISY_DEBUG2, "No callback on_socketconnect_request available.\n");
-			int (*callback_function2)(request_context_t *ctx, struct event_base *base) = NULL;
-			if (_mam_fetch_policy_function(ctx->mctx->policy, "on_resolve_request", (void **) &callback_function) == 0 && _mam_fetch_policy_function(ctx->mctx->policy, "on_connect_request", (void **) &callback_function2) == 0)
+			if (ops->on_resolve_request != NULL && ops->on_connect_request != NULL)
 			{
 				DLOG(MAM_MASTER_NOISY_DEBUG2, "Fallback to resolve_request and connect_request. \n");
 				ctx->action = muacc_act_socketconnect_fallback;
 				ctx->policy_calls_performed |= MAM_POLICY_RESOLVE_CALLED;
-				ret = callback_function(ctx, ctx->mctx->ev_base);
+				prev = _muacc_arena_use(ctx->arena);
+				ret = ops->on_resolve_request(ctx, ctx->mctx->ev_base);
+				_muacc_arena_use(prev);
 				if (ret != 0)
 				{
 					DLOG(MAM_MASTER_NOISY_DEBUG1, "on_resolve_request callback returned %d\n", ret);
@@ -100,10 +239,34 @@ static void process_mam_request(struct request_context *ctx)
 			}
 		}
 	}
+	else if (ctx->action == muacc_act_socketconnect_batch_req)
+	{
+		process_socketconnect_batch(ctx);
+	}
 	else if (ctx->action == muacc_act_socketchoose_req)
 	{
 		DLOG(MAM_MASTER_NOISY_DEBUG0, "Received new socketchoose request\n");
-		_mam_callback_or_fail(ctx, "on_socketchoose_request", MAM_POLICY_SOCKETCHOOSE_CALLED, muacc_act_socketchoose_resp_new);
+		_mam_callback_or_fail(ctx, ops->on_socketchoose_request, "on_socketchoose_request", MAM_POLICY_SOCKETCHOOSE_CALLED, muacc_act_socketchoose_resp_new);
+	}
+	else if (ctx->action == muacc_act_hello_req && ctx->client != NULL)
+	{
+		/* Agree on the highest protocol version both sides speak -
+		 * the response still goes out in the version of the hello */
+		client_list_t *client = ctx->client;
+		int version = ctx->version_offered;
+
+		if (version > MUACC_PROTOCOL_MAX)
+			version = MUACC_PROTOCOL_MAX;
+		else if (version < MUACC_PROTOCOL_V1)
+			version = MUACC_PROTOCOL_V1;
+
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "Received hello - speaking protocol version %d from now on\n", version);
+		_muacc_send_ctx_event(ctx, muacc_act_hello_resp);
+		client->version = version;
+	}
+	else if (ctx->action == muacc_act_shm_req && ctx->client != NULL)
+	{
+		switch_to_shm(ctx);
 	}
 	else
 	{
@@ -113,13 +276,15 @@ static void process_mam_request(struct request_context *ctx)
 	}
 }
 
-/** read next tlvs on one of mam's client sockets
+/** process all complete requests a client sent
  *
  */
-static void mamsock_readcb(struct bufferevent *bev, void *prctx)
+static void process_client_input(client_list_t *client, struct evbuffer *in)
 {
-	struct request_context **rctx = (struct request_context **) prctx;
-	uuid_t old;
+	struct bufferevent *bev = client->bev;
+	struct socketlist *sl;
+	struct request_context *item;
+	muacc_arena_t *prev;
 	
 #if MAM_MASTER_NOISY_DEBUG2 == 1
 	char uuid_str[37];
@@ -128,105 +293,149 @@ static void mamsock_readcb(struct bufferevent *bev, void *prctx)
     for(;;)
 	{
 		/* prepair stuff of this round */
-		struct request_context *crctx = *rctx;
+		struct request_context *crctx = client->rctx;
 		
-	    crctx->in = bufferevent_get_input(bev);
+	    crctx->in = in;
 	    crctx->out = bufferevent_get_output(bev);
 		
-    	switch( _muacc_proc_tlv_event(crctx) )
+    	switch( _muacc_proc_request_event(crctx) )
     	{
-    		case _muacc_proc_tlv_event_too_short:
+    		case _muacc_proc_request_event_too_short:
     			/* need more data - wait for next read event */
     			return;
-    		case _muacc_proc_tlv_event_eof:
-				/* re-initialize muacc context to back up further communication (keep uuid)*/
-				uuid_copy(old, crctx->ctx->ctxid);
-				 
-				 *rctx = malloc(sizeof(struct request_context));
-				 memset(*rctx, 0, sizeof(struct request_context));
-				(*rctx)->mctx = global_mctx;
-				(*rctx)->ctx = _muacc_create_ctx();
-    			uuid_copy((*rctx)->ctx->ctxid, old);
-
-				if (global_mctx->clients)
-				{
-					GSList *client_list = g_slist_find_custom(global_mctx->clients, crctx->ctx->ctxid, compare_id_in_struct);
-			
-					if (client_list)
-					{
-                    
+    		case _muacc_proc_request_event_error:
+				DLOG(MAM_MASTER_NOISY_DEBUG0, "Dropping client %d sending malformed requests\n", client->client_sk);
+				mamsock_errorcb(bev, BEV_EVENT_ERROR, client);
+				return;
+    		default:
+				/* request is complete - it may be answered at any time from now on,
+				 * while the next one of this client is read into a fresh context */
+				g_hash_table_insert(client->outstanding, crctx, crctx);
+				client->rctx = mam_new_request_context(client->mctx, client);
+				crctx->version = client->version;
+
 #if MAM_MASTER_NOISY_DEBUG2 == 1
-						printf("client inode: %u:%u\n", (uint32_t)((crctx->ctx->ctxino) >> 32),
- 										   		(uint32_t)((crctx->ctx->ctxino) & 0xFFFFFFFF));
+				printf("client inode: %u:%u\n", (uint32_t)((crctx->ctx->ctxino) >> 32),
+ 								   		(uint32_t)((crctx->ctx->ctxino) & 0xFFFFFFFF));
 #endif
 
-						((client_list_t*)client_list->data)->inode = crctx->ctx->ctxino;
-						((client_list_t*)client_list->data)->flow_table = g_hash_table_new(NULL, NULL);
-						
-						socket_list_t *sk = malloc(sizeof(socket_list_t));
-						sk->sk = crctx->ctx->sockfd;
+				/* remember what the client knows, so it can refer to it later on */
+				if (crctx->ctx_key != 0)
+				{
+					prev = _muacc_arena_use(crctx->arena);
+					crctx->ctx_sent = _muacc_clone_ctx(crctx->ctx);
+					_muacc_arena_use(prev);
+				}
+				/* each request of a batch is answered on its own */
+				for (item = crctx->batch; item != NULL; item = item->batch_next)
+				{
+					item->in = in;
+					item->out = crctx->out;
+					item->version = client->version;
+					g_hash_table_insert(client->outstanding, item, item);
+				}
+				/* contexts of sockets arrive in full only once - do not clone thousands of cached ones again */
+				for (sl = crctx->sockets; sl != NULL; sl = sl->next)
+					if (client->ctx_cache == NULL || g_hash_table_lookup(client->ctx_cache, GUINT_TO_POINTER(sl->mamkey)) == NULL)
+						_mam_cache_ctx(client, sl->mamkey, sl->ctx);
+
+				/* hello and release requests carry no context */
+				if (crctx->ctx->ctxino != 0)
+					client->inode = crctx->ctx->ctxino;
+				if (client->flow_table == NULL)
+					client->flow_table = g_hash_table_new(NULL, NULL);
 
 #if MAM_MASTER_NOISY_DEBUG2 == 1
-						uuid_unparse_lower(crctx->ctx->ctxid, uuid_str);
-						printf("(mam callback) add sockfd: %d to id: %s\n", sk->sk, uuid_str);
-						((client_list_t*)client_list->data)->sockets = g_slist_append(((client_list_t*)client_list->data)->sockets, sk);
+				socket_list_t *sk = malloc(sizeof(socket_list_t));
+				sk->sk = crctx->ctx->sockfd;
+				uuid_unparse_lower(crctx->ctx->ctxid, uuid_str);
+				printf("(mam callback) add sockfd: %d to id: %s\n", sk->sk, uuid_str);
+				client->sockets = g_slist_append(client->sockets, sk);
 #endif
-					}
-				}
 
 				/* Process the request by calling the policy */
 				process_mam_request(crctx);
 
     			continue;
-    		default:
-    			/* read a TLV - are there more out there? */
-    			continue;
     	}
 	}
 }
 
-int compare_id_in_struct(gconstpointer list_data,  gconstpointer user_data)
+/** read next requests on one of mam's client sockets
+ *
+ */
+static void mamsock_readcb(struct bufferevent *bev, void *arg)
 {
-	client_list_t *list = (client_list_t*) list_data;
-	uuid_t *id = (uuid_t*) user_data;
-	
-	if (memcmp(&(list->id), id, sizeof(uuid_t)) == 0)
-		return 0;
-	
-	return -1;
+	process_client_input((client_list_t *) arg, bufferevent_get_input(bev));
+}
+
+/** read next requests of a client talking through shared memory
+ *
+ */
+static void mamshm_readcb(evutil_socket_t fd, short what, void *arg)
+{
+	client_list_t *client = (client_list_t *) arg;
+
+	if (_mam_shm_flush(client->shm) < 0 || _mam_shm_recv(client->shm) < 0)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "Dropping client %d with unusable shared memory\n", client->client_sk);
+		mamsock_errorcb(client->bev, BEV_EVENT_ERROR, client);
+		return;
+	}
+
+	process_client_input(client, client->shm->in);
+}
+
+/** detach a request from a client that went away, so its response is dropped
+ *
+ */
+static void orphan_request(gpointer key, gpointer value, gpointer user_data)
+{
+	request_context_t *rctx = (request_context_t *) value;
+
+	rctx->client = NULL;
+	rctx->in = NULL;
+	rctx->out = NULL;
 }
 
 /** handle errors on one of mam's client sockets
  *
  */
-static void mamsock_errorcb(struct bufferevent *bev, short error, void *ctx)
+static void mamsock_errorcb(struct bufferevent *bev, short error, void *arg)
 {
-	struct request_context **rctx = (struct request_context **) ctx;
-	struct request_context *crctx = *rctx;
+	client_list_t *client = (client_list_t *) arg;
+	GSList *client_list;
 	
     if (error & BEV_EVENT_EOF) {
         /* connection has been closed, do any clean up here */
-		GSList *client_list = g_slist_find_custom(global_mctx->clients, crctx->ctx->ctxid, compare_id_in_struct);
-		
-		if (client_list)
-		{
-			if (((client_list_t*)client_list->data)->callback_function)
-				((client_list_t*)client_list->data)->callback_function(client_list);
-		}
-		
+		DLOG(MAM_MASTER_NOISY_DEBUG2, "Client %d closed the connection\n", client->client_sk);
     } else if (error & BEV_EVENT_ERROR) {
         /* check errno to see what error occurred */
-        /* ... */
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "Error on connection to client %d: %s\n", client->client_sk, strerror(errno));
     } else if (error & BEV_EVENT_TIMEOUT) {
         /* must be a timeout event handle, handle it */
         /* ... */
     }
-	if (*rctx != NULL)
+
+	/* policies may still answer outstanding requests later on */
+	g_hash_table_foreach(client->outstanding, &orphan_request, NULL);
+	g_hash_table_remove_all(client->outstanding);
+
+	if (client->rctx != NULL)
 	{
-		mam_release_request_context(*rctx);
-		free(rctx);
+		mam_release_request_context(client->rctx);
+		client->rctx = NULL;
 	}
+
+	pthread_mutex_lock(&clients_lock);
+	client_list = g_slist_find(global_mctx->clients, client);
+	if (client_list && client->callback_function)
+		client->callback_function(client_list);
+	pthread_mutex_unlock(&clients_lock);
+	mam_workers_client_gone(client);
+
     bufferevent_free(bev);
+	_free_client_list(client);
 }
 
 void clean_client_state(GSList *client_list)
@@ -241,6 +450,50 @@ void clean_client_state(GSList *client_list)
 	global_mctx->clients = g_slist_remove(global_mctx->clients, client_list->data);
 }
 
+/** set up the connection of a client - on the thread serving it
+ *
+ */
+static void serve_client(client_list_t *client)
+{
+	struct bufferevent *bev;
+
+	/* initialize request context to back up communication */
+	client->rctx = mam_new_request_context(client->mctx, client);
+
+	/* set up bufferevent magic */
+	evutil_make_socket_nonblocking(client->client_sk);
+	bev = bufferevent_socket_new(client->mctx->ev_base, client->client_sk, BEV_OPT_CLOSE_ON_FREE);
+	client->bev = bev;
+	bufferevent_setcb(bev, mamsock_readcb, NULL, mamsock_errorcb, (void *) client);
+	bufferevent_setwatermark(bev, EV_READ, MIN_BUF, MAX_BUF);
+	bufferevent_enable(bev, EV_READ|EV_WRITE);
+}
+
+/** disconnect a client, it connects again to be served by the main thread - on the thread serving it
+ *
+ */
+static void drop_client(client_list_t *client)
+{
+	GSList *client_list;
+
+	if (client->bev != NULL)
+	{
+		mamsock_errorcb(client->bev, BEV_EVENT_EOF, client);
+		return;
+	}
+
+	/* never was served */
+	pthread_mutex_lock(&clients_lock);
+	client_list = g_slist_find(global_mctx->clients, client);
+	if (client_list && client->callback_function)
+		client->callback_function(client_list);
+	pthread_mutex_unlock(&clients_lock);
+	mam_workers_client_gone(client);
+
+	close(client->client_sk);
+	_free_client_list(client);
+}
+
 /** accept new clients of mam
  *
  */
@@ -250,6 +503,7 @@ static void do_accept(evutil_socket_t listener, short event, void *arg)
     struct sockaddr_storage ss;
     socklen_t slen = sizeof(ss);
 	client_list_t *client_list;
+	struct mam_worker *worker;
 	
     int fd = accept(listener, (struct sockaddr*)&ss, &slen);
     if (fd < 0) {
@@ -259,30 +513,25 @@ static void do_accept(evutil_socket_t listener, short event, void *arg)
     } else {
 
 		DLOG(MAM_MASTER_NOISY_DEBUG2, "Accepted client %d\n", fd);
-    	struct bufferevent *bev;
-		request_context_t **ctx;
-
-		/* initialize request context to back up communication */
-		ctx = malloc(sizeof(struct request_context *));		
-		*ctx = malloc(sizeof(struct request_context));
-		memset(*ctx, 0, sizeof(struct request_context));
-		(*ctx)->ctx = _muacc_create_ctx();
-		(*ctx)->mctx = mctx;
-				
+
 		client_list = malloc(sizeof(client_list_t));
+		memset(client_list, 0, sizeof(client_list_t));
 		client_list->client_sk = fd; //bufferevent_getfd(bev);
-		uuid_generate((*ctx)->ctx->ctxid);
-		uuid_copy(client_list->id, (*ctx)->ctx->ctxid);
+		uuid_generate(client_list->id);
 		client_list->callback_function = &clean_client_state;
 		client_list->sockets = NULL;
+		client_list->outstanding = g_hash_table_new(NULL, NULL);
+		client_list->version = MUACC_PROTOCOL_V1;
+		client_list->ctx_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, &_mam_free_cached_ctx);
+		client_list->mctx = mctx;
+
+		pthread_mutex_lock(&clients_lock);
 		global_mctx->clients = g_slist_append(global_mctx->clients, client_list);
+		pthread_mutex_unlock(&clients_lock);
 
-    	/* set up bufferevent magic */
-        evutil_make_socket_nonblocking(fd);
-        bev = bufferevent_socket_new(mctx->ev_base, fd, BEV_OPT_CLOSE_ON_FREE);
-        bufferevent_setcb(bev, mamsock_readcb, NULL, mamsock_errorcb, (void *) ctx);
-        bufferevent_setwatermark(bev, EV_READ, MIN_BUF, MAX_BUF);
-        bufferevent_enable(bev, EV_READ|EV_WRITE);
+		/* hand the client to a worker if there are any, serve it here otherwise */
+		if ((worker = mam_workers_assign()) == NULL || mam_workers_add_client(worker, client_list) != 0)
+			serve_client(client_list);
     }
 }
 
@@ -290,7 +539,6 @@ static void do_read_fifo(evutil_socket_t fd, short event, void *arg)
 {
 	char buf[255];
 	int len, ret;
-	int (*callback_function)(struct mam_context *mctx, char* config) = NULL;
 
 	//printf("fifo_read called with fd: %d, event: %d\n", (int)fd, event);
 	
@@ -310,11 +558,16 @@ static void do_read_fifo(evutil_socket_t fd, short event, void *arg)
 		len -=1;
 	buf[len] = '\0';
 
-	if (_mam_fetch_policy_function(global_mctx->policy, "on_config_request", (void **) &callback_function) == 0)
+	if (mam_policy_ops(global_mctx)->on_config_request != NULL)
 	{
-			/* Call policy module function */
+			/* Call policy module function - the workers must not use the configuration meanwhile */
 			DLOG(MAM_MASTER_NOISY_DEBUG2, "calling on_config_request callback\n");
-			ret = callback_function(global_mctx, buf);
+			mam_workers_pause();
+			ret = mam_policy_ops(global_mctx)->on_config_request(global_mctx, buf);
+
+			/* the policy may decide differently from now on */
+			mam_revoke_leases(global_mctx);
+			mam_workers_resume();
 	}
 	else
 		DLOG(MAM_MASTER_NOISY_DEBUG2, "Policy does not have a on_config_request method!\n");
@@ -366,18 +619,20 @@ static int do_listen(mam_context_t *ctx, evutil_socket_t listener, struct sockad
 
 }
 
-/** Initialize the dynamic loader using libltdl,
- *  load the policy module from a file given by filename
- *  and call its init() function
+/** Load the policy module from a file given by filename into a new
+ *  policy generation and look up its entry points
+ *
+ *  @return the new generation, NULL if the module could not be loaded
  */
-static int setup_policy_module(mam_context_t *ctx, const char *filename)
+static mam_policy_gen_t *load_policy_module(const char *filename)
 {
-	DLOG(MAM_MASTER_NOISY_DEBUG2, "setting up policy module %s \n", filename);
+	DLOG(MAM_MASTER_NOISY_DEBUG2, "loading policy module %s \n", filename);
 
 	const char *ltdl_error = NULL;
 
 	lt_dlhandle mam_policy;
-	int (*init_function)() = NULL;
+	mam_policy_gen_t *gen;
+	static unsigned int loads = 0;
 
 	if (NULL != (mam_policy = lt_dlopen(filename)))
 	{
@@ -395,23 +650,69 @@ static int setup_policy_module(mam_context_t *ctx, const char *filename)
 			}
 			fprintf(stderr, "\n");
 		}
-		return -1;
+		return NULL;
 	}
-	
-	/* publish policy */
-	ctx->policy = mam_policy;
-	
-	if (_mam_fetch_policy_function(mam_policy, "init", (void **)&init_function) == 0)
+
+	if ((gen = malloc(sizeof(mam_policy_gen_t))) == NULL)
 	{
-		init_function(ctx);
+		lt_dlclose(mam_policy);
+		return NULL;
 	}
-	else
+	memset(gen, 0, sizeof(mam_policy_gen_t));
+	gen->handle = mam_policy;
+	gen->refs = 1;
+
+	/* its entry points are looked up once and for all */
+	if (_mam_resolve_policy(mam_policy, &(gen->ops)) != 0 || gen->ops.init == NULL)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "module %s could not be initialized\n", filename);
+		lt_dlclose(mam_policy);
+		free(gen);
+		return NULL;
+	}
+	gen->id = ++loads;
+
+	return gen;
+}
+
+/** Load the policy module from a file given by filename, replace the
+ *  current policy by it and call its init() function
+ *
+ *  The current policy is only cleaned up once the new module has been
+ *  loaded - if loading fails, it stays in place.
+ */
+static int setup_policy_module(mam_context_t *ctx, const char *filename)
+{
+	DLOG(MAM_MASTER_NOISY_DEBUG2, "setting up policy module %s \n", filename);
+
+	mam_policy_gen_t *gen;
+
+	if ((gen = load_policy_module(filename)) == NULL)
 	{
-		DLOG(MAM_MASTER_NOISY_DEBUG1, "module %s could not be initialized", filename);
+		if (ctx->policy_gen != NULL)
+		{
+			DLOG(1, "loading policy module %s failed - keeping policy generation %u\n", filename, ctx->policy_gen->id);
+		}
+		else
+		{
+			DLOG(1, "loading policy module %s failed - mamma is useless...\n", filename);
+		}
 		return -1;
 	}
 
-	
+	/* clean up old policy module if present */
+	if (ctx->policy_gen != NULL)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "unloading old policy module\n");
+		cleanup_policy_module(ctx);
+	}
+
+	/* publish policy - new requests go to it from now on */
+	ctx->policy_gen = gen;
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "policy generation %u is current now\n", gen->id);
+
+	gen->ops.init(ctx);
+
 	return 0;
 }
 
@@ -420,18 +721,20 @@ static int setup_policy_module(mam_context_t *ctx, const char *filename)
 static int cleanup_policy_module(mam_context_t *ctx) {
 	
 	int ret;
-	int (*cleanup_function)() = NULL;
+	mam_policy_gen_t *gen = ctx->policy_gen;
+
+	if (gen == NULL)
+		return -1;
 	
-	if (_mam_fetch_policy_function(ctx->policy, "cleanup", (void **) &cleanup_function) == 0)
+	if (gen->ops.cleanup != NULL)
 	{
 		/* Call policy module function */
 		DLOG(MAM_MASTER_NOISY_DEBUG1, "calling policy cleanup callback\n");
-		ret = cleanup_function(ctx);
+		ret = gen->ops.cleanup(ctx);
 		if (ret != 0)
 		{
 			DLOG(1, "cleanup callback returned %d\n", ret);
 		}
-		return(ret);
 	}
 	else
 	{
@@ -439,7 +742,11 @@ static int cleanup_policy_module(mam_context_t *ctx) {
 		ret = -1;
 	}
 	
-	ctx->policy = NULL;
+	/* new requests do not get to the old policy anymore - the requests still
+	 * in flight keep its module loaded until they are released */
+	ctx->policy_gen = NULL;
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "retiring policy generation %u with %d requests in flight\n", gen->id, __atomic_load_n(&(gen->refs), __ATOMIC_RELAXED) - 1);
+	_mam_policy_unref(gen);
 	return(ret);
 }
 
@@ -467,19 +774,50 @@ static void cleanup_fifo()
 }
 
 
+/** let the workers serve clients if the policy allows it - call while they are paused
+ */
+static void configure_workers() {
+
+	int safe;
+
+	if (mam_workers_count() == 0)
+		return;
+
+	safe = (mam_policy_ops(global_mctx)->capabilities & MAM_POLICY_THREAD_SAFE) != 0;
+	if (!safe)
+		DLOG(MAM_MASTER_NOISY_DEBUG0, "policy is not thread-safe - serving all clients on the main thread\n");
+
+	mam_workers_enable(safe);
+	mam_workers_reconfigured();
+}
+
+/** start the workers asked for in the configuration
+ */
+static void start_workers() {
+
+	gpointer value = NULL;
+	int n = 0;
+
+	if (global_mctx->policy_set_dict != NULL && (value = g_hash_table_lookup(global_mctx->policy_set_dict, "workers")) != NULL)
+		n = atoi(value);
+
+	if (n <= 0 || mam_workers_start(global_mctx, n, &serve_client, &drop_client) <= 0)
+	{
+		DLOG(MAM_MASTER_NOISY_DEBUG1, "serving all clients on the main thread\n");
+		return;
+	}
+
+	mam_workers_pause();
+	configure_workers();
+	mam_workers_resume();
+}
+
 /** read config an (re)load policy module
  */
 static void configure_mamma() {
 	
 	char *policy_filename = NULL;
 	
-	/* clean up old policy module of present */
-	if(global_mctx->policy != NULL)
-	{
-		DLOG(MAM_MASTER_NOISY_DEBUG1, "unloading old policy module\n");
-		cleanup_policy_module(global_mctx);
-	}
-	
 	/* get interface config from system */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "updating interface list from system\n");
 	update_src_prefix_list(global_mctx);
@@ -502,11 +840,29 @@ static void configure_mamma() {
 	{
 		DLOG(1, "no policy module given - mamma is useless...\n");
 	}
+
+	mam_configure_leases(global_mctx);
 	
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "(re)configuration done\n");
 	
 }
 
+/** give prefixes that came up their configuration
+ */
+static void configure_new_prefixes(mam_context_t *mctx) {
+	int fd;
+
+	if ( (fd = open(configfile_path, O_RDONLY)) == -1 )
+	{
+		DLOG(1, "opening config file %s failed: %s\n", configfile_path, strerror(errno));
+		return;
+	}
+
+	DLOG(MAM_MASTER_NOISY_DEBUG1, "configuring new prefixes\n");
+	mam_configure_new_prefixes(fd, mctx);
+	close(fd);
+}
+
 /** signal handler the libevent-way 
  */
 static void do_graceful_shutdown(evutil_socket_t _, short what, void* evctx) {
@@ -527,13 +883,9 @@ static void do_reconfigure(evutil_socket_t _, short what, void* evctx) {
 		return;
 	}
 
-	/* clean up old policy module of present */
-	if(global_mctx->policy != NULL)
-	{
-		DLOG(MAM_MASTER_NOISY_DEBUG1, "unloading old policy module\n");
-		cleanup_policy_module(global_mctx);
-	}
-	
+	/* the workers must not use the policy or the configuration meanwhile */
+	mam_workers_pause();
+
 	/* load policy module if we have command line arguments */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "parsing config file\n");	
 	mam_read_config(config_fd, &policy_filename, global_mctx);
@@ -546,10 +898,18 @@ static void do_reconfigure(evutil_socket_t _, short what, void* evctx) {
 		DLOG(MAM_MASTER_NOISY_DEBUG1, "loading policy module\n");
 		setup_policy_module(global_mctx, policy_filename);
 	}
+	else if (global_mctx->policy_gen != NULL)
+	{
+		DLOG(1, "no policy module given - keeping policy generation %u\n", global_mctx->policy_gen->id);
+	}
 	else
 	{
 		DLOG(1, "no policy module given - mamma is useless...\n");
 	}
+
+	mam_configure_leases(global_mctx);
+	configure_workers();
+	mam_workers_resume();
 	
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "(re)configuration done\n");
 }
@@ -648,6 +1008,9 @@ main(int c, char **v)
     */
     configure_fifo();
 
+	/* follow the addresses of the system coming and going */
+	mam_rtnl_start(global_mctx, &configure_new_prefixes);
+
 	/* pmeasure event */
     #ifdef HAVE_LIBNL
 	pmeasure_setup(global_mctx);
@@ -657,6 +1020,9 @@ main(int c, char **v)
 	evtimer_add(pmeasure_event, &hundred_milliseconds);
     #endif
 
+	/* worker threads serving the clients, if asked for */
+	start_workers();
+
 	/* set mam socket */
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "setting up mamma's socket %s\n", MUACC_SOCKET);
 	sun.sun_family = AF_UNIX;
@@ -684,6 +1050,8 @@ main(int c, char **v)
 	DLOG(MAM_MASTER_NOISY_DEBUG1, "cleaning up\n");
     close(listener);
     unlink(MUACC_SOCKET);
+	mam_workers_stop();
+	mam_rtnl_stop();
 	cleanup_policy_module(global_mctx);
     #ifdef HAVE_LIBNL
 	pmeasure_cleanup(global_mctx);
@@ -38,7 +38,6 @@ void netlink_readcb(struct bufferevent *bev, void *dummy)
 	struct nlmsghdr *nhl;
 	unsigned char *buf = NULL;
 	size_t len;
-	int (*new_subflow_function)() = NULL;	
 	struct mptcp_flow_info flow;
 
 	in = bufferevent_get_input(bev);
@@ -52,9 +51,9 @@ void netlink_readcb(struct bufferevent *bev, void *dummy)
 		case MAM_MPTCP_C_NEWFLOW:
 			new_flow(nhl, &flow);
 						
-			if (_mam_fetch_policy_function(global_mctx->policy, "on_new_subflow_request", (void **)&new_subflow_function) == 0)
+			if (mam_policy_ops(global_mctx)->on_new_subflow_request != NULL)
 			{
-				if (new_subflow_function(global_mctx, &flow))
+				if (mam_policy_ops(global_mctx)->on_new_subflow_request(global_mctx, &flow))
 				{
 					create_new_flow(&flow);
 				}
@@ -66,7 +65,8 @@ void netlink_readcb(struct bufferevent *bev, void *dummy)
 			break;
 			
 		case MAM_MPTCP_C_NEWIFACE:
-			new_iface(nhl, NULL, NULL); //TODO replace NULL with actual struct
+			/* the prefix itself comes in through rtnetlink, see mam_rtnl.h */
+			new_iface(nhl, NULL, NULL);
 			break;
 	}
 	
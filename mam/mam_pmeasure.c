@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <err.h>
 #include <assert.h>
@@ -14,18 +15,37 @@
 #include <arpa/inet.h>
 #include <math.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 
 #include <glib.h>
 #include "mam.h"
 #include "mam_pmeasure.h"
+#include "mam_lpm.h"
+#include "mam_history.h"
+#include "mam_util.h"
 
 #include "muacc_util.h"
+#include "muacc_metrics.h"
+#include "muacc_log.h"
 #include "dlog.h"
 
 #ifndef MAM_PMEASURE_LOGPREFIX
 #define MAM_PMEASURE_LOGPREFIX "/tmp/metrics"
 #endif
 
+// MUACC_LOG_CSV or MUACC_LOG_BINARY (turned back into CSV by mam-logcsv)
+#ifndef MAM_PMEASURE_LOGFORMAT
+#define MAM_PMEASURE_LOGFORMAT MUACC_LOG_CSV
+#endif
+
+// Size in bytes the logs are rotated at, 0 to never rotate them
+#ifndef MAM_PMEASURE_LOGROTATE
+#define MAM_PMEASURE_LOGROTATE MUACC_LOG_ROTATE_SIZE
+#endif
+
 #ifdef HAVE_LIBNL
 #include <netlink/netlink.h>
 #include <netlink/socket.h>
@@ -54,21 +74,62 @@ void compute_srtt(void *pfx, void *data);
 int compare_ip (struct sockaddr *a1, struct sockaddr *a2);
 int is_addr_in_pfx (const void *a, const void *b);
 
-void compute_median(GHashTable *dict, GList *values);
-void compute_mean(GHashTable *dict, GList *values);
-void compute_minimum(GHashTable *dict, GList *values);
+void compute_mean(struct prefix_metrics *metrics, const double *values, unsigned int n);
+double compute_minimum(struct prefix_metrics *metrics, const double *values, unsigned int n);
 
 #ifdef HAVE_LIBNL
 
-#define BUFFER_SIZE (getpagesize() < 8192L ? getpagesize() : 8192L)
+#define BUFFER_SIZE 32768L
+
 #define TCPF_ALL 0xFFF
 
+// Largest inet_diag bytecode we attach - with more prefixes, the kernel dumps all sockets
+#ifndef MAM_PMEASURE_BYTECODE_SIZE
+#define MAM_PMEASURE_BYTECODE_SIZE 4096
+#endif
+
+// Set to 1 to also measure listening sockets, which have no RTT of their own
+#ifndef MAM_PMEASURE_DUMP_LISTEN
+#define MAM_PMEASURE_DUMP_LISTEN 0
+#endif
+
 void get_stats(void *pfx, void *data);
 int create_nl_sock();
-GList * parse_nl_msg(struct inet_diag_msg *pMsg, int rtalen, void *pfx, GList *values);
-int send_nl_msg(int sock, int i);
-int recv_nl_msg(int sock, void *pfx, GList **values);
-void insert_errors(GHashTable *pTable, struct rtnl_link *pLink);
+void parse_nl_msg(struct inet_diag_msg *pMsg, int rtalen, const mam_lpm_t *lpm, GHashTable *buckets);
+int send_nl_msg(int sock, int af, const void *bytecode, int bclen);
+int recv_nl_msg(int sock, const mam_lpm_t *lpm, GHashTable *buckets);
+void collect_rtts(const mam_lpm_t *lpm, GHashTable *buckets);
+
+/** sock_diag sockets for the IPv4 and the IPv6 dump, kept open from one round to the next */
+static int diag_sock[2] = {-1, -1};
+
+// Number of RTTs a bucket has room for at first, it grows as needed
+#ifndef MAM_PMEASURE_BUCKET_SIZE
+#define MAM_PMEASURE_BUCKET_SIZE 64
+#endif
+
+/** RTTs of the sockets of one prefix, collected from the dump of a round
+ *  The buffer is kept for the next rounds, so it is only allocated while it grows
+ */
+struct rtt_bucket {
+    double *values;
+    unsigned int n;          /**< RTTs collected in this round */
+    unsigned int size;       /**< RTTs there is room for */
+    int active;              /**< the prefix is measured in this round */
+};
+
+/** buckets of the prefixes that are measured, by their src_prefix_list */
+static GHashTable *rtt_buckets = NULL;
+
+static void add_rtt(struct rtt_bucket *bucket, double rtt);
+
+/** rtnetlink socket and cache of the links with their statistics, refilled once per round */
+static struct nl_sock *link_sock = NULL;
+static struct nl_cache *link_cache = NULL;
+
+struct nl_cache *refresh_link_cache(void);
+static void free_link_cache(void);
+void insert_errors(struct prefix_metrics *metrics, struct rtnl_link *link);
 #endif
 
 // The interval in which the computation of the values happens, i.e. the time between two computations (in seconds)
@@ -91,19 +152,6 @@ static const double SMOOTH_FACTOR = 0.125;
 static const double SMOOTH_FACTOR_M = 0.125;
 #endif
 
-#ifdef IS_LINUX
-//path of statistics file (sans interface) in linux broken into two strings
-#ifndef path1
-static const char path1[] = "/sys/class/net/";
-#endif
-
-#ifndef path2
-static const char path2[] = "/statistics/";
-#endif
-
-long read_stats(char *path);
-#endif
-
 #ifndef MAM_PMEASURE_THRUPUT_DEBUG
 #define MAM_PMEASURE_THRUPUT_DEBUG 0
 #endif
@@ -113,6 +161,48 @@ void compute_link_usage(void *ifc, void *lookup);
 // Alpha Value for Smoothed RTT Calculation
 double alpha = 0.9;
 
+/** time of the current round for the histories, see mam_history_now */
+static double round_time = 0;
+
+/** Add the value of this round to a history, creating it with the first value */
+static void pmeasure_record(mam_history_t **history, double value)
+{
+    if (*history == NULL && (*history = mam_history_new(MAM_HISTORY_SIZE)) == NULL)
+        return;
+    mam_history_add(*history, round_time, value);
+}
+
+/** Columns of the prefix log, in the order of the CSV lines */
+static const struct muacc_log_column prefix_log_columns[] = {
+    { "time", MUACC_LOG_INT },
+    { "address", MUACC_LOG_STRING },
+    { "interface", MUACC_LOG_STRING },
+    { "srtt_mean", MUACC_LOG_DOUBLE },
+    { "srtt_median", MUACC_LOG_DOUBLE },
+    { "srtt_minimum", MUACC_LOG_DOUBLE },
+    { "rx_errors", MUACC_LOG_INT },
+    { "tx_errors", MUACC_LOG_INT },
+};
+
+/** Columns of the interface log, in the order of the CSV lines */
+static const struct muacc_log_column iface_log_columns[] = {
+    { "time", MUACC_LOG_INT },
+    { "timestamp", MUACC_LOG_TIMEVAL },
+    { "interface", MUACC_LOG_STRING },
+    { "download_rate", MUACC_LOG_DOUBLE },
+    { "download_max_rate", MUACC_LOG_DOUBLE },
+    { "download_srate", MUACC_LOG_DOUBLE },
+    { "download_max_srate", MUACC_LOG_DOUBLE },
+    { "upload_rate", MUACC_LOG_DOUBLE },
+    { "upload_max_rate", MUACC_LOG_DOUBLE },
+    { "upload_srate", MUACC_LOG_DOUBLE },
+    { "upload_max_srate", MUACC_LOG_DOUBLE },
+};
+
+/** logs of the measurements, kept open between the rounds - NULL if not logging */
+static muacc_log_t *prefix_log = NULL;
+static muacc_log_t *iface_log = NULL;
+
 /** compare two ip addresses
  *  return 0 if equal, non-zero otherwise
  */
@@ -156,475 +246,231 @@ int is_addr_in_pfx (const void *a, const void *b)
     return -1;
 }
 
-/** Compute the mean SRTT from the currently valid srtts
- *  Insert it into the measure_dict as "srtt_mean"
+/** Smooth the value of this round into the one of the rounds before
+ *  SRTT = (alpha * SRTT) + ((1-alpha) * RTT), see RFC793 - the first value is taken as it is
  */
-void compute_mean(GHashTable *dict, GList *values)
+static double smooth_srtt(double old_rtt, double new_rtt)
 {
+    if (old_rtt == 0)
+        return new_rtt;
+    return (alpha * new_rtt) + ((1-alpha) * old_rtt);
+}
 
-    double *meanvalue;
-    double old_rtt;
-
-    int n = g_list_length(values);
-    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "List for interface has length %d\n", n);
-
-    meanvalue = g_hash_table_lookup(dict, "srtt_mean");
-
-    if (meanvalue == NULL)
-    {
-        meanvalue = malloc(sizeof(double));
-        memset(meanvalue, 0, sizeof(double));
-        g_hash_table_insert(dict, "srtt_mean", meanvalue);
-    }
+/** Compute the mean SRTT from the currently valid srtts
+ *  Store it in the metrics as srtt_mean
+ */
+void compute_mean(struct prefix_metrics *metrics, const double *values, unsigned int n)
+{
+    double sum_of_values = 0;
 
-    old_rtt = *meanvalue;
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "List for interface has length %u\n", n);
 
     if (n == 0)
     {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old mean %f\n", old_rtt);
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old mean %f\n", metrics->srtt_mean);
         return;
     }
 
-	double sum_of_values = 0;
-
-    for (int i = 0; i < n; i++)
-    {
-        sum_of_values += *(double *) values->data;
-        values = values->next;
-    }
-
-    *meanvalue = sum_of_values / n;
-    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "List of length %d has mean value %f \n", n, *meanvalue);
+    for (unsigned int i = 0; i < n; i++)
+        sum_of_values += values[i];
 
-	if (old_rtt == 0)
-	{
-		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New mean value is %f \n", *meanvalue);
-	}
-	else
-	{
-		// calculate SRTT in accord with the formula
-		// SRTT = (alpha * SRTT) + ((1-alpha) * RTT)
-		// see RFC793
-		*meanvalue = (alpha * *meanvalue) + ((1-alpha) * old_rtt);
-		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New smoothed mean value is %f \n", *meanvalue);
-	}
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "List of length %u has mean value %f \n", n, sum_of_values / n);
+    metrics->srtt_mean = smooth_srtt(metrics->srtt_mean, sum_of_values / n);
+    metrics->valid |= MUACC_METRICS_SRTT_MEAN;
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New smoothed mean value is %f \n", metrics->srtt_mean);
 }
 
-/** Compute the median SRTT from a table of individual flows with their SRTTs
- *  Insert it into the measure_dict as "srtt_median"
+/** Compute the 10th, 50th and 90th percentile of the currently valid srtts
+ *  Store them in the metrics as srtt_p10, srtt_median and srtt_p90 - the values are reordered
+ *  Returns the median of this round before smoothing, 0 if there are no values
  */
-void compute_median(GHashTable *dict, GList *values)
+double compute_percentiles(struct prefix_metrics *metrics, double *values, unsigned int n)
 {
-    double *medianvalue;
-
-    int n;
-
-    n = g_list_length(values);
-
-    medianvalue = g_hash_table_lookup(dict, "srtt_median");
-
-    if (medianvalue == NULL)
-    {
-        medianvalue = malloc(sizeof(double));
-        memset(medianvalue, 0, sizeof(double));
-        g_hash_table_insert(dict, "srtt_median", medianvalue);
-    }
-
-	double old_rtt = *medianvalue;
+    double p10, median, p90;
 
     if (n == 0)
     {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old median %f\n", old_rtt);
-        return;
-    }
-    else if (n % 2)
-    {
-        // odd number of elements
-        *medianvalue = *(double *) g_list_nth_data(values, (n/2));
-    }
-    else
-    {
-        // even number of elements
-        double val1 = *(double *) g_list_nth_data(values, (n/2)-1);
-        double val2 = *(double *) g_list_nth_data(values, (n/2));
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "(intermediate value between %d. element %f and %d. element %f)\n",(n-1)/2, val1, (n+1)/2, val2);
-        *medianvalue = (val1 + val2) / 2;
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old median %f\n", metrics->srtt_median);
+        return 0;
     }
 
-	if (old_rtt == 0)
-	{
-		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New median value is %f \n", *medianvalue);
-	}
-	else
-	{
-		// calculate SRTT in accord with the formula
-		// SRTT = (alpha * SRTT) + ((1-alpha) * RTT)
-		// see RFC793
-		*medianvalue = (alpha * *medianvalue) + ((1-alpha) * old_rtt);
-		DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New smoothed median value is %f \n", *medianvalue);
-	}
+    p10 = mam_quantile(values, n, 0.1);
+    median = mam_quantile(values, n, 0.5);
+    p90 = mam_quantile(values, n, 0.9);
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "List of length %u has percentiles %f / %f / %f\n", n, p10, median, p90);
+
+    metrics->srtt_p10 = smooth_srtt(metrics->srtt_p10, p10);
+    metrics->srtt_median = smooth_srtt(metrics->srtt_median, median);
+    metrics->srtt_p90 = smooth_srtt(metrics->srtt_p90, p90);
+    metrics->valid |= MUACC_METRICS_SRTT_MEDIAN | MUACC_METRICS_SRTT_PERCENTILES;
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New smoothed median value is %f \n", metrics->srtt_median);
+    return median;
 }
 
-void compute_minimum(GHashTable *dict, GList *values)
+/** Compute the minimum SRTT from the currently valid srtts
+ *  Store it in the metrics as srtt_minimum, unless the one before was smaller
+ *  Returns the minimum of this round, 0 if there are no values
+ */
+double compute_minimum(struct prefix_metrics *metrics, const double *values, unsigned int n)
 {
-    double *minimum;
-
-    int n;
+    double old_rtt = metrics->srtt_minimum;
+    double minimum;
 
-    n = g_list_length(values);
-
-    minimum = g_hash_table_lookup(dict, "srtt_minimum");
-
-    if (minimum == NULL)
+    if (n == 0)
     {
-        minimum = malloc(sizeof(double));
-        memset(minimum, 0, sizeof(double));
-        g_hash_table_insert(dict, "srtt_minimum", minimum);
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old minimum %f\n", old_rtt);
+        return 0;
     }
 
-	double old_rtt = *minimum;
-    if (n == 0)
+    minimum = values[0];
+    for (unsigned int i = 1; i < n; i++)
+        if (values[i] < minimum)
+            minimum = values[i];
+    metrics->valid |= MUACC_METRICS_SRTT_MINIMUM;
+
+    if (old_rtt == 0 || minimum < old_rtt)
     {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "No new RTT values. Keeping old minimum %f\n", old_rtt);
-        return;
+        metrics->srtt_minimum = minimum;
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New minimum value: %f \n", minimum);
     }
     else
     {
-        *minimum = *(double *) g_list_first(values)->data;
-		if (old_rtt == 0 || *minimum < old_rtt)
-		{
-			DLOG(MAM_PMEASURE_NOISY_DEBUG2, "New minimum value: %f \n", *minimum);
-		}
-		else
-		{
-			DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Keeping old minimum value %f (=< %f) \n", old_rtt, *minimum);
-			*minimum = old_rtt;
-		}
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Keeping old minimum value %f (=< %f) \n", old_rtt, minimum);
     }
-
+    return minimum;
 }
 
 #ifdef HAVE_LIBNL
-void insert_errors(GHashTable *dict, struct rtnl_link *link)
+void insert_errors(struct prefix_metrics *metrics, struct rtnl_link *link)
 {
-    uint64_t *tx_errors;
-    uint64_t *rx_errors;
-
-    tx_errors = g_hash_table_lookup(dict, "tx_errors");
-    rx_errors = g_hash_table_lookup(dict, "rx_error");
-
-    if (tx_errors == NULL)
-    {
-        tx_errors = malloc(sizeof(uint64_t));
-        memset(tx_errors, 0, sizeof(uint64_t));
-        g_hash_table_insert(dict, "tx_errors", tx_errors);
-    }
-
-    if (rx_errors == NULL)
-    {
-        rx_errors = malloc(sizeof(uint64_t));
-        memset(rx_errors, 0, sizeof(uint64_t));
-        g_hash_table_insert(dict, "rx_errors", rx_errors);
-    }
-
-    *tx_errors = rtnl_link_get_stat(link,RTNL_LINK_TX_ERRORS);
-    DLOG(MAM_PMEASURE_NOISY_DEBUG2,"Added %" PRIu64 " as TX_ERRORS\n", *tx_errors);
-    *rx_errors = rtnl_link_get_stat(link,RTNL_LINK_RX_PACKETS);
-    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Added %" PRIu64 " as RX_ERRORS\n", *rx_errors);
+    metrics->tx_errors = rtnl_link_get_stat(link, RTNL_LINK_TX_ERRORS);
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2,"Added %" PRIu64 " as TX_ERRORS\n", metrics->tx_errors);
+    metrics->rx_errors = rtnl_link_get_stat(link, RTNL_LINK_RX_ERRORS);
+    DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Added %" PRIu64 " as RX_ERRORS\n", metrics->rx_errors);
+    metrics->valid |= MUACC_METRICS_ERRORS;
 }
-#endif
 
-#ifdef IS_LINUX
 /**
- *This function reads reads the interface counters for each interface called.
+ *This function updates the rates of one direction of an interface from its byte counter.
+ The maximum rate of the sample period is smoothed into max_srate at the end of the period.
  */
-
-long read_stats(char *path)
+static void update_link_rates(struct link_rates *rates, uint64_t curr_bytes, int end_of_period, const char *direction)
 {
-    FILE *fp;
-    long curr_counter = 0;
-
-    fp = fopen((const char *)path,"r");
+    int64_t activity = (int64_t) (curr_bytes - rates->counter);
+    double curr_rate = activity/CALLBACK_DURATION;
+
+    //calculating smooth rate
+    rates->rate = curr_rate;
+    rates->srate = SMOOTH_FACTOR*(curr_rate) + (1-SMOOTH_FACTOR)*(rates->srate);
+
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Value: %" PRIu64 " Bytes\n",curr_bytes);
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Previous Counter Value: %" PRIu64 " Bytes\n",rates->counter);
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Activity: %" PRId64 " Bytes\n",activity);
+    rates->counter = curr_bytes;
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"%s link usage: %f Bps\n",direction,rates->rate);
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Smoothed %s link usage: %f Bps\n",direction,rates->srate);
+
+    //Check if a new maximum data rate has been achieved in the sample period.
+    if (curr_rate > rates->max_rate){
+        rates->max_rate = curr_rate;
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"New Max. %s rate reached: %.3fbps\n",direction,rates->max_rate);
+    }
 
-    if (fp == NULL)
-    {    DLOG(MAM_PMEASURE_THRUPUT_DEBUG, "\nError Reading stats file\n");
-        perror(path);
+    //Check if the end of the sample period has been reached.
+    if (end_of_period){
+        //determine the newest smoothed maximal data rate (0.0 before the first sample period ended)
+        if (rates->max_srate == 0)
+            rates->max_srate = rates->max_rate;
+        else
+            rates->max_srate = SMOOTH_FACTOR_M*(rates->max_rate) + (1-SMOOTH_FACTOR_M)*(rates->max_srate);
+
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The Max. %s rate of this sample period: %.3fbps\n",direction,rates->max_rate);
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The new smooth Max. %s rate: %.3fbps\n",direction,rates->max_srate);
+        rates->max_rate = curr_rate;
     }
-    fscanf(fp,"%ld",&curr_counter);
-    fclose(fp);
-    return curr_counter;
 }
 #endif
 
 /**
- *This function computes the link usage for each interface. Many key values are stored in the dictonary of each interface.
- For the upload and download activity on the interface:
- The previous counter value with the key "upload_counter" and "download_counter"
- The data rate in the 10 second duration with the key "upload_rate" and "download_rate"
- The smoothed data rate which is a function of data rate(prev line) and previously calculated smoothed data rate with keys "upload_srate"
- and "download_srate"
- The function also observes the maximum data rate reached on each interface in a partical sample period(currently 5 min) They are stored
- with the keys "upload_max_rate" and "download_max_rate"
- Finally, The smoothed maximal data rate is calulated(from periodic maximal rates and previous smoothed maximal data rate)
+ *This function computes the link usage for each interface and stores it in the metrics of the interface.
+ For the upload and download activity on the interface (metrics.upload and metrics.download):
+ The previous counter value in counter
+ The data rate since the previous round in rate
+ The smoothed data rate which is a function of data rate(prev line) and previously calculated smoothed data rate in srate
+ The function also observes the maximum data rate reached on each interface in a partical sample period(currently 5 min) in max_rate
+ Finally, The smoothed maximal data rate is calulated(from periodic maximal rates and previous smoothed maximal data rate) into max_srate
+ The data rates since the previous round are added to the history of the interface
+ The byte and packet counters are taken from the link in the cache passed as lookup (see refresh_link_cache)
  */
 void compute_link_usage(void *ifc, void *lookup)
 {
-	#ifdef IS_LINUX
+	#ifdef HAVE_LIBNL
     struct iface_list *iface = ifc;
-    char path[100];
+    struct nl_cache *cache = lookup;
+    struct iface_metrics *metrics;
+    struct rtnl_link *link;
+    uint64_t tx_bytes;
+    uint64_t rx_bytes;
 
-    long curr_bytes;
-    double curr_rate;
-    double curr_srate;
-    double curr_MSrate;
-    long *prev_bytes;
-    double *prev_rate;
-    double *prev_srate;
-    double *prev_Mrate;
-    double *prev_MSrate;
+    if (iface == NULL || cache == NULL || strcmp(iface->if_name, "lo") == 0){
+        return;
+    }
+    metrics = &(iface->metrics);
 
-    int *prev_sample;
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"\n\n==========\tINTERFACE %s\t==========\n", iface->if_name);
 
-    if (iface == NULL){
+    //reading interface counters starts
+    if ((link = rtnl_link_get_by_name(cache, iface->if_name)) == NULL)
+    {
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Interface not in the link cache\n");
         return;
     }
+    tx_bytes = rtnl_link_get_stat(link, RTNL_LINK_TX_BYTES);
+    rx_bytes = rtnl_link_get_stat(link, RTNL_LINK_RX_BYTES);
+    metrics->tx_packets = rtnl_link_get_stat(link, RTNL_LINK_TX_PACKETS);
+    metrics->rx_packets = rtnl_link_get_stat(link, RTNL_LINK_RX_PACKETS);
+    rtnl_link_put(link);
+    //reading interface counters ends
 
-    if(strcmp(iface->if_name,"lo"))
+    if (metrics->valid & MUACC_METRICS_UPLOAD)
     {
-        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"\n\n==========\tINTERFACE %s\t==========\n", iface->if_name);
-
-        /******************************************************************************
-         ****************    Upload Activity
-         ******************************************************************************/
-        //creating path for tx_bytes starts
-        sprintf(path,"%s%s%s%s",path1,iface->if_name,path2,"tx_bytes");
-        //creating path for tx_bytes ends
-        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"=========\tUPLOAD STATS\t=========\n");
+        metrics->sample++;
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",metrics->sample);
 
-        //reading last counter from dictionary starts
-        prev_bytes = g_hash_table_lookup(iface->measure_dict, "upload_counter");
-        prev_rate = g_hash_table_lookup(iface->measure_dict, "upload_rate");
-        prev_srate = g_hash_table_lookup(iface->measure_dict, "upload_srate");
-        prev_Mrate = g_hash_table_lookup(iface->measure_dict,"upload_max_rate");
-        prev_sample = g_hash_table_lookup(iface->measure_dict,"sample");
-        //reading last counter from dictionary ends
-
-        //reading interface counter starts
-        curr_bytes = read_stats(path);
-        //reading interface counter ends
-        if(prev_bytes){
-            (*prev_sample)++;
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",*prev_sample);
-            curr_rate = (curr_bytes - *prev_bytes)/CALLBACK_DURATION;
-
-            //calculating smooth upload rate starts
-            curr_srate = SMOOTH_FACTOR*(curr_rate) + (1-SMOOTH_FACTOR)*(*prev_srate);
-            //calculating smooth upload rate ends
-
-            *prev_rate = curr_rate;
-            *prev_srate = curr_srate;
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Updating the dictionary\n");
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Value: %ld Bytes\n",curr_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Previous Counter Value: %ld Bytes\n",*prev_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Activity: %ld Bytes\n",(curr_bytes - *prev_bytes));
-            *prev_bytes = curr_bytes;
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Upload Link Usage: %f Bps\n",*prev_rate);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Smoothed Upload Link Usage: %f Bps\n",*prev_srate);
-
-            //Periodic Maximal Data rate determination starts
-
-            //Check if a new maximum data rate has been achieved in the sample period.
-            if (curr_rate > *prev_Mrate){
-                *prev_Mrate = curr_rate;
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"New Max. upload rate reached: %.3fbps\n",*prev_Mrate);
-            }
-
-            //Check if the end of the sample period has been reached.
-            if (*prev_sample == MAX_SAMPLE){
-
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"End of Sample duration\n");
-
-                //fetch the previous maximal smoothed rate (0.0 for the first sample period)
-                prev_MSrate = g_hash_table_lookup(iface->measure_dict,"upload_max_srate");
-                //determine the newest smoothed maximam data rate.
-				if (*prev_MSrate == 0)
-				{
-					curr_MSrate = *prev_Mrate;
-				}
-				else
-				{
-					curr_MSrate = SMOOTH_FACTOR_M*(*prev_Mrate) + (1-SMOOTH_FACTOR_M)*(*prev_MSrate);
-				}
-                *prev_MSrate = curr_MSrate;
-
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The Max. upload rate of this sample period: %.3fbps\n",*prev_Mrate);
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The new smooth Max. upload rate: %.3fbps\n",*prev_MSrate);
-                *prev_Mrate = curr_rate;
-            }
-            //periodic maximal ends
-        }
-        else {
-            //initialization during the first run for a particular interface
-            int *sample = malloc(sizeof(int));
-
-            long *t_bytes = malloc(sizeof(long));
-            double *upload_rate = malloc(sizeof(double));
-            double *s_up_rate = malloc(sizeof(double));
-            double *period_up_rate_max = malloc(sizeof(double));
-            double *period_up_rate_smooth = malloc(sizeof(double));
-            double *callback_duration_rate = malloc(sizeof(double));
-
-            *sample = 0;
-            *t_bytes = curr_bytes;
-            *upload_rate = 0.0;
-            *s_up_rate = 0.0;
-            *period_up_rate_max = 0.0;
-            *period_up_rate_smooth = 0.0;
-            *callback_duration_rate = CALLBACK_DURATION;
-
-            prev_sample = sample;
-
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",*sample);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Inserting to the dictionary\n");
-            g_hash_table_insert(iface->measure_dict, "sample",sample);
-            g_hash_table_insert(iface->measure_dict, "upload_counter",t_bytes);
-            g_hash_table_insert(iface->measure_dict, "upload_rate",upload_rate);
-            g_hash_table_insert(iface->measure_dict, "upload_max_rate",period_up_rate_max);
-            g_hash_table_insert(iface->measure_dict, "upload_srate",s_up_rate);
-            g_hash_table_insert(iface->measure_dict, "upload_max_srate",period_up_rate_smooth);
-            g_hash_table_insert(iface->measure_dict, "callback_duration_rate",callback_duration_rate);
-
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Value: %ld Bytes\n",*t_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Upload Link Usage: %f Bps\n",*upload_rate);
-        }
-
-        prev_bytes = NULL;
-        prev_rate = NULL;
-        prev_srate = NULL;
-        prev_Mrate = NULL;
-
-        /******************************************************************************
-         ****************    Download Activity
-         ******************************************************************************/
-        //creating path for rx_bytes starts
-        sprintf(path,"%s%s%s%s",path1,iface->if_name,path2,"rx_bytes");
-        //creating path for rx_bytes ends
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"=========\tUPLOAD STATS\t=========\n");
+        update_link_rates(&(metrics->upload), tx_bytes, metrics->sample == MAX_SAMPLE, "upload");
 
         DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"=========\tDOWNLOAD STATS\t=========\n");
-        //reading last counter from dictionary starts
-        prev_bytes = g_hash_table_lookup(iface->measure_dict, "download_counter");
-        prev_rate = g_hash_table_lookup(iface->measure_dict, "download_rate");
-        prev_srate = g_hash_table_lookup(iface->measure_dict, "download_srate");
-        prev_Mrate = g_hash_table_lookup(iface->measure_dict,"download_max_rate");
-        //reading last counter from dictionary ends
-
-        //reading interface counter starts
-        curr_bytes = read_stats(path);
-        //reading interface counter ends
-        if(prev_bytes){
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",*prev_sample);
-            curr_rate = (curr_bytes - *prev_bytes)/CALLBACK_DURATION;
-
-            //calculating smooth download rate starts
-            curr_srate = SMOOTH_FACTOR*(curr_rate) + (1-SMOOTH_FACTOR)*(*prev_srate);
-            //calculating smooth download rate ends
-
-            *prev_rate = curr_rate;
-            *prev_srate = curr_srate;
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Updating the dictionary\n");
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Value: %ld Bytes\n",curr_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Previous Counter Value: %ld Bytes\n",*prev_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Activity: %ld Bytes\n",(curr_bytes - *prev_bytes));
-            *prev_bytes = curr_bytes;
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Download Link Usage: %f Bps\n",*prev_rate);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Smoothed Download Link Usage: %f Bps\n",*prev_srate);
-
-            //Periodic Maximal Data rate determination starts
-
-            //Check if a new maximum data rate has been achieved in the sample period.
-            if (curr_rate > *prev_Mrate){
-                *prev_Mrate = curr_rate;
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"New Max. download rate reached: %.3fbps\n",*prev_Mrate);
-            }
-
-            //Check if the end of the sample period has been reached.
-            if (*prev_sample == MAX_SAMPLE){
-
-                *prev_sample = 0;
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"End of Sample duration\n");
-                //fetch the previous maximal smoothed rate (0.0 for the first sample period)
-                prev_MSrate = g_hash_table_lookup(iface->measure_dict,"download_max_srate");
-                //determine the newest smoothed maximam data rate.
-				if (*prev_MSrate == 0)
-				{
-					curr_MSrate = *prev_Mrate;
-				}
-				else
-				{
-					curr_MSrate = SMOOTH_FACTOR_M*(*prev_Mrate) + (1-SMOOTH_FACTOR_M)*(*prev_MSrate);
-				}
-                *prev_MSrate = curr_MSrate;
-
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The Max. download rate of this sample period: %.3fbps\n",*prev_Mrate);
-                DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"The new smooth Max. download rate: %.3fbps\n",*prev_MSrate);
-                *prev_Mrate = curr_rate;
-            }
-            //periodic maximal ends
-        }
-        else {
-            //initialization during the first run for a particular interface
-            long *r_bytes = malloc(sizeof(long));
-            double *download_rate = malloc(sizeof(double));
-            double *s_download_rate = malloc(sizeof(double));
-            double *period_down_rate_max = malloc(sizeof(double));
-            double *period_down_rate_smooth = malloc(sizeof(double));
-
-            *r_bytes = curr_bytes;
-            *download_rate = 0.0;
-            *s_download_rate = 0.0;
-            *period_down_rate_max = 0.0;
-            *period_down_rate_smooth = 0.0;
-
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",*prev_sample);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Inserting to the dictionary\n");
-            g_hash_table_insert(iface->measure_dict, "download_counter",r_bytes);
-            g_hash_table_insert(iface->measure_dict, "download_rate",download_rate);
-            g_hash_table_insert(iface->measure_dict, "download_max_rate",period_down_rate_max);
-            g_hash_table_insert(iface->measure_dict, "download_srate",s_download_rate);
-            g_hash_table_insert(iface->measure_dict, "download_max_srate",period_down_rate_smooth);
-
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Value: %ld Bytes\n",*r_bytes);
-            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Upload Link Usage: %f Bps\n",*download_rate);
-        }
+        update_link_rates(&(metrics->download), rx_bytes, metrics->sample == MAX_SAMPLE, "download");
 
-		// Get timestamp and log it
-		struct timeval current_time;
-		gettimeofday(&current_time, NULL);
-		double *measurement_timestamp_sec = g_hash_table_lookup(iface->measure_dict,"rate_timestamp_sec");
-		double *measurement_timestamp_usec = g_hash_table_lookup(iface->measure_dict,"rate_timestamp_usec");
+        pmeasure_record(&(iface->history[IFACE_HISTORY_UPLOAD]), metrics->upload.rate);
+        pmeasure_record(&(iface->history[IFACE_HISTORY_DOWNLOAD]), metrics->download.rate);
 
-		if (measurement_timestamp_sec == NULL || measurement_timestamp_usec == NULL)
-		{
-			measurement_timestamp_sec = malloc(sizeof(double));
-			memset(measurement_timestamp_sec, 0, sizeof(double));
-			g_hash_table_insert(iface->measure_dict, "rate_timestamp_sec", measurement_timestamp_sec);
-			*measurement_timestamp_sec = current_time.tv_sec;
-
-			measurement_timestamp_usec = malloc(sizeof(double));
-			memset(measurement_timestamp_usec, 0, sizeof(double));
-			g_hash_table_insert(iface->measure_dict, "rate_timestamp_usec", measurement_timestamp_usec);
-			*measurement_timestamp_usec = current_time.tv_usec;
-			DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Logged new timestamp %f.%f\n",*measurement_timestamp_sec, *measurement_timestamp_usec);
-		}
-		else
-		{
-			*measurement_timestamp_usec = current_time.tv_usec;
-			*measurement_timestamp_sec = current_time.tv_sec;
-			DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Logged timestamp %f.%f\n",*measurement_timestamp_sec, *measurement_timestamp_usec);
-		}
+        if (metrics->sample == MAX_SAMPLE)
+        {
+            DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"End of Sample duration\n");
+            metrics->sample = 0;
+        }
     }
+    else
+    {
+        //initialization during the first run for a particular interface
+        memset(&(metrics->upload), 0, sizeof(struct link_rates));
+        memset(&(metrics->download), 0, sizeof(struct link_rates));
+        metrics->upload.counter = tx_bytes;
+        metrics->download.counter = rx_bytes;
+        metrics->sample = 0;
+        metrics->valid |= MUACC_METRICS_UPLOAD | MUACC_METRICS_DOWNLOAD;
+
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Sample Number: %d\n",metrics->sample);
+        DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Current Counter Values: %" PRIu64 " Bytes up, %" PRIu64 " Bytes down\n",tx_bytes,rx_bytes);
+    }
+
+    // Get timestamp of the measurement
+    gettimeofday(&(metrics->timestamp), NULL);
+    metrics->valid |= MUACC_METRICS_TIMESTAMP;
+    DLOG(MAM_PMEASURE_THRUPUT_DEBUG,"Logged timestamp %ld.%ld\n",(long) metrics->timestamp.tv_sec,(long) metrics->timestamp.tv_usec);
 	#endif
-return;
 }
 
 
@@ -633,25 +479,25 @@ void pmeasure_print_prefix_summary(void *pfx, void *data)
 {
 	struct src_prefix_list *prefix = pfx;
 
-	if (prefix == NULL || prefix->measure_dict == NULL)
+	if (prefix == NULL)
 		return;
-    printf("Summary for prefix on interface %s, Family: %s\n", prefix->if_name, prefix->family == AF_INET?"IPv4":"IPv6");
-	double *meanvalue = g_hash_table_lookup(prefix->measure_dict, "srtt_mean");
-	if (meanvalue != NULL)
-		printf("\tMean SRTT: %f ms\n", *meanvalue);
+	struct prefix_metrics *metrics = &(prefix->metrics);
 
-	double *medianvalue = g_hash_table_lookup(prefix->measure_dict, "srtt_median");
-	if (medianvalue != NULL)
-		printf("\tMedian SRTT: %f ms\n", *medianvalue);
+    printf("Summary for prefix on interface %s, Family: %s\n", prefix->if_name, prefix->family == AF_INET?"IPv4":"IPv6");
+	if (metrics->valid & MUACC_METRICS_SRTT_MEAN)
+		printf("\tMean SRTT: %f ms\n", metrics->srtt_mean);
 
+	if (metrics->valid & MUACC_METRICS_SRTT_MEDIAN)
+		printf("\tMedian SRTT: %f ms\n", metrics->srtt_median);
 
-    uint64_t  *rx_errors = g_hash_table_lookup(prefix->measure_dict, "rx_errors");
-    if (rx_errors != NULL)
-        printf("\tRX Errors: %" PRIu64 " \n", *rx_errors);
+	if (metrics->valid & MUACC_METRICS_SRTT_PERCENTILES)
+		printf("\t10th / 90th percentile SRTT: %f / %f ms\n", metrics->srtt_p10, metrics->srtt_p90);
 
-    uint64_t *tx_errors = g_hash_table_lookup(prefix->measure_dict, "tx_errors");
-    if (medianvalue != NULL)
-        printf("\tTX Errors: %" PRIu64 " \n", *tx_errors);
+    if (metrics->valid & MUACC_METRICS_ERRORS)
+    {
+        printf("\tRX Errors: %" PRIu64 " \n", metrics->rx_errors);
+        printf("\tTX Errors: %" PRIu64 " \n", metrics->tx_errors);
+    }
 
 	printf("\n");
 }
@@ -681,29 +527,26 @@ void pmeasure_print_iface_summary(void *ifc, void *data)
 }
 
 /** Log the available measurement data for each prefix, with timestamp and first prefix address
-    Destination: MAM_PMEASURE_LOGPREFIX-prefix.log
+    Destination: MAM_PMEASURE_LOGPREFIX-prefix.log (or .bin, see prefix_log_columns)
  */
 void pmeasure_log_prefix_summary(void *pfx, void *data)
 {
     struct src_prefix_list *prefix = pfx;
 
-    if (prefix == NULL || prefix->measure_dict == NULL)
+    if (prefix == NULL || prefix_log == NULL)
         return;
-
-    // Put together logfile name
-    char *logfile;
-    asprintf(&logfile, "%s-prefix.log", MAM_PMEASURE_LOGPREFIX);
+    struct prefix_metrics *metrics = &(prefix->metrics);
 
     // Log timestamp
     if (data != NULL)
-        _muacc_logtofile(logfile, "%d,", *(int *)data);
+        _muacc_log_int(prefix_log, *(int *)data);
     else
-        _muacc_logtofile(logfile, "NA,");
+        _muacc_log_na(prefix_log);
 
     // Construct string to print the first address of this prefix into
-    char addr_str[INET6_ADDRSTRLEN+1];
+    char addr_str[INET6_ADDRSTRLEN+1] = "";
 
-    // Print first address of the prefix to the string, then print string to logfile
+    // Print first address of the prefix to the string, then log the string
     if (prefix->family == AF_INET)
     {
         inet_ntop(AF_INET, &( ((struct sockaddr_in *) (prefix->if_addrs->addr))->sin_addr ), addr_str, sizeof(addr_str));
@@ -712,121 +555,83 @@ void pmeasure_log_prefix_summary(void *pfx, void *data)
     {
         inet_ntop(AF_INET6, &( ((struct sockaddr_in6 *) (prefix->if_addrs->addr))->sin6_addr ), addr_str, sizeof(addr_str));
     }
-    _muacc_logtofile(logfile,"%s,", addr_str);
+    _muacc_log_string(prefix_log, addr_str);
 
     // Log interface name that this prefix belongs to
-    _muacc_logtofile(logfile, "%s,", prefix->if_name);
+    _muacc_log_string(prefix_log, prefix->if_name);
 
-    double *meanvalue = g_hash_table_lookup(prefix->measure_dict, "srtt_mean");
-    if (meanvalue != NULL)
-        _muacc_logtofile(logfile, "%f,", *meanvalue);
+    if (metrics->valid & MUACC_METRICS_SRTT_MEAN)
+        _muacc_log_double(prefix_log, metrics->srtt_mean);
     else
-        _muacc_logtofile(logfile, "NA,");
+        _muacc_log_na(prefix_log);
 
-    double *medianvalue = g_hash_table_lookup(prefix->measure_dict, "srtt_median");
-    if (medianvalue != NULL)
-        _muacc_logtofile(logfile, "%f,", *medianvalue);
+    if (metrics->valid & MUACC_METRICS_SRTT_MEDIAN)
+        _muacc_log_double(prefix_log, metrics->srtt_median);
     else
-        _muacc_logtofile(logfile, "NA,");
+        _muacc_log_na(prefix_log);
 
-	double *minimumvalue = g_hash_table_lookup(prefix->measure_dict, "srtt_minimum");
-	if (minimumvalue != NULL)
-		_muacc_logtofile(logfile, "%f,", *minimumvalue);
+	if (metrics->valid & MUACC_METRICS_SRTT_MINIMUM)
+		_muacc_log_double(prefix_log, metrics->srtt_minimum);
 	else
-		_muacc_logtofile(logfile, "NA,");
+		_muacc_log_na(prefix_log);
 
-    uint64_t  *rx_errors = g_hash_table_lookup(prefix->measure_dict, "rx_errors");
-    if (rx_errors != NULL)
-        _muacc_logtofile(logfile, "%" PRIu64 ",", *rx_errors);
-    else
-        _muacc_logtofile(logfile, "NA,");
+    if (metrics->valid & MUACC_METRICS_ERRORS)
+    {
+        _muacc_log_int(prefix_log, metrics->rx_errors);
+        _muacc_log_int(prefix_log, metrics->tx_errors);
+    }
 
-    uint64_t *tx_errors = g_hash_table_lookup(prefix->measure_dict, "tx_errors");
-    if (medianvalue != NULL)
-        _muacc_logtofile(logfile, "%" PRIu64 "\n", *tx_errors);
-    else
-        _muacc_logtofile(logfile, "NA\n");
+    // columns without a value are logged as NA
+    _muacc_log_row_end(prefix_log);
 }
 
-
 /** Log the available measurement data for each interface, with timestamp
-    Destination: MAM_PMEASURE_LOGPREFIX-interface.log
+    Destination: MAM_PMEASURE_LOGPREFIX-interface.log (or .bin, see iface_log_columns)
  */
 void pmeasure_log_iface_summary(void *ifc, void *data)
 {
     struct iface_list *iface = ifc;
 
-    if (iface == NULL || iface->measure_dict == NULL)
+    if (iface == NULL || iface_log == NULL)
         return;
-
-    // Put together logfile name
-    char *logfile;
-    asprintf(&logfile, "%s-interface.log", MAM_PMEASURE_LOGPREFIX);
+    struct iface_metrics *metrics = &(iface->metrics);
 
     // Log timestamp if available
     if (data != NULL)
-        _muacc_logtofile(logfile, "%d,", *(int *)data);
+        _muacc_log_int(iface_log, *(int *)data);
     else
-        _muacc_logtofile(logfile, "NA,");
+        _muacc_log_na(iface_log);
 
-	double *measurement_timestamp_sec = g_hash_table_lookup(iface->measure_dict,"rate_timestamp_sec");
-	double *measurement_timestamp_usec = g_hash_table_lookup(iface->measure_dict,"rate_timestamp_usec");
-
-	if (measurement_timestamp_sec != NULL && measurement_timestamp_usec != NULL)
-		_muacc_logtofile(logfile, "%.0f.%.0f,", *measurement_timestamp_sec, *measurement_timestamp_usec);
+	if (metrics->valid & MUACC_METRICS_TIMESTAMP)
+		_muacc_log_timeval(iface_log, &(metrics->timestamp));
 	else
-		_muacc_logtofile(logfile, "NA,");
+		_muacc_log_na(iface_log);
 
 	// Log interface name
-	_muacc_logtofile(logfile, "%s,", iface->if_name);
-
-    double *download_rate = g_hash_table_lookup(iface->measure_dict, "download_rate");
-    if (download_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *download_rate);
-    else
-        _muacc_logtofile(logfile, "NA,");
-
-    double *download_max_rate = g_hash_table_lookup(iface->measure_dict, "download_max_rate");
-    if (download_max_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *download_max_rate);
-    else
-        _muacc_logtofile(logfile, "NA,");
+	_muacc_log_string(iface_log, iface->if_name);
 
-    double *s_download_rate = g_hash_table_lookup(iface->measure_dict, "download_srate");
-    if (s_download_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *s_download_rate);
-    else
-        _muacc_logtofile(logfile, "NA,");
-
-    double *download_max_srate = g_hash_table_lookup(iface->measure_dict, "download_max_srate");
-    if (download_max_srate != NULL)
-        _muacc_logtofile(logfile, "%f,", *download_max_srate);
-    else
-        _muacc_logtofile(logfile, "NA,");
-
-    double *upload_rate = g_hash_table_lookup(iface->measure_dict, "upload_rate");
-    if (upload_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *upload_rate);
-    else
-        _muacc_logtofile(logfile, "NA,");
-
-    double *upload_max_rate = g_hash_table_lookup(iface->measure_dict, "upload_max_rate");
-    if (upload_max_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *upload_max_rate);
+    if (metrics->valid & MUACC_METRICS_DOWNLOAD)
+    {
+        _muacc_log_double(iface_log, metrics->download.rate);
+        _muacc_log_double(iface_log, metrics->download.max_rate);
+        _muacc_log_double(iface_log, metrics->download.srate);
+        _muacc_log_double(iface_log, metrics->download.max_srate);
+    }
     else
-        _muacc_logtofile(logfile, "NA,");
+    {
+        for (int i = 0; i < 4; i++)
+            _muacc_log_na(iface_log);
+    }
 
-    double *s_upload_rate = g_hash_table_lookup(iface->measure_dict, "upload_srate");
-    if (s_upload_rate != NULL)
-        _muacc_logtofile(logfile, "%f,", *s_upload_rate);
-    else
-        _muacc_logtofile(logfile, "NA,");
+    if (metrics->valid & MUACC_METRICS_UPLOAD)
+    {
+        _muacc_log_double(iface_log, metrics->upload.rate);
+        _muacc_log_double(iface_log, metrics->upload.max_rate);
+        _muacc_log_double(iface_log, metrics->upload.srate);
+        _muacc_log_double(iface_log, metrics->upload.max_srate);
+    }
 
-    double *upload_max_srate = g_hash_table_lookup(iface->measure_dict, "upload_max_srate");
-    if (upload_max_srate != NULL)
-        _muacc_logtofile(logfile, "%f\n", *upload_max_srate);
-    else
-        _muacc_logtofile(logfile, "NA\n");
+    _muacc_log_row_end(iface_log);
 }
 
 #ifdef HAVE_LIBNL
@@ -834,21 +639,114 @@ int create_nl_sock()
 {
 	int sock = 0;
 
-	if ((sock = socket(AF_NETLINK, SOCK_DGRAM, NETLINK_INET_DIAG)) ==-1)
+	if ((sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_INET_DIAG)) ==-1)
 	{
 		perror("socket error");
-		return EXIT_FAILURE;
+		return -1;
 	}
 	return sock;
 }
 
+/** length of the prefix a netmask describes */
+static int pmeasure_prefix_len(const struct sockaddr *mask)
+{
+	const unsigned char *bytes;
+	int n, len = 0;
+
+	if (mask->sa_family == AF_INET)
+	{
+		bytes = (const unsigned char *) &(((const struct sockaddr_in *) mask)->sin_addr);
+		n = sizeof(struct in_addr);
+	}
+	else
+	{
+		bytes = (const unsigned char *) &(((const struct sockaddr_in6 *) mask)->sin6_addr);
+		n = sizeof(struct in6_addr);
+	}
+
+	for (int i = 0; i < n && bytes[i] != 0; i++)
+		len += __builtin_popcount(bytes[i]);
+	return len;
+}
+
+/*
+ * Compile inet_diag bytecode that accepts the sockets bound to an address
+ * within one of the prefixes of the af - Family that have a bucket.
+ *
+ * The prefixes are or-ed like ss does it: each S_COND is followed by a JMP to
+ * the end (accept) if it matches, a condition that does not match skips the
+ * JMP and tries the next prefix, and the last one jumps past the end (reject).
+ *
+ * Returns the length of the bytecode, 0 if no prefix has the family, or -1
+ * if it does not fit into size bytes.
+ * */
+int pmeasure_build_bytecode(GHashTable *buckets, int af, unsigned char *bc, int size)
+{
+	struct src_prefix_list *pfx;
+	struct inet_diag_bc_op *op;
+	struct inet_diag_hostcond *cond;
+	GHashTableIter iter;
+	gpointer key;
+	int len = 0, addr_len, cond_len;
+
+	addr_len = (af == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+	cond_len = sizeof(struct inet_diag_bc_op) + sizeof(struct inet_diag_hostcond) + addr_len;
+
+	g_hash_table_iter_init(&iter, buckets);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+	{
+		pfx = key;
+		if (pfx->family != af || pfx->if_addrs == NULL || pfx->if_netmask == NULL)
+			continue;
+
+		if (len + (len > 0 ? sizeof(struct inet_diag_bc_op) : 0) + cond_len > size)
+			return -1;
+
+		// the JMP that accepts a match of the previous condition, its target is set below
+		if (len > 0)
+		{
+			op = (struct inet_diag_bc_op *) (bc + len);
+			op->code = INET_DIAG_BC_JMP;
+			op->yes = sizeof(struct inet_diag_bc_op);
+			op->no = 0;
+			len += sizeof(struct inet_diag_bc_op);
+		}
+
+		op = (struct inet_diag_bc_op *) (bc + len);
+		op->code = INET_DIAG_BC_S_COND;
+		op->yes = cond_len;
+		op->no = cond_len + sizeof(struct inet_diag_bc_op);
+
+		cond = (struct inet_diag_hostcond *) (op + 1);
+		cond->family = af;
+		cond->prefix_len = pmeasure_prefix_len(pfx->if_netmask);
+		cond->port = -1;
+		if (af == AF_INET)
+			memcpy(cond->addr, &(((struct sockaddr_in *) pfx->if_addrs->addr)->sin_addr), addr_len);
+		else
+			memcpy(cond->addr, &(((struct sockaddr_in6 *) pfx->if_addrs->addr)->sin6_addr), addr_len);
+		len += cond_len;
+	}
+
+	// all JMPs go to the end
+	for (int off = 0; off < len; off += op->yes)
+	{
+		op = (struct inet_diag_bc_op *) (bc + off);
+		if (op->code == INET_DIAG_BC_JMP)
+			op->no = len - off;
+	}
+
+	return len;
+}
+
 /*
  * Build and send a Netlink Request Message for the af - Family
- * on the given Socket.
+ * on the given Socket. If bclen is not 0, the bytecode is attached
+ * so the kernel only dumps the sockets it accepts.
  *
  * Returns the number of bytes sent, or -1 for errors.
  * */
-int send_nl_msg(int sock, int af)
+int send_nl_msg(int sock, int af, const void *bytecode, int bclen)
 {
     // initialize structures
 	struct msghdr msg;                 // Message structure
@@ -856,6 +754,7 @@ int send_nl_msg(int sock, int af)
 	struct sockaddr_nl sa;             // Socket address
 	struct iovec iov[4];               // vector for information
 	struct inet_diag_req_v2 request;   // Request structure
+	struct rtattr rta;                 // Header of the bytecode attribute
 	int ret = 0;
 
 	// set structures to 0
@@ -870,18 +769,22 @@ int send_nl_msg(int sock, int af)
     request.sdiag_protocol = IPPROTO_TCP;
 
     // We're interested in all TCP Sockets except Sockets
-    // in the states TCP_SYN_RECV, TCP_TIME_WAIT and TCP_CLOSE
+    // in the states TCP_SYN_RECV, TCP_TIME_WAIT and TCP_CLOSE,
+    // and listening ones unless asked for
     request.idiag_states = TCPF_ALL & ~((1<<TCP_SYN_RECV) | (1<<TCP_TIME_WAIT) | (1<<TCP_CLOSE));
+    if (!MAM_PMEASURE_DUMP_LISTEN)
+        request.idiag_states &= ~(1<<TCP_LISTEN);
 
     // Request tcp_info struct
     request.idiag_ext |= (1 << (INET_DIAG_INFO - 1));
 
     nlh.nlmsg_len = NLMSG_LENGTH(sizeof(request));
+    if (bclen > 0)
+        nlh.nlmsg_len += RTA_LENGTH(bclen);
 
-    // set message flags
-    // note: NLM_F_MATCH is not working due to a bug,
-    //       we have to do the filtering manual
-    nlh.nlmsg_flags = NLM_F_MATCH | NLM_F_REQUEST;
+    // set message flags - the kernel filters by the states and the bytecode,
+    // parse_nl_msg only sorts the sockets into the buckets
+    nlh.nlmsg_flags = NLM_F_DUMP | NLM_F_REQUEST;
 
     // Compose message
     nlh.nlmsg_type = SOCK_DIAG_BY_FAMILY;
@@ -895,6 +798,17 @@ int send_nl_msg(int sock, int af)
     msg.msg_iov = iov;
     msg.msg_iovlen = 2;
 
+    if (bclen > 0)
+    {
+        rta.rta_type = INET_DIAG_REQ_BYTECODE;
+        rta.rta_len = RTA_LENGTH(bclen);
+        iov[2].iov_base = (void*) &rta;
+        iov[2].iov_len = sizeof(rta);
+        iov[3].iov_base = (void*) bytecode;
+        iov[3].iov_len = bclen;
+        msg.msg_iovlen = 4;
+    }
+
     //send the message
     ret = sendmsg(sock, &msg, 0);
     return ret;
@@ -902,22 +816,27 @@ int send_nl_msg(int sock, int af)
 
 /*
  * Receives Netlink Messages on the given Socket
- * and calls the parse_nl_msg() method to parse
- * the RTT values and add it to the values list
+ * and calls the parse_nl_msg() method to sort
+ * the RTT values into the buckets of their prefixes
  *
  * Returns 0 on success and 1 on failure
  * */
-int recv_nl_msg(int sock, void *pfx, GList **values)
+int recv_nl_msg(int sock, const mam_lpm_t *lpm, GHashTable *buckets)
 {
     int numbytes = 0, rtalen =0;
     struct nlmsghdr *nlh;
-    uint8_t msg_buf[BUFFER_SIZE];
+    static uint8_t msg_buf[BUFFER_SIZE];
     struct inet_diag_msg *diag_msg;
 
     while (1)
     {
         // receive the message
         numbytes = recv(sock, msg_buf, sizeof(msg_buf), 0);
+        if (numbytes <= 0)
+        {
+            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error receiving from netlink socket: %s\n", strerror(errno));
+            return EXIT_FAILURE;
+        }
         nlh = (struct nlmsghdr*) msg_buf;
 
         while (NLMSG_OK(nlh, numbytes))
@@ -938,7 +857,7 @@ int recv_nl_msg(int sock, void *pfx, GList **values)
             rtalen = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(*diag_msg));
 
             // parse the message
-            *values = parse_nl_msg(diag_msg, rtalen, pfx, *values);
+            parse_nl_msg(diag_msg, rtalen, lpm, buckets);
 
             // get the next message
             nlh = NLMSG_NEXT(nlh, numbytes);
@@ -948,10 +867,10 @@ int recv_nl_msg(int sock, void *pfx, GList **values)
 }
 
 /*
- * Parses a Netlink Message and add the RTT values to the values list
+ * Parses a Netlink Message and adds the RTT value to the bucket of its prefix
  *
  * */
-GList * parse_nl_msg(struct inet_diag_msg *msg, int rtalen, void *pfx, GList *values)
+void parse_nl_msg(struct inet_diag_msg *msg, int rtalen, const mam_lpm_t *lpm, GHashTable *buckets)
 {
 
     // structure for attributes
@@ -960,41 +879,33 @@ GList * parse_nl_msg(struct inet_diag_msg *msg, int rtalen, void *pfx, GList *va
     // sockaddr structure for prefix sockets
     struct sockaddr_in msg_addr_v4;
     struct sockaddr_in6 msg_addr_v6;
-    
-    char address[INET6_ADDRSTRLEN];
-    memset(&address, 0, sizeof(address));
+    struct sockaddr *msg_addr;
+    struct rtt_bucket *bucket;
 
     if(msg->idiag_family == AF_INET)
     {
-        msg_addr_v4.sin_family = msg->idiag_family;
+        memset(&msg_addr_v4, 0, sizeof(msg_addr_v4));
+        msg_addr_v4.sin_family = AF_INET;
         msg_addr_v4.sin_port = msg->id.idiag_sport;
-        inet_ntop(AF_INET, &(msg->id.idiag_src), address, INET_ADDRSTRLEN);
-        inet_pton(AF_INET, address, &(msg_addr_v4.sin_addr));
+        memcpy(&(msg_addr_v4.sin_addr), msg->id.idiag_src, sizeof(struct in_addr));
+        msg_addr = (struct sockaddr *) &msg_addr_v4;
 
     } else if(msg->idiag_family == AF_INET6)
     {
+        memset(&msg_addr_v6, 0, sizeof(msg_addr_v6));
         msg_addr_v6.sin6_family = AF_INET6;
         msg_addr_v6.sin6_port = msg->id.idiag_sport;
-        inet_ntop(AF_INET6, (struct in_addr6 *) &(msg->id.idiag_src), address, INET6_ADDRSTRLEN);
-        inet_pton(AF_INET6, address,  &(msg_addr_v6.sin6_addr));
+        memcpy(&(msg_addr_v6.sin6_addr), msg->id.idiag_src, sizeof(struct in6_addr));
+        msg_addr = (struct sockaddr *) &msg_addr_v6;
     }
-
-    // Find the right Socket
-    switch(msg->idiag_family)
+    else
     {
-        case(AF_INET6):
-        {
-            if ( (is_addr_in_pfx(pfx, &msg_addr_v6) != 0))
-                return values; break;
-        }
-        case(AF_INET):
-        {
-            if ( (is_addr_in_pfx(pfx, &msg_addr_v4) != 0))
-                return values; break;
-        }
-        default: return values;
+        return;
     }
-    //DLOG(MAM_PMEASURE_NOISY_DEBUG1,"%s is in the Prefixlist\n", address);
+
+    // Find the right bucket - the index tells the prefix of the source address
+    if ((bucket = g_hash_table_lookup(buckets, mam_lpm_lookup(lpm, msg_addr))) == NULL)
+        return;
 
     // Get Attributes
     if (rtalen > 0)
@@ -1007,118 +918,236 @@ GList * parse_nl_msg(struct inet_diag_msg *msg, int rtalen, void *pfx, GList *va
             {
                 // Get rtt values
                 tcpInfo = (struct tcp_info*) RTA_DATA(attr);
-                double *rtt = malloc(sizeof(double));
-                *rtt = tcpInfo->tcpi_rtt/1000.;
-
-                // append it to the list of values
-                values = g_list_append(values, rtt);
-                //DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Adding %f to values\n", *rtt);
+                add_rtt(bucket, tcpInfo->tcpi_rtt/1000.);
             }
             //Get next attributes
             attr = RTA_NEXT(attr, rtalen);
         }
+    }
+}
+
+/** Dump the TCP sockets of the host on the prefixes that have a bucket once and sort their RTTs into the buckets
+ *  The sock_diag sockets are kept open, and reopened on the next round if a dump failed
+ */
+void collect_rtts(const mam_lpm_t *lpm, GHashTable *buckets)
+{
+    static const int families[2] = {AF_INET, AF_INET6};
+    static unsigned char bytecode[MAM_PMEASURE_BYTECODE_SIZE] __attribute__((aligned(4)));
+    int bclen;
+
+    // we have to send two different requests, the first time
+    // with the IPv4 Flag and the other time with the IPv6 flag
+    for (int i = 0; i < 2; i++)
+    {
+        // only ask for the sockets on the prefixes we have buckets for
+        if ((bclen = pmeasure_build_bytecode(buckets, families[i], bytecode, sizeof(bytecode))) == 0)
+            continue;
+        if (bclen < 0)
+        {
+            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Too many prefixes for the bytecode - dumping all sockets\n");
+            bclen = 0;
+        }
+
+        if (diag_sock[i] < 0 && (diag_sock[i] = create_nl_sock()) < 0)
+        {
+            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket creation failed\n");
+            continue;
+        }
+
+        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Sending %s Request\n", (families[i] == AF_INET) ? "IPv4" : "IPv6");
+        if (send_nl_msg(diag_sock[i], families[i], bytecode, bclen) == -1 || recv_nl_msg(diag_sock[i], lpm, buckets) != 0)
+        {
+            // the rest of the dump would end up in the next round
+            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error dumping sockets - reopening netlink socket\n");
+            close(diag_sock[i]);
+            diag_sock[i] = -1;
+        }
+    }
+}
+
+/** Release a bucket and its RTT values */
+static void free_rtt_bucket(gpointer data)
+{
+    struct rtt_bucket *bucket = data;
+
+    free(bucket->values);
+    free(bucket);
+}
+
+/** Is a bucket of a prefix that is no longer measured */
+static gboolean is_inactive_rtt_bucket(gpointer key, gpointer value, gpointer data)
+{
+    return !((struct rtt_bucket *) value)->active;
+}
+
+/** Empty the buckets to collect the RTTs of the sockets of the prefixes in for this round, except on lo
+ *  If any prefix is enabled, only the enabled ones get a bucket. Buckets of prefixes that went away are released.
+ */
+static GHashTable *prepare_rtt_buckets(GSList *prefixes)
+{
+    struct src_prefix_list *prefix;
+    struct rtt_bucket *bucket;
+    unsigned int pfx_flags = PFX_ANY;
+    GHashTableIter iter;
+    gpointer value;
+    GSList *l;
+
+    if (rtt_buckets == NULL)
+        rtt_buckets = g_hash_table_new_full(NULL, NULL, NULL, &free_rtt_bucket);
+
+    g_hash_table_iter_init(&iter, rtt_buckets);
+    while (g_hash_table_iter_next(&iter, NULL, &value))
+        ((struct rtt_bucket *) value)->active = 0;
+
+    // without any enabled prefix, e.g. without configuration, measure all of them
+    for (l = prefixes; l != NULL; l = l->next)
+        if (l->data != NULL && (((struct src_prefix_list *) l->data)->pfx_flags & PFX_ENABLED))
+            pfx_flags = PFX_ENABLED;
+
+    for (l = prefixes; l != NULL; l = l->next)
+    {
+        prefix = l->data;
+        if (prefix == NULL || prefix->if_name == NULL || strcmp(prefix->if_name, "lo") == 0)
+            continue;
+        if ((prefix->pfx_flags & pfx_flags) != pfx_flags)
+            continue;
+
+        if ((bucket = g_hash_table_lookup(rtt_buckets, prefix)) == NULL)
+        {
+            if ((bucket = calloc(1, sizeof(struct rtt_bucket))) == NULL)
+                continue;
+            g_hash_table_insert(rtt_buckets, prefix, bucket);
         }
-    return values;
+        bucket->n = 0;
+        bucket->active = 1;
+    }
+
+    g_hash_table_foreach_remove(rtt_buckets, &is_inactive_rtt_bucket, NULL);
+    return rtt_buckets;
+}
+
+/** Add an RTT to a bucket, making room for twice as many if it is full - dropped if that fails */
+static void add_rtt(struct rtt_bucket *bucket, double rtt)
+{
+    unsigned int size;
+    double *values;
+
+    if (bucket->n == bucket->size)
+    {
+        size = (bucket->size > 0) ? 2 * bucket->size : MAM_PMEASURE_BUCKET_SIZE;
+        if ((values = realloc(bucket->values, size * sizeof(double))) == NULL)
+            return;
+        bucket->values = values;
+        bucket->size = size;
+    }
+    bucket->values[bucket->n++] = rtt;
 }
 #endif
 
-/** Compute the SRTT on an prefix, except on lo
- *  Insert it into the measure_dict as "srtt_median"
+/** Compute the SRTTs of a prefix from the RTTs collected in its bucket, except on lo
+ *  Store them in its metrics, and the minimum and median of this round in its history
  */
 void compute_srtt(void *pfx, void *data)
 {
 	struct src_prefix_list *prefix = pfx;
+	#ifdef HAVE_LIBNL
+	struct rtt_bucket *bucket;
+	double minimum, median;
+	#endif
 
-    // List for rtt values
-    GList *values = NULL;
-
-	if (prefix == NULL || prefix->measure_dict == NULL)
+	if (prefix == NULL)
 		return;
 
-
-	if (prefix->if_name != NULL && strcmp(prefix->if_name,"lo"))
+	#ifdef HAVE_LIBNL
+	if ((bucket = g_hash_table_lookup((GHashTable *) data, prefix)) != NULL)
     {
         DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Computing median SRTTs for a prefix of interface %s:\n", prefix->if_name);
 
-		#ifdef HAVE_LIBNL
-        // create the socket
-        int sock_ip4 = create_nl_sock();
-        int sock_ip6 = create_nl_sock();
-
-        if (sock_ip4 == EXIT_FAILURE || sock_ip6 == EXIT_FAILURE)
-            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Socket creation failed");
-
-        // Create and send netlink messages
-        // we have to send two different requests, the first time
-        // with the IPv4 Flag and the other time with the IPv6 flag
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Sending IPv4 Request\n");
-        if (send_nl_msg(sock_ip4, AF_INET) == -1)
-            DLOG(MAM_PMEASURE_NOISY_DEBUG1, " Error sending Netlink Request");
-
-        // receive messages
-        if (recv_nl_msg(sock_ip4, prefix, &values) != 0)
-            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error receiving Netlink Messages")
-
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Sending IPv6 Request\n");
-        if (send_nl_msg(sock_ip6, AF_INET6) == -1)
-            DLOG(MAM_PMEASURE_NOISY_DEBUG1, " Error sending Netlink Request");
-
-        if (recv_nl_msg(sock_ip6, prefix, &values) != 0)
-            DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error receiving Netlink Messages");
-
-        // compute mean, median and minimum out of the
-        // rtt values and write it into the dict
-        compute_mean(prefix->measure_dict, values);
-        compute_median(prefix->measure_dict, values);
-        compute_minimum(prefix->measure_dict, values);
-
-        // clean up
-        g_list_free(values);
-        close(sock_ip4);
-        close(sock_ip6);
-		#endif
+        // compute mean, minimum and percentiles out of the
+        // rtt values and write it into the metrics - the percentiles reorder them
+        compute_mean(&(prefix->metrics), bucket->values, bucket->n);
+        minimum = compute_minimum(&(prefix->metrics), bucket->values, bucket->n);
+        median = compute_percentiles(&(prefix->metrics), bucket->values, bucket->n);
+
+        // rounds without connections leave a gap in the history
+        if (bucket->n > 0)
+        {
+            pmeasure_record(&(prefix->history[PFX_HISTORY_SRTT_MINIMUM]), minimum);
+            pmeasure_record(&(prefix->history[PFX_HISTORY_SRTT_MEDIAN]), median);
+        }
     }
+	#endif
 	return;
 }
 
 #ifdef HAVE_LIBNL
+/*
+ * Refresh the cache of the links and their statistics with one dump,
+ * creating the socket and the cache on the first call or after an error
+ *
+ * Returns the cache, or NULL for errors
+ * */
+struct nl_cache *refresh_link_cache(void)
+{
+    if (link_cache != NULL)
+    {
+        if (nl_cache_refill(link_sock, link_cache) >= 0)
+            return link_cache;
+        DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error refilling link cache - reconnecting\n");
+        goto error;
+    }
+
+    if ((link_sock = nl_socket_alloc()) == NULL)
+    {
+        DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error creating Socket\n");
+        goto error;
+    }
+    if (nl_connect(link_sock, NETLINK_ROUTE) < 0)
+    {
+        DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error connecting Socket\n");
+        goto error;
+    }
+    if (rtnl_link_alloc_cache(link_sock, AF_UNSPEC, &link_cache) < 0)
+    {
+        DLOG(MAM_PMEASURE_NOISY_DEBUG1, "Error allocating Link cache\n");
+        link_cache = NULL;
+        goto error;
+    }
+    return link_cache;
+
+error:
+    free_link_cache();
+    return NULL;
+}
+
+/** Release the link cache and its socket */
+static void free_link_cache(void)
+{
+    if (link_cache != NULL)
+        nl_cache_free(link_cache);
+    link_cache = NULL;
+
+    if (link_sock != NULL)
+        nl_socket_free(link_sock);
+    link_sock = NULL;
+}
+
 /*
  * Get TCP Statistics like TX_ERRORS and RX_ERRORS
- * of an Interface and insert it into the measure_dict
+ * of the Interface of a prefix from the link cache passed as data
+ * and store it in the metrics of the prefix
  *
  * */
 void get_stats(void *pfx, void *data)
 {
-    struct nl_sock *sock;
-    struct nl_cache *cache;
+    struct nl_cache *cache = data;
     struct rtnl_link *link;
 
     struct src_prefix_list *prefix = pfx;
 
-    if (prefix == NULL || prefix->measure_dict == NULL)
+    if (prefix == NULL || cache == NULL)
         return;
 
-    // Allocate Socket
-    sock = nl_socket_alloc();
-
-    if (!sock)
-    {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Error creating Socket");
-        return;
-    }
-    // connect Socket
-    if(nl_connect(sock, NETLINK_ROUTE) < 0)
-    {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Error connecting Socket");
-        return;
-    }
-    // Allocate Link Cache
-    if (rtnl_link_alloc_cache(sock, AF_UNSPEC, &cache) <0)
-    {
-        DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Error allocating Link cache");
-        nl_socket_free(sock);
-        return;
-    }
     // Get Interface by name
     if (!(link = rtnl_link_get_by_name(cache, prefix->if_name)))
     {
@@ -1126,19 +1155,176 @@ void get_stats(void *pfx, void *data)
         return;
     }
 
-    insert_errors(prefix->measure_dict, link);
-
-    // clean up
+    insert_errors(&(prefix->metrics), link);
     rtnl_link_put(link);
-    nl_cache_put(cache);
-    nl_socket_free(sock);
 }
 #endif
 
+/** Segment the measurements are published in for clients, NULL if it could not be created */
+static struct muacc_metrics_shm *metrics_shm = NULL;
+
+/** Record the measurements are published in for policies only, if the segment could not be created */
+static struct muacc_metrics_shm *metrics_local = NULL;
+
+/** Create the shared memory segment
+ *
+ * @return the segment, NULL if it could not be created
+ */
+static struct muacc_metrics_shm *pmeasure_publish_map(void)
+{
+	int fd;
+
+	if ((fd = shm_open(MUACC_METRICS_SHM, O_CREAT | O_RDWR, 0644)) < 0)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Could not create %s - not publishing measurements: %s\n", MUACC_METRICS_SHM, strerror(errno));
+		return NULL;
+	}
+
+	if (ftruncate(fd, sizeof(struct muacc_metrics_shm)) != 0 ||
+		(metrics_shm = mmap(NULL, sizeof(struct muacc_metrics_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+	{
+		DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Could not map %s - not publishing measurements: %s\n", MUACC_METRICS_SHM, strerror(errno));
+		metrics_shm = NULL;
+		close(fd);
+		shm_unlink(MUACC_METRICS_SHM);
+		return NULL;
+	}
+	close(fd);
+
+	/* a previous MAM may have died while updating - start over with an even sequence number */
+	if (metrics_shm->seq & 1)
+		metrics_shm->seq++;
+
+	return metrics_shm;
+}
+
+/** Set up the records the measurements are published in and mark them as ours
+ *
+ * @return the records - the segment, or memory of our own if there is none - NULL if out of memory
+ */
+static struct muacc_metrics_shm *pmeasure_publish_setup(void)
+{
+	struct muacc_metrics_shm *metrics;
+
+	if ((metrics = pmeasure_publish_map()) == NULL)
+	{
+		/* policies still read the measurements through the same records */
+		if ((metrics_local = calloc(1, sizeof(struct muacc_metrics_shm))) == NULL)
+			return NULL;
+		metrics = metrics_local;
+	}
+
+	_muacc_metrics_write_begin(metrics);
+	memset(metrics->prefixes, 0, sizeof(metrics->prefixes));
+	memset(metrics->ifaces, 0, sizeof(metrics->ifaces));
+	metrics->version = MUACC_METRICS_VERSION;
+	metrics->n_prefixes = metrics->n_ifaces = 0;
+	metrics->magic = MUACC_METRICS_MAGIC;
+	_muacc_metrics_write_end(metrics);
+
+	return metrics;
+}
+
+/** Append the record of a prefix to the records given as data */
+static void pmeasure_publish_prefix(void *pfx, void *data)
+{
+	struct src_prefix_list *prefix = pfx;
+	struct muacc_metrics_shm *metrics = data;
+	struct muacc_metrics_prefix *rec;
+
+	if (prefix == NULL || metrics->n_prefixes >= MUACC_METRICS_MAX_PREFIXES)
+		return;
+
+	rec = &(metrics->prefixes[metrics->n_prefixes++]);
+	memset(rec, 0, sizeof(struct muacc_metrics_prefix));
+	strncpy(rec->if_name, prefix->if_name, MUACC_METRICS_IFNAMSIZ - 1);
+	rec->family = prefix->family;
+	if (prefix->if_addrs != NULL && prefix->if_addrs->addr_len <= sizeof(struct sockaddr_storage))
+		memcpy(&(rec->addr), prefix->if_addrs->addr, prefix->if_addrs->addr_len);
+
+	rec->flags = prefix->metrics.valid & (MUACC_METRICS_SRTT_MEAN | MUACC_METRICS_SRTT_MEDIAN | MUACC_METRICS_SRTT_MINIMUM | MUACC_METRICS_SRTT_PERCENTILES | MUACC_METRICS_ERRORS);
+	rec->srtt_mean = prefix->metrics.srtt_mean;
+	rec->srtt_median = prefix->metrics.srtt_median;
+	rec->srtt_minimum = prefix->metrics.srtt_minimum;
+	rec->srtt_p10 = prefix->metrics.srtt_p10;
+	rec->srtt_p90 = prefix->metrics.srtt_p90;
+	rec->rx_errors = prefix->metrics.rx_errors;
+	rec->tx_errors = prefix->metrics.tx_errors;
+}
+
+/** Append the record of an interface to the records given as data */
+static void pmeasure_publish_iface(void *ifc, void *data)
+{
+	struct iface_list *iface = ifc;
+	struct muacc_metrics_shm *metrics = data;
+	struct muacc_metrics_iface *rec;
+
+	if (iface == NULL || metrics->n_ifaces >= MUACC_METRICS_MAX_IFACES)
+		return;
+
+	rec = &(metrics->ifaces[metrics->n_ifaces++]);
+	memset(rec, 0, sizeof(struct muacc_metrics_iface));
+	strncpy(rec->if_name, iface->if_name, MUACC_METRICS_IFNAMSIZ - 1);
+
+	rec->flags = iface->metrics.valid & (MUACC_METRICS_DOWNLOAD | MUACC_METRICS_UPLOAD | MUACC_METRICS_TIMESTAMP);
+	rec->download_rate = iface->metrics.download.rate;
+	rec->download_max_rate = iface->metrics.download.max_rate;
+	rec->download_srate = iface->metrics.download.srate;
+	rec->download_max_srate = iface->metrics.download.max_srate;
+	rec->upload_rate = iface->metrics.upload.rate;
+	rec->upload_max_rate = iface->metrics.upload.max_rate;
+	rec->upload_srate = iface->metrics.upload.srate;
+	rec->upload_max_srate = iface->metrics.upload.max_srate;
+	rec->timestamp_sec = iface->metrics.timestamp.tv_sec;
+	rec->timestamp_usec = iface->metrics.timestamp.tv_usec;
+}
+
+/** Publish the measurements of this round for clients and policies */
+static void pmeasure_publish(mam_context_t *ctx)
+{
+	struct muacc_metrics_shm *metrics = ctx->metrics;
+	struct timeval now;
+
+	if (metrics == NULL)
+		return;
+
+	gettimeofday(&now, NULL);
+
+	_muacc_metrics_write_begin(metrics);
+	metrics->n_prefixes = 0;
+	metrics->n_ifaces = 0;
+	g_slist_foreach(ctx->prefixes, &pmeasure_publish_prefix, metrics);
+	g_slist_foreach(ctx->ifaces, &pmeasure_publish_iface, metrics);
+	metrics->updated_sec = now.tv_sec;
+	metrics->updated_usec = now.tv_usec;
+	_muacc_metrics_write_end(metrics);
+
+	DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Published %u prefixes and %u interfaces\n", metrics->n_prefixes, metrics->n_ifaces);
+}
+
 void pmeasure_setup(mam_context_t *ctx)
 {
 	DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Setting up pmeasure \n");
 
+	ctx->metrics = pmeasure_publish_setup();
+
+	if (MAM_PMEASURE_LOGPREFIX)
+	{
+		const char *suffix = (MAM_PMEASURE_LOGFORMAT == MUACC_LOG_BINARY) ? ".bin" : ".log";
+		char *logfile;
+
+		if (asprintf(&logfile, "%s-prefix%s", MAM_PMEASURE_LOGPREFIX, suffix) > 0)
+		{
+			prefix_log = _muacc_log_open(logfile, MAM_PMEASURE_LOGFORMAT, prefix_log_columns, sizeof(prefix_log_columns) / sizeof(prefix_log_columns[0]), MAM_PMEASURE_LOGROTATE);
+			free(logfile);
+		}
+		if (asprintf(&logfile, "%s-interface%s", MAM_PMEASURE_LOGPREFIX, suffix) > 0)
+		{
+			iface_log = _muacc_log_open(logfile, MAM_PMEASURE_LOGFORMAT, iface_log_columns, sizeof(iface_log_columns) / sizeof(iface_log_columns[0]), MAM_PMEASURE_LOGROTATE);
+			free(logfile);
+		}
+	}
+
 	// Invoke callback explicitly to initialize stats
 	pmeasure_callback(0, 0, ctx);
 }
@@ -1146,6 +1332,32 @@ void pmeasure_setup(mam_context_t *ctx)
 void pmeasure_cleanup(mam_context_t *ctx)
 {
 	DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Cleaning up\n");
+
+	ctx->metrics = NULL;
+	_muacc_log_close(prefix_log);
+	prefix_log = NULL;
+	_muacc_log_close(iface_log);
+	iface_log = NULL;
+	#ifdef HAVE_LIBNL
+	for (int i = 0; i < 2; i++)
+	{
+		if (diag_sock[i] >= 0)
+			close(diag_sock[i]);
+		diag_sock[i] = -1;
+	}
+	if (rtt_buckets != NULL)
+		g_hash_table_destroy(rtt_buckets);
+	rtt_buckets = NULL;
+	free_link_cache();
+	#endif
+	if (metrics_shm != NULL)
+	{
+		munmap(metrics_shm, sizeof(struct muacc_metrics_shm));
+		metrics_shm = NULL;
+		shm_unlink(MUACC_METRICS_SHM);
+	}
+	free(metrics_local);
+	metrics_local = NULL;
 }
 
 void pmeasure_callback(evutil_socket_t fd, short what, void *arg)
@@ -1157,11 +1369,21 @@ void pmeasure_callback(evutil_socket_t fd, short what, void *arg)
 	if (ctx == NULL)
 		return;
 
-	g_slist_foreach(ctx->prefixes, &compute_srtt, NULL);
-    g_slist_foreach(ctx->prefixes, &get_stats, NULL);
+	round_time = mam_history_now();
+
+	#ifdef HAVE_LIBNL
+	// one dump of the sockets of the host for the RTTs of all prefixes
+	GHashTable *buckets = prepare_rtt_buckets(ctx->prefixes);
+	collect_rtts(ctx->prefix_lpm, buckets);
+	g_slist_foreach(ctx->prefixes, &compute_srtt, buckets);
+
+	// one dump of the links for the statistics of all prefixes and interfaces
+	struct nl_cache *links = refresh_link_cache();
+	g_slist_foreach(ctx->prefixes, &get_stats, links);
 
     DLOG(MAM_PMEASURE_NOISY_DEBUG2, "Computing Link Usage\n");
-    g_slist_foreach(ctx->ifaces, &compute_link_usage, NULL);
+    g_slist_foreach(ctx->ifaces, &compute_link_usage, links);
+	#endif
 
 	if (MAM_PMEASURE_NOISY_DEBUG2)
 	{
@@ -1169,13 +1391,22 @@ void pmeasure_callback(evutil_socket_t fd, short what, void *arg)
 		g_slist_foreach(ctx->prefixes, &pmeasure_print_prefix_summary, NULL);
 		g_slist_foreach(ctx->ifaces, &pmeasure_print_iface_summary, NULL);
 	}
-	if (MAM_PMEASURE_LOGPREFIX)
+	if (prefix_log != NULL || iface_log != NULL)
 	{
 		int timestamp = (int)time(NULL);
 		g_slist_foreach(ctx->prefixes, &pmeasure_log_prefix_summary, &timestamp);
 		g_slist_foreach(ctx->ifaces, &pmeasure_log_iface_summary, &timestamp);
 	}
 
+	pmeasure_publish(ctx);
+
+	/* let the policy react to the new measurements */
+	if (mam_policy_ops(ctx)->on_feedback != NULL)
+		mam_policy_ops(ctx)->on_feedback(ctx);
+
+	/* the policy may have found its leased decisions outdated */
+	mam_revoke_leases_if_requested(ctx);
+
 	DLOG(MAM_PMEASURE_NOISY_DEBUG0, "Callback finished.\n\n");
 	DLOG(MAM_PMEASURE_NOISY_DEBUG2, "\n\n");
 }
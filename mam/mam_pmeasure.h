@@ -16,3 +16,17 @@ void pmeasure_print_iface_summary(void *ifc, void *data);
 
 void pmeasure_log_prefix_summary(void *pfx, void *data);
 void pmeasure_log_iface_summary(void *ifc, void *data);
+
+/** Compute the 10th, 50th and 90th percentile of the srtts of a round and smooth them
+ *  into srtt_p10, srtt_median and srtt_p90 of the metrics - the values are reordered
+ *
+ *  \return median of the round before smoothing, 0 if there are no values
+ */
+double compute_percentiles(struct prefix_metrics *metrics, double *values, unsigned int n);
+
+/** Compile inet_diag bytecode that accepts the sockets bound to an address within one
+ *  of the prefixes of family af that have a bucket (the keys of buckets)
+ *
+ *  \return length of the bytecode, 0 if no prefix has the family, -1 if it does not fit into size bytes
+ */
+int pmeasure_build_bytecode(GHashTable *buckets, int af, unsigned char *bc, int size);
@@ -0,0 +1,304 @@
+/** \file mam_rtnl.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "mam.h"
+#include "mam_rtnl.h"
+#include "mam_worker.h"
+
+#include "dlog.h"
+
+#ifndef MAM_RTNL_NOISY_DEBUG0
+#define MAM_RTNL_NOISY_DEBUG0 0
+#endif
+
+#ifndef MAM_RTNL_NOISY_DEBUG1
+#define MAM_RTNL_NOISY_DEBUG1 1
+#endif
+
+#ifdef IS_LINUX
+
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <event2/event.h>
+
+#ifndef MAM_RTNL_RCVBUF
+#define MAM_RTNL_RCVBUF (256 * 1024)	/**< receive buffer asked for, notifications beyond it are lost */
+#endif
+
+static int rtnl_sk = -1;						/**< rtnetlink socket subscribed to the changes */
+static int ioctl_sk = -1;						/**< socket to query the flags of links */
+static struct event *rtnl_event = NULL;
+static mam_context_t *rtnl_mctx = NULL;
+static void (*rtnl_configure)(mam_context_t *mctx) = NULL;
+static int rtnl_rescan = 0;						/**< compare the lists with getifaddrs() on the next update */
+
+/** flags of a link like getifaddrs() reports them, 0 if it is gone */
+static unsigned int mam_rtnl_link_flags(const char *if_name)
+{
+	struct ifreq ifr;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, if_name, IFNAMSIZ - 1);
+	if (ioctl(ioctl_sk, SIOCGIFFLAGS, &ifr) < 0)
+		return 0;
+
+	return (unsigned short) ifr.ifr_flags;
+}
+
+/** make a socket address from an address attribute, scoped like getifaddrs() does it */
+static void mam_rtnl_sockaddr(int family, const void *data, unsigned int ifindex, struct sockaddr_storage *ss)
+{
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+
+	if (family == AF_INET)
+	{
+		memcpy(&(((struct sockaddr_in *) ss)->sin_addr), data, sizeof(struct in_addr));
+	}
+	else
+	{
+		struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) ss;
+		memcpy(&(sin6->sin6_addr), data, sizeof(struct in6_addr));
+		if (IN6_IS_ADDR_LINKLOCAL(&(sin6->sin6_addr)) || IN6_IS_ADDR_MC_LINKLOCAL(&(sin6->sin6_addr)))
+			sin6->sin6_scope_id = ifindex;
+	}
+}
+
+/** make a netmask from a prefix length */
+static void mam_rtnl_netmask(int family, unsigned int prefixlen, struct sockaddr_storage *ss)
+{
+	unsigned char *bytes;
+	unsigned int i, n;
+
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+
+	if (family == AF_INET)
+	{
+		bytes = (unsigned char *) &(((struct sockaddr_in *) ss)->sin_addr);
+		n = sizeof(struct in_addr);
+	}
+	else
+	{
+		bytes = (unsigned char *) &(((struct sockaddr_in6 *) ss)->sin6_addr);
+		n = sizeof(struct in6_addr);
+	}
+
+	for (i = 0; i < n && prefixlen > 0; i++)
+	{
+		bytes[i] = (prefixlen >= 8) ? 0xff : (unsigned char) (0xff << (8 - prefixlen));
+		prefixlen = (prefixlen >= 8) ? prefixlen - 8 : 0;
+	}
+}
+
+/** apply a RTM_NEWADDR or RTM_DELADDR message to the prefixes */
+static void mam_rtnl_addr(struct nlmsghdr *nh, mam_prefix_changes_t *chg)
+{
+	struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+	struct rtattr *rta;
+	int len = IFA_PAYLOAD(nh);
+	const void *local = NULL;
+	const void *address = NULL;
+	const char *label = NULL;
+	char if_name[IF_NAMESIZE];
+	struct sockaddr_storage addr, mask;
+	unsigned int if_flags;
+
+	if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+		return;
+
+	for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+	{
+		if (rta->rta_type == IFA_LOCAL)
+			local = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_ADDRESS)
+			address = RTA_DATA(rta);
+		else if (rta->rta_type == IFA_LABEL)
+			label = RTA_DATA(rta);
+	}
+
+	/* on point-to-point links, IFA_ADDRESS is the one of the peer */
+	if (local == NULL && (local = address) == NULL)
+		return;
+	mam_rtnl_sockaddr(ifa->ifa_family, local, ifa->ifa_index, &addr);
+
+	/* IPv4 addresses are listed under their label, like getifaddrs() does */
+	if (label != NULL)
+	{
+		strncpy(if_name, label, IF_NAMESIZE - 1);
+		if_name[IF_NAMESIZE - 1] = 0;
+	}
+	else if (if_indextoname(ifa->ifa_index, if_name) == NULL)
+	{
+		/* the link is gone already - the address can only be removed */
+		mam_prefix_del_addr(rtnl_mctx, chg, NULL, ifa->ifa_family, (struct sockaddr *) &addr);
+		return;
+	}
+
+	/* addresses still doing duplicate address detection are not usable yet */
+	if (nh->nlmsg_type == RTM_DELADDR || (ifa->ifa_flags & (IFA_F_TENTATIVE | IFA_F_DADFAILED)))
+	{
+		if (mam_prefix_del_addr(rtnl_mctx, chg, if_name, ifa->ifa_family, (struct sockaddr *) &addr) > 0)
+			DLOG(MAM_RTNL_NOISY_DEBUG1, "%s: address removed\n", if_name);
+		return;
+	}
+
+	if (((if_flags = mam_rtnl_link_flags(if_name)) & IFF_UP) == 0)
+		return;
+
+	mam_rtnl_netmask(ifa->ifa_family, ifa->ifa_prefixlen, &mask);
+	if (mam_prefix_add_addr(rtnl_mctx, chg, if_name, if_flags, ifa->ifa_family, (struct sockaddr *) &addr, (struct sockaddr *) &mask) > 0)
+		DLOG(MAM_RTNL_NOISY_DEBUG1, "%s: address added\n", if_name);
+}
+
+/** read all notifications there are and apply them at once */
+static void mam_rtnl_read_cb(evutil_socket_t fd, short what, void *arg)
+{
+	static char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+	mam_prefix_changes_t chg;
+	struct nlmsghdr *nh;
+	ssize_t len;
+
+	/* the workers must not look at the prefixes meanwhile */
+	mam_workers_pause();
+	mam_prefix_changes_init(rtnl_mctx, &chg);
+
+	while ((len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) != 0)
+	{
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == ENOBUFS)
+			{
+				DLOG(MAM_RTNL_NOISY_DEBUG1, "lost address notifications - scanning again\n");
+				rtnl_rescan = 1;
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				DLOG(MAM_RTNL_NOISY_DEBUG1, "reading from rtnetlink failed: %s\n", strerror(errno));
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len))
+		{
+			switch (nh->nlmsg_type)
+			{
+				case RTM_NEWADDR:
+				case RTM_DELADDR:
+					mam_rtnl_addr(nh, &chg);
+					break;
+
+				/* links going up bring back addresses without telling about them */
+				case RTM_NEWLINK:
+				case RTM_DELLINK:
+					rtnl_rescan = 1;
+					break;
+			}
+		}
+	}
+
+	if (rtnl_rescan)
+	{
+		rtnl_rescan = 0;
+		mam_prefix_rescan(rtnl_mctx, &chg);
+	}
+
+	if (chg.added != NULL && rtnl_configure != NULL)
+		rtnl_configure(rtnl_mctx);
+	mam_prefix_changes_apply(rtnl_mctx, &chg);
+
+	mam_workers_resume();
+}
+
+int mam_rtnl_start(mam_context_t *mctx, void (*configure)(mam_context_t *mctx))
+{
+	struct sockaddr_nl snl;
+	int rcvbuf = MAM_RTNL_RCVBUF;
+
+	if ((rtnl_sk = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE)) < 0)
+	{
+		DLOG(MAM_RTNL_NOISY_DEBUG1, "creating rtnetlink socket failed: %s\n", strerror(errno));
+		goto error;
+	}
+	setsockopt(rtnl_sk, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR;
+	if (bind(rtnl_sk, (struct sockaddr *) &snl, sizeof(snl)) < 0)
+	{
+		DLOG(MAM_RTNL_NOISY_DEBUG1, "subscribing to address changes failed: %s\n", strerror(errno));
+		goto error;
+	}
+
+	if ((ioctl_sk = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0)
+	{
+		DLOG(MAM_RTNL_NOISY_DEBUG1, "creating socket for link flags failed: %s\n", strerror(errno));
+		goto error;
+	}
+
+	if ((rtnl_event = event_new(mctx->ev_base, rtnl_sk, EV_READ | EV_PERSIST, mam_rtnl_read_cb, NULL)) == NULL)
+		goto error;
+	event_add(rtnl_event, NULL);
+
+	rtnl_mctx = mctx;
+	rtnl_configure = configure;
+
+	/* catch up with changes from before we subscribed */
+	rtnl_rescan = 1;
+	event_active(rtnl_event, EV_READ, 0);
+
+	DLOG(MAM_RTNL_NOISY_DEBUG0, "following address changes through rtnetlink\n");
+	return 0;
+
+error:
+	mam_rtnl_stop();
+	return -1;
+}
+
+void mam_rtnl_stop(void)
+{
+	if (rtnl_event != NULL)
+		event_free(rtnl_event);
+	rtnl_event = NULL;
+
+	if (rtnl_sk >= 0)
+		close(rtnl_sk);
+	rtnl_sk = -1;
+
+	if (ioctl_sk >= 0)
+		close(ioctl_sk);
+	ioctl_sk = -1;
+
+	rtnl_mctx = NULL;
+	rtnl_configure = NULL;
+}
+
+#else /* IS_LINUX */
+
+int mam_rtnl_start(mam_context_t *mctx, void (*configure)(mam_context_t *mctx))
+{
+	DLOG(MAM_RTNL_NOISY_DEBUG1, "no rtnetlink - prefixes are only scanned at startup\n");
+	return -1;
+}
+
+void mam_rtnl_stop(void)
+{
+}
+
+#endif /* IS_LINUX */
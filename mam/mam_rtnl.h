@@ -0,0 +1,30 @@
+/** \file  mam_rtnl.h
+ *  \brief Follow address and link changes of the system through rtnetlink
+ *
+ *  MAM subscribes to RTM_NEWADDR, RTM_DELADDR, RTM_NEWLINK and RTM_DELLINK and
+ *  updates the prefixes and interfaces of its context in place: prefixes and
+ *  interfaces still there keep their measurements, configuration and
+ *  policy_info. Address changes are applied one by one, link changes and lost
+ *  notifications make MAM compare its lists with getifaddrs().
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_RTNL_H__
+#define __MAM_RTNL_H__
+
+#include "mam.h"
+
+/** subscribe to the address and link changes of the system on the event base of mctx
+ *
+ *  configure is called after prefixes were added, before the policy learns about them,
+ *  so they can get their configuration.
+ *
+ * @return 0 on success, -1 if rtnetlink is not available
+ */
+int mam_rtnl_start(mam_context_t *mctx, void (*configure)(mam_context_t *mctx));
+
+/** stop following the changes */
+void mam_rtnl_stop(void);
+
+#endif /* __MAM_RTNL_H__ */
@@ -0,0 +1,261 @@
+/** \file mam_shm.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#ifdef IS_LINUX
+#include <sys/eventfd.h>
+#endif
+
+#include "muacc_tlv.h"
+#include "dlog.h"
+
+#include "mam_shm.h"
+
+#ifndef MAM_SHM_NOISY_DEBUG0
+#define MAM_SHM_NOISY_DEBUG0 0
+#endif
+
+#ifndef MAM_SHM_NOISY_DEBUG1
+#define MAM_SHM_NOISY_DEBUG1 1
+#endif
+
+#ifndef MAM_SHM_NOISY_DEBUG2
+#define MAM_SHM_NOISY_DEBUG2 0
+#endif
+
+/** signal the other side through an eventfd */
+static void _mam_shm_signal(int efd)
+{
+	uint64_t one = 1;
+
+	if (write(efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: could not signal eventfd %d: %s\n", efd, strerror(errno));
+}
+
+void _mam_shm_free(struct mam_shm *shm)
+{
+	if (shm == NULL)
+		return;
+
+	if (shm->ev != NULL)
+		event_free(shm->ev);
+	if (shm->base != NULL && shm->base != MAP_FAILED)
+		munmap(shm->base, shm->len);
+	if (shm->efd_mam != -1)
+		close(shm->efd_mam);
+	if (shm->efd_client != -1)
+		close(shm->efd_client);
+	if (shm->pending != NULL)
+		evbuffer_free(shm->pending);
+	if (shm->in != NULL)
+		evbuffer_free(shm->in);
+	free(shm->buf);
+	free(shm);
+}
+
+#ifdef IS_LINUX
+
+/** send the response to a shm request together with the shared memory and both eventfds */
+static int _mam_shm_send_fds(request_context_t *ctx, int memfd, struct mam_shm *shm)
+{
+	char buf[64];
+	ssize_t pos = 0;
+	muacc_mam_action_t reason = muacc_act_shm_resp;
+	int fds[3] = { memfd, shm->efd_mam, shm->efd_client };
+	char cbuf[CMSG_SPACE(sizeof(fds))];
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->version, action, &reason, sizeof(muacc_mam_action_t)) ) return -1;
+	if (ctx->has_request_id)
+	{
+		if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), ctx->version, request_id, &(ctx->request_id), sizeof(muacc_reqid_t)) ) return -1;
+	}
+	if( 0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), ctx->version, eof) ) return -1;
+
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = buf;
+	iov.iov_len = pos;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	if (sendmsg(ctx->client->client_sk, &msg, MSG_NOSIGNAL) != pos)
+	{
+		DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: could not pass shared memory to client %d: %s\n", ctx->client->client_sk, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+struct mam_shm *_mam_shm_offer(request_context_t *ctx)
+{
+	struct mam_shm *shm = NULL;
+	int memfd = -1;
+
+	if (ctx->client == NULL || ctx->client->bev == NULL || ctx->version < MUACC_PROTOCOL_V2)
+		return NULL;
+
+	if (evbuffer_get_length(bufferevent_get_output(ctx->client->bev)) != 0)
+	{
+		DLOG(MAM_SHM_NOISY_DEBUG2, "Client %d still has responses queued - not switching to shared memory\n", ctx->client->client_sk);
+		return NULL;
+	}
+
+	if ((shm = malloc(sizeof(struct mam_shm))) == NULL)
+		return NULL;
+	memset(shm, 0, sizeof(struct mam_shm));
+	shm->efd_mam = shm->efd_client = -1;
+	shm->len = _muacc_ring_shm_len(MUACC_RING_SIZE);
+
+	if ((memfd = memfd_create("muacc", MFD_CLOEXEC)) < 0 || ftruncate(memfd, shm->len) != 0)
+	{
+		DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: could not create shared memory: %s\n", strerror(errno));
+		goto _mam_shm_offer_err;
+	}
+
+	shm->base = mmap(NULL, shm->len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (shm->base == MAP_FAILED || _muacc_ring_shm_init(shm->base, shm->len, MUACC_RING_SIZE, &(shm->req), &(shm->resp)) != 0)
+	{
+		DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: could not map shared memory: %s\n", strerror(errno));
+		goto _mam_shm_offer_err;
+	}
+
+	if ((shm->efd_mam = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0 ||
+		(shm->efd_client = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+	{
+		DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: could not create eventfd: %s\n", strerror(errno));
+		goto _mam_shm_offer_err;
+	}
+
+	if ((shm->pending = evbuffer_new()) == NULL || (shm->in = evbuffer_new()) == NULL ||
+		(shm->buf = malloc(MUACC_RING_SIZE)) == NULL)
+		goto _mam_shm_offer_err;
+
+	if (_mam_shm_send_fds(ctx, memfd, shm) != 0)
+		goto _mam_shm_offer_err;
+
+	close(memfd);
+	DLOG(MAM_SHM_NOISY_DEBUG2, "Client %d talks through shared memory now\n", ctx->client->client_sk);
+	return shm;
+
+_mam_shm_offer_err:
+	if (memfd >= 0)
+		close(memfd);
+	_mam_shm_free(shm);
+	return NULL;
+}
+
+#else
+
+struct mam_shm *_mam_shm_offer(request_context_t *ctx)
+{
+	return NULL;
+}
+
+#endif /* IS_LINUX */
+
+int _mam_shm_flush(struct mam_shm *shm)
+{
+	uint32_t len;
+	int sent = 0;
+	int ret;
+
+	while (evbuffer_get_length(shm->pending) >= sizeof(uint32_t))
+	{
+		evbuffer_copyout(shm->pending, &len, sizeof(uint32_t));
+		if (evbuffer_get_length(shm->pending) < sizeof(uint32_t) + len)
+			return -1;
+
+		ret = _muacc_ring_push(&(shm->resp), evbuffer_pullup(shm->pending, sizeof(uint32_t) + len) + sizeof(uint32_t), len);
+		if (ret == -1)
+		{
+			/* ring is full - the client tells us when it made room */
+			if (_muacc_ring_producer_sleep(&(shm->resp), len))
+				break;
+			continue;
+		}
+		else if (ret < 0)
+		{
+			DLOG(MAM_SHM_NOISY_DEBUG1, "WARNING: dropping response of %u bytes that never fits the ring\n", len);
+		}
+		else
+		{
+			sent++;
+		}
+		evbuffer_drain(shm->pending, sizeof(uint32_t) + len);
+	}
+
+	if (sent > 0 && _muacc_ring_wake_consumer(&(shm->resp)))
+		_mam_shm_signal(shm->efd_client);
+
+	return 0;
+}
+
+int _mam_shm_send(struct mam_shm *shm, const void *msg, size_t len)
+{
+	uint32_t hdr = len;
+
+	/* keep the order - queue behind responses that did not fit yet */
+	if (evbuffer_get_length(shm->pending) == 0)
+	{
+		if (_muacc_ring_push(&(shm->resp), msg, len) == 0)
+		{
+			if (_muacc_ring_wake_consumer(&(shm->resp)))
+				_mam_shm_signal(shm->efd_client);
+			return 0;
+		}
+	}
+
+	if (evbuffer_add(shm->pending, &hdr, sizeof(uint32_t)) != 0 || evbuffer_add(shm->pending, msg, len) != 0)
+		return -1;
+
+	return _mam_shm_flush(shm);
+}
+
+int _mam_shm_recv(struct mam_shm *shm)
+{
+	uint64_t cnt;
+	ssize_t len;
+	int n = 0;
+
+	/* reset the eventfd first, so nothing signalled from now on gets lost */
+	if (read(shm->efd_mam, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		return -1;
+
+	for (;;)
+	{
+		while ((len = _muacc_ring_pop(&(shm->req), shm->buf, MUACC_RING_SIZE)) > 0)
+		{
+			if (evbuffer_add(shm->in, shm->buf, len) != 0)
+				return -1;
+			n++;
+		}
+		if (len < 0)
+			return -1;
+
+		if (_muacc_ring_consumer_sleep(&(shm->req)))
+			break;
+	}
+
+	DLOG(MAM_SHM_NOISY_DEBUG2, "took %d requests off the ring\n", n);
+	return n;
+}
@@ -0,0 +1,63 @@
+/** \file mam_shm.h
+ *	Shared memory transport between MAM and its clients
+ *
+ *  A client may ask to move its connection to a pair of shared memory rings
+ *  (see muacc_ring.h). The socket stays open, but only to notice the client
+ *  going away - requests and responses go through the rings from then on and
+ *  both sides only signal each other using eventfds when the other one sleeps.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_SHM_H__
+#define __MAM_SHM_H__
+
+#include "mam.h"
+#include "muacc_ring.h"
+
+/** Shared memory a client talks to MAM through */
+typedef struct mam_shm {
+	void				*base;			/**< mapping of the rings */
+	size_t				len;
+	muacc_ring_ref_t	req;			/**< requests from the client */
+	muacc_ring_ref_t	resp;			/**< responses to the client */
+	int					efd_mam;		/**< client signals new requests or free space here */
+	int					efd_client;		/**< we signal new responses here */
+	struct event		*ev;			/**< waits for efd_mam */
+	struct evbuffer		*pending;		/**< responses waiting for space in the ring, each prefixed by its length */
+	struct evbuffer		*in;			/**< requests taken off the ring, waiting to be parsed */
+	char				*buf;			/**< room for a request taken off the ring */
+} mam_shm_t;
+
+/** Answer a muacc_act_shm_req: create the rings and pass them to the client
+ *
+ *  The response is sent directly on the socket of the client, together with
+ *  the shared memory and the eventfds. Nothing else may be waiting in the
+ *  output buffer, so the client cannot confuse it with a response sent earlier.
+ *
+ * @return the new shared memory on success, NULL if it could not be offered (ctx is still valid then)
+ */
+struct mam_shm *_mam_shm_offer(request_context_t *ctx);
+
+/** Send a response through the shared memory
+ *
+ * @return 0 on success (possibly queued until the client makes room), -1 otherwise
+ */
+int _mam_shm_send(struct mam_shm *shm, const void *msg, size_t len);
+
+/** Retry sending queued responses, e.g. after the client signalled it made room
+ *
+ * @return 0 on success (whether or not everything fit), -1 if the ring is unusable
+ */
+int _mam_shm_flush(struct mam_shm *shm);
+
+/** Move all requests that are waiting in the ring to shm->in
+ *
+ * @return number of requests moved, -1 if the ring is unusable
+ */
+int _mam_shm_recv(struct mam_shm *shm);
+
+/** Unmap the shared memory and close the eventfds */
+void _mam_shm_free(struct mam_shm *shm);
+
+#endif /* __MAM_SHM_H__ */
@@ -6,9 +6,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <ltdl.h>
 #include <assert.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <pthread.h>
 
 #include "muacc_util.h"
 #include "muacc_tlv.h"
@@ -18,6 +21,10 @@
 
 #include "mam_util.h"
 #include "mam_pmeasure.h"
+#include "mam_shm.h"
+#include "mam_lpm.h"
+#include "mam_worker.h"
+#include "muacc_metrics.h"
 
 #ifndef MAM_UTIL_NOISY_DEBUG0
 #define MAM_UTIL_NOISY_DEBUG0 0
@@ -96,6 +103,41 @@ void _mam_print_measure_dict (gpointer key,  gpointer val, gpointer sb)
 		strbuf_printf((strbuf_t *) sb, " %s -> (unknown format)", (char *) key);
 }
 
+static void _mam_print_link_rates(strbuf_t *sb, const char *direction, const struct link_rates *rates)
+{
+	strbuf_printf(sb, " %s_counter -> %" PRIu64 " %s_rate -> %f %s_srate -> %f %s_max_rate -> %f %s_max_srate -> %f",
+		direction, rates->counter, direction, rates->rate, direction, rates->srate, direction, rates->max_rate, direction, rates->max_srate);
+}
+
+static void _mam_print_iface_metrics(strbuf_t *sb, const struct iface_metrics *metrics)
+{
+	strbuf_printf(sb, " metrics = {");
+	if (metrics->valid & MUACC_METRICS_DOWNLOAD)
+	{
+		strbuf_printf(sb, " sample -> %d", metrics->sample);
+		_mam_print_link_rates(sb, "download", &(metrics->download));
+		_mam_print_link_rates(sb, "upload", &(metrics->upload));
+		strbuf_printf(sb, " rx_packets -> %" PRIu64 " tx_packets -> %" PRIu64, metrics->rx_packets, metrics->tx_packets);
+	}
+	strbuf_printf(sb, " }");
+}
+
+static void _mam_print_prefix_metrics(strbuf_t *sb, const struct prefix_metrics *metrics)
+{
+	strbuf_printf(sb, " metrics = {");
+	if (metrics->valid & MUACC_METRICS_SRTT_MEAN)
+		strbuf_printf(sb, " srtt_mean -> %f", metrics->srtt_mean);
+	if (metrics->valid & MUACC_METRICS_SRTT_MEDIAN)
+		strbuf_printf(sb, " srtt_median -> %f", metrics->srtt_median);
+	if (metrics->valid & MUACC_METRICS_SRTT_MINIMUM)
+		strbuf_printf(sb, " srtt_minimum -> %f", metrics->srtt_minimum);
+	if (metrics->valid & MUACC_METRICS_SRTT_PERCENTILES)
+		strbuf_printf(sb, " srtt_p10 -> %f srtt_p90 -> %f", metrics->srtt_p10, metrics->srtt_p90);
+	if (metrics->valid & MUACC_METRICS_ERRORS)
+		strbuf_printf(sb, " rx_errors -> %" PRIu64 " tx_errors -> %" PRIu64, metrics->rx_errors, metrics->tx_errors);
+	strbuf_printf(sb, " }");
+}
+
 void _mam_print_iface_list(strbuf_t *sb, GSList *ifaces)
 {
 	GSList *i = ifaces;
@@ -121,6 +163,7 @@ void _mam_print_iface(strbuf_t *sb, struct iface_list *current)
 		g_hash_table_foreach(current->policy_set_dict, &_mam_print_dict_kv, sb);
 		strbuf_printf(sb, " }");
 	}
+	_mam_print_iface_metrics(sb, &(current->metrics));
 	if(current->measure_dict != NULL)
 	{
 		strbuf_printf(sb, " measure_dict = {");
@@ -165,6 +208,7 @@ void _mam_print_prefix(strbuf_t *sb, struct src_prefix_list *current)
 		g_hash_table_foreach(current->policy_set_dict, &_mam_print_dict_kv, sb);
 		strbuf_printf(sb, " }");
 	}
+	_mam_print_prefix_metrics(sb, &(current->metrics));
 	if(current->measure_dict != NULL)
 	{
 		strbuf_printf(sb, " measure_dict = {");
@@ -191,9 +235,10 @@ void _mam_print_ctx(strbuf_t *sb, const struct mam_context *ctx)
 		strbuf_printf(sb, " }\n");
 	}
 	strbuf_printf(sb, "\tpolicy = ");
-	if (ctx->policy != 0)
+	if (ctx->policy_gen != NULL)
 	{
-		const lt_dlinfo *policy_info = lt_dlgetinfo(ctx->policy);
+		const lt_dlinfo *policy_info = lt_dlgetinfo(ctx->policy_gen->handle);
+		strbuf_printf(sb, "#%u ", ctx->policy_gen->id);
 		if (policy_info != NULL )
 		{
 			if (policy_info->name != NULL && policy_info->filename != NULL)
@@ -235,11 +280,41 @@ void _free_client_list (gpointer data)
 	
 	if (element->sockets != NULL)
 		g_slist_free_full(element->sockets,  &_free_socket_list);
+
+	if (element->outstanding != NULL)
+		g_hash_table_destroy(element->outstanding);
+
+	if (element->flow_table != NULL)
+		g_hash_table_destroy(element->flow_table);
+
+	if (element->ctx_cache != NULL)
+		g_hash_table_destroy(element->ctx_cache);
+
+	_mam_shm_free(element->shm);
 		
 	free (element);
 	return;
 }
 
+void _mam_free_cached_ctx (gpointer data)
+{
+	if (data != NULL)
+		_muacc_free_ctx((struct _muacc_ctx *) data);
+}
+
+void _mam_cache_ctx(client_list_t *client, uint32_t key, struct _muacc_ctx *ctx)
+{
+	if (client == NULL || client->ctx_cache == NULL || key == 0 || ctx == NULL)
+		return;
+
+	DLOG(MAM_UTIL_NOISY_DEBUG2, "caching context under key %u\n", key);
+
+	/* the cache outlives the request - never clone into its arena */
+	muacc_arena_t *prev = _muacc_arena_use(NULL);
+	g_hash_table_replace(client->ctx_cache, GUINT_TO_POINTER(key), _muacc_clone_ctx(ctx));
+	_muacc_arena_use(prev);
+}
+
 void _free_socket_list (gpointer data)
 {
 	if (!data)
@@ -262,6 +337,7 @@ int _mam_free_ctx(struct mam_context *ctx)
 		return -1;
 	}
 
+	mam_lpm_free(ctx->prefix_lpm);
 	g_slist_free_full(ctx->prefixes, &_free_src_prefix_list);
 	g_slist_free_full(ctx->ifaces, &_free_iface_list);
 	g_slist_free_full(ctx->clients,  &_free_client_list);
@@ -271,6 +347,9 @@ int _mam_free_ctx(struct mam_context *ctx)
 	return 0;
 }
 
+/** serializes lookups of policy symbols */
+static pthread_mutex_t ltdl_lock = PTHREAD_MUTEX_INITIALIZER;
+
 int _mam_fetch_policy_function(lt_dlhandle policy, const char *name, void **function)
 {
 	if (policy == 0 || name == NULL || function == NULL)
@@ -281,10 +360,15 @@ int _mam_fetch_policy_function(lt_dlhandle policy, const char *name, void **func
 	const char *ltdl_error = NULL;
 
 	DLOG(MAM_UTIL_NOISY_DEBUG2, "Trying to find function %s\n", name);
+
+	/* the error state of ltdl is global - workers must not look up symbols at the same time */
+	pthread_mutex_lock(&ltdl_lock);
 	lt_dlerror();
 	*function = lt_dlsym(policy, name);
+	ltdl_error = lt_dlerror();
+	pthread_mutex_unlock(&ltdl_lock);
 
-	if (NULL != (ltdl_error = lt_dlerror()))
+	if (NULL != ltdl_error)
 	{
 		/* Error occured */
 		DLOG(MAM_UTIL_NOISY_DEBUG1, "Function %s not found:\t%s\n", name, ltdl_error);
@@ -294,18 +378,127 @@ int _mam_fetch_policy_function(lt_dlhandle policy, const char *name, void **func
 	return 0;
 }
 
-int _mam_callback_or_fail(request_context_t *ctx, const char *function, unsigned int flag_if_success, muacc_mam_action_t action_if_fail)
+int _mam_resolve_policy(lt_dlhandle policy, struct mam_policy *ops)
+{
+	const struct mam_policy *table = NULL;
+	const unsigned int *capabilities = NULL;
+
+	memset(ops, 0, sizeof(struct mam_policy));
+	if (policy == 0)
+		return -1;
+
+	if (_mam_fetch_policy_function(policy, "mam_policy", (void **) &table) == 0 && table != NULL)
+	{
+		if (table->abi_version == MAM_POLICY_ABI_VERSION)
+		{
+			DLOG(MAM_UTIL_NOISY_DEBUG1, "Policy exports its entry points\n");
+			*ops = *table;
+			return 0;
+		}
+		DLOG(MAM_UTIL_NOISY_DEBUG0, "Policy was built for ABI version %u instead of %u - looking up its functions by name\n", table->abi_version, MAM_POLICY_ABI_VERSION);
+	}
+
+	/* policy without table - missing functions are left NULL */
+	ops->abi_version = MAM_POLICY_ABI_VERSION;
+	if (_mam_fetch_policy_function(policy, "mam_policy_capabilities", (void **) &capabilities) == 0 && capabilities != NULL)
+		ops->capabilities = *capabilities;
+	_mam_fetch_policy_function(policy, "init", (void **) &(ops->init));
+	_mam_fetch_policy_function(policy, "cleanup", (void **) &(ops->cleanup));
+	_mam_fetch_policy_function(policy, "on_resolve_request", (void **) &(ops->on_resolve_request));
+	_mam_fetch_policy_function(policy, "on_connect_request", (void **) &(ops->on_connect_request));
+	_mam_fetch_policy_function(policy, "on_socketconnect_request", (void **) &(ops->on_socketconnect_request));
+	_mam_fetch_policy_function(policy, "on_socketconnect_batch", (void **) &(ops->on_socketconnect_batch));
+	_mam_fetch_policy_function(policy, "on_socketchoose_request", (void **) &(ops->on_socketchoose_request));
+	_mam_fetch_policy_function(policy, "on_config_request", (void **) &(ops->on_config_request));
+	_mam_fetch_policy_function(policy, "on_new_subflow_request", (void **) &(ops->on_new_subflow_request));
+	_mam_fetch_policy_function(policy, "on_feedback", (void **) &(ops->on_feedback));
+	_mam_fetch_policy_function(policy, "on_prefix_change", (void **) &(ops->on_prefix_change));
+
+	return 0;
+}
+
+/** entry points of a context without policy */
+static const mam_policy_t no_policy;
+
+struct mam_policy_gen *_mam_policy_ref(struct mam_policy_gen *gen)
+{
+	if (gen != NULL)
+		__atomic_add_fetch(&(gen->refs), 1, __ATOMIC_RELAXED);
+
+	return gen;
+}
+
+void _mam_policy_unref(struct mam_policy_gen *gen)
+{
+	if (gen == NULL || __atomic_sub_fetch(&(gen->refs), 1, __ATOMIC_ACQ_REL) > 0)
+		return;
+
+	DLOG(MAM_UTIL_NOISY_DEBUG1, "Policy generation %u has no requests left - closing it\n", gen->id);
+	pthread_mutex_lock(&ltdl_lock);
+	lt_dlclose(gen->handle);
+	pthread_mutex_unlock(&ltdl_lock);
+	free(gen);
+}
+
+const mam_policy_t *mam_policy_ops(mam_context_t *mctx)
+{
+	if (mctx == NULL || mctx->policy_gen == NULL)
+		return &no_policy;
+
+	return &(mctx->policy_gen->ops);
+}
+
+const mam_policy_t *_mam_request_policy(request_context_t *ctx)
+{
+	if (ctx->policy_gen == NULL)
+		ctx->policy_gen = _mam_policy_ref(ctx->mctx->policy_gen);
+
+	if (ctx->policy_gen == NULL)
+		return &no_policy;
+
+	return &(ctx->policy_gen->ops);
+}
+
+/** snapshot of the measurements taken by this thread, and the sequence number it was taken at */
+static __thread struct muacc_metrics_shm *measurements = NULL;
+static __thread uint32_t measurements_seq = 0;
+
+const struct muacc_metrics_shm *mam_measurements(mam_context_t *mctx)
+{
+	uint32_t seq;
+
+	if (mctx == NULL || mctx->metrics == NULL)
+		return NULL;
+
+	seq = __atomic_load_n(&(mctx->metrics->seq), __ATOMIC_ACQUIRE);
+	if (measurements != NULL && seq == measurements_seq)
+		return measurements;
+
+	if (measurements == NULL && (measurements = malloc(sizeof(struct muacc_metrics_shm))) == NULL)
+		return NULL;
+
+	/* keep the last snapshot if the measurements are updated right now */
+	if (muacc_metrics_snapshot(mctx->metrics, measurements) == 0)
+		measurements_seq = measurements->seq;
+	else if (measurements_seq == 0)
+		return NULL;
+
+	return measurements;
+}
+
+int _mam_callback_or_fail(request_context_t *ctx, int (*callback_function)(request_context_t *ctx, struct event_base *base), const char *function, unsigned int flag_if_success, muacc_mam_action_t action_if_fail)
 {
 	if (ctx == NULL || function == NULL)
 		return -1;
 
-	int (*callback_function)(request_context_t *ctx, struct event_base *base) = NULL;
-	if (_mam_fetch_policy_function(ctx->mctx->policy, function, (void **) &callback_function) == 0)
+	if (callback_function != NULL)
 	{
 		int ret;
+		muacc_arena_t *prev = _muacc_arena_use(ctx->arena);
 		DLOG(MAM_UTIL_NOISY_DEBUG2,"Calling %s\n", function);
 		ctx->policy_calls_performed |= flag_if_success;
 		ret = callback_function(ctx, ctx->mctx->ev_base);
+		_muacc_arena_use(prev);
 		if (ret != 0)
 		{
 			DLOG(MAM_UTIL_NOISY_DEBUG1,"Callback %s returned %d\n", function, ret);
@@ -331,7 +524,7 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 		if ((ctx->policy_calls_performed & MAM_POLICY_RESOLVE_CALLED) == 0)
 		{
 			DLOG(MAM_UTIL_NOISY_DEBUG0,"Calling on_resolve_request for Socketconnect fallback\n");
-			return _mam_callback_or_fail(ctx, "on_resolve_request", MAM_POLICY_RESOLVE_CALLED, reason);
+			return _mam_callback_or_fail(ctx, _mam_request_policy(ctx)->on_resolve_request, "on_resolve_request", MAM_POLICY_RESOLVE_CALLED, reason);
 		}
 		else if ((ctx->policy_calls_performed & MAM_POLICY_CONNECT_CALLED) == 0)
 		{
@@ -344,7 +537,7 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 					ctx->ctx->type = ctx->ctx->remote_addrinfo_res->ai_socktype;
 					ctx->ctx->protocol = ctx->ctx->remote_addrinfo_res->ai_protocol;
 					ctx->ctx->remote_sa_len = ctx->ctx->remote_addrinfo_res->ai_addrlen;
-					ctx->ctx->remote_sa = _muacc_clone_sockaddr(ctx->ctx->remote_addrinfo_res->ai_addr, ctx->ctx->remote_addrinfo_res->ai_addrlen);
+					ctx->ctx->remote_sa = _muacc_ctx_clone_sockaddr(ctx->ctx, ctx->ctx->remote_addrinfo_res->ai_addr, ctx->ctx->remote_addrinfo_res->ai_addrlen);
 				}
 				else
 				{
@@ -352,10 +545,17 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 				}
 			}
 			DLOG(MAM_UTIL_NOISY_DEBUG0,"Calling on_connect_request to complete Socketconnect fallback\n");
-			return _mam_callback_or_fail(ctx, "on_connect_request", MAM_POLICY_CONNECT_CALLED, reason);
+			return _mam_callback_or_fail(ctx, _mam_request_policy(ctx)->on_connect_request, "on_connect_request", MAM_POLICY_CONNECT_CALLED, reason);
 		}
 	}
 
+	if (ctx->out == NULL)
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG1,"Client went away - dropping response %d\n", reason);
+		mam_release_request_context(ctx);
+		return(-1);
+	}
+
 	DLOG(MAM_UTIL_NOISY_DEBUG0,"Sending response %d to client request\n", reason);
 	/* Request has finished - Actually send a reply */
 	struct evbuffer_iovec v[1];
@@ -377,19 +577,65 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 	DLOG(MAM_UTIL_NOISY_DEBUG2, "packing request\n");
 
 	/* pack request */
-	if( 0 > _muacc_push_tlv(v[0].iov_base, &pos, v[0].iov_len, action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_send_ctx_event_pack_err;
+	if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, action, &reason, sizeof(muacc_mam_action_t)) ) goto  _muacc_send_ctx_event_pack_err;
+
+	/* only clients that sent an id know how to handle it */
+	if (ctx->has_request_id)
+	{
+		if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, request_id, &(ctx->request_id), sizeof(muacc_reqid_t)) ) goto  _muacc_send_ctx_event_pack_err;
+	}
+
+	if (reason == muacc_act_hello_resp)
+	{
+		uint32_t version = (ctx->version_offered > MUACC_PROTOCOL_MAX) ? MUACC_PROTOCOL_MAX : ctx->version_offered;
+		if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, protocol_version, &version, sizeof(uint32_t)) ) goto  _muacc_send_ctx_event_pack_err;
+	}
+
+	if (reason == muacc_error_unknown_ctx)
+	{
+		/* we do not know the context the client has in mind - it has to send it again */
+		ctx->ctx_key = 0;
+		goto _muacc_send_ctx_event_pack_eof;
+	}
+
+	if (reason == muacc_act_socketconnect_resp && ctx->lease_ttl > 0 && ctx->version >= MUACC_PROTOCOL_V2)
+	{
+		/* the client may apply this decision again on its own until the lease ends */
+		if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, lease_ttl, &(ctx->lease_ttl), sizeof(uint32_t)) ) goto  _muacc_send_ctx_event_pack_err;
+		if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, lease_epoch, &(ctx->mctx->lease_epoch), sizeof(uint32_t)) ) goto  _muacc_send_ctx_event_pack_err;
+	}
 
 	if (reason == muacc_act_socketchoose_resp_existing && ctx->sockets != NULL)
 	{
-		if( 0 > _muacc_push_tlv(v[0].iov_base, &pos, v[0].iov_len, socketset_file, &(ctx->sockets->file), sizeof(int)) ) goto  _muacc_send_ctx_event_pack_err;
+		if( 0 > _muacc_push_tlv_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, socketset_file, &(ctx->sockets->file), sizeof(int)) ) goto  _muacc_send_ctx_event_pack_err;
 	}
 
-	if( 0 > _muacc_pack_ctx(v[0].iov_base, &pos, v[0].iov_len, ctx->ctx) ) goto  _muacc_send_ctx_event_pack_err;
-	if( 0 > _muacc_push_tlv_tag(v[0].iov_base, &pos, v[0].iov_len, eof) ) goto  _muacc_send_ctx_event_pack_err;
+	if (ctx->version >= MUACC_PROTOCOL_V2 && ctx->ctx_key != 0 && ctx->ctx_sent != NULL)
+	{
+		/* the client still has the context it sent - only send what the policy changed */
+		if( 0 > _muacc_pack_ctx_delta(v[0].iov_base, &pos, v[0].iov_len, ctx->ctx_sent, ctx->ctx) ) goto  _muacc_send_ctx_event_pack_err;
+		_mam_cache_ctx(ctx->client, ctx->ctx_key, ctx->ctx);
+	}
+	else
+	{
+		if( 0 > _muacc_pack_ctx_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, ctx->ctx) ) goto  _muacc_send_ctx_event_pack_err;
+	}
+
+_muacc_send_ctx_event_pack_eof:
+	if( 0 > _muacc_push_tlv_tag_v(v[0].iov_base, &pos, v[0].iov_len, ctx->version, eof) ) goto  _muacc_send_ctx_event_pack_err;
 	DLOG(MAM_UTIL_NOISY_DEBUG2,"packing request done\n");
 
    v[0].iov_len = pos;
 
+	if (ctx->client != NULL && ctx->client->shm != NULL)
+	{
+		/* the reserved space was only needed for packing - nothing is committed */
+		DLOG(MAM_UTIL_NOISY_DEBUG2,"sending response through shared memory\n");
+		ret = _mam_shm_send(ctx->client->shm, v[0].iov_base, pos);
+		mam_release_request_context(ctx);
+		return (ret < 0) ? -1 : 0;
+	}
+
 
 	DLOG(MAM_UTIL_NOISY_DEBUG2,"committing buffer\n");
 	if (evbuffer_commit_space(ctx->out, v, 1) < 0)
@@ -411,121 +657,337 @@ int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason)
 }
 
 
-int _muacc_proc_tlv_event(request_context_t *ctx)
+/** set by mam_request_lease_revoke, taken by mam_revoke_leases_if_requested */
+static int lease_revoke_requested = 0;
+
+/** tell a client that its leases are revoked - only clients speaking version 2 know about leases */
+static void _mam_send_lease_revoke(gpointer data, gpointer user_data)
+{
+	client_list_t *client = (client_list_t *) data;
+	mam_context_t *mctx = (mam_context_t *) user_data;
+	muacc_mam_action_t reason = muacc_act_lease_revoke;
+	char buf[64];
+	ssize_t pos = 0;
+
+	if (client->bev == NULL || client->version < MUACC_PROTOCOL_V2)
+		return;
+
+	if( 0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), client->version, action, &reason, sizeof(muacc_mam_action_t)) ||
+		0 > _muacc_push_tlv_v(buf, &pos, sizeof(buf), client->version, lease_epoch, &(mctx->lease_epoch), sizeof(uint32_t)) ||
+		0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), client->version, eof) )
+		return;
+
+	if (client->shm != NULL)
+		_mam_shm_send(client->shm, buf, pos);
+	else
+		bufferevent_write(client->bev, buf, pos);
+}
+
+void mam_revoke_leases(mam_context_t *mctx)
+{
+	mctx->lease_epoch++;
+	DLOG(MAM_UTIL_NOISY_DEBUG1, "Revoking leases - epoch is %u now\n", mctx->lease_epoch);
+	g_slist_foreach(mctx->clients, &_mam_send_lease_revoke, mctx);
+}
+
+void mam_request_lease_revoke(void)
 {
+	__atomic_store_n(&lease_revoke_requested, 1, __ATOMIC_RELEASE);
+}
 
-	unsigned char *buf;
-	size_t buf_pos = 0;
+void mam_revoke_leases_if_requested(mam_context_t *mctx)
+{
+	if (!__atomic_exchange_n(&lease_revoke_requested, 0, __ATOMIC_ACQ_REL))
+		return;
 
-	size_t tlv_len;
-	muacc_tlv_t *tag;
-	void *data;
-	size_t *data_len;
+	DLOG(MAM_UTIL_NOISY_DEBUG1, "Policy asked to revoke the leases\n");
+	mam_workers_pause();
+	mam_revoke_leases(mctx);
+	mam_workers_resume();
+}
+
+void mam_configure_leases(mam_context_t *mctx)
+{
+	gpointer value = NULL;
+
+	mctx->lease_ttl = 0;
+	if (mctx->policy_set_dict != NULL && (value = g_hash_table_lookup(mctx->policy_set_dict, "lease_ttl")) != NULL)
+		mctx->lease_ttl = atoi(value);
+
+	DLOG(MAM_UTIL_NOISY_DEBUG1, "Leasing socketconnect decisions for %u ms\n", mctx->lease_ttl);
+	mam_revoke_leases(mctx);
+}
 
-	/* check header */
-	tlv_len = sizeof(muacc_tlv_t) + sizeof(size_t);
-    buf = evbuffer_pullup(ctx->in, tlv_len);
-	if(buf == NULL)
+/** copy up to n bytes at offset off of an evbuffer without pulling it up
+ *
+ * @return number of bytes copied
+ */
+static size_t _mam_peek_bytes(struct evbuffer *in, size_t off, unsigned char *dst, size_t n)
+{
+	struct evbuffer_ptr ptr;
+	struct evbuffer_iovec v[4];
+	size_t copied = 0;
+	int i, n_vec;
+
+	if (evbuffer_ptr_set(in, &ptr, off, EVBUFFER_PTR_SET) != 0)
+		return 0;
+
+	n_vec = evbuffer_peek(in, n, &ptr, v, 4);
+	for (i = 0; i < n_vec && i < 4 && copied < n; i++)
+	{
+		size_t l = (v[i].iov_len < n - copied) ? v[i].iov_len : n - copied;
+		memcpy(dst + copied, v[i].iov_base, l);
+		copied += l;
+	}
+
+	if (copied < n && evbuffer_get_length(in) > off + copied)
 	{
-		DLOG(MAM_UTIL_NOISY_DEBUG1, "TLV read failed: not enough data \n");
-		return(_muacc_proc_tlv_event_too_short);
+		/* header scattered over lots of tiny chunks - rare enough to just pull it up */
+		size_t want = (evbuffer_get_length(in) - off < n) ? evbuffer_get_length(in) - off : n;
+		unsigned char *buf = evbuffer_pullup(in, off + want);
+		if (buf == NULL)
+			return 0;
+		memcpy(dst, buf + off, want);
+		copied = want;
 	}
-	assert(evbuffer_get_length(ctx->in) >= tlv_len );
 
-	/* parse tag and length */
-	tag = ((muacc_tlv_t *) (buf + buf_pos));
-	buf_pos += sizeof(muacc_tlv_t);
+	return copied;
+}
+
+/** append a socket to the candidates of a socketchoose request
+ *
+ * @return the new socketset member
+ */
+static struct socketlist *_mam_add_candidate(request_context_t *ctx, int file)
+{
+	struct socketlist *new = _muacc_alloc(sizeof(struct socketlist));
+
+	memset(new, 0, sizeof(struct socketlist));
+	new->file = file;
+	new->ctx = _muacc_create_ctx();
+
+	/* keep the order the client offered them in - appending is cheap with the tail remembered */
+	if (ctx->sockets == NULL)
+		ctx->sockets = new;
+	else
+		ctx->sockets_tail->next = new;
+	ctx->sockets_tail = new;
 
-	data_len = ((size_t *) (buf + buf_pos));
-	buf_pos += sizeof(size_t);
+	return new;
+}
 
-	DLOG(MAM_UTIL_NOISY_DEBUG2, "read header - buf_pos=%ld tag=%x, data_len=%ld tlv_len=%ld \n" , (long int) buf_pos, *tag, (long int) *data_len, (long int) tlv_len);
+/** continue from the context the client made us cache under key - flags the request if we do not know it */
+static void _mam_ctx_from_cache(request_context_t *ctx, uint32_t key, struct _muacc_ctx **parsectx)
+{
+	struct _muacc_ctx *cached = NULL;
 
-	/* check eof */
-	if(*tag == eof)
+	if (ctx->client != NULL && ctx->client->ctx_cache != NULL)
+		cached = g_hash_table_lookup(ctx->client->ctx_cache, GUINT_TO_POINTER(key));
+	if (cached == NULL)
 	{
-		DLOG(MAM_UTIL_NOISY_DEBUG2, "found eof - returning\n");
-        evbuffer_drain(ctx->in, tlv_len);
-		return(_muacc_proc_tlv_event_eof);
+		DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: request refers to unknown context %u\n", key);
+		ctx->ctx_unknown = 1;
 	}
-
-	/* check data */
-	tlv_len += *data_len;
-    buf = evbuffer_pullup(ctx->in, tlv_len);
-	if(buf == NULL)
+	else
 	{
-		DLOG(MAM_UTIL_NOISY_DEBUG1, "TLV read failed: not enough data\n");
-		return(_muacc_proc_tlv_event_too_short);
+		_muacc_free_ctx(*parsectx);
+		*parsectx = _muacc_clone_ctx(cached);
 	}
-	assert(evbuffer_get_length(ctx->in) >= tlv_len );
-	data = ((void *) (buf + buf_pos));
+}
 
+/** process a single TLV of a request */
+static void _muacc_proc_tlv(request_context_t *ctx, muacc_tlv_t tag, void *data, size_t data_len)
+{
 	/* check action */
-	if(*tag == action)
+	if(tag == action && data_len == sizeof(muacc_mam_action_t))
 	{
 		DLOG(MAM_UTIL_NOISY_DEBUG2, "unpacking action: %d \n" , *((muacc_mam_action_t *) data));
 		ctx->action = *((muacc_mam_action_t *) data);
 	}
-	else if (*tag == socketset_file)
+	else if (tag == request_id && data_len == sizeof(muacc_reqid_t))
 	{
-		DLOG(MAM_UTIL_NOISY_DEBUG2, "socketset file descriptor %d \n" , *((muacc_mam_action_t *) data));
-
-		/* Searching for a place to insert the new socketset member */
-		if (ctx->sockets == NULL)
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "unpacking request id: %u \n" , *((muacc_reqid_t *) data));
+		ctx->request_id = *((muacc_reqid_t *) data);
+		ctx->has_request_id = 1;
+	}
+	else if (tag == protocol_version && data_len == sizeof(uint32_t))
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "unpacking protocol version: %u \n" , *((uint32_t *) data));
+		ctx->version_offered = *((uint32_t *) data);
+	}
+	else if (tag == batch_item && data_len == sizeof(muacc_reqid_t))
+	{
+		request_context_t *item = mam_new_request_context(ctx->mctx, ctx->client);
+
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "unpacking batch item with request id %u \n" , *((muacc_reqid_t *) data));
+		item->action = muacc_act_socketconnect_req;
+		item->request_id = *((muacc_reqid_t *) data);
+		item->has_request_id = 1;
+		item->batch_next = ctx->batch;
+		ctx->batch = item;
+	}
+	else if (ctx->batch != NULL)
+	{
+		/* everything after a batch item describes it - parse it into its own arena */
+		muacc_arena_t *prev = _muacc_arena_use(ctx->batch->arena);
+		_muacc_proc_tlv(ctx->batch, tag, data, data_len);
+		_muacc_arena_use(prev);
+	}
+	else if (tag == socketset_file && data_len == sizeof(int))
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "socketset file descriptor %d \n" , *((int *) data));
+		_mam_add_candidate(ctx, *(int *) data);
+	}
+	else if (tag == socketset_summary)
+	{
+		uint64_t file, key, state;
+		ssize_t pos = 0;
+		struct socketlist *new;
+
+		if (0 > _muacc_get_varint(data, &pos, data_len, &file) ||
+			0 > _muacc_get_varint(data, &pos, data_len, &key) ||
+			0 > _muacc_get_varint(data, &pos, data_len, &state) ||
+			file > INT_MAX || key > UINT32_MAX || state > INT_MAX)
 		{
-			DLOG(MAM_UTIL_NOISY_DEBUG2, "Receiving new socket set\n");
-			ctx->sockets = malloc(sizeof(struct socketlist));
-			ctx->sockets->next = NULL;
-			ctx->sockets->file = *(int *) data;
-			ctx->sockets->ctx = _muacc_create_ctx();
+			DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: malformed socketset summary of %ld bytes\n", (long) data_len);
+			return;
 		}
-		else
-		{
-			DLOG(MAM_UTIL_NOISY_DEBUG2, "Adding to existing set\n");
-			struct socketlist *new = ctx->sockets;
-			while (new->next != NULL)
-			{
-				new = new->next;
-			}
+		DLOG(MAM_UTIL_NOISY_DEBUG2, "socketset file descriptor %d (context %u, TCP state %d)\n", (int) file, (uint32_t) key, (int) state);
 
-			/* Creating socket set member */
-			new->next = malloc(sizeof(struct socketlist));
-			new->next->next = NULL;
-			new->next->file = *(int *) data;
-			new->next->ctx = _muacc_create_ctx();
+		new = _mam_add_candidate(ctx, (int) file);
+		new->tcp_state = (int) state;
+		if (key != 0)
+		{
+			new->mamkey = (uint32_t) key;
+			_mam_ctx_from_cache(ctx, new->mamkey, &(new->ctx));
 		}
 	}
 	else
 	{
-		struct _muacc_ctx *parsectx = ctx->ctx;
+		struct _muacc_ctx **parsectx = &(ctx->ctx);
+		uint32_t *parsekey = &(ctx->ctx_key);
 
 		if (ctx->sockets != NULL)
 		{
 			/* parse incoming context into the socket set */
-			struct socketlist *socklist = ctx->sockets;
-			while (socklist->next != NULL)
-			{
-				socklist = socklist->next;
-			}
+			struct socketlist *socklist = ctx->sockets_tail;
 			DLOG(MAM_UTIL_NOISY_DEBUG2, "receiving context for socketset member %d\n", socklist->file);
-			parsectx = socklist->ctx;
+			parsectx = &(socklist->ctx);
+			parsekey = &(socklist->mamkey);
+		}
+
+		if ((tag == ctx_key || tag == ctx_base) && data_len == sizeof(uint32_t))
+		{
+			*parsekey = *(uint32_t *) data;
+			DLOG(MAM_UTIL_NOISY_DEBUG2, "context is cached under key %u\n", *parsekey);
+
+			if (tag == ctx_base)
+				_mam_ctx_from_cache(ctx, *parsekey, parsectx);
+			return;
 		}
 
 		/* unpack context */
-		switch( _muacc_unpack_ctx(*tag, data, *data_len, parsectx) )
+		switch( _muacc_unpack_ctx(tag, data, data_len, *parsectx) )
 		{
 			case 0:
 				DLOG(MAM_UTIL_NOISY_DEBUG2, "parsing TLV successful\n");
 				break;
 			default:
-				DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: parsing TLV failed: tag=%d data_len=%ld\n", (int) *tag, (long) *data_len);
+				DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: parsing TLV failed: tag=%d data_len=%ld\n", (int) tag, (long) data_len);
 				break;
 		}
 	}
+}
+
+int _muacc_proc_request_event(request_context_t *ctx)
+{
+	unsigned char hdr[sizeof(muacc_tlv_t) + sizeof(size_t)];
+	unsigned char *buf;
+	size_t avail = evbuffer_get_length(ctx->in);
+	size_t off = ctx->in_scanned;
+	size_t hdr_len, data_len;
+	ssize_t pos;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t tlv_data_len;
+	int version = (ctx->client != NULL) ? ctx->client->version : MUACC_PROTOCOL_V1;
+	muacc_arena_t *prev;
+
+	/* find the end of the request by walking the headers, without touching the data */
+	for (;;)
+	{
+		if (version < MUACC_PROTOCOL_V2)
+		{
+			hdr_len = sizeof(muacc_tlv_t) + sizeof(size_t);
+			if (_mam_peek_bytes(ctx->in, off, hdr, hdr_len) < hdr_len)
+				goto _muacc_proc_request_event_incomplete;
+			memcpy(&tag, hdr, sizeof(muacc_tlv_t));
+			memcpy(&data_len, hdr + sizeof(muacc_tlv_t), sizeof(size_t));
+		}
+		else
+		{
+			/* one byte tag and a varint length of at most 10 bytes */
+			uint64_t len;
+			size_t n = _mam_peek_bytes(ctx->in, off, hdr, 11);
+
+			pos = 1;
+			if (n < 2)
+				goto _muacc_proc_request_event_incomplete;
+			if (0 > _muacc_get_varint((char *) hdr, &pos, n, &len))
+			{
+				if (n < 11)
+					goto _muacc_proc_request_event_incomplete;
+				DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: malformed TLV header\n");
+				return(_muacc_proc_request_event_error);
+			}
+			tag = hdr[0];
+			hdr_len = pos;
+			data_len = len;
+		}
+
+		if (data_len > MUACC_REQUEST_MAXLEN)
+		{
+			DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: TLV of %zu bytes exceeds the maximum request length\n", data_len);
+			return(_muacc_proc_request_event_error);
+		}
+		if (off + hdr_len + data_len > avail)
+			goto _muacc_proc_request_event_incomplete;
+
+		off += hdr_len + data_len;
+		if (tag == eof)
+			break;
+		if (off > MUACC_REQUEST_MAXLEN)
+		{
+			DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: request exceeds the maximum request length\n");
+			return(_muacc_proc_request_event_error);
+		}
+	}
+
+	DLOG(MAM_UTIL_NOISY_DEBUG2, "complete request of %zu bytes buffered\n", off);
 
-    evbuffer_drain(ctx->in, tlv_len);
-	return(tlv_len);
+	/* make the request contiguous - no copy if it sits in a single chunk */
+	if ((buf = evbuffer_pullup(ctx->in, off)) == NULL)
+	{
+		DLOG(MAM_UTIL_NOISY_DEBUG0, "WARNING: failed to linearize request\n");
+		return(_muacc_proc_request_event_error);
+	}
 
+	/* parse it in a single pass - into the arena of the request */
+	pos = 0;
+	prev = _muacc_arena_use(ctx->arena);
+	while (_muacc_next_tlv((char *) buf, &pos, off, version, &tag, &data, &tlv_data_len) > 0 && tag != eof)
+		_muacc_proc_tlv(ctx, tag, data, tlv_data_len);
+	_muacc_arena_use(prev);
+
+	evbuffer_drain(ctx->in, off);
+	ctx->in_scanned = 0;
+	return(off);
+
+_muacc_proc_request_event_incomplete:
+	/* remember how far the request is known to be complete */
+	ctx->in_scanned = off;
+	DLOG(MAM_UTIL_NOISY_DEBUG2, "request incomplete - %zu of %zu bytes scanned\n", off, avail);
+	return(_muacc_proc_request_event_too_short);
 }
 
 /** check whether two ipv4 addresses are in the same subnet */
@@ -543,11 +1005,17 @@ int _cmp_in6_addr_with_mask(
 	struct in6_addr *b,
 	struct in6_addr *mask	/**< the subnet mask */
 ){
-	for(int i=0; i<16; i++)
-	{
-		if( (((a->s6_addr)[i] ^ (b->s6_addr)[i]) & (mask->s6_addr)[i]) != 0 )
-			return (i+1);
-	}
+	uint64_t wa[2], wb[2], wm[2];
+
+	/* two words instead of 16 bytes - in6_addr may not be aligned for them */
+	memcpy(wa, a->s6_addr, sizeof(wa));
+	memcpy(wb, b->s6_addr, sizeof(wb));
+	memcpy(wm, mask->s6_addr, sizeof(wm));
+
+	if( ((wa[0] ^ wb[0]) & wm[0]) != 0 )
+		return (1);
+	if( ((wa[1] ^ wb[1]) & wm[1]) != 0 )
+		return (2);
 	return(0);	
 }
 
@@ -39,19 +39,63 @@ void _free_iface_list (gpointer data);
 void _free_client_list (gpointer data);
 void _free_socket_list (gpointer data);
 
+/** Helper that frees a context cached for a client (GDestroyNotify) */
+void _mam_free_cached_ctx (gpointer data);
+
+/** Remember a copy of the context a client knows under the given key */
+void _mam_cache_ctx(client_list_t *client, uint32_t key, struct _muacc_ctx *ctx);
+
 /** Helper that frees a context */
 int _mam_free_ctx(struct mam_context *ctx);
 
-/** Helper that fetches a function pointer from the handle of a policy module */
+/** Helper that fetches a function pointer from the handle of a policy module - use the resolved entry points on requests */
 int _mam_fetch_policy_function(lt_dlhandle policy, const char *name, void **function);
 
-#define _muacc_proc_tlv_event_too_short	-1
-#define _muacc_proc_tlv_event_eof		0
-/** try to read a TLV from an libevent2 evbuffer
+/** Helper that resolves the entry points of a policy module once it is loaded (see mam_policy_t)
+ *
+ * @return 0 on success, -1 if there is no module
+ */
+int _mam_resolve_policy(lt_dlhandle policy, struct mam_policy *ops);
+
+/** take a reference on a policy generation
+ *
+ * @return gen
+ */
+struct mam_policy_gen *_mam_policy_ref(struct mam_policy_gen *gen);
+
+/** drop a reference on a policy generation - the last one closes its module */
+void _mam_policy_unref(struct mam_policy_gen *gen);
+
+/** entry points of the current policy of a MAM context, all NULL if there is none */
+const mam_policy_t *mam_policy_ops(mam_context_t *mctx);
+
+/** entry points of the policy a request is passed to
+ *
+ *  The first call ties the request to the current policy generation, so all
+ *  callbacks of the request go to the same module, even if it is reloaded meanwhile.
+ */
+const mam_policy_t *_mam_request_policy(request_context_t *ctx);
+
+/** consistent snapshot of the measurements of the last round, for policies
+ *
+ *  The snapshot belongs to the calling thread and is only taken again once
+ *  the measurements changed, so reading it needs no locks. It stays valid
+ *  until the next call on the same thread.
  *
- * @return number of bytes processed, 0 if last TLV was EOF, -1 if buffer was too short
+ * @return the snapshot, NULL if there are no measurements
  */
-int _muacc_proc_tlv_event(
+const struct muacc_metrics_shm *mam_measurements(mam_context_t *mctx);
+
+#define _muacc_proc_request_event_too_short	-1
+#define _muacc_proc_request_event_error		-2
+/** try to read a complete request from an libevent2 evbuffer
+ *
+ *  Waits until the whole request up to the eof TLV is buffered, then parses it in a
+ *  single pass over contiguous memory and drains it at once.
+ *
+ * @return number of bytes processed, -1 if the request is not complete yet, -2 if it is malformed
+ */
+int _muacc_proc_request_event(
 	request_context_t *ctx		/**< [in]	  ctx to extract data to */
 );
 
@@ -61,16 +105,41 @@ int _muacc_proc_tlv_event(
  */
 int _muacc_send_ctx_event(request_context_t *ctx, muacc_mam_action_t reason);
 
+/** revoke all leases on socketconnect decisions MAM granted so far
+ *
+ *  Bumps the lease epoch and tells all clients about it. Call whenever decisions
+ *  may change, e.g. after prefixes changed or the policy was reconfigured.
+ *  Only call it on the main thread while the workers are paused (see mam_worker.h) -
+ *  policies use mam_request_lease_revoke instead.
+ */
+void mam_revoke_leases(mam_context_t *mctx);
+
+/** ask for all leases to be revoked at the end of the current measurement round
+ *
+ *  For policies whose decisions depend on measurements, to call when these changed
+ *  a decision. Safe on any thread and in any callback - a request made on a worker
+ *  is carried out at the end of the next round.
+ */
+void mam_request_lease_revoke(void);
+
+/** revoke the leases if mam_request_lease_revoke was called since the last time -
+ *  main thread only, pauses the workers for it
+ */
+void mam_revoke_leases_if_requested(mam_context_t *mctx);
+
+/** take the default lease_ttl from the policy configuration and revoke all leases */
+void mam_configure_leases(mam_context_t *mctx);
+
 /** helper to print a prefix list flags into a string
  *
  */
 void _mam_print_prefix_list_flags(strbuf_t *sb, unsigned int	pfx_flags);
 
-/** helper that tries to call a policy function. If it fails, it simply tries to send back the context
+/** helper that tries to call a policy function. If the policy does not have it, it simply tries to send back the context
  *
  * @return 0 if callback was successfully invoked, -1 if it failed
  */
-int _mam_callback_or_fail(request_context_t *ctx, const char *function, unsigned int calls_performed_flag, muacc_mam_action_t action_if_fail);
+int _mam_callback_or_fail(request_context_t *ctx, int (*callback_function)(request_context_t *ctx, struct event_base *base), const char *function, unsigned int calls_performed_flag, muacc_mam_action_t action_if_fail);
 
 /** check whether two ipv4 addresses are in the same subnet 
  *
@@ -0,0 +1,435 @@
+/** \file mam_worker.c
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "dlog.h"
+
+#include "mam_worker.h"
+
+#ifndef MAM_WORKER_NOISY_DEBUG0
+#define MAM_WORKER_NOISY_DEBUG0 1
+#endif
+
+#ifndef MAM_WORKER_NOISY_DEBUG1
+#define MAM_WORKER_NOISY_DEBUG1 0
+#endif
+
+#define MAM_WORKER_CMD_CLIENT	1	/**< serve a new client */
+#define MAM_WORKER_CMD_PAUSE	2	/**< wait until mam_workers_resume */
+#define MAM_WORKER_CMD_STOP		3	/**< leave the event loop */
+
+/** Command the main thread sends to a worker through its pipe */
+struct mam_worker_cmd {
+	int						type;		/**< MAM_WORKER_CMD_* */
+	client_list_t			*client;
+};
+
+struct mam_worker {
+	int						id;
+	pthread_t				thread;
+	struct event_base		*ev_base;			/**< event base of the worker, only touched by its thread */
+	mam_context_t			view;				/**< the global context as seen by the requests on this worker */
+	int						cmd[2];				/**< pipe commands arrive through */
+	struct event			*cmd_ev;
+	unsigned int			n_clients;			/**< clients handed to the worker, updated atomically */
+	GHashTable				*clients;			/**< clients served, only touched by the worker */
+	GHashTable				*evdns_bases;		/**< copies of the DNS bases of the prefixes, by prefix */
+	unsigned int			dns_generation;		/**< dns_generation the copies were made in */
+};
+
+static struct mam_worker *workers = NULL;
+static int n_workers = 0;
+static int enabled = 0;
+static mam_context_t *global = NULL;
+static void (*serve_client)(client_list_t *client) = NULL;
+static void (*drop_client)(client_list_t *client) = NULL;
+
+/** protects the pause state below */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int n_paused = 0;					/**< workers waiting in mam_worker_pause */
+static unsigned int pause_generation = 0;	/**< bumped by each pause */
+static unsigned int resume_generation = 0;	/**< pause_generation the workers may go on after */
+static unsigned int dns_generation = 0;		/**< bumped whenever the DNS bases of the prefixes changed */
+static int pause_depth = 0;					/**< nesting of mam_workers_pause, main thread only */
+
+/** worker running on this thread, NULL on the main thread */
+static __thread struct mam_worker *current = NULL;
+
+static void mam_worker_free_evdns_base(gpointer data)
+{
+	evdns_base_free((struct evdns_base *) data, 1);
+}
+
+/** create a DNS base on base asking the same name servers as orig */
+static struct evdns_base *mam_worker_clone_evdns_base(struct event_base *base, struct evdns_base *orig)
+{
+	struct evdns_base *dns;
+	struct sockaddr_storage ss;
+	int i, n, len;
+
+	if ((dns = evdns_base_new(base, 0)) == NULL)
+		return NULL;
+
+	n = evdns_base_count_nameservers(orig);
+	for (i = 0; i < n; i++)
+	{
+		len = evdns_base_get_nameserver_addr(orig, i, (struct sockaddr *) &ss, sizeof(ss));
+		if (len > 0 && len <= (int) sizeof(ss))
+			evdns_base_nameserver_sockaddr_add(dns, (struct sockaddr *) &ss, len, 0);
+	}
+
+	return dns;
+}
+
+/** copy the DNS bases of all prefixes onto the event base of the worker */
+static void mam_worker_setup_dns(struct mam_worker *w)
+{
+	struct src_prefix_list *pfx;
+	struct evdns_base *dns;
+	GSList *l;
+
+	if (w->evdns_bases != NULL)
+		g_hash_table_destroy(w->evdns_bases);
+	w->evdns_bases = g_hash_table_new_full(NULL, NULL, NULL, &mam_worker_free_evdns_base);
+
+	for (l = global->prefixes; l != NULL; l = l->next)
+	{
+		pfx = l->data;
+		if (pfx->evdns_base != NULL && (dns = mam_worker_clone_evdns_base(w->ev_base, pfx->evdns_base)) != NULL)
+			g_hash_table_insert(w->evdns_bases, pfx, dns);
+	}
+
+	w->dns_generation = dns_generation;
+	DLOG(MAM_WORKER_NOISY_DEBUG1, "Worker %d has %u prefix DNS bases\n", w->id, g_hash_table_size(w->evdns_bases));
+}
+
+/** take over the global context, but keep the bases of the worker */
+static void mam_worker_sync_view(struct mam_worker *w)
+{
+	struct evdns_base *dns = w->view.evdns_default_base;
+
+	w->view = *global;
+	w->view.ev_base = w->ev_base;
+	w->view.evdns_default_base = dns;
+}
+
+/** drop all clients of the worker - on the worker */
+static void mam_worker_drop_clients(struct mam_worker *w)
+{
+	GList *clients, *l;
+
+	if (g_hash_table_size(w->clients) == 0)
+		return;
+
+	DLOG(MAM_WORKER_NOISY_DEBUG0, "Worker %d drops its %u clients\n", w->id, g_hash_table_size(w->clients));
+	clients = g_hash_table_get_keys(w->clients);
+	for (l = clients; l != NULL; l = l->next)
+		drop_client((client_list_t *) l->data);
+	g_list_free(clients);
+}
+
+/** wait in between two events until the main thread resumes the workers - on the worker */
+static void mam_worker_pause(struct mam_worker *w)
+{
+	unsigned int gen;
+
+	pthread_mutex_lock(&lock);
+	gen = pause_generation;
+	n_paused++;
+	pthread_cond_broadcast(&cond);
+	while (resume_generation != gen)
+		pthread_cond_wait(&cond, &lock);
+
+	/* the main thread waits for all workers to get here again */
+	mam_worker_sync_view(w);
+	if (w->dns_generation != dns_generation)
+		mam_worker_setup_dns(w);
+	if (!enabled)
+		mam_worker_drop_clients(w);
+
+	n_paused--;
+	pthread_cond_broadcast(&cond);
+	pthread_mutex_unlock(&lock);
+}
+
+static void mam_worker_cmd_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct mam_worker *w = (struct mam_worker *) arg;
+	struct mam_worker_cmd cmd;
+
+	while (read(fd, &cmd, sizeof(cmd)) == sizeof(cmd))
+	{
+		switch (cmd.type)
+		{
+			case MAM_WORKER_CMD_CLIENT:
+				g_hash_table_insert(w->clients, cmd.client, cmd.client);
+				if (__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+					serve_client(cmd.client);
+				else
+					drop_client(cmd.client);
+				break;
+			case MAM_WORKER_CMD_PAUSE:
+				mam_worker_pause(w);
+				break;
+			case MAM_WORKER_CMD_STOP:
+				event_base_loopbreak(w->ev_base);
+				return;
+			default:
+				DLOG(MAM_WORKER_NOISY_DEBUG0, "Worker %d got unknown command %d\n", w->id, cmd.type);
+		}
+	}
+}
+
+static void *mam_worker_run(void *arg)
+{
+	struct mam_worker *w = (struct mam_worker *) arg;
+
+	current = w;
+	DLOG(MAM_WORKER_NOISY_DEBUG1, "Worker %d running\n", w->id);
+	event_base_dispatch(w->ev_base);
+
+	mam_worker_drop_clients(w);
+	DLOG(MAM_WORKER_NOISY_DEBUG1, "Worker %d stopped\n", w->id);
+	return NULL;
+}
+
+static int mam_worker_send(struct mam_worker *w, int type, client_list_t *client)
+{
+	struct mam_worker_cmd cmd = { type, client };
+
+	/* smaller than PIPE_BUF - written at once or not at all */
+	if (write(w->cmd[1], &cmd, sizeof(cmd)) != sizeof(cmd))
+	{
+		DLOG(MAM_WORKER_NOISY_DEBUG0, "Could not send command %d to worker %d: %s\n", type, w->id, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/** free everything of a worker that is not running (anymore) */
+static void mam_worker_free(struct mam_worker *w)
+{
+	if (w->cmd_ev != NULL)
+		event_free(w->cmd_ev);
+	if (w->evdns_bases != NULL)
+		g_hash_table_destroy(w->evdns_bases);
+	if (w->view.evdns_default_base != NULL)
+		evdns_base_free(w->view.evdns_default_base, 0);
+	if (w->clients != NULL)
+		g_hash_table_destroy(w->clients);
+	if (w->ev_base != NULL)
+		event_base_free(w->ev_base);
+	if (w->cmd[0] != -1)
+		close(w->cmd[0]);
+	if (w->cmd[1] != -1)
+		close(w->cmd[1]);
+}
+
+int mam_workers_start(mam_context_t *mctx, int n, void (*serve)(client_list_t *client), void (*drop)(client_list_t *client))
+{
+	struct mam_worker *w;
+	int i;
+
+	if (workers != NULL || n <= 0)
+		return -1;
+	if (n > MAM_WORKERS_MAX)
+		n = MAM_WORKERS_MAX;
+
+	if ((workers = malloc(n * sizeof(struct mam_worker))) == NULL)
+		return -1;
+	memset(workers, 0, n * sizeof(struct mam_worker));
+
+	global = mctx;
+	serve_client = serve;
+	drop_client = drop;
+
+	for (i = 0; i < n; i++)
+	{
+		w = &(workers[i]);
+		w->id = i;
+		w->cmd[0] = w->cmd[1] = -1;
+
+		/* nothing runs on the worker yet - set it up from here */
+		if (pipe(w->cmd) != 0 ||
+			evutil_make_socket_nonblocking(w->cmd[0]) != 0 ||
+			(w->ev_base = event_base_new()) == NULL ||
+			(w->cmd_ev = event_new(w->ev_base, w->cmd[0], EV_READ|EV_PERSIST, &mam_worker_cmd_cb, w)) == NULL ||
+			event_add(w->cmd_ev, NULL) != 0 ||
+			(w->view.evdns_default_base = evdns_base_new(w->ev_base, 1)) == NULL ||
+			(w->clients = g_hash_table_new(NULL, NULL)) == NULL)
+		{
+			DLOG(MAM_WORKER_NOISY_DEBUG0, "Could not set up worker %d\n", i);
+			mam_worker_free(w);
+			break;
+		}
+		mam_worker_sync_view(w);
+		mam_worker_setup_dns(w);
+
+		if (pthread_create(&(w->thread), NULL, &mam_worker_run, w) != 0)
+		{
+			DLOG(MAM_WORKER_NOISY_DEBUG0, "Could not start worker %d: %s\n", i, strerror(errno));
+			mam_worker_free(w);
+			break;
+		}
+	}
+
+	n_workers = i;
+	if (n_workers == 0)
+	{
+		free(workers);
+		workers = NULL;
+		return -1;
+	}
+
+	DLOG(MAM_WORKER_NOISY_DEBUG0, "Started %d workers\n", n_workers);
+	return n_workers;
+}
+
+void mam_workers_stop(void)
+{
+	int i;
+
+	if (workers == NULL)
+		return;
+
+	__atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < n_workers; i++)
+		mam_worker_send(&(workers[i]), MAM_WORKER_CMD_STOP, NULL);
+	for (i = 0; i < n_workers; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		mam_worker_free(&(workers[i]));
+	}
+
+	free(workers);
+	workers = NULL;
+	n_workers = 0;
+	DLOG(MAM_WORKER_NOISY_DEBUG0, "Stopped all workers\n");
+}
+
+int mam_workers_count(void)
+{
+	return n_workers;
+}
+
+void mam_workers_enable(int enable)
+{
+	if (n_workers == 0)
+		return;
+
+	DLOG(MAM_WORKER_NOISY_DEBUG0, "%s clients to workers\n", enable ? "Handing out" : "Not handing out");
+	__atomic_store_n(&enabled, enable ? 1 : 0, __ATOMIC_RELEASE);
+}
+
+struct mam_worker *mam_workers_assign(void)
+{
+	struct mam_worker *best = NULL;
+	unsigned int n, least = 0;
+	int i;
+
+	if (n_workers == 0 || !__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	for (i = 0; i < n_workers; i++)
+	{
+		n = __atomic_load_n(&(workers[i].n_clients), __ATOMIC_RELAXED);
+		if (best == NULL || n < least)
+		{
+			best = &(workers[i]);
+			least = n;
+		}
+	}
+
+	return best;
+}
+
+int mam_workers_add_client(struct mam_worker *worker, client_list_t *client)
+{
+	client->worker = worker;
+	client->mctx = &(worker->view);
+	__atomic_add_fetch(&(worker->n_clients), 1, __ATOMIC_RELAXED);
+
+	if (mam_worker_send(worker, MAM_WORKER_CMD_CLIENT, client) != 0)
+	{
+		__atomic_sub_fetch(&(worker->n_clients), 1, __ATOMIC_RELAXED);
+		client->worker = NULL;
+		client->mctx = global;
+		return -1;
+	}
+
+	return 0;
+}
+
+void mam_workers_client_gone(client_list_t *client)
+{
+	struct mam_worker *w = client->worker;
+
+	if (w == NULL)
+		return;
+
+	g_hash_table_remove(w->clients, client);
+	__atomic_sub_fetch(&(w->n_clients), 1, __ATOMIC_RELAXED);
+	client->worker = NULL;
+}
+
+void mam_workers_pause(void)
+{
+	int i;
+
+	if (n_workers == 0 || pause_depth++ > 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	pause_generation++;
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < n_workers; i++)
+		mam_worker_send(&(workers[i]), MAM_WORKER_CMD_PAUSE, NULL);
+
+	pthread_mutex_lock(&lock);
+	while (n_paused < n_workers)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	DLOG(MAM_WORKER_NOISY_DEBUG1, "Paused all workers\n");
+}
+
+void mam_workers_resume(void)
+{
+	if (n_workers == 0 || pause_depth == 0 || --pause_depth > 0)
+		return;
+
+	pthread_mutex_lock(&lock);
+	resume_generation = pause_generation;
+	pthread_cond_broadcast(&cond);
+	while (n_paused > 0)
+		pthread_cond_wait(&cond, &lock);
+	pthread_mutex_unlock(&lock);
+
+	DLOG(MAM_WORKER_NOISY_DEBUG1, "Resumed all workers\n");
+}
+
+void mam_workers_reconfigured(void)
+{
+	pthread_mutex_lock(&lock);
+	dns_generation++;
+	pthread_mutex_unlock(&lock);
+}
+
+struct evdns_base *mam_prefix_evdns_base(struct src_prefix_list *pfx)
+{
+	if (pfx == NULL)
+		return NULL;
+
+	if (current == NULL)
+		return pfx->evdns_base;
+
+	return g_hash_table_lookup(current->evdns_bases, pfx);
+}
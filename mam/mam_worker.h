@@ -0,0 +1,86 @@
+/** \file  mam_worker.h
+ *  \brief Worker threads serving the clients of MAM
+ *
+ *  If the configuration asks for workers (set workers in the policy block)
+ *  and the policy declares MAM_POLICY_THREAD_SAFE, new clients are handed to
+ *  a pool of threads, each running an event base of its own. A client stays
+ *  with its worker until it goes away - its requests are parsed, passed to the
+ *  policy and answered there, including the DNS lookups, which go through
+ *  evdns bases owned by the worker.
+ *
+ *  Requests see the MAM context through a view owned by the worker (see
+ *  client_list_t.mctx): a copy of the global one, but with the event and DNS
+ *  bases of the worker. Prefixes, interfaces and the configuration are not
+ *  locked - the main thread only changes them while all workers are paused
+ *  in between two events (mam_workers_pause), and the views are brought up
+ *  to date before they go on. Measurements are read through mam_measurements,
+ *  which returns a snapshot private to the calling thread.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+#ifndef __MAM_WORKER_H__
+#define __MAM_WORKER_H__
+
+#include "mam.h"
+
+#ifndef MAM_WORKERS_MAX
+#define MAM_WORKERS_MAX 64		/**< workers configured beyond this are not started */
+#endif
+
+struct mam_worker;
+
+/** start n workers serving clients in views of mctx
+ *
+ *  serve is called on the worker to set up the connection of a client handed
+ *  to it, drop to get rid of a client the worker may not serve (anymore).
+ *  Both also get clients that never were set up by serve.
+ *
+ * @return number of workers started, -1 if none could be started
+ */
+int mam_workers_start(mam_context_t *mctx, int n, void (*serve)(client_list_t *client), void (*drop)(client_list_t *client));
+
+/** stop all workers - the clients they still serve are dropped */
+void mam_workers_stop(void);
+
+/** number of workers running */
+int mam_workers_count(void);
+
+/** allow handing out new clients to workers, or stop doing so and drop the clients of
+ *  the workers the next time they are resumed - call while the workers are paused
+ */
+void mam_workers_enable(int enable);
+
+/** pick the worker with the least clients for a new one
+ *
+ * @return the worker, NULL if the main thread serves new clients itself
+ */
+struct mam_worker *mam_workers_assign(void);
+
+/** hand a client to a worker - serve is called on it there */
+int mam_workers_add_client(struct mam_worker *worker, client_list_t *client);
+
+/** tell the worker of a client that it went away */
+void mam_workers_client_gone(client_list_t *client);
+
+/** wait until all workers are in between two events and keep them there,
+ *  so the main thread may change the global context - main thread only, nests
+ */
+void mam_workers_pause(void);
+
+/** bring the views of the workers up to date and let them go on */
+void mam_workers_resume(void);
+
+/** tell the workers to set up their DNS bases again, as the ones of the prefixes changed -
+ *  call while the workers are paused
+ */
+void mam_workers_reconfigured(void);
+
+/** DNS base to look up names for a prefix with in the current thread
+ *
+ * @return the copy of the worker running the request, pfx->evdns_base on the main thread,
+ *         NULL if the prefix has none (use the evdns_default_base of the request's mctx then)
+ */
+struct evdns_base *mam_prefix_evdns_base(struct src_prefix_list *pfx);
+
+#endif /* __MAM_WORKER_H__ */
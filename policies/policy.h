@@ -14,9 +14,21 @@
 #include "lib/muacc_util.h"
 #include "lib/intents.h"
 #include "mam/mam.h"
+#include "mam/mam_worker.h"
 
 #include "mam/mptcp_netlink_parser.h"
 
+/** Entry points of the policy (optional, see mam_policy_t)
+ *  Policies without it get their functions looked up by the names declared below.
+ *  A policy declaring MAM_POLICY_THREAD_SAFE gets requests on all worker threads at once:
+ *  it may only read its own state and the context after init, must take DNS bases of prefixes
+ *  from mam_prefix_evdns_base and measurements from mam_measurements instead of the metrics of prefixes and interfaces
+ */
+extern const struct mam_policy mam_policy;
+
+/** MAM_POLICY_* capabilities of a policy without mam_policy (optional) */
+extern const unsigned int mam_policy_capabilities;
+
 void set_policy_info(gpointer elem, gpointer data);
 void freepolicyinfo(gpointer elem, gpointer data);
 
@@ -28,4 +40,6 @@ int on_new_subflow_request(mam_context_t *mctx, struct mptcp_flow_info *flow);
 int on_resolve_request(request_context_t *rctx, struct event_base *base);
 int on_connect_request(request_context_t *rctx, struct event_base *base);
 int on_socketconnect_request(request_context_t *rctx, struct event_base *base);
+int on_socketconnect_batch(request_context_t **batch, int n, struct event_base *base);
 int on_socketchoose_request(request_context_t *rctx, struct event_base *base);
+void on_prefix_change(mam_context_t *mctx, struct src_prefix_list *pfx, int event);
@@ -13,6 +13,8 @@
 
 #include "policy.h"
 #include "policy_util.h"
+#include "mam/mam_util.h"
+#include "lib/muacc_log.h"
 #include <time.h>
 
 /** Policy-specific per-prefix data structure that contains additional information */
@@ -33,14 +35,36 @@ struct src_prefix_list *get_default_prefix(request_context_t *rctx, strbuf_t *sb
 
 int resolve_name(request_context_t *rctx);
 
+/** Predicted socketconnect decision leased to a client, to tell when new measurements change it */
+struct eafirst_lease {
+	int domain;                     /** address family of the request */
+	int filesize;                   /** size of the object */
+	struct src_prefix_list *fastest; /** fastest prefix for a new connection when the lease was granted - only compared */
+};
+
+#define EAFIRST_LEASES_MAX 16        /** distinct leased decisions watched, more revoke all leases with the next measurements */
+
 static const double EPSILON = 0.0001;
 
+/** Seconds of history the estimates are taken from, so a single round cannot swing them */
+static const double SRTT_WINDOW = 10;		/**< minimum SRTT of the rounds in this window */
+static const double MAX_RATE_WINDOW = 60;	/**< 95th percentile of the download rates in this window as capacity */
+static const double RATE_WINDOW = 1;		/**< mean download rate in this window as current load */
+
 static const char *logfile = NULL;
 
+/** Log of the predictions and decisions, NULL if not logging */
+static muacc_log_t *policy_log = NULL;
+
 /** List of enabled addresses for each address family */
 GSList *in4_enabled = NULL;
 GSList *in6_enabled = NULL;
 
+/** Leased decisions since the leases were revoked last */
+static struct eafirst_lease leases[EAFIRST_LEASES_MAX];
+static int n_leases = 0;
+static int leases_overflow = 0;
+
 /** Initialize policy information for each prefix
  */
 void set_policy_info(gpointer elem, gpointer data)
@@ -125,17 +149,25 @@ double get_srtt(struct src_prefix_list *pfx, strbuf_t *sb)
 	if (pfx == NULL)
 		return 0;
 
-	double *min_srtt = lookup_prefix_info(pfx, "srtt_minimum");
+	double srtt_minimum;
+	if (mam_history_range(get_prefix_history(pfx, PFX_HISTORY_SRTT_MINIMUM), SRTT_WINDOW, &srtt_minimum, NULL) > 0 && srtt_minimum > EPSILON)
+	{
+		strbuf_printf(sb, "\t\tMinimum RTT: %.2f ms (last %.0f s), ", srtt_minimum, SRTT_WINDOW);
+		return srtt_minimum;
+	}
+
+	// No connections in the window: fall back to the lowest RTT ever seen
+	const struct prefix_metrics *metrics = get_prefix_metrics(pfx, MUACC_METRICS_SRTT_MINIMUM);
 
-	if (min_srtt == NULL || *min_srtt < EPSILON)
+	if (metrics == NULL || metrics->srtt_minimum < EPSILON)
 	{
 		// If not found or zero: Return
 		strbuf_printf(sb, "\t\tMinimum RTT:   N/A,   ");
 		return 0;
 	}
 
-	strbuf_printf(sb, "\t\tMinimum RTT: %.2f ms, ", *min_srtt);
-	return *min_srtt;
+	strbuf_printf(sb, "\t\tMinimum RTT: %.2f ms, ", metrics->srtt_minimum);
+	return metrics->srtt_minimum;
 }
 
 /* Look up a value for maximum download rate on a prefix */
@@ -144,27 +176,36 @@ double get_max_rate(struct src_prefix_list *pfx, strbuf_t *sb)
 	if (pfx == NULL)
 		return -1;
 
-	/* Smoothed rates are not used for now!
-	// Look up smoothed maximum download rate first
-	double *download_max_rate = lookup_prefix_info(pfx, "download_max_srate");
-
-	if (download_max_rate == NULL || *download_max_rate < EPSILON)
-		// If not found or zero: look up maximum download rate (non-smoothoed)
-		download_max_rate = lookup_prefix_info(pfx, "download_max_rate");
-	*/
+	double download_max_rate;
+	if (mam_history_quantile(get_iface_history(pfx, IFACE_HISTORY_DOWNLOAD), MAX_RATE_WINDOW, 0.95, &download_max_rate) > 0)
+	{
+		strbuf_printf(sb, "download max rate: %.2f (p95 of last %.0f s), ", download_max_rate, MAX_RATE_WINDOW);
+		return download_max_rate;
+	}
 
-	double *download_max_rate = lookup_prefix_info(pfx, "download_max_rate");
+	const struct iface_metrics *metrics = get_iface_metrics(pfx, MUACC_METRICS_DOWNLOAD);
 
-	if (download_max_rate == NULL)
+	if (metrics == NULL)
 	{
 		// If still not found or zero: Return
 		strbuf_printf(sb, "download max rate:   N/A,   ");
 		return -1;
 	}
 
-	strbuf_printf(sb, "download max rate: %.2f, ", *download_max_rate);
+	/* Smoothed rates are not used for now!
+	// Take smoothed maximum download rate first
+	double download_max_rate = metrics->download.max_srate;
+
+	if (download_max_rate < EPSILON)
+		// If zero: take maximum download rate (non-smoothoed)
+		download_max_rate = metrics->download.max_rate;
+	*/
+
+	download_max_rate = metrics->download.max_rate;
+
+	strbuf_printf(sb, "download max rate: %.2f, ", download_max_rate);
 
-	return *download_max_rate;
+	return download_max_rate;
 }
 
 /* Look up a value for current download rate on a prefix */
@@ -173,27 +214,36 @@ double get_rate(struct src_prefix_list *pfx, strbuf_t *sb)
 	if (pfx == NULL)
 		return -1;
 
-	/* Smoothed rates are not used for now!
-	// Look up smoothed download rate
-	double *download_rate = lookup_prefix_info(pfx, "download_srate");
-
-	if (download_rate == NULL || *download_rate < EPSILON)
-		// If not found or zero: take download rate (non-smoothoed)
-		download_rate = lookup_prefix_info(pfx, "download_rate");
-	*/
+	struct mam_history_stats stats;
+	if (mam_history_stats(get_iface_history(pfx, IFACE_HISTORY_DOWNLOAD), RATE_WINDOW, &stats) > 0)
+	{
+		strbuf_printf(sb, "download rate: %.2f (mean of last %.0f s), ", stats.mean, RATE_WINDOW);
+		return stats.mean;
+	}
 
-	double *download_rate = lookup_prefix_info(pfx, "download_rate");
+	const struct iface_metrics *metrics = get_iface_metrics(pfx, MUACC_METRICS_DOWNLOAD);
 
-	if (download_rate == NULL)
+	if (metrics == NULL)
 	{
 		// If still not found: Return
 		strbuf_printf(sb, "download rate:   N/A,   ");
 		return -1;
 	}
 
-	strbuf_printf(sb, "download rate: %.2f, ", *download_rate);
+	/* Smoothed rates are not used for now!
+	// Take smoothed download rate
+	double download_rate = metrics->download.srate;
+
+	if (download_rate < EPSILON)
+		// If zero: take download rate (non-smoothoed)
+		download_rate = metrics->download.rate;
+	*/
+
+	double download_rate = metrics->download.rate;
+
+	strbuf_printf(sb, "download rate: %.2f, ", download_rate);
 
-	return *download_rate;
+	return download_rate;
 }
 
 /* Compute free capacity on a prefix */
@@ -231,7 +281,7 @@ double predict_completion_time(struct src_prefix_list *pfx, int filesize, int re
 	double rate = get_rate(pfx, sb);
 	double free_capacity = get_capacity(pfx, max_rate, rate, sb);
 
-	_muacc_logtofile(logfile, "%f,%f,%f,%f,", srtt, max_rate, rate, free_capacity);
+	_muacc_log_printf(policy_log, "%f,%f,%f,%f,", srtt, max_rate, rate, free_capacity);
 
 	if (srtt > EPSILON && free_capacity > EPSILON)
 	{
@@ -247,13 +297,13 @@ double predict_completion_time(struct src_prefix_list *pfx, int filesize, int re
 		}
 
 		strbuf_printf(sb, "\t\tEstimated completion time is %.2f ms\n", completion_time);
-		_muacc_logtofile(logfile, "%f,", completion_time);
+		_muacc_log_printf(policy_log, "%f,", completion_time);
 	}
 	else
 	{
 		// Not all metrics found - cannot compute completion time
 		strbuf_printf(sb, "\t\tCannot compute completion time!\n");
-		_muacc_logtofile(logfile, "0.0,", completion_time);
+		_muacc_log_printf(policy_log, "0.0,");
 	}
 
 	return completion_time;
@@ -288,7 +338,7 @@ struct src_prefix_list *get_src_prefix(request_context_t *rctx, int reuse, strbu
 	int timestamp = (int)time(NULL);
 	char uuid_str[37];
 	__uuid_unparse_lower(rctx->ctx->ctxid, uuid_str);
-	_muacc_logtofile(logfile, "%d,%s,", timestamp, uuid_str);
+	_muacc_log_printf(policy_log, "%d,%s,", timestamp, uuid_str);
 	GSList *spl = NULL;
 	struct src_prefix_list *cur = NULL;
 
@@ -301,13 +351,13 @@ struct src_prefix_list *get_src_prefix(request_context_t *rctx, int reuse, strbu
 	if (mampol_get_socketopt(rctx->ctx->sockopts_current, SOL_INTENTS, INTENT_FILESIZE, &fslen, &filesize) != 0)
 	{
 		strbuf_printf(sb, "\tNo filesize given - cannot predict completion time!\n");
-		_muacc_logtofile(logfile, "0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,");
+		_muacc_log_printf(policy_log, "0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,0.0,");
 		chosenpfx = get_default_prefix(rctx, sb);
-		_muacc_logtofile(logfile, "%s_default\n", chosenpfx->if_name);
+		_muacc_log_printf(policy_log, "%s_default\n", chosenpfx->if_name);
 	}
 	else
 	{
-		_muacc_logtofile(logfile, "%d,", filesize);
+		_muacc_log_printf(policy_log, "%d,", filesize);
 
 		// Filesize Intent given -- get list of possible source prefixes
 		if (rctx->ctx->domain == AF_INET)
@@ -345,20 +395,20 @@ struct src_prefix_list *get_src_prefix(request_context_t *rctx, int reuse, strbu
 			{
 				// Set source prefix to the fastest prefix, if link is not overloaded
 				strbuf_printf(sb, "\tFastest prefix is on %s (%.2f ms)\n", chosenpfx->if_name, min_completion_time);
-				_muacc_logtofile(logfile, "%s_fastest\n", chosenpfx->if_name);
+				_muacc_log_printf(policy_log, "%s_fastest\n", chosenpfx->if_name);
 			}
 			else
 			{
 				strbuf_printf(sb, "\tGot completion time of %.2f ms on %s - not taking it\n", min_completion_time, chosenpfx->if_name);
 				chosenpfx = get_default_prefix(rctx, sb);
-				_muacc_logtofile(logfile, "%s_default\n", chosenpfx->if_name);
+				_muacc_log_printf(policy_log, "%s_default\n", chosenpfx->if_name);
 			}	
 		}
 		else
 		{
 			strbuf_printf(sb, "\tCould not determine fastest prefix\n");
 			chosenpfx = get_default_prefix(rctx, sb);
-			_muacc_logtofile(logfile, "%s_default\n", chosenpfx->if_name);
+			_muacc_log_printf(policy_log, "%s_default\n", chosenpfx->if_name);
 		}
 
 	}
@@ -366,6 +416,80 @@ struct src_prefix_list *get_src_prefix(request_context_t *rctx, int reuse, strbu
 	return chosenpfx;
 }
 
+/** Fastest prefix for a new connection to get an object of a given size on, without logging
+ *  NULL if the completion time cannot be predicted on any prefix
+ */
+static struct src_prefix_list *predict_fastest_prefix(int domain, int filesize)
+{
+	GSList *lists[2] = { (domain != AF_INET6) ? in4_enabled : NULL, (domain != AF_INET) ? in6_enabled : NULL };
+	struct src_prefix_list *cur = NULL;
+	struct src_prefix_list *fastest = NULL;
+	double min_completion_time = DBL_MAX;
+	double srtt, max_rate, free_capacity, completion_time;
+	GSList *spl = NULL;
+	strbuf_t sb;
+	int i;
+
+	strbuf_init(&sb);
+	for (i = 0; i < 2; i++)
+	{
+		for (spl = lists[i]; spl != NULL; spl = spl->next)
+		{
+			cur = spl->data;
+			srtt = get_srtt(cur, &sb);
+			max_rate = get_max_rate(cur, &sb);
+			free_capacity = get_capacity(cur, max_rate, get_rate(cur, &sb), &sb);
+			if (srtt < EPSILON || free_capacity < EPSILON)
+				continue;
+
+			completion_time = 2 * srtt + 1000 * (filesize / free_capacity);
+			if (completion_time < min_completion_time)
+			{
+				fastest = cur;
+				min_completion_time = completion_time;
+			}
+		}
+	}
+	strbuf_release(&sb);
+
+	return fastest;
+}
+
+/** Remember a leased decision that was made from predictions, so on_feedback can tell when it changes */
+static void remember_lease(request_context_t *rctx)
+{
+	int filesize = 0;
+	socklen_t fslen = sizeof(int);
+	int i;
+
+	if (rctx->lease_ttl == 0 || mampol_get_socketopt(rctx->ctx->sockopts_current, SOL_INTENTS, INTENT_FILESIZE, &fslen, &filesize) != 0)
+		return;
+
+	for (i = 0; i < n_leases; i++)
+	{
+		if (leases[i].domain == rctx->ctx->domain && leases[i].filesize == filesize)
+			return;
+	}
+
+	if (n_leases == EAFIRST_LEASES_MAX)
+	{
+		leases_overflow = 1;
+		return;
+	}
+
+	leases[n_leases].domain = rctx->ctx->domain;
+	leases[n_leases].filesize = filesize;
+	leases[n_leases].fastest = predict_fastest_prefix(rctx->ctx->domain, filesize);
+	n_leases++;
+}
+
+/** Forget all leased decisions */
+static void forget_leases(void)
+{
+	n_leases = 0;
+	leases_overflow = 0;
+}
+
 /** Initializer function (mandatory)
  *  Is called once the policy is loaded and every time it is reloaded
  *  Typically sets the policy_info and initializes the lists of candidate addresses
@@ -377,9 +501,12 @@ int init(mam_context_t *mctx)
 	g_slist_foreach(mctx->prefixes, &set_policy_info, NULL);
 
 	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+	forget_leases();
 
 	logfile = g_hash_table_lookup(mctx->policy_set_dict, "logfile");
-	if (logfile != NULL)
+	_muacc_log_close(policy_log);
+	policy_log = NULL;
+	if (logfile != NULL && (policy_log = _muacc_log_open(logfile, MUACC_LOG_CSV, NULL, 0, MUACC_LOG_ROTATE_SIZE)) != NULL)
 	{
 		printf("\nLogging to %s\n", logfile);
 	}
@@ -400,6 +527,10 @@ int cleanup(mam_context_t *mctx)
 
 	in4_enabled = NULL;
 	in6_enabled = NULL;
+	forget_leases();
+
+	_muacc_log_close(policy_log);
+	policy_log = NULL;
 
 	printf("Policy earliest arrival cleaned up.\n");
 	return 0;
@@ -434,14 +565,14 @@ static void resolve_request_result(int errcode, struct evutil_addrinfo *addr, vo
 		// Clone result into the request context
 		assert(addr != NULL);  
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = _muacc_ctx_clone_addrinfo(rctx->ctx, addr);
 
 		// Choose first result as the remote address
 		rctx->ctx->domain = addr->ai_family;
 		rctx->ctx->type = addr->ai_socktype;
 		rctx->ctx->protocol = addr->ai_protocol;
 		rctx->ctx->remote_sa_len = addr->ai_addrlen;
-		rctx->ctx->remote_sa = _muacc_clone_sockaddr(addr->ai_addr, addr->ai_addrlen);
+		rctx->ctx->remote_sa = _muacc_ctx_clone_sockaddr(rctx->ctx, addr->ai_addr, addr->ai_addrlen);
 
 		// Print remote address
 		strbuf_printf(&sb, "\n\tSet remote address =");
@@ -598,6 +729,9 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 		{
 			rctx->evdns_base = NULL;
 		}
+
+		// The client may reuse this decision until measurements change it
+		remember_lease(rctx);
 	}
 
     printf("%s\n\n", strbuf_export(&sb));
@@ -690,6 +824,31 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 }
 
 
+/** Feedback function
+ *  Is called after each measurement round
+ *  Revokes the leases once the fastest prefix of a leased decision is another one
+ */
+void on_feedback(mam_context_t *mctx)
+{
+	int changed = leases_overflow;
+	int i;
+
+	for (i = 0; i < n_leases && !changed; i++)
+	{
+		if (predict_fastest_prefix(leases[i].domain, leases[i].filesize) != leases[i].fastest)
+		{
+			printf("\tFastest prefix for objects of %d bytes changed - revoking leases\n", leases[i].filesize);
+			changed = 1;
+		}
+	}
+
+	if (changed)
+	{
+		mam_request_lease_revoke();
+		forget_leases();
+	}
+}
+
 int on_new_subflow_request(mam_context_t *mctx, struct mptcp_flow_info *flow)
 {
     return 0;
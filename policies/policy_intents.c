@@ -178,7 +178,7 @@ static void resolve_request_result(int errcode, struct evutil_addrinfo *addr, vo
 
 		assert(addr != NULL);
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = _muacc_ctx_clone_addrinfo(rctx->ctx, addr);
 		evutil_freeaddrinfo(addr);
 		print_addrinfo_response (rctx->ctx->remote_addrinfo_res);
 	}
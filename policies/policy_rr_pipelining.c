@@ -103,7 +103,7 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 	 
 		assert(addr != NULL);   
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = _muacc_ctx_clone_addrinfo(rctx->ctx, addr);
 		print_addrinfo_response (rctx->ctx->remote_addrinfo_res);
 
 		// Choose first result as the remote address
@@ -111,7 +111,7 @@ static void resolve_request_result_connect(int errcode, struct evutil_addrinfo *
 		rctx->ctx->type = addr->ai_socktype;
 		rctx->ctx->protocol = addr->ai_protocol;
 		rctx->ctx->remote_sa_len = addr->ai_addrlen;
-		rctx->ctx->remote_sa = _muacc_clone_sockaddr(addr->ai_addr, addr->ai_addrlen);
+		rctx->ctx->remote_sa = _muacc_ctx_clone_sockaddr(rctx->ctx, addr->ai_addr, addr->ai_addrlen);
 
 		// free libevent addrinfo
 		evutil_freeaddrinfo(addr);
@@ -213,7 +213,7 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 					socket_not_chosen = socket_not_chosen->next;
 
 					_muacc_free_ctx(todelete->ctx);
-					free(todelete);
+					_muacc_arena_free(rctx->arena, todelete);
 				}
 			}
 			else
@@ -12,6 +12,8 @@
  *  Connect         - Choose the default prefix if available
  *  Socketconnect   - Choose the default prefix if available, resolve name on its dns_base if available
  *  Socketchoose    - From list of available sockets, choose first one, else do same as socketconnect
+ *
+ *  Only reads its lists after init, so it is safe to run on the worker threads of MAM.
  */
 
 #include "policy.h"
@@ -70,22 +72,13 @@ void freepolicyinfo(gpointer elem, gpointer data)
 }
 
 /** Helper function
- *  Returns the default prefix, if any exists, otherwise NULL
+ *  Returns the first prefix of the list that is configured as default, otherwise NULL
  */
-struct src_prefix_list *get_default_prefix(request_context_t *rctx, strbuf_t *sb)
+static struct src_prefix_list *find_default_prefix(GSList *spl)
 {
-	GSList *spl = NULL;
 	struct src_prefix_list *cur = NULL;
 	struct sample_info *info = NULL;
 
-	// If address family is specified, only look in its list, else look in both (v4 first)
-	if (rctx->ctx->domain == AF_INET)
-		spl = in4_enabled;
-	else if (rctx->ctx->domain == AF_INET6)
-		spl = in6_enabled;
-	else
-		spl = g_slist_concat(in4_enabled, in6_enabled);
-
 	// Go through list of src prefixes
 	while (spl != NULL)
 	{
@@ -93,15 +86,34 @@ struct src_prefix_list *get_default_prefix(request_context_t *rctx, strbuf_t *sb
 		cur = spl->data;
 		info = (struct sample_info *)cur->policy_info;
 		if (info != NULL && info->is_default)
-		{
-			/* This prefix is configured as default. Return it */
-			strbuf_printf(sb, "\tFound default prefix ");
-	        _muacc_print_sockaddr(sb, cur->if_addrs->addr, cur->if_addrs->addr_len);
-			strbuf_printf(sb, "\n");
 			return cur;
-		}
 		spl = spl->next;
 	}
+	return NULL;
+}
+
+/** Helper function
+ *  Returns the default prefix, if any exists, otherwise NULL
+ */
+struct src_prefix_list *get_default_prefix(request_context_t *rctx, strbuf_t *sb)
+{
+	struct src_prefix_list *cur = NULL;
+
+	// If address family is specified, only look in its list, else look in both (v4 first)
+	// The lists are shared by all requests - never modify them here
+	if (rctx->ctx->domain != AF_INET6)
+		cur = find_default_prefix(in4_enabled);
+	if (cur == NULL && rctx->ctx->domain != AF_INET)
+		cur = find_default_prefix(in6_enabled);
+
+	if (cur != NULL)
+	{
+		/* This prefix is configured as default. Return it */
+		strbuf_printf(sb, "\tFound default prefix ");
+		_muacc_print_sockaddr(sb, cur->if_addrs->addr, cur->if_addrs->addr_len);
+		strbuf_printf(sb, "\n");
+		return cur;
+	}
 	strbuf_printf(sb, "\tDid not find a default prefix %s%s\n", (rctx->ctx->domain == AF_INET) ? "for IPv4" : "", (rctx->ctx->domain == AF_INET6) ? "for IPv6" : "");
 
 	return NULL;
@@ -140,6 +152,27 @@ int cleanup(mam_context_t *mctx)
 	return 0;
 }
 
+/** Prefix change function
+ *  Is called whenever a prefix came up, changed its addresses or went away
+ *  Keeps the policy_info and the lists of candidate addresses up to date
+ */
+void on_prefix_change(mam_context_t *mctx, struct src_prefix_list *pfx, int event)
+{
+	if (event == MAM_PREFIX_ADDED)
+		set_policy_info(pfx, NULL);
+	else if (event == MAM_PREFIX_REMOVED)
+		freepolicyinfo(pfx, NULL);
+	else
+		return;
+
+	// The workers are paused meanwhile, so the lists can be replaced
+	g_slist_free(in4_enabled);
+	g_slist_free(in6_enabled);
+	in4_enabled = NULL;
+	in6_enabled = NULL;
+	make_v4v6_enabled_lists (mctx->prefixes, &in4_enabled, &in6_enabled);
+}
+
 /** Asynchronous callback function for resolve_name
  *  Invoked once a response to the resolver query has been received
  *  Sends back a reply to the client with the received answer
@@ -169,14 +202,14 @@ static void resolve_request_result(int errcode, struct evutil_addrinfo *addr, vo
 		// Clone result into the request context
 		assert(addr != NULL);  
 		assert(rctx->ctx->remote_addrinfo_res == NULL);
-		rctx->ctx->remote_addrinfo_res = _muacc_clone_addrinfo(addr);
+		rctx->ctx->remote_addrinfo_res = _muacc_ctx_clone_addrinfo(rctx->ctx, addr);
 
 		// Choose first result as the remote address
 		rctx->ctx->domain = addr->ai_family;
 		rctx->ctx->type = addr->ai_socktype;
 		rctx->ctx->protocol = addr->ai_protocol;
 		rctx->ctx->remote_sa_len = addr->ai_addrlen;
-		rctx->ctx->remote_sa = _muacc_clone_sockaddr(addr->ai_addr, addr->ai_addrlen);
+		rctx->ctx->remote_sa = _muacc_ctx_clone_sockaddr(rctx->ctx, addr->ai_addr, addr->ai_addrlen);
 
 		// Print remote address
 		strbuf_printf(&sb, "\n\tSet remote address =");
@@ -269,7 +302,7 @@ int on_resolve_request(request_context_t *rctx, struct event_base *base)
 		struct src_prefix_list *bind_pfx = get_pfx_with_addr(rctx, rctx->ctx->bind_sa_req);
 		if (bind_pfx != NULL) {
 			// Set DNS base to this prefix's
-			rctx->evdns_base = bind_pfx->evdns_base;
+			rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
 			printf("Set DNS base\n");
 		}
 	}
@@ -337,7 +370,7 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 		struct src_prefix_list *bind_pfx = get_pfx_with_addr(rctx, rctx->ctx->bind_sa_req);
 		if (bind_pfx != NULL) {
 			// Set DNS base to this prefix's
-			rctx->evdns_base = bind_pfx->evdns_base;
+			rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
 			strbuf_printf(&sb, ", set DNS base. ");
 		}
 	}
@@ -349,7 +382,7 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 			set_bind_sa(rctx, bind_pfx, &sb);
 
 			// Set this prefix' evdns base for name resolution
-			rctx->evdns_base = bind_pfx->evdns_base;
+			rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
 		}
 		else
 		{
@@ -365,6 +398,72 @@ int on_socketconnect_request(request_context_t *rctx, struct event_base *base)
 	return resolve_name(rctx);
 }
 
+/** Socketconnect batch function (optional)
+ *  Is called with all requests of a socketconnect batch at once, so they can be planned together:
+ *  requests that are not bound yet are spread round-robin over the enabled prefixes of their address family
+ *  Must send a reply back for each request using _muacc_sent_ctx_event or register a callback that does so,
+ *  or return non-zero without having answered any to get them passed to on_socketconnect_request one by one
+ */
+int on_socketconnect_batch(request_context_t **batch, int n, struct event_base *base)
+{
+	GSList *next4 = in4_enabled;
+	GSList *next6 = in6_enabled;
+	GSList **next;
+	GSList *enabled;
+	int i;
+
+	printf("\n\tSocketconnect batch of %d requests\n\n", n);
+
+	for (i = 0; i < n; i++)
+	{
+		request_context_t *rctx = batch[i];
+		struct src_prefix_list *bind_pfx;
+		strbuf_t sb;
+
+		if (rctx->ctx->domain == AF_INET)
+		{
+			next = &next4;
+			enabled = in4_enabled;
+		}
+		else if (rctx->ctx->domain == AF_INET6)
+		{
+			next = &next6;
+			enabled = in6_enabled;
+		}
+		else
+		{
+			next = NULL;
+			enabled = NULL;
+		}
+
+		// Bound requests and those without address family are handled like single ones
+		if (rctx->ctx->bind_sa_req != NULL || enabled == NULL)
+		{
+			on_socketconnect_request(rctx, base);
+			continue;
+		}
+
+		if (*next == NULL)
+			*next = enabled;
+		bind_pfx = (*next)->data;
+		*next = (*next)->next;
+
+		strbuf_init(&sb);
+		strbuf_printf(&sb, "\tBatch request %d: %s:%s\n", i, (rctx->ctx->remote_hostname == NULL ? "" : rctx->ctx->remote_hostname), (rctx->ctx->remote_service == NULL ? "" : rctx->ctx->remote_service));
+		set_bind_sa(rctx, bind_pfx, &sb);
+		printf("%s\n\n", strbuf_export(&sb));
+		strbuf_release(&sb);
+
+		// Set this prefix' evdns base for name resolution
+		rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
+		rctx->action = muacc_act_socketconnect_resp;
+
+		resolve_name(rctx);
+	}
+
+	return 0;
+}
+
 /** Socketchoose request function
  *  Is called upon each socketchoose request from a client
  *  Chooses from a set of existing sockets, or if none exists, does the same as socketconnect
@@ -409,7 +508,7 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 			struct src_prefix_list *bind_pfx = get_pfx_with_addr(rctx, rctx->ctx->bind_sa_req);
 			if (bind_pfx != NULL) {
 				// Set DNS base to this prefix's
-				rctx->evdns_base = bind_pfx->evdns_base;
+				rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
 				strbuf_printf(&sb, ", set DNS base. ");
 			}
 		}
@@ -421,7 +520,7 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 				set_bind_sa(rctx, bind_pfx, &sb);
 
 				// Set this prefix' evdns base for name resolution
-				rctx->evdns_base = bind_pfx->evdns_base;
+				rctx->evdns_base = mam_prefix_evdns_base(bind_pfx);
 				strbuf_printf(&sb, ", set DNS base. ");
 			}
 			else
@@ -438,3 +537,17 @@ int on_socketchoose_request(request_context_t *rctx, struct event_base *base)
 		return resolve_name(rctx);
 	}
 }
+
+/** Entry points of the policy - requests may be handled on all worker threads at once */
+const struct mam_policy mam_policy = {
+	.abi_version = MAM_POLICY_ABI_VERSION,
+	.capabilities = MAM_POLICY_THREAD_SAFE,
+	.init = &init,
+	.cleanup = &cleanup,
+	.on_resolve_request = &on_resolve_request,
+	.on_connect_request = &on_connect_request,
+	.on_socketconnect_request = &on_socketconnect_request,
+	.on_socketconnect_batch = &on_socketconnect_batch,
+	.on_socketchoose_request = &on_socketchoose_request,
+	.on_prefix_change = &on_prefix_change,
+};
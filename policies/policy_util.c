@@ -4,8 +4,11 @@
  *  All rights reserved. This project is released under the New BSD License.
  */
 
+#include <stddef.h>
+
 #include "policy_util.h"
 #include "mam/mam_util.h"
+#include "mam/mam_lpm.h"
 
 #include "dlog.h"
 
@@ -94,7 +97,7 @@ void set_bind_sa(request_context_t *rctx, struct src_prefix_list *chosen, strbuf
 		_muacc_print_sockaddr(sb, chosen->if_addrs->addr, chosen->if_addrs->addr_len);
 	}
 	
-	rctx->ctx->bind_sa_suggested = _muacc_clone_sockaddr(chosen->if_addrs->addr, chosen->if_addrs->addr_len);
+	rctx->ctx->bind_sa_suggested = _muacc_ctx_clone_sockaddr(rctx->ctx, chosen->if_addrs->addr, chosen->if_addrs->addr_len);
 	rctx->ctx->bind_sa_suggested_len = chosen->if_addrs->addr_len;
 	rctx->ctx->domain = chosen->family;
 }
@@ -104,7 +107,7 @@ void _set_bind_sa(request_context_t *rctx, struct sockaddr *addr, strbuf_t *sb)
 	strbuf_printf(sb, "\n\tSet src=");
 	_muacc_print_sockaddr(sb, addr, sizeof(struct sockaddr));
 
-	rctx->ctx->bind_sa_suggested = _muacc_clone_sockaddr(addr, sizeof(struct sockaddr));
+	rctx->ctx->bind_sa_suggested = _muacc_ctx_clone_sockaddr(rctx->ctx, addr, sizeof(struct sockaddr));
 	rctx->ctx->bind_sa_suggested_len = sizeof(struct sockaddr);
 }
 
@@ -131,6 +134,62 @@ void print_addrinfo_response (struct addrinfo *res)
 	strbuf_release(&sb);
 }
 
+/** Measurements lookup_prefix_info finds by the names they had in measure_dict */
+static const struct {
+	const char	*key;
+	int			in_iface;		/**< in iface_metrics instead of prefix_metrics */
+	size_t		offset;
+	uint32_t	flag;			/**< MUACC_METRICS_* telling whether it was measured */
+} metric_keys[] = {
+	{ "srtt_mean",			0, offsetof(struct prefix_metrics, srtt_mean),		MUACC_METRICS_SRTT_MEAN },
+	{ "srtt_median",		0, offsetof(struct prefix_metrics, srtt_median),	MUACC_METRICS_SRTT_MEDIAN },
+	{ "srtt_minimum",		0, offsetof(struct prefix_metrics, srtt_minimum),	MUACC_METRICS_SRTT_MINIMUM },
+	{ "srtt_p10",			0, offsetof(struct prefix_metrics, srtt_p10),		MUACC_METRICS_SRTT_PERCENTILES },
+	{ "srtt_p90",			0, offsetof(struct prefix_metrics, srtt_p90),		MUACC_METRICS_SRTT_PERCENTILES },
+	{ "rx_errors",			0, offsetof(struct prefix_metrics, rx_errors),		MUACC_METRICS_ERRORS },
+	{ "tx_errors",			0, offsetof(struct prefix_metrics, tx_errors),		MUACC_METRICS_ERRORS },
+	{ "download_counter",	1, offsetof(struct iface_metrics, download.counter),	MUACC_METRICS_DOWNLOAD },
+	{ "download_rate",		1, offsetof(struct iface_metrics, download.rate),		MUACC_METRICS_DOWNLOAD },
+	{ "download_srate",		1, offsetof(struct iface_metrics, download.srate),		MUACC_METRICS_DOWNLOAD },
+	{ "download_max_rate",	1, offsetof(struct iface_metrics, download.max_rate),	MUACC_METRICS_DOWNLOAD },
+	{ "download_max_srate",	1, offsetof(struct iface_metrics, download.max_srate),	MUACC_METRICS_DOWNLOAD },
+	{ "upload_counter",		1, offsetof(struct iface_metrics, upload.counter),		MUACC_METRICS_UPLOAD },
+	{ "upload_rate",		1, offsetof(struct iface_metrics, upload.rate),			MUACC_METRICS_UPLOAD },
+	{ "upload_srate",		1, offsetof(struct iface_metrics, upload.srate),		MUACC_METRICS_UPLOAD },
+	{ "upload_max_rate",	1, offsetof(struct iface_metrics, upload.max_rate),		MUACC_METRICS_UPLOAD },
+	{ "upload_max_srate",	1, offsetof(struct iface_metrics, upload.max_srate),	MUACC_METRICS_UPLOAD },
+	{ "rx_packets",			1, offsetof(struct iface_metrics, rx_packets),		MUACC_METRICS_DOWNLOAD },
+	{ "tx_packets",			1, offsetof(struct iface_metrics, tx_packets),		MUACC_METRICS_UPLOAD },
+	{ "sample",				1, offsetof(struct iface_metrics, sample),			MUACC_METRICS_DOWNLOAD },
+};
+
+/** Find a measurement of the metrics of a prefix or its interface by its name, NULL if it is none or was not measured */
+static void *lookup_metric(struct src_prefix_list *prefix, const char *key, int in_iface)
+{
+	uint32_t valid;
+	char *metrics;
+
+	if (in_iface)
+	{
+		if (prefix->iface == NULL)
+			return NULL;
+		metrics = (char *) &(prefix->iface->metrics);
+		valid = prefix->iface->metrics.valid;
+	}
+	else
+	{
+		metrics = (char *) &(prefix->metrics);
+		valid = prefix->metrics.valid;
+	}
+
+	for (size_t i = 0; i < sizeof(metric_keys) / sizeof(metric_keys[0]); i++)
+	{
+		if (metric_keys[i].in_iface == in_iface && strcmp(metric_keys[i].key, key) == 0)
+			return (valid & metric_keys[i].flag) ? metrics + metric_keys[i].offset : NULL;
+	}
+	return NULL;
+}
+
 void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key)
 {
 	if (prefix == NULL || key == NULL)
@@ -149,6 +208,12 @@ void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key)
 			return value;
 		}
 	}
+	value = lookup_metric(prefix, key, 0);
+	if (value != NULL)
+	{
+		DLOG(MAM_POLICY_UTIL_NOISY_DEBUG2, "Found key %s in prefix metrics\n", (char *) key);
+		return value;
+	}
 	if (prefix->measure_dict != NULL)
 	{
 		value = g_hash_table_lookup(prefix->measure_dict, key);
@@ -167,6 +232,12 @@ void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key)
 			return value;
 		}
 	}
+	value = lookup_metric(prefix, key, 1);
+	if (value != NULL)
+	{
+		DLOG(MAM_POLICY_UTIL_NOISY_DEBUG2, "Found key %s in iface metrics\n", (char *) key);
+		return value;
+	}
 	if (prefix->iface != NULL && prefix->iface->measure_dict != NULL)
 	{
 		value = g_hash_table_lookup(prefix->iface->measure_dict, key);
@@ -179,6 +250,38 @@ void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key)
 	return value;
 }
 
+const struct prefix_metrics *get_prefix_metrics(struct src_prefix_list *prefix, uint32_t flags)
+{
+	if (prefix == NULL || (prefix->metrics.valid & flags) != flags)
+		return NULL;
+
+	return &(prefix->metrics);
+}
+
+const struct iface_metrics *get_iface_metrics(struct src_prefix_list *prefix, uint32_t flags)
+{
+	if (prefix == NULL || prefix->iface == NULL || (prefix->iface->metrics.valid & flags) != flags)
+		return NULL;
+
+	return &(prefix->iface->metrics);
+}
+
+const mam_history_t *get_prefix_history(struct src_prefix_list *prefix, enum prefix_history which)
+{
+	if (prefix == NULL || (unsigned int) which >= PFX_HISTORY_MAX)
+		return NULL;
+
+	return prefix->history[which];
+}
+
+const mam_history_t *get_iface_history(struct src_prefix_list *prefix, enum iface_history which)
+{
+	if (prefix == NULL || prefix->iface == NULL || (unsigned int) which >= IFACE_HISTORY_MAX)
+		return NULL;
+
+	return prefix->iface->history[which];
+}
+
 int is_there_a_socket_on_prefix(struct socketlist *list, struct src_prefix_list *pfx)
 {
 	strbuf_t sb;
@@ -284,7 +387,7 @@ void pick_sockets_on_prefix(request_context_t *rctx, struct src_prefix_list *bin
 			struct socketlist *slist_to_free = current;
 			current = current->next;
 			_muacc_free_ctx(slist_to_free->ctx);
-			free(slist_to_free);
+			_muacc_arena_free(rctx->arena, slist_to_free);
 		}
 	}
 
@@ -296,22 +399,15 @@ void pick_sockets_on_prefix(request_context_t *rctx, struct src_prefix_list *bin
 
 struct src_prefix_list *get_pfx_with_addr(request_context_t *rctx, struct sockaddr *addr)
 {
-	if (rctx == NULL || rctx->mctx == NULL || rctx->mctx->prefixes == NULL || addr == NULL)
+	struct src_prefix_list *pfx;
+
+	if (rctx == NULL || rctx->mctx == NULL || addr == NULL)
 		return NULL;
 
-	GSList *current = rctx->mctx->prefixes;
-	while (current != NULL)
+	if ((pfx = mam_lpm_lookup(rctx->mctx->prefix_lpm, addr)) != NULL)
 	{
-		struct src_prefix_list *currentpfx = (struct src_prefix_list *) current->data;
-		if (currentpfx == NULL)
-			continue;
-
-		if (is_addr_in_prefix(addr, currentpfx) == 0)
-		{
-			DLOG(MAM_POLICY_UTIL_NOISY_DEBUG2, "Found prefix with the given address!\n");
-			return currentpfx;
-		}
-		current = current->next;
+		DLOG(MAM_POLICY_UTIL_NOISY_DEBUG2, "Found prefix with the given address!\n");
+		return pfx;
 	}
 	DLOG(MAM_POLICY_UTIL_NOISY_DEBUG2, "Did not find prefix with the given address!\n");
 	return NULL;
@@ -6,6 +6,7 @@
  */
 
 #include "mam/mam.h"
+#include "mam/mam_history.h"
 #include "lib/muacc_util.h"
 #include "lib/muacc_ctx.h"
 #include "policy.h"
@@ -42,9 +43,37 @@ void _set_bind_sa(request_context_t *rctx, struct sockaddr *addr, strbuf_t *sb);
 /** Helper that prints the addresses returned by getaddrinfo */
 void print_addrinfo_response (struct addrinfo *res);
 
-/** Helper that searches for information for a prefix in various dictionaries */
+/** Helper that searches for information for a prefix in various dictionaries
+ *  Measurements of the prefix and its interface are found by their names, e.g. "srtt_minimum"
+ *  or "download_max_rate" - prefer get_prefix_metrics and get_iface_metrics for them
+ */
 void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key);
 
+/** Helper that returns the measurements of a prefix if all in flags (MUACC_METRICS_*) were taken
+ *  Only for policies running on the main thread - thread safe ones use mam_measurements
+ *
+ *  \return the metrics of the prefix, NULL if some were not measured yet
+ */
+const struct prefix_metrics *get_prefix_metrics(struct src_prefix_list *prefix, uint32_t flags);
+
+/** Helper that returns the measurements of the interface of a prefix if all in flags (MUACC_METRICS_*) were taken
+ *  Only for policies running on the main thread - thread safe ones use mam_measurements
+ *
+ *  \return the metrics of the interface, NULL if some were not measured yet
+ */
+const struct iface_metrics *get_iface_metrics(struct src_prefix_list *prefix, uint32_t flags);
+
+/** Helper that returns the history of a measurement of a prefix, for aggregates over the last seconds
+ *  (see mam_history_stats, mam_history_range and mam_history_quantile)
+ *  Only for policies running on the main thread
+ *
+ *  \return the history, NULL if nothing was measured yet - the mam_history functions find no samples in it then
+ */
+const mam_history_t *get_prefix_history(struct src_prefix_list *prefix, enum prefix_history which);
+
+/** Helper that returns the history of a measurement of the interface of a prefix, like get_prefix_history */
+const mam_history_t *get_iface_history(struct src_prefix_list *prefix, enum iface_history which);
+
 /** Helper that looks if the socketlist contains a socket on a particular prefix
  *	Returns 0 if no socket is found, 1 if at least one socket is found
   */
@@ -53,5 +82,5 @@ void *lookup_prefix_info(struct src_prefix_list *prefix, const void *key);
 /** Helper that filters a socket list for a particular prefix */
 void pick_sockets_on_prefix(request_context_t *rctx, struct src_prefix_list *bind_pfx);
 
-/** Helper that returns the prefix with a given socket address */
+/** Helper that returns the most specific prefix a socket address belongs to, looked up in the prefix index of the context */
 struct src_prefix_list *get_pfx_with_addr(request_context_t *rctx, struct sockaddr *addr);
@@ -0,0 +1,25 @@
+/** \file test_check.c
+ *	\brief Counting and reporting of the checks of the test programs (see CHECK in test_util.h)
+ *
+ *  Kept apart from test_util.c, so test programs that do not need the client library can use it.
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ */
+
+#include <stdio.h>
+
+#include "test_util.h"
+
+int test_failed = 0;
+
+int test_report(void)
+{
+	if (test_failed > 0)
+	{
+		fprintf(stderr, "%d checks failed\n", test_failed);
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
@@ -0,0 +1,481 @@
+/** \file test_ctx_codec.c
+ *  \brief Test for the encodings of contexts in both protocol versions
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Packs contexts the way clients and MAM send them - as TLVs per member (protocol version 1)
+ *	and as a single packed_ctx element (protocol version 2) - unpacks them again and checks
+ *	that the result equals the original context, member by member. Deltas (packed_ctx_delta)
+ *	are applied to the context the receiver has cached and must reproduce the full context.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "muacc.h"
+#include "muacc_ctx.h"
+#include "muacc_tlv.h"
+#include "muacc_util.h"
+#include "muacc_arena.h"
+
+#include "dlog.h"
+
+#include "test_util.h"
+
+#ifndef TEST_CTX_CODEC_NOISY_DEBUG
+#define TEST_CTX_CODEC_NOISY_DEBUG 0
+#endif
+
+#define TEST_BUF_LEN (64 * 1024)
+
+/** Members of a packed_ctx in the order of the bits of its bitmap (see muacc_ctx.c) */
+#define TEST_PACKED_CTX_TYPE           (1 << 5)
+#define TEST_PACKED_CTX_REMOTE_SERVICE (1 << 11)
+
+static char buf[TEST_BUF_LEN];
+
+static int sockaddr_equal(const struct sockaddr *a, socklen_t a_len, const struct sockaddr *b, socklen_t b_len)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (a_len == b_len && memcmp(a, b, a_len) == 0);
+}
+
+static int string_equal(const char *a, const char *b)
+{
+	if (a == NULL || b == NULL)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
+
+static int addrinfo_equal(const struct addrinfo *a, const struct addrinfo *b)
+{
+	for (; a != NULL && b != NULL; a = a->ai_next, b = b->ai_next)
+	{
+		if (a->ai_flags != b->ai_flags || a->ai_family != b->ai_family ||
+			a->ai_socktype != b->ai_socktype || a->ai_protocol != b->ai_protocol ||
+			!sockaddr_equal(a->ai_addr, a->ai_addrlen, b->ai_addr, b->ai_addrlen) ||
+			!string_equal(a->ai_canonname, b->ai_canonname))
+			return 0;
+	}
+	return (a == b);
+}
+
+static int socketopt_equal(const struct socketopt *a, const struct socketopt *b)
+{
+	for (; a != NULL && b != NULL; a = a->next, b = b->next)
+	{
+		if (a->level != b->level || a->optname != b->optname || a->flags != b->flags ||
+			a->returnvalue != b->returnvalue || a->optlen != b->optlen ||
+			(a->optval == NULL) != (b->optval == NULL) ||
+			(a->optval != NULL && memcmp(a->optval, b->optval, a->optlen) != 0))
+			return 0;
+	}
+	return (a == b);
+}
+
+/** compare two contexts member by member, reporting the first one that differs
+ *
+ *  \return 1 if equal, 0 otherwise
+ */
+static int ctx_equal(const struct _muacc_ctx *a, const struct _muacc_ctx *b, const char *what)
+{
+	const char *member = NULL;
+
+	if (__uuid_compare(a->ctxid, b->ctxid) != 0)             member = "ctxid";
+	else if (a->ctxino != b->ctxino)                         member = "ctxino";
+	else if (a->sockfd != b->sockfd)                         member = "sockfd";
+	else if (a->calls_performed != b->calls_performed)       member = "calls_performed";
+	else if (a->domain != b->domain)                         member = "domain";
+	else if (a->type != b->type)                             member = "type";
+	else if (a->protocol != b->protocol)                     member = "protocol";
+	else if (!sockaddr_equal(a->bind_sa_req, a->bind_sa_req_len, b->bind_sa_req, b->bind_sa_req_len))
+		member = "bind_sa_req";
+	else if (!sockaddr_equal(a->bind_sa_suggested, a->bind_sa_suggested_len, b->bind_sa_suggested, b->bind_sa_suggested_len))
+		member = "bind_sa_suggested";
+	else if (!sockaddr_equal(a->remote_sa, a->remote_sa_len, b->remote_sa, b->remote_sa_len))
+		member = "remote_sa";
+	else if (!string_equal(a->remote_hostname, b->remote_hostname)) member = "remote_hostname";
+	else if (!string_equal(a->remote_service, b->remote_service))   member = "remote_service";
+	else if (!addrinfo_equal(a->remote_addrinfo_hint, b->remote_addrinfo_hint)) member = "remote_addrinfo_hint";
+	else if (!addrinfo_equal(a->remote_addrinfo_res, b->remote_addrinfo_res))   member = "remote_addrinfo_res";
+	else if (!socketopt_equal(a->sockopts_current, b->sockopts_current))       member = "sockopts_current";
+	else if (!socketopt_equal(a->sockopts_suggested, b->sockopts_suggested))   member = "sockopts_suggested";
+
+	if (member != NULL)
+		fprintf(stderr, "%s: contexts differ in %s\n", what, member);
+	return (member == NULL);
+}
+
+/** create a context with every member set, the host name hostname_len characters long */
+static struct _muacc_ctx *create_full_ctx(size_t hostname_len)
+{
+	struct _muacc_ctx *ctx = _muacc_create_ctx();
+	struct sockaddr_in sin;
+	struct sockaddr_in6 sin6;
+	struct addrinfo hint, res[2];
+	int one = 1, bufsize = 65536;
+	char *hostname;
+	int i;
+
+	if (ctx == NULL)
+		return NULL;
+
+	for (i = 0; i < 16; i++)
+		ctx->ctxid[i] = i + 1;
+	ctx->ctxino = 0x123456789abcULL;
+	ctx->sockfd = 42;
+	ctx->calls_performed = MUACC_SOCKET_CALLED | MUACC_CONNECT_CALLED;
+	ctx->domain = AF_INET6;
+	ctx->type = SOCK_STREAM;
+	ctx->protocol = IPPROTO_TCP;
+
+	memset(&sin, 0, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(8080);
+	inet_pton(AF_INET, "192.0.2.1", &sin.sin_addr);
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(443);
+	sin6.sin6_scope_id = 3;
+	inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+
+	ctx->bind_sa_req = _muacc_clone_sockaddr((struct sockaddr *) &sin, sizeof(sin));
+	ctx->bind_sa_req_len = sizeof(sin);
+	ctx->bind_sa_suggested = _muacc_clone_sockaddr((struct sockaddr *) &sin6, sizeof(sin6));
+	ctx->bind_sa_suggested_len = sizeof(sin6);
+	ctx->remote_sa = _muacc_clone_sockaddr((struct sockaddr *) &sin6, sizeof(sin6));
+	ctx->remote_sa_len = sizeof(sin6);
+
+	hostname = malloc(hostname_len + 1);
+	memset(hostname, 'h', hostname_len);
+	hostname[hostname_len] = 0x00;
+	ctx->remote_hostname = _muacc_clone_string(hostname);
+	free(hostname);
+	ctx->remote_service = _muacc_clone_string("https");
+
+	memset(&hint, 0, sizeof(hint));
+	hint.ai_family = AF_UNSPEC;
+	hint.ai_socktype = SOCK_STREAM;
+	hint.ai_flags = AI_ADDRCONFIG;
+	ctx->remote_addrinfo_hint = _muacc_clone_addrinfo(&hint);
+
+	memset(res, 0, sizeof(res));
+	res[0].ai_family = AF_INET6;
+	res[0].ai_socktype = SOCK_STREAM;
+	res[0].ai_protocol = IPPROTO_TCP;
+	res[0].ai_addr = (struct sockaddr *) &sin6;
+	res[0].ai_addrlen = sizeof(sin6);
+	res[0].ai_canonname = "example.org";
+	res[0].ai_next = &res[1];
+	res[1].ai_family = AF_INET;
+	res[1].ai_socktype = SOCK_STREAM;
+	res[1].ai_protocol = IPPROTO_TCP;
+	res[1].ai_addr = (struct sockaddr *) &sin;
+	res[1].ai_addrlen = sizeof(sin);
+	ctx->remote_addrinfo_res = _muacc_clone_addrinfo(res);
+
+	_muacc_add_sockopt_to_list(&ctx->sockopts_current, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one), SOCKOPT_IS_SET);
+	_muacc_add_sockopt_to_list(&ctx->sockopts_current, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize), SOCKOPT_OPTIONAL);
+	_muacc_add_sockopt_to_list(&ctx->sockopts_suggested, IPPROTO_TCP, 1, &one, sizeof(one), 0);
+
+	return ctx;
+}
+
+/** unpack all context TLVs of a message up to eof
+ *
+ *  \return 0 on success, -1 if a TLV could not be parsed or unpacked
+ */
+static int unpack_msg(const char *msg, ssize_t len, int version, struct _muacc_ctx *ctx)
+{
+	ssize_t pos = 0;
+	muacc_tlv_t tag;
+	void *data;
+	ssize_t data_len;
+
+	while (_muacc_next_tlv(msg, &pos, len, version, &tag, &data, &data_len) > 0)
+	{
+		if (tag == eof)
+			return (pos == len) ? 0 : -1;
+		if (0 > _muacc_unpack_ctx(tag, data, data_len, ctx))
+			return -1;
+	}
+	return -1;
+}
+
+/** pack a context into buf as a message of the given version
+ *
+ *  \return length of the message, -1 on error
+ */
+static ssize_t pack_msg(int version, const struct _muacc_ctx *ctx)
+{
+	ssize_t pos = 0;
+
+	if (0 > _muacc_pack_ctx_v(buf, &pos, sizeof(buf), version, ctx) ||
+		0 > _muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), version, eof))
+		return -1;
+	return pos;
+}
+
+/** pack a context in a version and unpack it into a fresh one, which must equal the original */
+static void check_roundtrip(int version, const struct _muacc_ctx *ctx, const char *what)
+{
+	struct _muacc_ctx *out = _muacc_create_ctx();
+	ssize_t len;
+
+	CHECK((len = pack_msg(version, ctx)) > 0);
+	CHECK(unpack_msg(buf, len, version, out) == 0);
+	CHECK(ctx_equal(ctx, out, what));
+	DLOG(TEST_CTX_CODEC_NOISY_DEBUG, "%s: %zd bytes\n", what, len);
+
+	_muacc_free_ctx(out);
+}
+
+/** varints at the boundaries of their lengths, alone and as lengths of compact TLVs */
+static void test_varint(void)
+{
+	static const struct { uint64_t val; ssize_t len; const char *bytes; } cases[] = {
+		{ 0,          1,  "\x00" },
+		{ 127,        1,  "\x7f" },
+		{ 128,        2,  "\x80\x01" },
+		{ 16383,      2,  "\xff\x7f" },
+		{ 16384,      3,  "\x80\x80\x01" },
+		{ UINT64_MAX, 10, "\xff\xff\xff\xff\xff\xff\xff\xff\xff\x01" },
+	};
+	static const ssize_t tlv_lens[] = { 0, 127, 128, 16383, 16384 };
+	char *payload;
+	ssize_t pos, data_len;
+	uint64_t val;
+	muacc_tlv_t tag;
+	void *data;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++)
+	{
+		pos = 0;
+		CHECK(_muacc_push_varint(NULL, NULL, 0, cases[i].val) == cases[i].len);
+		CHECK(_muacc_push_varint(buf, &pos, sizeof(buf), cases[i].val) == cases[i].len);
+		CHECK(pos == cases[i].len && memcmp(buf, cases[i].bytes, pos) == 0);
+
+		pos = 0;
+		CHECK(_muacc_get_varint(buf, &pos, cases[i].len, &val) == cases[i].len);
+		CHECK(val == cases[i].val && pos == cases[i].len);
+
+		/* one byte short */
+		pos = 0;
+		CHECK(_muacc_get_varint(buf, &pos, cases[i].len - 1, &val) < 0 && pos == 0);
+		pos = 0;
+		CHECK(_muacc_push_varint(buf, &pos, cases[i].len - 1, cases[i].val) < 0);
+	}
+
+	/* zigzag keeps small negative numbers short */
+	CHECK(MUACC_ZIGZAG_ENCODE(-1) == 1 && MUACC_ZIGZAG_DECODE(MUACC_ZIGZAG_ENCODE(-1)) == -1);
+	CHECK(MUACC_ZIGZAG_DECODE(MUACC_ZIGZAG_ENCODE(INT32_MIN)) == INT32_MIN);
+	CHECK(MUACC_ZIGZAG_DECODE(MUACC_ZIGZAG_ENCODE(INT32_MAX)) == INT32_MAX);
+
+	payload = malloc(16384);
+	for (i = 0; i < 16384; i++)
+		payload[i] = (char) i;
+
+	for (i = 0; i < sizeof(tlv_lens) / sizeof(tlv_lens[0]); i++)
+	{
+		pos = 0;
+		CHECK(_muacc_push_tlv_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, remote_hostname, payload, tlv_lens[i]) ==
+			1 + _muacc_push_varint(NULL, NULL, 0, tlv_lens[i]) + tlv_lens[i]);
+		data_len = pos;
+
+		pos = 0;
+		CHECK(_muacc_next_tlv(buf, &pos, data_len, MUACC_PROTOCOL_V2, &tag, &data, &data_len) > 0);
+		CHECK(tag == remote_hostname && data_len == tlv_lens[i]);
+		CHECK(data_len == 0 || memcmp(data, payload, data_len) == 0);
+
+		/* ending within the TLV is an error */
+		pos = 0;
+		CHECK(tlv_lens[i] == 0 || _muacc_next_tlv(buf, &pos, tlv_lens[i], MUACC_PROTOCOL_V2, &tag, &data, &data_len) < 0);
+	}
+
+	free(payload);
+}
+
+/** whole contexts in both versions, with host names at the boundaries of the varint lengths */
+static void test_full_ctx(void)
+{
+	static const size_t hostname_lens[] = { 1, 127, 128, 16383, 16384 };
+	struct _muacc_ctx *ctx;
+	char what[64];
+	unsigned int i;
+
+	for (i = 0; i < sizeof(hostname_lens) / sizeof(hostname_lens[0]); i++)
+	{
+		CHECK((ctx = create_full_ctx(hostname_lens[i])) != NULL);
+		if (ctx == NULL)
+			continue;
+
+		snprintf(what, sizeof(what), "v1 with host name of %zu", hostname_lens[i]);
+		check_roundtrip(MUACC_PROTOCOL_V1, ctx, what);
+		snprintf(what, sizeof(what), "v2 with host name of %zu", hostname_lens[i]);
+		check_roundtrip(MUACC_PROTOCOL_V2, ctx, what);
+
+		_muacc_free_ctx(ctx);
+	}
+}
+
+/** members that are zero or NULL are left out of a packed_ctx, scalars left out are zero afterwards */
+static void test_absent_fields(void)
+{
+	struct _muacc_ctx *ctx = _muacc_create_ctx();
+	struct _muacc_ctx *out = _muacc_create_ctx();
+	ssize_t len, pos, data_len;
+	uint64_t present;
+	muacc_tlv_t tag;
+	void *data;
+
+	ctx->type = SOCK_DGRAM;
+	ctx->remote_service = _muacc_clone_string("53");
+
+	/* the bitmap names exactly the members that are set */
+	CHECK((len = pack_msg(MUACC_PROTOCOL_V2, ctx)) > 0);
+	pos = 0;
+	CHECK(_muacc_next_tlv(buf, &pos, len, MUACC_PROTOCOL_V2, &tag, &data, &data_len) > 0 && tag == packed_ctx);
+	pos = 0;
+	CHECK(_muacc_get_varint(data, &pos, data_len, &present) > 0);
+	CHECK(present == (TEST_PACKED_CTX_TYPE | TEST_PACKED_CTX_REMOTE_SERVICE));
+
+	/* unpacked over stale scalars */
+	out->sockfd = 7;
+	out->domain = AF_INET;
+	out->protocol = IPPROTO_UDP;
+	CHECK(unpack_msg(buf, len, MUACC_PROTOCOL_V2, out) == 0);
+	CHECK(ctx_equal(ctx, out, "v2 with absent members"));
+
+	/* an empty context is a bitmap of zero: tag, length and bitmap, then eof */
+	_muacc_free_ctx(ctx);
+	ctx = _muacc_create_ctx();
+	CHECK((len = pack_msg(MUACC_PROTOCOL_V2, ctx)) == 3 + 2);
+	check_roundtrip(MUACC_PROTOCOL_V1, ctx, "v1 empty");
+	check_roundtrip(MUACC_PROTOCOL_V2, ctx, "v2 empty");
+
+	_muacc_free_ctx(ctx);
+	_muacc_free_ctx(out);
+}
+
+/** a peer that only speaks version 1 and one that speaks version 2 understand each other */
+static void test_v1_v2_peers(void)
+{
+	static char v1_buf[TEST_BUF_LEN];
+	struct _muacc_ctx *ctx = create_full_ctx(32);
+	struct _muacc_ctx *from_v1 = _muacc_create_ctx();
+	struct _muacc_ctx *from_v2 = _muacc_create_ctx();
+	struct _muacc_ctx *garbage = _muacc_create_ctx();
+	ssize_t v1_len = 0, len;
+
+	/* what a version 1 peer sends: one TLV per member, as before version 2 existed */
+	CHECK(_muacc_pack_ctx(v1_buf, &v1_len, sizeof(v1_buf), ctx) > 0);
+	CHECK(_muacc_push_tlv_tag(v1_buf, &v1_len, sizeof(v1_buf), eof) > 0);
+
+	/* a version 2 peer that negotiated version 1 sends exactly the same */
+	CHECK((len = pack_msg(MUACC_PROTOCOL_V1, ctx)) == v1_len);
+	CHECK(len == v1_len && memcmp(buf, v1_buf, len) == 0);
+
+	/* and reads it to the same context it gets from a version 2 peer */
+	CHECK(unpack_msg(v1_buf, v1_len, MUACC_PROTOCOL_V1, from_v1) == 0);
+	CHECK((len = pack_msg(MUACC_PROTOCOL_V2, ctx)) > 0 && len < v1_len);
+	CHECK(unpack_msg(buf, len, MUACC_PROTOCOL_V2, from_v2) == 0);
+	CHECK(ctx_equal(from_v1, from_v2, "v1 peer against v2 peer"));
+	CHECK(ctx_equal(ctx, from_v2, "v2 peer"));
+
+	/* a version 1 peer knows no packed_ctx - as version 1 TLVs, the message is garbage */
+	CHECK(unpack_msg(buf, len, MUACC_PROTOCOL_V1, garbage) < 0);
+
+	_muacc_free_ctx(ctx);
+	_muacc_free_ctx(from_v1);
+	_muacc_free_ctx(from_v2);
+	_muacc_free_ctx(garbage);
+}
+
+/** pack the delta between old and ctx, apply it to cached (which equals old) - cached must equal ctx then */
+static void check_delta(const struct _muacc_ctx *old, const struct _muacc_ctx *ctx, struct _muacc_ctx *cached, const char *what)
+{
+	ssize_t pos = 0, len;
+
+	CHECK((len = _muacc_pack_ctx_delta(buf, &pos, sizeof(buf), old, ctx)) > 0);
+	CHECK(_muacc_push_tlv_tag_v(buf, &pos, sizeof(buf), MUACC_PROTOCOL_V2, eof) > 0);
+	CHECK(unpack_msg(buf, pos, MUACC_PROTOCOL_V2, cached) == 0);
+	CHECK(ctx_equal(ctx, cached, what));
+	DLOG(TEST_CTX_CODEC_NOISY_DEBUG, "%s: %zd bytes\n", what, len);
+}
+
+/** deltas applied to the context the receiver cached reproduce the full context, also when members are cleared */
+static void test_delta(void)
+{
+	struct _muacc_ctx *base = create_full_ctx(64);
+	struct _muacc_ctx *ctx, *cached, *empty;
+	ssize_t pos = 0, full_len, len;
+	int two = 2;
+
+	/* the receiver caches the base as it got it */
+	cached = _muacc_create_ctx();
+	CHECK((full_len = pack_msg(MUACC_PROTOCOL_V2, base)) > 0);
+	CHECK(unpack_msg(buf, full_len, MUACC_PROTOCOL_V2, cached) == 0);
+
+	/* nothing changed - nothing to send */
+	ctx = _muacc_clone_ctx(base);
+	CHECK(_muacc_pack_ctx_delta(buf, &pos, sizeof(buf), base, ctx) == 0 && pos == 0);
+
+	/* some members changed, some cleared to zero or NULL, the rest as before */
+	ctx->sockfd = 43;
+	ctx->calls_performed |= MUACC_BIND_CALLED;
+	ctx->domain = 0;
+	_muacc_dealloc(ctx->remote_service);
+	ctx->remote_service = _muacc_clone_string("http");
+	_muacc_dealloc(ctx->remote_hostname);
+	ctx->remote_hostname = NULL;
+	_muacc_dealloc(ctx->bind_sa_req);
+	ctx->bind_sa_req = NULL;
+	ctx->bind_sa_req_len = 0;
+	_muacc_free_addrinfo(ctx->remote_addrinfo_res);
+	ctx->remote_addrinfo_res = NULL;
+	_muacc_free_socketopts(ctx->sockopts_suggested);
+	ctx->sockopts_suggested = NULL;
+	_muacc_add_sockopt_to_list(&ctx->sockopts_current, SOL_SOCKET, SO_PRIORITY, &two, sizeof(two), 0);
+
+	pos = 0;
+	CHECK((len = _muacc_pack_ctx_delta(buf, &pos, sizeof(buf), base, ctx)) > 0 && len < full_len);
+	check_delta(base, ctx, cached, "delta changing and clearing members");
+
+	/* back to the base - cleared members come back */
+	check_delta(ctx, base, cached, "delta setting members again");
+
+	/* everything but the identifier cleared */
+	empty = _muacc_create_ctx();
+	__uuid_copy(empty->ctxid, base->ctxid);
+	check_delta(base, empty, cached, "delta clearing all members");
+	check_delta(empty, base, cached, "delta from an empty context");
+
+	_muacc_free_ctx(base);
+	_muacc_free_ctx(ctx);
+	_muacc_free_ctx(cached);
+	_muacc_free_ctx(empty);
+}
+
+int main(int argc, char *argv[])
+{
+	test_varint();
+	test_full_ctx();
+	test_absent_fields();
+	test_v1_v2_peers();
+	test_delta();
+
+	return test_report();
+}
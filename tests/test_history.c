@@ -0,0 +1,287 @@
+/** \file test_history.c
+ *  \brief Test for the windowed measurement history of MAM
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Fills histories (see mam_history.h) beyond their size, so the ring wraps around and
+ *	the running sums start over, and checks count, mean, standard deviation, trend,
+ *	range and quantiles of several windows against a recomputation over the samples
+ *	themselves. Checks mam_quantile against a sorted copy of its input.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "mam/mam_history.h"
+
+#include "test_util.h"
+
+#define TEST_DT 0.1			/**< seconds between two samples */
+#define TEST_MAX_SAMPLES (3 * MAM_HISTORY_SIZE + 100)
+
+static const double quantiles[] = { 0, 0.01, 0.25, 0.5, 0.9, 0.95, 0.99, 1 };
+#define N_QUANTILES (sizeof(quantiles) / sizeof(quantiles[0]))
+
+/** all samples added to a history, the oldest first */
+static double ref_t[TEST_MAX_SAMPLES];
+static double ref_v[TEST_MAX_SAMPLES];
+
+static int close_to(double a, double b)
+{
+	return fabs(a - b) <= 1e-6 * (fabs(b) > 1 ? fabs(b) : 1);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/** p-th quantile of n sorted values, interpolated between the two closest ranks */
+static double sorted_quantile(const double *sorted, unsigned int n, double p)
+{
+	double pos = p * (n - 1);
+	unsigned int k = (unsigned int) pos;
+
+	if (k + 1 >= n || pos == k)
+		return sorted[k];
+	return sorted[k] + (pos - k) * (sorted[k + 1] - sorted[k]);
+}
+
+/** check the aggregates of the samples from index from up to index to (exclusive) of the reference,
+ *  which a history is asked for with window seconds
+ */
+static void check_window(const mam_history_t *h, double window, unsigned int from, unsigned int to, const char *what)
+{
+	struct mam_history_stats stats;
+	double mean = 0, var = 0, tm = 0, stt = 0, stv = 0, trend = 0;
+	double min = NAN, max = NAN, q, sorted[TEST_MAX_SAMPLES];
+	unsigned int n = to - from, i, j;
+	int bad = 0;
+
+	if (mam_history_stats(h, window, &stats) != n || stats.n != n)
+	{
+		fprintf(stderr, "%s: window of %.2f s has %u samples instead of %u\n", what, window, stats.n, n);
+		test_failed++;
+		return;
+	}
+
+	if (n == 0)
+	{
+		CHECK(stats.mean == 0 && stats.stddev == 0 && stats.trend == 0 && stats.span == 0);
+		CHECK(mam_history_range(h, window, &min, &max) == 0 && isnan(min) && isnan(max));
+		CHECK(mam_history_quantile(h, window, 0.5, &q) == 0);
+		return;
+	}
+
+	for (i = from; i < to; i++)
+	{
+		mean += ref_v[i] / n;
+		tm += ref_t[i] / n;
+	}
+	for (i = from; i < to; i++)
+	{
+		var += (ref_v[i] - mean) * (ref_v[i] - mean) / n;
+		stt += (ref_t[i] - tm) * (ref_t[i] - tm);
+		stv += (ref_t[i] - tm) * (ref_v[i] - mean);
+	}
+	if (n > 1)
+		trend = stv / stt;
+
+	if (!close_to(stats.mean, mean) || !close_to(stats.stddev, sqrt(var)) || !close_to(stats.trend, trend)
+		|| !close_to(stats.span, ref_t[to - 1] - ref_t[from]))
+	{
+		fprintf(stderr, "%s: window of %.2f s: mean %f stddev %f trend %f span %f instead of %f %f %f %f\n",
+			what, window, stats.mean, stats.stddev, stats.trend, stats.span, mean, sqrt(var), trend, ref_t[to - 1] - ref_t[from]);
+		test_failed++;
+	}
+
+	memcpy(sorted, &(ref_v[from]), n * sizeof(double));
+	qsort(sorted, n, sizeof(double), &compare_doubles);
+
+	CHECK(mam_history_range(h, window, &min, &max) == n);
+	CHECK(min == sorted[0] && max == sorted[n - 1]);
+
+	for (j = 0; j < N_QUANTILES; j++)
+	{
+		if (mam_history_quantile(h, window, quantiles[j], &q) != n || q != sorted_quantile(sorted, n, quantiles[j]))
+			bad++;
+	}
+	if (bad > 0)
+	{
+		fprintf(stderr, "%s: window of %.2f s: %d quantiles wrong\n", what, window, bad);
+		test_failed++;
+	}
+}
+
+/** seconds from half a sample before the one taken at t until now - the window to ask for
+ *  so that it starts with that sample, taken right before the check as time goes on meanwhile
+ */
+static double window_from(double t)
+{
+	return mam_history_now() - t + TEST_DT / 2;
+}
+
+/** check a history that has been given the first added samples of the reference */
+static void check_history(const mam_history_t *h, unsigned int size, unsigned int added, const char *what)
+{
+	unsigned int kept = (added < size) ? added : size;
+	unsigned int first = added - kept;
+	unsigned int j;
+
+	/* no sample in an empty window, all of them in one longer than the history */
+	check_window(h, 0, added, added, what);
+	check_window(h, 1e9, first, added, what);
+
+	/* windows that start half way between two samples, from the last one kept to before the oldest */
+	for (j = added; j > first; j = (j - first > 16) ? j - (j - first) / 3 : j - 1)
+		check_window(h, window_from(ref_t[j - 1]), j - 1, added, what);
+	if (first > 0)
+		check_window(h, window_from(ref_t[first - 1]), first, added, what);
+}
+
+/** the next sample of the reference: a trend and some noise, with large values at first */
+static double sample_value(unsigned int i)
+{
+	double v = 100 + 0.5 * (i % 500) + (rand() % 1000) / 100.0;
+
+	return (i < MAM_HISTORY_SIZE / 2) ? v + 900 : v;
+}
+
+static void test_history(unsigned int size, unsigned int n_samples, unsigned int check_every)
+{
+	char what[64];
+	mam_history_t *h;
+	double now, t0;
+	unsigned int i;
+
+	snprintf(what, sizeof(what), "history of %u samples", size);
+	CHECK((h = mam_history_new(size)) != NULL);
+	if (h == NULL)
+		return;
+
+	/* the last sample is taken just before now */
+	now = mam_history_now();
+	t0 = now - n_samples * TEST_DT;
+
+	check_history(h, size, 0, what);
+	for (i = 0; i < n_samples; i++)
+	{
+		ref_t[i] = t0 + i * TEST_DT;
+		ref_v[i] = sample_value(i);
+		mam_history_add(h, ref_t[i], ref_v[i]);
+
+		if ((i + 1) % check_every == 0 || i + 1 == size || i + 1 == size + 1 || i + 1 == n_samples)
+			check_history(h, size, i + 1, what);
+	}
+
+	mam_history_free(h);
+}
+
+static void test_history_constant()
+{
+	struct mam_history_stats stats;
+	mam_history_t *h = mam_history_new(8);
+	double now = mam_history_now(), q;
+	unsigned int i;
+
+	for (i = 0; i < 20; i++)
+		mam_history_add(h, now - (20 - i) * TEST_DT, 42.5);
+
+	CHECK(mam_history_stats(h, 1e9, &stats) == 8);
+	CHECK(stats.mean == 42.5 && stats.stddev == 0 && stats.trend == 0);
+	CHECK(mam_history_quantile(h, 1e9, 0.95, &q) == 8 && q == 42.5);
+
+	/* samples at the same time have no trend */
+	mam_history_add(h, now, 1);
+	mam_history_add(h, now, 2);
+	CHECK(mam_history_stats(h, TEST_DT / 2, &stats) == 2);
+	CHECK(stats.span == 0 && stats.trend == 0 && stats.mean == 1.5);
+
+	mam_history_free(h);
+	CHECK(mam_history_new(0) == NULL);
+	CHECK(mam_history_stats(NULL, 1e9, &stats) == 0);
+}
+
+/** check mam_quantile on a copy of n values */
+static void check_quantile(const double *values, unsigned int n, const char *what)
+{
+	double *sorted = malloc(n * sizeof(double));
+	double *work = malloc(n * sizeof(double));
+	unsigned int j;
+	double q;
+
+	memcpy(sorted, values, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), &compare_doubles);
+
+	for (j = 0; j < N_QUANTILES; j++)
+	{
+		memcpy(work, values, n * sizeof(double));
+		q = mam_quantile(work, n, quantiles[j]);
+		if (q != sorted_quantile(sorted, n, quantiles[j]))
+		{
+			fprintf(stderr, "%s: quantile %.2f of %u values is %f instead of %f\n", what, quantiles[j], n, q, sorted_quantile(sorted, n, quantiles[j]));
+			test_failed++;
+		}
+
+		/* the values are only reordered */
+		qsort(work, n, sizeof(double), &compare_doubles);
+		CHECK(memcmp(work, sorted, n * sizeof(double)) == 0);
+	}
+
+	free(sorted);
+	free(work);
+}
+
+static void test_quantile()
+{
+	static const unsigned int sizes[] = { 1, 2, 3, 10, 1001 };
+	double values[1001];
+	unsigned int s, i, n;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		n = sizes[s];
+
+		for (i = 0; i < n; i++)
+			values[i] = rand() % 100000 / 7.0;
+		check_quantile(values, n, "random values");
+
+		for (i = 0; i < n; i++)
+			values[i] = 3.25;
+		check_quantile(values, n, "equal values");
+
+		for (i = 0; i < n; i++)
+			values[i] = i * 0.5;
+		check_quantile(values, n, "sorted values");
+
+		for (i = 0; i < n; i++)
+			values[i] = -(double) i;
+		check_quantile(values, n, "values sorted the other way round");
+
+		for (i = 0; i < n; i++)
+			values[i] = rand() % 3;
+		check_quantile(values, n, "values with many duplicates");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	srand(4711);
+
+	test_history(7, 40, 1);
+	test_history(64, 300, 5);
+	test_history(MAM_HISTORY_SIZE, TEST_MAX_SAMPLES, MAM_HISTORY_SIZE / 4);
+	test_history_constant();
+	test_quantile();
+
+	return test_report();
+}
@@ -0,0 +1,241 @@
+/** \file test_iface.c
+ *  \brief Test for keeping the prefixes of MAM up to date with the addresses of the system
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Adds and removes addresses of an interface the system does not have through
+ *	mam_prefix_add_addr and mam_prefix_del_addr, and checks which prefixes a change
+ *	set reports as added, changed and removed - also when a prefix loses its last
+ *	address within the change set that added it. Then lets mam_prefix_rescan find
+ *	these addresses gone, the way it does after their link went down, both for
+ *	prefixes added in the same change set and for prefixes applied before.
+ *	Using a prefix or list cell after it was freed only shows under ASan or valgrind,
+ *	with G_SLICE=always-malloc as ctest sets it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <ifaddrs.h>
+
+#include "mam/mam.h"
+
+#include "test_util.h"
+
+/** name of an interface the system does not have */
+#define TEST_IF "mamtest0"
+
+/** fill a sockaddr of the family of a textual address */
+static struct sockaddr *make_sockaddr(struct sockaddr_storage *ss, int family, const char *addr)
+{
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+	if (family == AF_INET)
+		inet_pton(AF_INET, addr, &(((struct sockaddr_in *) ss)->sin_addr));
+	else
+		inet_pton(AF_INET6, addr, &(((struct sockaddr_in6 *) ss)->sin6_addr));
+	return (struct sockaddr *) ss;
+}
+
+/** add a textual address with a textual netmask to the prefixes of TEST_IF */
+static int add_addr(mam_context_t *ctx, mam_prefix_changes_t *chg, int family, const char *addr, const char *mask)
+{
+	struct sockaddr_storage a, m;
+
+	return mam_prefix_add_addr(ctx, chg, TEST_IF, IFF_UP, family, make_sockaddr(&a, family, addr), make_sockaddr(&m, family, mask));
+}
+
+/** remove a textual address from the prefixes of TEST_IF */
+static int del_addr(mam_context_t *ctx, mam_prefix_changes_t *chg, int family, const char *addr)
+{
+	struct sockaddr_storage a;
+
+	return mam_prefix_del_addr(ctx, chg, TEST_IF, family, make_sockaddr(&a, family, addr));
+}
+
+/** number of prefixes of TEST_IF in a list */
+static int count_test_prefixes(GSList *l)
+{
+	int n = 0;
+
+	for (; l != NULL; l = l->next)
+	{
+		if (strcmp(((struct src_prefix_list *) l->data)->if_name, TEST_IF) == 0)
+			n++;
+	}
+	return n;
+}
+
+/** number of addresses of a prefix */
+static int count_addrs(struct src_prefix_list *pfx)
+{
+	struct sockaddr_list *cus;
+	int n = 0;
+
+	for (cus = pfx->if_addrs; cus != NULL; cus = cus->next)
+		n++;
+	return n;
+}
+
+/** whether all prefixes and interfaces MAM has belong to interfaces that are up on the system */
+static int all_on_system(mam_context_t *ctx)
+{
+	struct ifaddrs *ifaddr, *ifa;
+	GSList *cur;
+	int ok = 1;
+
+	if (getifaddrs(&ifaddr) == -1)
+		return 0;
+
+	for (cur = ctx->prefixes; cur != NULL; cur = cur->next)
+	{
+		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+		{
+			if ((ifa->ifa_flags & IFF_UP) && strcmp(ifa->ifa_name, ((struct src_prefix_list *) cur->data)->if_name) == 0)
+				break;
+		}
+		if (ifa == NULL)
+			ok = 0;
+	}
+	for (cur = ctx->ifaces; cur != NULL; cur = cur->next)
+	{
+		for (ifa = ifaddr; ifa != NULL; ifa = ifa->ifa_next)
+		{
+			if (strcmp(ifa->ifa_name, ((struct iface_list *) cur->data)->if_name) == 0)
+				break;
+		}
+		if (ifa == NULL)
+			ok = 0;
+	}
+
+	freeifaddrs(ifaddr);
+	return ok;
+}
+
+static void test_add_del(mam_context_t *ctx)
+{
+	mam_prefix_changes_t chg;
+	struct src_prefix_list *pfx;
+
+	/* a prefix that comes and goes within one change set is never reported */
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(add_addr(ctx, &chg, AF_INET, "10.99.0.1", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, &chg, AF_INET, "10.99.0.2", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, &chg, AF_INET, "10.99.0.2", "255.255.255.0") == 0);
+	CHECK(count_test_prefixes(ctx->prefixes) == 1 && count_test_prefixes(chg.added) == 1);
+	CHECK(chg.changed == NULL);
+
+	CHECK(del_addr(ctx, &chg, AF_INET, "10.99.0.1") == 1);
+	CHECK(count_test_prefixes(ctx->prefixes) == 1 && chg.changed == NULL);
+	CHECK(del_addr(ctx, &chg, AF_INET, "10.99.0.2") == 1);
+	CHECK(count_test_prefixes(ctx->prefixes) == 0);
+	CHECK(chg.added == NULL && chg.changed == NULL && chg.removed == NULL);
+	CHECK(del_addr(ctx, &chg, AF_INET, "10.99.0.2") == 0);
+	mam_prefix_changes_apply(ctx, &chg);
+
+	/* prefixes that were applied before are changed and removed */
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(add_addr(ctx, &chg, AF_INET, "10.99.1.1", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, &chg, AF_INET6, "2001:db8::1", "ffff:ffff:ffff:ffff::") == 1);
+	CHECK(count_test_prefixes(chg.added) == 2);
+	mam_prefix_changes_apply(ctx, &chg);
+	CHECK(count_test_prefixes(ctx->prefixes) == 2);
+
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(add_addr(ctx, &chg, AF_INET, "10.99.1.2", "255.255.255.0") == 1);
+	CHECK(count_test_prefixes(chg.changed) == 1 && chg.added == NULL);
+	pfx = chg.changed->data;
+	CHECK(pfx->family == AF_INET && count_addrs(pfx) == 2);
+	CHECK(del_addr(ctx, &chg, AF_INET, "10.99.1.1") == 1);
+	CHECK(count_test_prefixes(chg.changed) == 1 && count_addrs(pfx) == 1);
+
+	/* a prefix taken out stays until the changes are applied */
+	CHECK(del_addr(ctx, &chg, AF_INET6, "2001:db8::1") == 1);
+	CHECK(count_test_prefixes(ctx->prefixes) == 1 && count_test_prefixes(chg.removed) == 1);
+	CHECK(((struct src_prefix_list *) chg.removed->data)->family == AF_INET6);
+	CHECK(((struct src_prefix_list *) chg.removed->data)->if_addrs == NULL);
+	mam_prefix_changes_apply(ctx, &chg);
+
+	/* losing the last address of a prefix applied before removes it as well */
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(del_addr(ctx, &chg, AF_INET, "10.99.1.2") == 1);
+	CHECK(count_test_prefixes(ctx->prefixes) == 0);
+	CHECK(count_test_prefixes(chg.removed) == 1 && chg.changed == NULL);
+	mam_prefix_changes_apply(ctx, &chg);
+}
+
+/** put several prefixes with several addresses on TEST_IF, as rescans find them gone */
+static void add_test_prefixes(mam_context_t *ctx, mam_prefix_changes_t *chg)
+{
+	CHECK(add_addr(ctx, chg, AF_INET, "10.99.2.1", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, chg, AF_INET, "10.99.2.2", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, chg, AF_INET, "10.99.3.1", "255.255.255.0") == 1);
+	CHECK(add_addr(ctx, chg, AF_INET6, "2001:db8:1::1", "ffff:ffff:ffff:ffff::") == 1);
+	CHECK(add_addr(ctx, chg, AF_INET6, "2001:db8:1::2", "ffff:ffff:ffff:ffff::") == 1);
+	CHECK(add_addr(ctx, chg, AF_INET, "10.99.3.2", "255.255.255.0") == 1);
+}
+
+static void test_rescan(mam_context_t *ctx)
+{
+	mam_prefix_changes_t chg;
+
+	/* the system as it is */
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(mam_prefix_rescan(ctx, &chg) == 0);
+	mam_prefix_changes_apply(ctx, &chg);
+	CHECK(all_on_system(ctx));
+
+	/* nothing changed since */
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(mam_prefix_rescan(ctx, &chg) == 0);
+	CHECK(!mam_prefix_changes_pending(&chg));
+	mam_prefix_changes_apply(ctx, &chg);
+
+	/* prefixes added in the same change set lose all their addresses and are freed right away */
+	mam_prefix_changes_init(ctx, &chg);
+	add_test_prefixes(ctx, &chg);
+	CHECK(count_test_prefixes(ctx->prefixes) == 3 && count_test_prefixes(chg.added) == 3);
+	CHECK(mam_prefix_rescan(ctx, &chg) == 0);
+	CHECK(count_test_prefixes(ctx->prefixes) == 0);
+	CHECK(count_test_prefixes(chg.added) == 0 && count_test_prefixes(chg.removed) == 0);
+	CHECK(g_slist_length(chg.ifaces_removed) == 1);
+	CHECK(all_on_system(ctx));
+	mam_prefix_changes_apply(ctx, &chg);
+
+	/* prefixes applied before are removed as if their link went down */
+	mam_prefix_changes_init(ctx, &chg);
+	add_test_prefixes(ctx, &chg);
+	mam_prefix_changes_apply(ctx, &chg);
+	CHECK(count_test_prefixes(ctx->prefixes) == 3);
+
+	mam_prefix_changes_init(ctx, &chg);
+	CHECK(mam_prefix_rescan(ctx, &chg) == 0);
+	CHECK(count_test_prefixes(ctx->prefixes) == 0);
+	CHECK(count_test_prefixes(chg.removed) == 3 && g_slist_length(chg.removed) == 3);
+	CHECK(chg.added == NULL && chg.changed == NULL);
+	CHECK(g_slist_length(chg.ifaces_removed) == 1);
+	CHECK(all_on_system(ctx));
+	mam_prefix_changes_apply(ctx, &chg);
+}
+
+int main(int argc, char *argv[])
+{
+	mam_context_t *ctx = mam_create_context();
+
+	test_add_del(ctx);
+	test_rescan(ctx);
+
+	mam_release_context(ctx);
+
+	return test_report();
+}
@@ -0,0 +1,350 @@
+/** \file test_log.c
+ *  \brief Test for the buffered logs of measurements
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Writes the same rows - with missing values, strings longer than a log keeps and
+ *	more rows than fit into a block - to a CSV log and to a binary log (see muacc_log.h),
+ *	turns the binary log back into CSV and checks that it is the same, byte by byte.
+ *	Checks that logs are rotated to filename.1 and so on once they are large enough.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "muacc_log.h"
+
+#include "test_util.h"
+
+#define TEST_ROWS (3 * MUACC_LOG_BLOCK_ROWS + 17)
+#define TEST_LONG_STRING 300
+
+static const struct muacc_log_column columns[] = {
+	{ "time", MUACC_LOG_TIMEVAL },
+	{ "id", MUACC_LOG_INT },
+	{ "rate", MUACC_LOG_DOUBLE },
+	{ "name", MUACC_LOG_STRING },
+	{ "note", MUACC_LOG_STRING },
+};
+#define N_COLUMNS (sizeof(columns) / sizeof(columns[0]))
+
+static char dir[] = "/tmp/muacc_logtest_XXXXXX";
+static char long_string[TEST_LONG_STRING + 1];
+
+/** name of a file in the directory of the test, followed by .suffix if suffix > 0 */
+static const char *path(const char *name, int suffix)
+{
+	static char buf[256];
+
+	if (suffix > 0)
+		snprintf(buf, sizeof(buf), "%s/%s.%d", dir, name, suffix);
+	else
+		snprintf(buf, sizeof(buf), "%s/%s", dir, name);
+	return buf;
+}
+
+static int exists(const char *filename)
+{
+	struct stat st;
+
+	return stat(filename, &st) == 0;
+}
+
+static size_t file_size(const char *filename)
+{
+	struct stat st;
+
+	return (stat(filename, &st) == 0) ? (size_t) st.st_size : 0;
+}
+
+/** whole content of a file, NULL if it cannot be read */
+static char *read_file(const char *filename, size_t *len)
+{
+	FILE *f = fopen(filename, "r");
+	char *data;
+
+	if (f == NULL)
+		return NULL;
+	*len = file_size(filename);
+	data = malloc(*len + 1);
+	if (fread(data, 1, *len, f) != *len)
+	{
+		free(data);
+		data = NULL;
+	}
+	else
+	{
+		data[*len] = 0;
+	}
+	fclose(f);
+	return data;
+}
+
+/** CSV of a binary log file, NULL if it cannot be converted */
+static char *convert_file(const char *filename, size_t *len, long *rows, int names)
+{
+	FILE *in, *out;
+	char *data = NULL;
+
+	if ((in = fopen(filename, "r")) == NULL)
+		return NULL;
+	out = open_memstream(&data, len);
+	*rows = _muacc_log_convert(in, out, names);
+	fclose(out);
+	fclose(in);
+
+	if (*rows < 0)
+	{
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+/** row r of the test - some of them with missing values, a value of the wrong type,
+ *  strings that are cut or empty, or values left out at the end
+ */
+static void write_row(muacc_log_t *log, unsigned int r)
+{
+	struct timeval tv = { 1500000000 + r, (r * 37) % 1000000 };
+	char name[32], note[32];
+
+	if (r % 13 == 0)
+		_muacc_log_na(log);
+	else
+		_muacc_log_timeval(log, &tv);
+
+	if (r % 5 == 0)
+		_muacc_log_na(log);
+	else if (r == 17)
+		_muacc_log_double(log, 1.5);
+	else
+		_muacc_log_int(log, (int64_t) r * 1000003 - 5000000);
+
+	_muacc_log_double(log, r * 0.25 - 3);
+
+	snprintf(name, sizeof(name), "host%u.example.org", r);
+	if (r % 7 == 0)
+		_muacc_log_string(log, NULL);
+	else if (r % 11 == 0)
+		_muacc_log_string(log, long_string);
+	else if (r % 19 == 0)
+		_muacc_log_string(log, "");
+	else
+		_muacc_log_string(log, name);
+
+	if (r % 3 != 0)
+	{
+		snprintf(note, sizeof(note), "n%u", r);
+		_muacc_log_string(log, note);
+	}
+
+	CHECK(_muacc_log_row_end(log) == 0);
+}
+
+/** write rows first to last to both logs */
+static void write_rows(muacc_log_t *csv, muacc_log_t *bin, unsigned int first, unsigned int last)
+{
+	unsigned int r;
+
+	for (r = first; r < last; r++)
+	{
+		write_row(csv, r);
+		write_row(bin, r);
+	}
+}
+
+static void test_csv_binary()
+{
+	muacc_log_t *csv, *bin;
+	char *expected, *converted, cut[MUACC_LOG_STRING_MAX + 2];
+	size_t expected_len = 0, converted_len = 0;
+	long rows = 0;
+
+	CHECK((csv = _muacc_log_open(path("rows.csv", 0), MUACC_LOG_CSV, columns, N_COLUMNS, 0)) != NULL);
+	CHECK((bin = _muacc_log_open(path("rows.log", 0), MUACC_LOG_BINARY, columns, N_COLUMNS, 0)) != NULL);
+	if (csv == NULL || bin == NULL)
+		return;
+
+	/* a partial block in the middle, more than a block, and the rest of a block when closing */
+	write_rows(csv, bin, 0, 100);
+	CHECK(_muacc_log_flush(bin) == 0);
+	write_rows(csv, bin, 100, TEST_ROWS / 2);
+	_muacc_log_close(csv);
+	_muacc_log_close(bin);
+
+	/* logs are appended to when they are opened again */
+	CHECK((csv = _muacc_log_open(path("rows.csv", 0), MUACC_LOG_CSV, columns, N_COLUMNS, 0)) != NULL);
+	CHECK((bin = _muacc_log_open(path("rows.log", 0), MUACC_LOG_BINARY, columns, N_COLUMNS, 0)) != NULL);
+	write_rows(csv, bin, TEST_ROWS / 2, TEST_ROWS);
+	_muacc_log_close(csv);
+	_muacc_log_close(bin);
+
+	expected = read_file(path("rows.csv", 0), &expected_len);
+	converted = convert_file(path("rows.log", 0), &converted_len, &rows, 0);
+	CHECK(expected != NULL && converted != NULL);
+	CHECK(rows == TEST_ROWS);
+	CHECK(converted_len == expected_len);
+	CHECK(expected != NULL && converted != NULL && memcmp(expected, converted, expected_len) == 0);
+
+	/* long strings are cut */
+	memcpy(cut, long_string, MUACC_LOG_STRING_MAX);
+	cut[MUACC_LOG_STRING_MAX] = ',';
+	cut[MUACC_LOG_STRING_MAX + 1] = 0;
+	CHECK(expected != NULL && strstr(expected, cut) != NULL);
+	cut[MUACC_LOG_STRING_MAX] = long_string[MUACC_LOG_STRING_MAX];
+	CHECK(expected != NULL && strstr(expected, cut) == NULL);
+
+	/* missing values in the first and the last column */
+	CHECK(expected != NULL && strncmp(expected, "NA,NA,-3.000000,NA,NA\n", strlen("NA,NA,-3.000000,NA,NA\n")) == 0);
+	CHECK(expected != NULL && strstr(expected, "1500000001.37,-3999997,-2.750000,host1.example.org,n1\n") == expected + strlen("NA,NA,-3.000000,NA,NA\n"));
+
+	free(expected);
+	free(converted);
+
+	/* with the names of the columns first */
+	converted = convert_file(path("rows.log", 0), &converted_len, &rows, 1);
+	CHECK(rows == TEST_ROWS && converted != NULL && strncmp(converted, "time,id,rate,name,note\n", strlen("time,id,rate,name,note\n")) == 0);
+	free(converted);
+
+	/* a binary log with other columns is rotated away */
+	CHECK((bin = _muacc_log_open(path("rows.log", 0), MUACC_LOG_BINARY, columns, N_COLUMNS - 1, 0)) != NULL);
+	_muacc_log_close(bin);
+	CHECK(exists(path("rows.log", 1)));
+	converted = convert_file(path("rows.log", 1), &converted_len, &rows, 0);
+	CHECK(rows == TEST_ROWS);
+	free(converted);
+	converted = convert_file(path("rows.log", 0), &converted_len, &rows, 0);
+	CHECK(rows == 0);
+	free(converted);
+
+	/* neither of them is a binary log */
+	CHECK(convert_file(path("rows.csv", 0), &converted_len, &rows, 0) == NULL && rows == -1);
+
+	unlink(path("rows.csv", 0));
+	unlink(path("rows.log", 0));
+	unlink(path("rows.log", 1));
+}
+
+/** the content of name.n, ..., name.1, name, one after the other - binary logs converted to CSV */
+static char *read_rotated(const char *name, int n, int binary, size_t *len, long *rows)
+{
+	char *all = NULL, *data;
+	size_t all_len = 0, data_len;
+	long data_rows = 0;
+	int i;
+
+	*rows = 0;
+	for (i = n; i >= 0; i--)
+	{
+		if (binary)
+			data = convert_file(path(name, i), &data_len, &data_rows, 0);
+		else
+			data = read_file(path(name, i), &data_len);
+		if (data == NULL)
+		{
+			fprintf(stderr, "%s cannot be read\n", path(name, i));
+			test_failed++;
+			continue;
+		}
+		all = realloc(all, all_len + data_len + 1);
+		memcpy(all + all_len, data, data_len);
+		all_len += data_len;
+		all[all_len] = 0;
+		*rows += data_rows;
+		free(data);
+	}
+	*len = all_len;
+	return all;
+}
+
+static void test_rotation()
+{
+	muacc_log_t *ref, *csv, *bin;
+	char *expected, *rotated;
+	size_t expected_len, rotated_len, rotate_size = 4096;
+	long rows;
+	int i;
+
+	CHECK((ref = _muacc_log_open(path("ref.csv", 0), MUACC_LOG_CSV, columns, N_COLUMNS, 0)) != NULL);
+	CHECK((csv = _muacc_log_open(path("rot.csv", 0), MUACC_LOG_CSV, columns, N_COLUMNS, rotate_size)) != NULL);
+	CHECK((bin = _muacc_log_open(path("rot.log", 0), MUACC_LOG_BINARY, columns, N_COLUMNS, rotate_size)) != NULL);
+	if (ref == NULL || csv == NULL || bin == NULL)
+		return;
+
+	/* not rotated before a file is large enough */
+	write_rows(ref, csv, 0, 10);
+	CHECK(!exists(path("rot.csv", 1)));
+	for (i = 0; i < 10; i++)
+		write_row(bin, i);
+	CHECK(!exists(path("rot.log", 1)));
+
+	/* a binary log grows by blocks, so each block starts a new file here */
+	write_rows(ref, csv, 10, TEST_ROWS);
+	for (i = 10; i < TEST_ROWS; i++)
+		write_row(bin, i);
+	_muacc_log_close(ref);
+	_muacc_log_close(csv);
+	_muacc_log_close(bin);
+
+	expected = read_file(path("ref.csv", 0), &expected_len);
+	CHECK(expected != NULL && expected_len > (MUACC_LOG_KEEP + 1) * rotate_size);
+
+	/* CSV: rotated at the end of a row once larger than rotate_size, only MUACC_LOG_KEEP files kept */
+	CHECK(exists(path("rot.csv", 1)));
+	CHECK(exists(path("rot.csv", MUACC_LOG_KEEP)));
+	CHECK(!exists(path("rot.csv", MUACC_LOG_KEEP + 1)));
+	for (i = 1; i <= MUACC_LOG_KEEP; i++)
+		CHECK(file_size(path("rot.csv", i)) >= rotate_size && file_size(path("rot.csv", i)) < rotate_size + 1024);
+	rotated = read_rotated("rot.csv", MUACC_LOG_KEEP, 0, &rotated_len, &rows);
+	CHECK(expected != NULL && rotated != NULL && rotated_len < expected_len);
+	CHECK(expected != NULL && rotated != NULL && memcmp(expected + expected_len - rotated_len, rotated, rotated_len) == 0);
+	CHECK(rotated != NULL && (rotated_len == expected_len || expected[expected_len - rotated_len - 1] == '\n'));
+	free(rotated);
+
+	/* binary: one file per block, each with its header, the last one with the rows left */
+	CHECK(exists(path("rot.log", 3)));
+	CHECK(!exists(path("rot.log", 4)));
+	rotated = read_rotated("rot.log", 3, 1, &rotated_len, &rows);
+	CHECK(rows == TEST_ROWS);
+	CHECK(rotated != NULL && rotated_len == expected_len && memcmp(expected, rotated, expected_len) == 0);
+	free(rotated);
+	free(expected);
+
+	unlink(path("ref.csv", 0));
+	for (i = 0; i <= MUACC_LOG_KEEP; i++)
+	{
+		unlink(path("rot.csv", i));
+		unlink(path("rot.log", i));
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	for (i = 0; i < TEST_LONG_STRING; i++)
+		long_string[i] = 'a' + i % 26;
+
+	if (mkdtemp(dir) == NULL)
+	{
+		perror("mkdtemp");
+		return 1;
+	}
+
+	test_csv_binary();
+	test_rotation();
+
+	rmdir(dir);
+
+	return test_report();
+}
@@ -0,0 +1,379 @@
+/** \file test_lpm.c
+ *  \brief Test for the longest prefix match index of MAM
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Builds indices (see mam_lpm.h) from prefix lists the way MAM has them - interface
+ *	addresses with their netmasks - and checks that lookups return the most specific
+ *	prefix, for hand-picked cases and against a linear scan over random prefixes.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "mam/mam.h"
+#include "mam/mam_lpm.h"
+
+#include "test_util.h"
+
+#define TEST_RANDOM_PREFIXES 200
+#define TEST_RANDOM_LOOKUPS 5000
+
+/** fill a sockaddr of the family of a textual address, return its length */
+static socklen_t make_sockaddr(struct sockaddr_storage *ss, int family, const char *addr)
+{
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+	if (family == AF_INET)
+	{
+		inet_pton(AF_INET, addr, &(((struct sockaddr_in *) ss)->sin_addr));
+		return sizeof(struct sockaddr_in);
+	}
+	inet_pton(AF_INET6, addr, &(((struct sockaddr_in6 *) ss)->sin6_addr));
+	return sizeof(struct sockaddr_in6);
+}
+
+/** bytes of the address of a sockaddr, NULL if neither IPv4 nor IPv6 */
+static unsigned char *addr_bytes(struct sockaddr *sa, size_t *len)
+{
+	if (sa->sa_family == AF_INET)
+	{
+		*len = 4;
+		return (unsigned char *) &(((struct sockaddr_in *) sa)->sin_addr);
+	}
+	if (sa->sa_family == AF_INET6)
+	{
+		*len = 16;
+		return (unsigned char *) &(((struct sockaddr_in6 *) sa)->sin6_addr);
+	}
+	return NULL;
+}
+
+/** create a prefix with one interface address and the netmask for plen */
+static struct src_prefix_list *make_prefix_sa(const struct sockaddr *addr, socklen_t addr_len, unsigned int plen)
+{
+	struct src_prefix_list *pfx = calloc(1, sizeof(struct src_prefix_list));
+	struct sockaddr_storage mask;
+	unsigned char *bytes;
+	size_t len, i;
+
+	pfx->family = addr->sa_family;
+	pfx->if_addrs = calloc(1, sizeof(struct sockaddr_list));
+	pfx->if_addrs->addr = malloc(addr_len);
+	memcpy(pfx->if_addrs->addr, addr, addr_len);
+	pfx->if_addrs->addr_len = addr_len;
+
+	memset(&mask, 0, sizeof(mask));
+	mask.ss_family = addr->sa_family;
+	bytes = addr_bytes((struct sockaddr *) &mask, &len);
+	for (i = 0; i < len; i++)
+		bytes[i] = (plen >= 8 * (i + 1)) ? 0xff : (plen > 8 * i) ? (0xff << (8 - (plen - 8 * i))) & 0xff : 0;
+	pfx->if_netmask = malloc(addr_len);
+	memcpy(pfx->if_netmask, &mask, addr_len);
+	pfx->if_netmask_len = addr_len;
+
+	return pfx;
+}
+
+static struct src_prefix_list *make_prefix(int family, const char *addr, unsigned int plen)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = make_sockaddr(&ss, family, addr);
+
+	return make_prefix_sa((struct sockaddr *) &ss, len, plen);
+}
+
+static void free_prefix(gpointer data, gpointer user_data)
+{
+	struct src_prefix_list *pfx = data;
+
+	free(pfx->if_addrs->addr);
+	free(pfx->if_addrs);
+	free(pfx->if_netmask);
+	free(pfx);
+}
+
+static void free_prefixes(GSList *prefixes)
+{
+	g_slist_foreach(prefixes, &free_prefix, NULL);
+	g_slist_free(prefixes);
+}
+
+static struct src_prefix_list *lookup(const mam_lpm_t *lpm, int family, const char *addr)
+{
+	struct sockaddr_storage ss;
+
+	make_sockaddr(&ss, family, addr);
+	return mam_lpm_lookup(lpm, (struct sockaddr *) &ss);
+}
+
+/** longest prefix match by comparing the address with every prefix - the first one wins a tie */
+static struct src_prefix_list *lookup_linear(GSList *prefixes, struct sockaddr *addr)
+{
+	struct src_prefix_list *pfx, *best = NULL;
+	unsigned char *a, *p, *m;
+	size_t len, i;
+	int plen, best_plen = -1, match;
+	GSList *l;
+
+	for (l = prefixes; l != NULL; l = l->next)
+	{
+		pfx = l->data;
+		if (pfx->if_addrs->addr->sa_family != addr->sa_family)
+			continue;
+		a = addr_bytes(addr, &len);
+		p = addr_bytes(pfx->if_addrs->addr, &len);
+		m = addr_bytes(pfx->if_netmask, &len);
+
+		match = 1;
+		plen = 0;
+		for (i = 0; i < len; i++)
+		{
+			if ((a[i] & m[i]) != (p[i] & m[i]))
+				match = 0;
+			plen += __builtin_popcount(m[i]);
+		}
+		if (match && plen > best_plen)
+		{
+			best = pfx;
+			best_plen = plen;
+		}
+	}
+	return best;
+}
+
+static void test_nested()
+{
+	struct src_prefix_list *p8, *p16, *p24;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+
+	/* interface addresses, not networks, and the most specific prefix first */
+	prefixes = g_slist_append(prefixes, p24 = make_prefix(AF_INET, "10.1.2.77", 24));
+	prefixes = g_slist_append(prefixes, p8 = make_prefix(AF_INET, "10.200.0.1", 8));
+	prefixes = g_slist_append(prefixes, p16 = make_prefix(AF_INET, "10.1.99.1", 16));
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lpm != NULL);
+
+	CHECK(lookup(lpm, AF_INET, "10.1.2.0") == p24);
+	CHECK(lookup(lpm, AF_INET, "10.1.2.77") == p24);
+	CHECK(lookup(lpm, AF_INET, "10.1.2.255") == p24);
+	CHECK(lookup(lpm, AF_INET, "10.1.3.1") == p16);
+	CHECK(lookup(lpm, AF_INET, "10.1.255.255") == p16);
+	CHECK(lookup(lpm, AF_INET, "10.0.0.0") == p8);
+	CHECK(lookup(lpm, AF_INET, "10.2.2.2") == p8);
+	CHECK(lookup(lpm, AF_INET, "10.255.255.255") == p8);
+	CHECK(lookup(lpm, AF_INET, "9.255.255.255") == NULL);
+	CHECK(lookup(lpm, AF_INET, "11.0.0.0") == NULL);
+	CHECK(lookup(lpm, AF_INET, "192.168.1.1") == NULL);
+
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+}
+
+static void test_duplicates()
+{
+	struct src_prefix_list *a, *b, *c, *d;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+
+	/* link local prefixes of two interfaces */
+	prefixes = g_slist_append(prefixes, a = make_prefix(AF_INET6, "fe80::1", 64));
+	prefixes = g_slist_append(prefixes, b = make_prefix(AF_INET6, "fe80::2", 64));
+	prefixes = g_slist_append(prefixes, c = make_prefix(AF_INET, "169.254.1.1", 16));
+	prefixes = g_slist_append(prefixes, d = make_prefix(AF_INET, "169.254.2.2", 16));
+	lpm = mam_lpm_build(prefixes);
+
+	CHECK(lookup(lpm, AF_INET6, "fe80::2") == a);
+	CHECK(lookup(lpm, AF_INET6, "fe80::1234:5678") == a);
+	CHECK(lookup(lpm, AF_INET, "169.254.2.2") == c);
+	mam_lpm_free(lpm);
+
+	/* the other way round */
+	prefixes = g_slist_reverse(prefixes);
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lookup(lpm, AF_INET6, "fe80::1") == b);
+	CHECK(lookup(lpm, AF_INET, "169.254.1.1") == d);
+	mam_lpm_free(lpm);
+
+	/* a duplicate of a prefix that is only a branching point so far */
+	free_prefixes(prefixes);
+	prefixes = NULL;
+	prefixes = g_slist_append(prefixes, a = make_prefix(AF_INET, "10.0.1.1", 24));
+	prefixes = g_slist_append(prefixes, b = make_prefix(AF_INET, "10.0.2.1", 24));
+	prefixes = g_slist_append(prefixes, c = make_prefix(AF_INET, "10.0.0.1", 22));
+	prefixes = g_slist_append(prefixes, d = make_prefix(AF_INET, "10.0.3.1", 22));
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lookup(lpm, AF_INET, "10.0.1.9") == a);
+	CHECK(lookup(lpm, AF_INET, "10.0.2.9") == b);
+	CHECK(lookup(lpm, AF_INET, "10.0.3.9") == c);
+	CHECK(lookup(lpm, AF_INET, "10.0.4.9") == NULL);
+
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+}
+
+static void test_default_route()
+{
+	struct src_prefix_list *def4, *def6, *p16, *p32;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+
+	prefixes = g_slist_append(prefixes, p16 = make_prefix(AF_INET, "192.168.3.4", 16));
+	prefixes = g_slist_append(prefixes, def4 = make_prefix(AF_INET, "192.168.3.4", 0));
+	prefixes = g_slist_append(prefixes, def6 = make_prefix(AF_INET6, "2001:db8::1", 0));
+	prefixes = g_slist_append(prefixes, p32 = make_prefix(AF_INET6, "2001:db8::1", 32));
+	lpm = mam_lpm_build(prefixes);
+
+	CHECK(lookup(lpm, AF_INET, "192.168.200.1") == p16);
+	CHECK(lookup(lpm, AF_INET, "0.0.0.0") == def4);
+	CHECK(lookup(lpm, AF_INET, "8.8.8.8") == def4);
+	CHECK(lookup(lpm, AF_INET, "255.255.255.255") == def4);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:ffff::1") == p32);
+	CHECK(lookup(lpm, AF_INET6, "::") == def6);
+	CHECK(lookup(lpm, AF_INET6, "2001:db9::1") == def6);
+	CHECK(lookup(lpm, AF_INET6, "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff") == def6);
+
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+}
+
+static void test_host_routes()
+{
+	struct src_prefix_list *h4, *n4, *h6, *n64, *n48, *n127;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+
+	prefixes = g_slist_append(prefixes, n4 = make_prefix(AF_INET, "192.0.2.1", 24));
+	prefixes = g_slist_append(prefixes, h4 = make_prefix(AF_INET, "192.0.2.1", 32));
+	prefixes = g_slist_append(prefixes, h6 = make_prefix(AF_INET6, "2001:db8:1:2::1", 128));
+	prefixes = g_slist_append(prefixes, n48 = make_prefix(AF_INET6, "2001:db8:1::1", 48));
+	prefixes = g_slist_append(prefixes, n64 = make_prefix(AF_INET6, "2001:db8:1:2::1", 64));
+	prefixes = g_slist_append(prefixes, n127 = make_prefix(AF_INET6, "2001:db8:1:2::1", 127));
+	lpm = mam_lpm_build(prefixes);
+
+	CHECK(lookup(lpm, AF_INET, "192.0.2.1") == h4);
+	CHECK(lookup(lpm, AF_INET, "192.0.2.0") == n4);
+	CHECK(lookup(lpm, AF_INET, "192.0.2.2") == n4);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:1:2::1") == h6);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:1:2::") == n127);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:1:2::2") == n64);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:1:2:8000::1") == n64);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:1:3::1") == n48);
+	CHECK(lookup(lpm, AF_INET6, "2001:db8:2::1") == NULL);
+
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+}
+
+static void test_families()
+{
+	struct src_prefix_list *def4, *def6, *p8;
+	struct sockaddr_un sun;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+
+	/* no IPv6 prefix - IPv6 addresses do not fall into the IPv4 default route */
+	prefixes = g_slist_append(prefixes, def4 = make_prefix(AF_INET, "0.0.0.0", 0));
+	prefixes = g_slist_append(prefixes, p8 = make_prefix(AF_INET, "10.0.0.1", 8));
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lookup(lpm, AF_INET, "10.0.0.1") == p8);
+	CHECK(lookup(lpm, AF_INET6, "::") == NULL);
+	CHECK(lookup(lpm, AF_INET6, "::ffff:10.0.0.1") == NULL);
+	CHECK(lookup(lpm, AF_INET6, "a00:1::") == NULL);
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+
+	/* and the other way round */
+	prefixes = NULL;
+	prefixes = g_slist_append(prefixes, def6 = make_prefix(AF_INET6, "::", 0));
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lookup(lpm, AF_INET6, "::ffff:10.0.0.1") == def6);
+	CHECK(lookup(lpm, AF_INET, "10.0.0.1") == NULL);
+	CHECK(lookup(lpm, AF_INET, "0.0.0.0") == NULL);
+
+	/* addresses of other families are in no prefix */
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	CHECK(mam_lpm_lookup(lpm, (struct sockaddr *) &sun) == NULL);
+	CHECK(mam_lpm_lookup(lpm, NULL) == NULL);
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+
+	/* no prefixes at all */
+	lpm = mam_lpm_build(NULL);
+	CHECK(lpm != NULL);
+	CHECK(lookup(lpm, AF_INET, "10.0.0.1") == NULL);
+	CHECK(lookup(lpm, AF_INET6, "::1") == NULL);
+	mam_lpm_free(lpm);
+	CHECK(lookup(NULL, AF_INET, "10.0.0.1") == NULL);
+}
+
+/** random addresses near each other, so that prefixes nest and share bits */
+static void random_address(struct sockaddr_storage *ss, int family)
+{
+	unsigned char *bytes;
+	size_t len, i;
+
+	memset(ss, 0, sizeof(struct sockaddr_storage));
+	ss->ss_family = family;
+	bytes = addr_bytes((struct sockaddr *) ss, &len);
+	bytes[0] = 10;
+	for (i = 1; i < len; i++)
+		bytes[i] = (i < len - 2) ? rand() % 4 : rand() % 256;
+}
+
+static void test_random(int family)
+{
+	struct sockaddr_storage ss;
+	GSList *prefixes = NULL;
+	mam_lpm_t *lpm;
+	unsigned int bits = (family == AF_INET) ? 32 : 128;
+	int i, mismatches = 0;
+
+	for (i = 0; i < TEST_RANDOM_PREFIXES; i++)
+	{
+		random_address(&ss, family);
+		prefixes = g_slist_append(prefixes, make_prefix_sa((struct sockaddr *) &ss, (family == AF_INET) ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6), rand() % (bits + 1)));
+	}
+	lpm = mam_lpm_build(prefixes);
+	CHECK(lpm != NULL);
+
+	for (i = 0; i < TEST_RANDOM_LOOKUPS; i++)
+	{
+		random_address(&ss, family);
+		if (mam_lpm_lookup(lpm, (struct sockaddr *) &ss) != lookup_linear(prefixes, (struct sockaddr *) &ss))
+			mismatches++;
+	}
+	CHECK(mismatches == 0);
+
+	mam_lpm_free(lpm);
+	free_prefixes(prefixes);
+}
+
+int main(int argc, char *argv[])
+{
+	srand(4711);
+
+	test_nested();
+	test_duplicates();
+	test_default_route();
+	test_host_routes();
+	test_families();
+	test_random(AF_INET);
+	test_random(AF_INET6);
+
+	return test_report();
+}
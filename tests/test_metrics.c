@@ -0,0 +1,169 @@
+/** \file test_metrics.c
+ *  \brief Test for the snapshots of the measurements MAM publishes in shared memory
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Takes snapshots of a segment (see muacc_metrics.h) while a writer thread keeps
+ *	updating all of its records to the same value and checks that no snapshot mixes
+ *	two updates. Checks that snapshots fail during an update that does not end and
+ *	that the counts of records are clamped to the arrays.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "muacc_metrics.h"
+
+#include "test_util.h"
+
+#define TEST_SNAPSHOTS 20000
+
+static struct muacc_metrics_shm shm;
+static int writer_done;
+
+/** set all records of the segment to value v */
+static void write_records(struct muacc_metrics_shm *m, uint64_t v)
+{
+	int i;
+
+	m->n_prefixes = v % MUACC_METRICS_MAX_PREFIXES;
+	m->n_ifaces = v % MUACC_METRICS_MAX_IFACES;
+	m->updated_sec = v;
+	m->updated_usec = v;
+	for (i = 0; i < MUACC_METRICS_MAX_PREFIXES; i++)
+	{
+		m->prefixes[i].srtt_mean = v;
+		m->prefixes[i].srtt_median = v;
+		m->prefixes[i].rx_errors = v;
+		m->prefixes[i].tx_errors = v;
+	}
+	for (i = 0; i < MUACC_METRICS_MAX_IFACES; i++)
+	{
+		m->ifaces[i].download_rate = v;
+		m->ifaces[i].upload_rate = v;
+		m->ifaces[i].timestamp_sec = v;
+	}
+}
+
+/** check that all records of a snapshot have the same value
+ *
+ *  \return 1 if they have, 0 otherwise
+ */
+static int consistent(const struct muacc_metrics_shm *m)
+{
+	uint64_t v = m->updated_sec;
+	int i;
+
+	if (m->updated_usec != v || m->n_prefixes != v % MUACC_METRICS_MAX_PREFIXES || m->n_ifaces != v % MUACC_METRICS_MAX_IFACES)
+		return 0;
+	for (i = 0; i < MUACC_METRICS_MAX_PREFIXES; i++)
+	{
+		if (m->prefixes[i].srtt_mean != v || m->prefixes[i].srtt_median != v
+			|| m->prefixes[i].rx_errors != v || m->prefixes[i].tx_errors != v)
+			return 0;
+	}
+	for (i = 0; i < MUACC_METRICS_MAX_IFACES; i++)
+	{
+		if (m->ifaces[i].download_rate != v || m->ifaces[i].upload_rate != v || m->ifaces[i].timestamp_sec != v)
+			return 0;
+	}
+	return 1;
+}
+
+static void *writer(void *arg)
+{
+	uint64_t v = 1;
+
+	while (!__atomic_load_n(&writer_done, __ATOMIC_ACQUIRE))
+	{
+		_muacc_metrics_write_begin(&shm);
+		write_records(&shm, v++);
+		_muacc_metrics_write_end(&shm);
+		/* leave the readers a window between updates on a single CPU */
+		if (v % 4 == 0)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void test_single()
+{
+	static struct muacc_metrics_shm snap;
+
+	memset(&shm, 0, sizeof(shm));
+	shm.magic = MUACC_METRICS_MAGIC;
+	shm.version = MUACC_METRICS_VERSION;
+
+	_muacc_metrics_write_begin(&shm);
+	CHECK(shm.seq == 1);
+	write_records(&shm, 42);
+	CHECK(muacc_metrics_snapshot(&shm, &snap) == -1);
+	_muacc_metrics_write_end(&shm);
+	CHECK(shm.seq == 2);
+
+	CHECK(muacc_metrics_snapshot(&shm, &snap) == 0);
+	CHECK(memcmp(&snap, &shm, sizeof(shm)) == 0);
+	CHECK(consistent(&snap) && snap.updated_sec == 42);
+
+	/* counts beyond the arrays are clamped */
+	_muacc_metrics_write_begin(&shm);
+	shm.n_prefixes = MUACC_METRICS_MAX_PREFIXES + 1;
+	shm.n_ifaces = UINT32_MAX;
+	_muacc_metrics_write_end(&shm);
+	CHECK(muacc_metrics_snapshot(&shm, &snap) == 0);
+	CHECK(snap.n_prefixes == MUACC_METRICS_MAX_PREFIXES && snap.n_ifaces == MUACC_METRICS_MAX_IFACES);
+	CHECK(shm.n_prefixes == MUACC_METRICS_MAX_PREFIXES + 1);
+}
+
+static void test_concurrent()
+{
+	static struct muacc_metrics_shm snap;
+	pthread_t thread;
+	int i, ok = 0, torn = 0;
+
+	memset(&shm, 0, sizeof(shm));
+	writer_done = 0;
+	CHECK(pthread_create(&thread, NULL, &writer, NULL) == 0);
+
+	for (i = 0; i < TEST_SNAPSHOTS; i++)
+	{
+		/* let the writer go on on a single CPU as well */
+		if (i % 16 == 0)
+			sched_yield();
+		if (muacc_metrics_snapshot(&shm, &snap) != 0)
+			continue;
+		ok++;
+		if (!consistent(&snap))
+			torn++;
+	}
+
+	__atomic_store_n(&writer_done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	CHECK(ok > 0);
+	if (torn > 0)
+	{
+		fprintf(stderr, "%d of %d snapshots mix two updates\n", torn, ok);
+		test_failed++;
+	}
+
+	/* once the writer is done, snapshots succeed again */
+	CHECK(muacc_metrics_snapshot(&shm, &snap) == 0 && consistent(&snap) && (shm.seq & 1) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	test_single();
+	test_concurrent();
+
+	return test_report();
+}
@@ -0,0 +1,405 @@
+/** \file test_pmeasure.c
+ *  \brief Test for the parts of the passive measurements of MAM that need no kernel
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Compiles the inet_diag bytecode for random prefix sets and runs it on random
+ *	addresses the way the kernel does (only the S_COND and JMP ops pmeasure uses),
+ *	checking it accepts exactly the addresses within one of the prefixes.
+ *	Checks the percentiles of the RTTs of a round against a sorted copy of them.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+
+#include <glib.h>
+
+#include "mam/mam.h"
+#include "mam/mam_pmeasure.h"
+
+#include "test_util.h"
+
+#define TEST_MAX_PREFIXES 32
+#define TEST_RANDOM_SETS 50
+#define TEST_RANDOM_LOOKUPS 2000
+#define TEST_BC_LEN 4096
+#define TEST_MAX_RTTS 1001
+
+/** a prefix as MAM has it, with storage for its address and netmask */
+struct test_prefix {
+	struct src_prefix_list pfx;
+	struct sockaddr_list addr;
+	struct sockaddr_storage addr_ss;
+	struct sockaddr_storage mask_ss;
+};
+
+static struct test_prefix prefixes[TEST_MAX_PREFIXES];
+
+static int addr_len(int af)
+{
+	return (af == AF_INET) ? sizeof(struct in_addr) : sizeof(struct in6_addr);
+}
+
+static unsigned char *addr_bytes(struct sockaddr_storage *ss)
+{
+	if (ss->ss_family == AF_INET)
+		return (unsigned char *) &(((struct sockaddr_in *) ss)->sin_addr);
+	return (unsigned char *) &(((struct sockaddr_in6 *) ss)->sin6_addr);
+}
+
+/** set up prefix i with the address bytes and a netmask of plen bits */
+static struct src_prefix_list *make_prefix(int i, int af, const unsigned char *addr, int plen)
+{
+	struct test_prefix *p = &(prefixes[i]);
+	unsigned char *mask;
+	int b;
+
+	memset(p, 0, sizeof(struct test_prefix));
+	p->addr_ss.ss_family = af;
+	p->mask_ss.ss_family = af;
+	memcpy(addr_bytes(&(p->addr_ss)), addr, addr_len(af));
+	mask = addr_bytes(&(p->mask_ss));
+	for (b = 0; b < plen; b++)
+		mask[b / 8] |= 0x80 >> (b % 8);
+
+	p->addr.addr = (struct sockaddr *) &(p->addr_ss);
+	p->pfx.family = af;
+	p->pfx.if_addrs = &(p->addr);
+	p->pfx.if_netmask = (struct sockaddr *) &(p->mask_ss);
+	return &(p->pfx);
+}
+
+/** whether addr is within prefix i - a linear reference to check the bytecode against */
+static int in_prefix(int i, int af, const unsigned char *addr)
+{
+	struct test_prefix *p = &(prefixes[i]);
+	const unsigned char *pa = addr_bytes(&(p->addr_ss));
+	const unsigned char *mask = addr_bytes(&(p->mask_ss));
+	int j;
+
+	if (p->pfx.family != af || p->pfx.if_addrs == NULL)
+		return 0;
+	for (j = 0; j < addr_len(af); j++)
+		if ((pa[j] & mask[j]) != (addr[j] & mask[j]))
+			return 0;
+	return 1;
+}
+
+/** check the structure of the bytecode like the kernel does before it runs it (inet_diag_bc_audit)
+ *
+ *  \return 0 if it is valid, -1 otherwise
+ */
+static int audit_bytecode(const unsigned char *bc, int len, int af)
+{
+	const struct inet_diag_bc_op *op;
+	const struct inet_diag_hostcond *cond;
+	char starts[TEST_BC_LEN + 1];
+	int pos, target;
+
+	memset(starts, 0, sizeof(starts));
+	for (pos = 0; pos < len; pos += op->yes)
+	{
+		op = (const struct inet_diag_bc_op *) (bc + pos);
+		starts[pos] = 1;
+		switch (op->code)
+		{
+			case INET_DIAG_BC_S_COND:
+				cond = (const struct inet_diag_hostcond *) (op + 1);
+				if (op->yes != sizeof(*op) + sizeof(*cond) + addr_len(af)
+					|| cond->family != af || cond->prefix_len > 8 * addr_len(af) || cond->port != -1)
+					return -1;
+				break;
+			case INET_DIAG_BC_JMP:
+				if (op->yes != sizeof(*op))
+					return -1;
+				break;
+			default:
+				return -1;
+		}
+		if (pos + op->yes > len || op->no < sizeof(*op) || op->no % 4 != 0 || pos + op->no > len + 4)
+			return -1;
+	}
+	starts[len] = 1;
+
+	/* every jump ends at an op, at the end (accept) or just past it (reject) */
+	for (pos = 0; pos < len; pos += op->yes)
+	{
+		op = (const struct inet_diag_bc_op *) (bc + pos);
+		target = pos + op->no;
+		if (target != len + 4 && !starts[target])
+			return -1;
+	}
+	return 0;
+}
+
+/** run the bytecode on a socket bound to addr like the kernel does (inet_diag_bc_run)
+ *
+ *  \return 1 if the socket is accepted, 0 if not
+ */
+static int run_bytecode(const unsigned char *bc, int len, int af, const unsigned char *addr)
+{
+	const struct inet_diag_bc_op *op;
+	const struct inet_diag_hostcond *cond;
+	const unsigned char *ca;
+	int pos = 0, yes, b;
+
+	while (pos < len)
+	{
+		op = (const struct inet_diag_bc_op *) (bc + pos);
+		yes = 0;
+		if (op->code == INET_DIAG_BC_S_COND)
+		{
+			cond = (const struct inet_diag_hostcond *) (op + 1);
+			ca = (const unsigned char *) cond->addr;
+			yes = (cond->family == af);
+			for (b = 0; yes && b < cond->prefix_len; b++)
+				if (((ca[b / 8] ^ addr[b / 8]) & (0x80 >> (b % 8))) != 0)
+					yes = 0;
+		}
+		pos += yes ? op->yes : op->no;
+	}
+	return pos == len;
+}
+
+static void random_addr(int af, unsigned char *addr)
+{
+	int j;
+
+	for (j = 0; j < addr_len(af); j++)
+		addr[j] = rand();
+}
+
+/** address within prefix i with random host bits */
+static void random_addr_in(int i, int af, unsigned char *addr)
+{
+	const unsigned char *pa = addr_bytes(&(prefixes[i].addr_ss));
+	const unsigned char *mask = addr_bytes(&(prefixes[i].mask_ss));
+	int j;
+
+	random_addr(af, addr);
+	for (j = 0; j < addr_len(af); j++)
+		addr[j] = (pa[j] & mask[j]) | (addr[j] & ~mask[j]);
+}
+
+/** build the bytecode for the first n prefixes and check it against in_prefix on random addresses */
+static void check_bytecode(int n, int af, const char *what)
+{
+	GHashTable *buckets = g_hash_table_new(g_direct_hash, g_direct_equal);
+	unsigned char bc[TEST_BC_LEN];
+	unsigned char addr[sizeof(struct in6_addr)];
+	int i, j, len, any = 0, expect, wrong = 0;
+
+	for (i = 0; i < n; i++)
+	{
+		g_hash_table_insert(buckets, &(prefixes[i].pfx), &(prefixes[i]));
+		if (prefixes[i].pfx.family == af && prefixes[i].pfx.if_addrs != NULL)
+			any = 1;
+	}
+
+	len = pmeasure_build_bytecode(buckets, af, bc, sizeof(bc));
+	if (!any)
+	{
+		CHECK(len == 0);
+		g_hash_table_destroy(buckets);
+		return;
+	}
+	CHECK(len > 0);
+	if (len <= 0 || audit_bytecode(bc, len, af) != 0)
+	{
+		fprintf(stderr, "%s: invalid bytecode of %d bytes\n", what, len);
+		test_failed++;
+		g_hash_table_destroy(buckets);
+		return;
+	}
+
+	/* it does not fit into a byte less */
+	CHECK(pmeasure_build_bytecode(buckets, af, bc, len - 1) == -1);
+	CHECK(pmeasure_build_bytecode(buckets, af, bc, len) == len);
+
+	for (j = 0; j < TEST_RANDOM_LOOKUPS; j++)
+	{
+		/* half of the addresses are within some prefix, which may not be of the family */
+		if (j % 2 == 0)
+			random_addr_in(rand() % n, af, addr);
+		else
+			random_addr(af, addr);
+
+		for (expect = 0, i = 0; i < n && !expect; i++)
+			expect = in_prefix(i, af, addr);
+		if (run_bytecode(bc, len, af, addr) != expect)
+			wrong++;
+	}
+	if (wrong > 0)
+	{
+		fprintf(stderr, "%s: bytecode of %d prefixes decides %d of %d addresses wrong\n", what, n, wrong, TEST_RANDOM_LOOKUPS);
+		test_failed++;
+	}
+
+	g_hash_table_destroy(buckets);
+}
+
+static void test_bytecode_simple()
+{
+	unsigned char a[sizeof(struct in6_addr)];
+
+	/* no prefixes at all */
+	check_bytecode(0, AF_INET, "no prefixes");
+
+	/* one prefix, with host bits set in the address of the interface */
+	inet_pton(AF_INET, "192.168.1.17", a);
+	make_prefix(0, AF_INET, a, 24);
+	check_bytecode(1, AF_INET, "one prefix");
+	check_bytecode(1, AF_INET6, "one prefix of the other family");
+
+	/* nested prefixes, a host route and a prefix without addresses */
+	inet_pton(AF_INET, "192.168.0.1", a);
+	make_prefix(1, AF_INET, a, 16);
+	inet_pton(AF_INET, "10.1.2.3", a);
+	make_prefix(2, AF_INET, a, 32);
+	inet_pton(AF_INET, "172.16.0.1", a);
+	make_prefix(3, AF_INET, a, 12)->if_addrs = NULL;
+	inet_pton(AF_INET6, "2001:db8::1", a);
+	make_prefix(4, AF_INET6, a, 64);
+	check_bytecode(5, AF_INET, "mixed IPv4 prefixes");
+	check_bytecode(5, AF_INET6, "mixed IPv6 prefixes");
+
+	/* a default route accepts everything */
+	inet_pton(AF_INET6, "::", a);
+	make_prefix(5, AF_INET6, a, 0);
+	check_bytecode(6, AF_INET6, "default route");
+}
+
+static void test_bytecode_random(int af)
+{
+	unsigned char a[sizeof(struct in6_addr)];
+	char what[64];
+	int s, i, n;
+
+	for (s = 0; s < TEST_RANDOM_SETS; s++)
+	{
+		n = 1 + rand() % TEST_MAX_PREFIXES;
+		for (i = 0; i < n; i++)
+		{
+			/* some prefixes of the other family, some of them nested in the ones before */
+			int paf = (rand() % 4 == 0) ? (af == AF_INET ? AF_INET6 : AF_INET) : af;
+
+			if (i > 0 && rand() % 3 == 0 && prefixes[i - 1].pfx.family == paf)
+				random_addr_in(i - 1, paf, a);
+			else
+				random_addr(paf, a);
+			make_prefix(i, paf, a, 1 + rand() % (8 * addr_len(paf)));
+		}
+		snprintf(what, sizeof(what), "random set %d of %s prefixes", s, (af == AF_INET) ? "IPv4" : "IPv6");
+		check_bytecode(n, af, what);
+	}
+}
+
+static int close_to(double a, double b)
+{
+	return fabs(a - b) <= 1e-9 * (fabs(b) > 1 ? fabs(b) : 1);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+/** p-th quantile of n sorted values, interpolated between the two closest ranks */
+static double sorted_quantile(const double *sorted, unsigned int n, double p)
+{
+	double pos = p * (n - 1);
+	unsigned int k = (unsigned int) pos;
+
+	if (k + 1 >= n || pos == k)
+		return sorted[k];
+	return sorted[k] + (pos - k) * (sorted[k + 1] - sorted[k]);
+}
+
+/** check the percentiles of the first round of n RTTs, which are taken as they are */
+static void check_percentiles(double *values, unsigned int n, const char *what)
+{
+	struct prefix_metrics metrics, before;
+	double sorted[TEST_MAX_RTTS];
+
+	memset(&metrics, 0, sizeof(metrics));
+	memcpy(sorted, values, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), &compare_doubles);
+
+	compute_percentiles(&metrics, values, n);
+	if (metrics.srtt_p10 != sorted_quantile(sorted, n, 0.1) || metrics.srtt_median != sorted_quantile(sorted, n, 0.5)
+		|| metrics.srtt_p90 != sorted_quantile(sorted, n, 0.9))
+	{
+		fprintf(stderr, "%s: percentiles of %u RTTs are %f / %f / %f instead of %f / %f / %f\n", what, n,
+			metrics.srtt_p10, metrics.srtt_median, metrics.srtt_p90,
+			sorted_quantile(sorted, n, 0.1), sorted_quantile(sorted, n, 0.5), sorted_quantile(sorted, n, 0.9));
+		test_failed++;
+	}
+	CHECK(metrics.valid == (MUACC_METRICS_SRTT_MEDIAN | MUACC_METRICS_SRTT_PERCENTILES));
+
+	/* the values are only reordered */
+	qsort(values, n, sizeof(double), &compare_doubles);
+	CHECK(memcmp(values, sorted, n * sizeof(double)) == 0);
+
+	/* a round without RTTs keeps them, one with the same RTTs as well */
+	before = metrics;
+	compute_percentiles(&metrics, values, 0);
+	CHECK(memcmp(&metrics, &before, sizeof(metrics)) == 0);
+	compute_percentiles(&metrics, values, n);
+	CHECK(close_to(metrics.srtt_p10, before.srtt_p10) && close_to(metrics.srtt_median, before.srtt_median)
+		&& close_to(metrics.srtt_p90, before.srtt_p90));
+}
+
+static void test_percentiles()
+{
+	static const unsigned int sizes[] = { 1, 2, 3, 10, TEST_MAX_RTTS };
+	double values[TEST_MAX_RTTS];
+	unsigned int s, i, n;
+
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		n = sizes[s];
+
+		for (i = 0; i < n; i++)
+			values[i] = 1 + rand() % 100000 / 7.0;
+		check_percentiles(values, n, "random RTTs");
+
+		for (i = 0; i < n; i++)
+			values[i] = 20;
+		check_percentiles(values, n, "equal RTTs");
+
+		for (i = 0; i < n; i++)
+			values[i] = 1 + i * 0.5;
+		check_percentiles(values, n, "sorted RTTs");
+
+		for (i = 0; i < n; i++)
+			values[i] = 1 + rand() % 3;
+		check_percentiles(values, n, "RTTs with many duplicates");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	srand(4711);
+
+	test_bytecode_simple();
+	test_bytecode_random(AF_INET);
+	test_bytecode_random(AF_INET6);
+	test_percentiles();
+
+	return test_report();
+}
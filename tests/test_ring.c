@@ -0,0 +1,265 @@
+/** \file test_ring.c
+ *  \brief Test for the shared memory message rings between the client library and MAM
+ *
+ *  \copyright Copyright 2013-2017 Philipp S. Tiesel, Theresa Enghardt, and Mirko Palmer.
+ *  All rights reserved. This project is released under the New BSD License.
+ *
+ *	Pushes and pops messages of random lengths through small rings (see muacc_ring.h),
+ *	so they wrap around many times, and checks them against a queue of the messages
+ *	pushed so far. Checks full and empty rings, messages that never fit, corrupt
+ *	rings and the handshake of a side that goes to sleep.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "muacc_ring.h"
+
+#include "test_util.h"
+
+#define TEST_RING_SIZE 256
+#define TEST_ROUNDS 20000
+#define TEST_QUEUE_LEN 128
+
+/** messages pushed but not popped yet, the way the ring should have them */
+static struct {
+	unsigned char data[TEST_RING_SIZE];
+	size_t len;
+} queue[TEST_QUEUE_LEN];
+static unsigned int queue_head, queue_tail;
+static size_t queue_used;	/**< bytes the queued messages take up in the ring */
+
+/** a region for two rings, aligned like a mapping */
+static void *new_region(uint32_t size, size_t *len)
+{
+	void *base;
+
+	*len = _muacc_ring_shm_len(size);
+	if (*len == 0 || posix_memalign(&base, 4096, *len) != 0)
+		return NULL;
+	memset(base, 0xa5, *len);
+	return base;
+}
+
+static void test_layout()
+{
+	muacc_ring_ref_t req, resp, req2, resp2;
+	void *base;
+	size_t len;
+
+	CHECK(_muacc_ring_shm_len(0) == 0);
+	CHECK(_muacc_ring_shm_len(4) == 0);
+	CHECK(_muacc_ring_shm_len(100) == 0);
+	CHECK(_muacc_ring_shm_len(MUACC_RING_SIZE) >= 2 * MUACC_RING_SIZE);
+
+	CHECK((base = new_region(TEST_RING_SIZE, &len)) != NULL);
+	if (base == NULL)
+		return;
+
+	CHECK(_muacc_ring_shm_init(base, len - 1, TEST_RING_SIZE, &req, &resp) == -1);
+	CHECK(_muacc_ring_shm_init(base, len, 100, &req, &resp) == -1);
+	CHECK(_muacc_ring_shm_attach(base, len, &req2, &resp2) == -1);
+
+	CHECK(_muacc_ring_shm_init(base, len, TEST_RING_SIZE, &req, &resp) == 0);
+	CHECK(req.size == TEST_RING_SIZE && resp.size == TEST_RING_SIZE && req.shm != resp.shm);
+	CHECK(_muacc_ring_max_msg(&req) == TEST_RING_SIZE - sizeof(uint32_t));
+	CHECK(_muacc_ring_empty(&req) && _muacc_ring_empty(&resp));
+
+	/* the other side finds the same rings */
+	CHECK(_muacc_ring_shm_attach(base, len, &req2, &resp2) == 0);
+	CHECK(req2.shm == req.shm && resp2.shm == resp.shm && req2.size == req.size && resp2.size == resp.size);
+
+	/* but not in a region too short for them or with rings of different sizes */
+	CHECK(_muacc_ring_shm_attach(base, len - 1, &req2, &resp2) == -1);
+	resp.shm->size = TEST_RING_SIZE / 2;
+	CHECK(_muacc_ring_shm_attach(base, len, &req2, &resp2) == -1);
+	req.shm->size = 100;
+	CHECK(_muacc_ring_shm_attach(base, len, &req2, &resp2) == -1);
+	req.shm->magic = 0;
+	CHECK(_muacc_ring_shm_attach(base, len, &req2, &resp2) == -1);
+
+	free(base);
+}
+
+/** pop one message and check it is the oldest one queued */
+static void check_pop(muacc_ring_ref_t *r, unsigned int round)
+{
+	unsigned char buf[TEST_RING_SIZE];
+	ssize_t ret = _muacc_ring_pop(r, buf, sizeof(buf));
+
+	if (queue_head == queue_tail)
+	{
+		CHECK(ret == 0);
+		return;
+	}
+	if (ret != (ssize_t) queue[queue_tail].len || memcmp(buf, queue[queue_tail].data, ret) != 0)
+	{
+		fprintf(stderr, "round %u: popped %ld bytes instead of the %lu bytes pushed\n", round, (long) ret, (unsigned long) queue[queue_tail].len);
+		test_failed++;
+	}
+	queue_used -= sizeof(uint32_t) + queue[queue_tail].len;
+	queue_tail = (queue_tail + 1) % TEST_QUEUE_LEN;
+}
+
+static void test_fifo()
+{
+	muacc_ring_ref_t req, resp;
+	unsigned char msg[TEST_RING_SIZE];
+	size_t len, region_len, i;
+	unsigned int round;
+	void *base = new_region(TEST_RING_SIZE, &region_len);
+	int ret, fits;
+
+	CHECK(base != NULL && _muacc_ring_shm_init(base, region_len, TEST_RING_SIZE, &req, &resp) == 0);
+	if (base == NULL)
+		return;
+
+	queue_head = queue_tail = 0;
+	queue_used = 0;
+
+	for (round = 0; round < TEST_ROUNDS; round++)
+	{
+		/* mostly small messages, now and then one that takes up most of the ring */
+		len = (rand() % 8 == 0) ? rand() % (TEST_RING_SIZE - sizeof(uint32_t) + 1) : rand() % 40;
+		for (i = 0; i < len; i++)
+			msg[i] = rand();
+
+		if (rand() % 2 == 0 && (queue_head + 1) % TEST_QUEUE_LEN != queue_tail)
+		{
+			fits = (queue_used + sizeof(uint32_t) + len <= TEST_RING_SIZE);
+			ret = _muacc_ring_push(&resp, msg, len);
+			if (ret != (fits ? 0 : -1))
+			{
+				fprintf(stderr, "round %u: push of %lu bytes with %lu used returned %d\n", round, (unsigned long) len, (unsigned long) queue_used, ret);
+				test_failed++;
+			}
+			if (ret == 0)
+			{
+				memcpy(queue[queue_head].data, msg, len);
+				queue[queue_head].len = len;
+				queue_used += sizeof(uint32_t) + len;
+				queue_head = (queue_head + 1) % TEST_QUEUE_LEN;
+			}
+		}
+		else
+		{
+			check_pop(&resp, round);
+		}
+		CHECK(_muacc_ring_empty(&resp) == (queue_head == queue_tail));
+	}
+
+	while (queue_head != queue_tail)
+		check_pop(&resp, round);
+	check_pop(&resp, round);
+
+	/* a message that takes up all of the ring fits an empty one only, a larger one never */
+	CHECK(_muacc_ring_push(&resp, msg, _muacc_ring_max_msg(&resp)) == 0);
+	CHECK(_muacc_ring_push(&resp, msg, 0) == -1);
+	CHECK(_muacc_ring_pop(&resp, msg, sizeof(msg)) == (ssize_t) _muacc_ring_max_msg(&resp));
+	CHECK(_muacc_ring_push(&resp, msg, _muacc_ring_max_msg(&resp) + 1) == -2);
+	CHECK(_muacc_ring_empty(&resp));
+
+	/* the request ring was not touched */
+	CHECK(_muacc_ring_empty(&req) && req.shm->head == 0);
+
+	free(base);
+}
+
+static void test_corrupt()
+{
+	muacc_ring_ref_t req, resp;
+	unsigned char msg[TEST_RING_SIZE];
+	size_t region_len;
+	void *base = new_region(TEST_RING_SIZE, &region_len);
+	uint32_t hdr;
+
+	CHECK(base != NULL && _muacc_ring_shm_init(base, region_len, TEST_RING_SIZE, &req, &resp) == 0);
+	if (base == NULL)
+		return;
+
+	/* a buffer too small leaves the message on the ring */
+	memset(msg, 'x', 100);
+	CHECK(_muacc_ring_push(&req, msg, 100) == 0);
+	CHECK(_muacc_ring_pop(&req, msg, 99) == -1);
+	CHECK(!_muacc_ring_empty(&req));
+	CHECK(_muacc_ring_pop(&req, msg, 100) == 100);
+
+	/* indices the other side scribbled into */
+	req.shm->head = req.shm->tail + TEST_RING_SIZE + 1;
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == -1);
+	CHECK(_muacc_ring_push(&req, msg, 0) == -1);
+	req.shm->head = req.shm->tail + 2;
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == -1);
+
+	/* a length beyond what was pushed */
+	req.shm->head = req.shm->tail;
+	CHECK(_muacc_ring_push(&req, msg, 10) == 0);
+	hdr = 11;
+	memcpy(req.shm->data + (req.shm->tail & (TEST_RING_SIZE - 1)), &hdr, sizeof(hdr));
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == -1);
+
+	/* a size changed in the shared memory does not change the handle */
+	req.shm->head = req.shm->tail;
+	req.shm->size = 1 << 30;
+	CHECK(_muacc_ring_push(&req, msg, TEST_RING_SIZE) == -2);
+
+	free(base);
+}
+
+static void test_sleep()
+{
+	muacc_ring_ref_t req, resp;
+	unsigned char msg[TEST_RING_SIZE];
+	size_t region_len;
+	void *base = new_region(TEST_RING_SIZE, &region_len);
+
+	CHECK(base != NULL && _muacc_ring_shm_init(base, region_len, TEST_RING_SIZE, &req, &resp) == 0);
+	if (base == NULL)
+		return;
+
+	/* MAM sleeps until the first request arrives, the client does not */
+	CHECK(_muacc_ring_wake_consumer(&resp) == 0);
+	CHECK(_muacc_ring_push(&req, msg, 10) == 0);
+	CHECK(_muacc_ring_wake_consumer(&req) == 1);
+	CHECK(_muacc_ring_wake_consumer(&req) == 0);
+
+	/* a consumer does not go to sleep while there is a message */
+	CHECK(_muacc_ring_consumer_sleep(&req) == 0);
+	CHECK(_muacc_ring_wake_consumer(&req) == 0);
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == 10);
+	CHECK(_muacc_ring_consumer_sleep(&req) == 1);
+	CHECK(_muacc_ring_push(&req, msg, 10) == 0);
+	CHECK(_muacc_ring_wake_consumer(&req) == 1);
+
+	/* a producer waits for space for its message only */
+	CHECK(_muacc_ring_push(&req, msg, 200) == 0);
+	CHECK(_muacc_ring_producer_sleep(&req, 10) == 0);
+	CHECK(_muacc_ring_wake_producer(&req) == 0);
+	CHECK(_muacc_ring_producer_sleep(&req, 100) == 1);
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == 10);
+	CHECK(_muacc_ring_producer_sleep(&req, 100) == 1);
+	CHECK(_muacc_ring_wake_producer(&req) == 1);
+	CHECK(_muacc_ring_wake_producer(&req) == 0);
+	CHECK(_muacc_ring_pop(&req, msg, sizeof(msg)) == 200);
+	CHECK(_muacc_ring_producer_sleep(&req, 100) == 0);
+
+	free(base);
+}
+
+int main(int argc, char *argv[])
+{
+	srand(4711);
+
+	test_layout();
+	test_fifo();
+	test_corrupt();
+	test_sleep();
+
+	return test_report();
+}
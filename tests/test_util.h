@@ -8,8 +8,28 @@
 #ifndef __TEST_UTIL_H__
 #define __TEST_UTIL_H__
 
+#include <stdio.h>
+
 #include "muacc.h"
 #include "intents.h"
+#include "client_util.h"
+
+/** Number of checks that failed so far - see test_report (test_check.c) */
+extern int test_failed;
+
+/** Check a condition and count it as failed if it does not hold */
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failed++; \
+	} \
+} while (0)
+
+/** Print the outcome of the checks of a test program
+ *
+ *  \return exit code for main: 0 if all checks passed, 1 otherwise
+ */
+int test_report(void);
 
 #ifndef memset_pattern4
 void memset_pattern4 (void *dst, const void *pat, size_t len);